@@ -0,0 +1,41 @@
+# Try to find libzstd
+#
+# The streaming API we use (ZSTD_compressStream2) is stable as of zstd
+# 1.4; older versions are treated as not found.
+#
+# Once done, this will define
+#
+# ZSTD_FOUND
+# ZSTD_INCLUDE_DIR
+# ZSTD_LIBRARY
+# ZSTD_VERSION_STRING
+
+find_path(ZSTD_INCLUDE_DIR NAMES zstd.h)
+find_library(ZSTD_LIBRARY NAMES zstd)
+
+if(ZSTD_INCLUDE_DIR AND EXISTS "${ZSTD_INCLUDE_DIR}/zstd.h")
+  foreach(part MAJOR MINOR RELEASE)
+    file(STRINGS "${ZSTD_INCLUDE_DIR}/zstd.h" ZSTD_VERSION_${part}_LINE
+      REGEX "^#define[ \t]+ZSTD_VERSION_${part}[ \t]+[0-9]+")
+    string(REGEX REPLACE "^#define[ \t]+ZSTD_VERSION_${part}[ \t]+([0-9]+).*$"
+      "\\1" ZSTD_VERSION_${part} "${ZSTD_VERSION_${part}_LINE}")
+  endforeach()
+  set(ZSTD_VERSION_STRING
+    "${ZSTD_VERSION_MAJOR}.${ZSTD_VERSION_MINOR}.${ZSTD_VERSION_RELEASE}")
+endif()
+
+if(ZSTD_INCLUDE_DIR AND ZSTD_LIBRARY)
+  include(CheckSymbolExists)
+  set(CMAKE_REQUIRED_INCLUDES ${ZSTD_INCLUDE_DIR})
+  set(CMAKE_REQUIRED_LIBRARIES ${ZSTD_LIBRARY})
+  check_symbol_exists(ZSTD_compressStream2 "zstd.h" HAVE_ZSTD_COMPRESSSTREAM2)
+  unset(CMAKE_REQUIRED_INCLUDES)
+  unset(CMAKE_REQUIRED_LIBRARIES)
+endif()
+
+include(FindPackageHandleStandardArgs)
+find_package_handle_standard_args(Zstd
+  REQUIRED_VARS ZSTD_LIBRARY ZSTD_INCLUDE_DIR HAVE_ZSTD_COMPRESSSTREAM2
+  VERSION_VAR ZSTD_VERSION_STRING)
+
+mark_as_advanced(ZSTD_INCLUDE_DIR ZSTD_LIBRARY)
@@ -5,9 +5,37 @@
 #define CEPH_OS_BLUESTORE_CHECKSUMMER
 
 #include "include/buffer.h"
+#include "include/crc32c.h"
 #include "xxHash/xxhash.h"
 
+/*
+ * Each algorithm provides calc(), which checksums one block from a
+ * bufferlist iterator, and calc_blocks(), which checksums a run of
+ * blocks that sit in one contiguous buffer.  calculate() and verify()
+ * hand each contiguous run of whole blocks to calc_blocks() and only
+ * fall back to calc() for blocks that straddle two buffers.
+ */
 class Checksummer {
+  /// crc32c of each block, truncated to value_t
+  template<typename value_t, uint32_t mask>
+  static void crc32c_blocks(
+    size_t block_size,
+    size_t blocks,
+    const char *data,
+    value_t *pv
+    ) {
+    uint32_t crc[64];
+    while (blocks > 0) {
+      size_t n = std::min<size_t>(blocks, sizeof(crc) / sizeof(crc[0]));
+      ceph_crc32c_blocks(-1, (const unsigned char*)data, block_size, n, crc);
+      for (size_t i = 0; i < n; ++i) {
+	*pv++ = crc[i] & mask;
+      }
+      data += n * block_size;
+      blocks -= n;
+    }
+  }
+
 public:
   struct crc32c {
     typedef __le32 value_t;
@@ -26,6 +54,16 @@ public:
       ) {
       return p.crc32c(len, -1);
     }
+
+    static void calc_blocks(
+      state_t state,
+      size_t block_size,
+      size_t blocks,
+      const char *data,
+      value_t *pv
+      ) {
+      crc32c_blocks<value_t, 0xffffffff>(block_size, blocks, data, pv);
+    }
   };
 
   struct crc32c_16 {
@@ -45,6 +83,16 @@ public:
       ) {
       return p.crc32c(len, -1) & 0xffff;
     }
+
+    static void calc_blocks(
+      state_t state,
+      size_t block_size,
+      size_t blocks,
+      const char *data,
+      value_t *pv
+      ) {
+      crc32c_blocks<value_t, 0xffff>(block_size, blocks, data, pv);
+    }
   };
 
   struct crc32c_8 {
@@ -64,6 +112,16 @@ public:
       ) {
       return p.crc32c(len, -1) & 0xff;
     }
+
+    static void calc_blocks(
+      state_t state,
+      size_t block_size,
+      size_t blocks,
+      const char *data,
+      value_t *pv
+      ) {
+      crc32c_blocks<value_t, 0xff>(block_size, blocks, data, pv);
+    }
   };
 
   struct xxhash32 {
@@ -91,6 +149,20 @@ public:
       }
       return XXH32_digest(state);
     }
+
+    static void calc_blocks(
+      state_t state,
+      size_t block_size,
+      size_t blocks,
+      const char *data,
+      value_t *pv
+      ) {
+      // one-shot; no need to reset and feed the streaming state
+      while (blocks--) {
+	*pv++ = XXH32(data, block_size, -1);
+	data += block_size;
+      }
+    }
   };
 
   struct xxhash64 {
@@ -118,8 +190,46 @@ public:
       }
       return XXH64_digest(state);
     }
+
+    static void calc_blocks(
+      state_t state,
+      size_t block_size,
+      size_t blocks,
+      const char *data,
+      value_t *pv
+      ) {
+      // one-shot; no need to reset and feed the streaming state
+      while (blocks--) {
+	*pv++ = XXH64(data, block_size, -1);
+	data += block_size;
+      }
+    }
   };
 
+  /// checksum blocks from p into pv, a contiguous run at a time
+  template<class Alg>
+  static void calc_run(
+    typename Alg::state_t state,
+    size_t csum_block_size,
+    size_t blocks,
+    bufferlist::const_iterator& p,
+    typename Alg::value_t *pv
+    ) {
+    while (blocks > 0) {
+      bufferptr cur = p.get_current_ptr();
+      size_t n = std::min<size_t>(blocks, cur.length() / csum_block_size);
+      if (n > 0) {
+	Alg::calc_blocks(state, csum_block_size, n, cur.c_str(), pv);
+	p.advance(n * csum_block_size);
+      } else {
+	*pv = Alg::calc(state, csum_block_size, p);
+	n = 1;
+      }
+      pv += n;
+      blocks -= n;
+    }
+  }
+
   template<class Alg>
   static int calculate(
     size_t csum_block_size,
@@ -142,10 +252,7 @@ public:
     typename Alg::value_t *pv =
       reinterpret_cast<typename Alg::value_t*>(csum_data->c_str());
     pv += offset / csum_block_size;
-    while (blocks--) {
-      *pv = Alg::calc(state, csum_block_size, p);
-      ++pv;
-    }
+    calc_run<Alg>(state, csum_block_size, blocks, p, pv);
     Alg::fini(&state);
     return 0;
   }
@@ -169,14 +276,20 @@ public:
       reinterpret_cast<const typename Alg::value_t*>(csum_data.c_str());
     pv += offset / csum_block_size;
     size_t pos = offset;
-    while (length > 0) {
-      typename Alg::value_t v = Alg::calc(state, csum_block_size, p);
-      if (*pv != v) {
-	return pos;
+    size_t blocks = length / csum_block_size;
+    typename Alg::value_t v[64];
+    while (blocks > 0) {
+      size_t n = std::min<size_t>(blocks, sizeof(v) / sizeof(v[0]));
+      calc_run<Alg>(state, csum_block_size, n, p, v);
+      for (size_t i = 0; i < n; ++i) {
+	if (*pv != v[i]) {
+	  Alg::fini(&state);
+	  return pos;
+	}
+	++pv;
+	pos += csum_block_size;
       }
-      ++pv;
-      pos += csum_block_size;
-      length -= csum_block_size;
+      blocks -= n;
     }
     Alg::fini(&state);
     return -1;  // no errors
@@ -26,6 +26,7 @@
 #include "include/types.h"
 #include "include/compat.h"
 #include "include/inline_memory.h"
+#include "include/mempool.h"
 #if defined(HAVE_XIO)
 #include "msg/xio/XioMsg.h"
 #endif
@@ -168,15 +169,43 @@ static simple_spinlock_t buffer_debug_lock = SIMPLE_SPINLOCK_INITIALIZER;
     mutable simple_spinlock_t crc_spinlock;
     map<pair<size_t, size_t>, pair<uint32_t, uint32_t> > crc_map;
 
+    mempool::pool_index_t mempool = mempool::mempool_buffer_anon;
+
     explicit raw(unsigned l)
       : data(NULL), len(l), nref(0),
 	crc_spinlock(SIMPLE_SPINLOCK_INITIALIZER)
-    { }
+    {
+      mempool::get_pool(mempool).adjust_count(1, len);
+    }
     raw(char *c, unsigned l)
       : data(c), len(l), nref(0),
 	crc_spinlock(SIMPLE_SPINLOCK_INITIALIZER)
-    { }
-    virtual ~raw() {}
+    {
+      mempool::get_pool(mempool).adjust_count(1, len);
+    }
+    virtual ~raw() {
+      mempool::get_pool(mempool).adjust_count(-1, -(ssize_t)len);
+    }
+
+    void _set_len(unsigned l) {
+      mempool::get_pool(mempool).adjust_count(0, (ssize_t)l - (ssize_t)len);
+      len = l;
+    }
+
+    void reassign_to_mempool(mempool::pool_index_t pool) {
+      if (pool == mempool) {
+	return;
+      }
+      mempool::get_pool(mempool).adjust_count(-1, -(ssize_t)len);
+      mempool = pool;
+      mempool::get_pool(pool).adjust_count(1, len);
+    }
+
+    void try_assign_to_mempool(mempool::pool_index_t pool) {
+      if (mempool == mempool::mempool_buffer_anon) {
+	reassign_to_mempool(pool);
+      }
+    }
 
     // no copying.
     // cppcheck-suppress noExplicitConstructor
@@ -459,7 +488,7 @@ static simple_spinlock_t buffer_debug_lock = SIMPLE_SPINLOCK_INITIALIZER;
 	return r;
       }
       // update length with actual amount read
-      len = r;
+      _set_len(r);
       return 0;
     }
 
@@ -634,6 +663,20 @@ static simple_spinlock_t buffer_debug_lock = SIMPLE_SPINLOCK_INITIALIZER;
     }
   };
 
+  class buffer::raw_claim_buffer : public buffer::raw {
+    void (*release)(void *, char *);
+    void *arg;
+  public:
+    raw_claim_buffer(char *d, unsigned l, void (*r)(void *, char *), void *a)
+      : raw(d, l), release(r), arg(a) { }
+    ~raw_claim_buffer() {
+      release(arg, data);
+    }
+    raw* clone_empty() {
+      return new buffer::raw_char(len);
+    }
+  };
+
 #if defined(HAVE_XIO)
   class buffer::xio_msg_buffer : public buffer::raw {
   private:
@@ -708,6 +751,11 @@ static simple_spinlock_t buffer_debug_lock = SIMPLE_SPINLOCK_INITIALIZER;
   buffer::raw* buffer::create_static(unsigned len, char *buf) {
     return new raw_static(buf, len);
   }
+  buffer::raw* buffer::claim_buffer(unsigned len, char *buf,
+				    void (*release)(void *, char *),
+				    void *arg) {
+    return new raw_claim_buffer(buf, len, release, arg);
+  }
 
   buffer::raw* buffer::create_aligned(unsigned len, unsigned align) {
     // If alignment is a page multiple, use a separate buffer::raw to
@@ -925,6 +973,24 @@ static simple_spinlock_t buffer_debug_lock = SIMPLE_SPINLOCK_INITIALIZER;
   unsigned buffer::ptr::raw_length() const { assert(_raw); return _raw->len; }
   int buffer::ptr::raw_nref() const { assert(_raw); return _raw->nref.read(); }
 
+  int buffer::ptr::get_mempool() const {
+    if (_raw) {
+      return (int)_raw->mempool;
+    }
+    return mempool::mempool_buffer_anon;
+  }
+
+  void buffer::ptr::reassign_to_mempool(int pool) {
+    if (_raw) {
+      _raw->reassign_to_mempool((mempool::pool_index_t)pool);
+    }
+  }
+  void buffer::ptr::try_assign_to_mempool(int pool) {
+    if (_raw) {
+      _raw->try_assign_to_mempool((mempool::pool_index_t)pool);
+    }
+  }
+
   void buffer::ptr::copy_out(unsigned o, unsigned l, char *dest) const {
     assert(_raw);
     if (o+l > _len)
@@ -1494,6 +1560,28 @@ static simple_spinlock_t buffer_debug_lock = SIMPLE_SPINLOCK_INITIALIZER;
     return true;
   }
 
+  void buffer::list::reassign_to_mempool(int pool)
+  {
+    if (append_buffer.get_raw()) {
+      append_buffer.get_raw()->reassign_to_mempool(
+	(mempool::pool_index_t)pool);
+    }
+    for (auto& p : _buffers) {
+      p.get_raw()->reassign_to_mempool((mempool::pool_index_t)pool);
+    }
+  }
+
+  void buffer::list::try_assign_to_mempool(int pool)
+  {
+    if (append_buffer.get_raw()) {
+      append_buffer.get_raw()->try_assign_to_mempool(
+	(mempool::pool_index_t)pool);
+    }
+    for (auto& p : _buffers) {
+      p.get_raw()->try_assign_to_mempool((mempool::pool_index_t)pool);
+    }
+  }
+
   void buffer::list::zero()
   {
     for (std::list<ptr>::iterator it = _buffers.begin();
@@ -1807,6 +1895,39 @@ static simple_spinlock_t buffer_debug_lock = SIMPLE_SPINLOCK_INITIALIZER;
     append(std::move(bp));
   }
 
+  void buffer::list::reserve(size_t len)
+  {
+    if (append_buffer.unused_tail_length() >= len)
+      return;
+    // same sizing policy as append(): fill out whole allocation units,
+    // factoring in the raw_combined overhead.
+    size_t need = ROUND_UP_TO(len, sizeof(size_t)) + sizeof(raw_combined);
+    size_t alen = ROUND_UP_TO(need, CEPH_BUFFER_ALLOC_UNIT) -
+      sizeof(raw_combined);
+    append_buffer = raw_combined::create(alen);
+    append_buffer.set_length(0);   // unused, so far.
+  }
+
+  buffer::list::contiguous_appender::contiguous_appender(list& l, size_t len)
+    : bl(l)
+  {
+    bl.reserve(len);
+    start = pos = bl.append_buffer.c_str() + bl.append_buffer.length();
+    end_ptr = start + len;
+  }
+
+  buffer::list::contiguous_appender::~contiguous_appender()
+  {
+    unsigned used = pos - start;
+    if (!used)
+      return;
+    // the bytes were written in place; just extend append_buffer over
+    // them and add the new segment to the list.
+    ptr& ab = bl.append_buffer;
+    ab.set_length(ab.length() + used);
+    bl.append(ab, ab.length() - used, used);
+  }
+
   
   /*
    * get a char
@@ -103,6 +103,15 @@ OPTION(async_compressor_threads, OPT_INT, 2)
 OPTION(async_compressor_thread_timeout, OPT_INT, 5)
 OPTION(async_compressor_thread_suicide_timeout, OPT_INT, 30)
 
+OPTION(compressor_zstd_level, OPT_INT, 1)
+// directory of trained zstd dictionaries, one per pool: <pool id>.dict
+OPTION(compressor_zstd_dict_dir, OPT_STR, "")
+// only use a dictionary for inputs up to this size.  bluestore only
+// compresses blobs bigger than min_alloc_size, so with the defaults that
+// is small writes on SSD (4K) but nothing on HDD (64K)
+OPTION(compressor_zstd_dict_max_size, OPT_U64, 64*1024)
+OPTION(compressor_lz4_level, OPT_INT, 0)  // 0 = fast, 1-12 = lz4hc level
+
 DEFAULT_SUBSYS(0, 5)
 SUBSYS(lockdep, 0, 1)
 SUBSYS(context, 0, 1)
@@ -918,7 +927,13 @@ OPTION(bdev_inject_crash_flush_delay, OPT_INT, 2) // wait N more seconds on flus
 OPTION(bdev_aio, OPT_BOOL, true)
 OPTION(bdev_aio_poll_ms, OPT_INT, 250)  // milliseconds
 OPTION(bdev_aio_max_queue_depth, OPT_INT, 32)
+OPTION(bdev_aio_queues, OPT_INT, 1)  // aio contexts (each with a reaping thread) per device; e.g., osd_op_num_shards for one per op shard
+OPTION(bdev_aio_busy_poll_us, OPT_INT, 0)  // after a completion, poll without sleeping for this long (0 = never busy poll)
 OPTION(bdev_block_size, OPT_INT, 4096)
+OPTION(bdev_type, OPT_STR, "")  // kernel, ust-nvme, mem or null; empty means detect from the path
+OPTION(bdev_mem_hugepages, OPT_BOOL, true)  // back bdev_type=mem with hugepages when available
+OPTION(bdev_mem_aio_thread, OPT_BOOL, false) // mem/null: complete writes on a thread instead of inline
+OPTION(bdev_mem_latency_us, OPT_U64, 0)      // mem/null: added to each inline write, or each submit on the thread
 
 // if yes, osd will unbind all NVMe devices from kernel driver and bind them
 // to the uio_pci_generic driver. The purpose is to prevent the case where
@@ -935,6 +950,7 @@ OPTION(bluefs_log_compact_min_size, OPT_U64, 16*1048576)  // before we consider
 OPTION(bluefs_min_flush_size, OPT_U64, 65536)  // ignore flush until its this big
 OPTION(bluefs_compact_log_sync, OPT_BOOL, false)  // sync or async log compaction?
 OPTION(bluefs_buffered_io, OPT_BOOL, false)
+OPTION(bluefs_cache_size, OPT_U64, 0)  // shared cache for random reads; 0 to disable
 
 OPTION(bluestore_bluefs, OPT_BOOL, true)
 OPTION(bluestore_bluefs_env_mirror, OPT_BOOL, false) // mirror to normal Env for debug
@@ -967,8 +983,11 @@ OPTION(bluestore_min_alloc_size, OPT_U32, 0)
 OPTION(bluestore_min_alloc_size_hdd, OPT_U32, 64*1024)
 OPTION(bluestore_min_alloc_size_ssd, OPT_U32, 4*1024)
 OPTION(bluestore_max_alloc_size, OPT_U32, 0)
+// give new blobs smaller than min_alloc_size a few blocks of a shared
+// allocation unit instead of a whole unit each
+OPTION(bluestore_pack_small_blobs, OPT_BOOL, true)
 OPTION(bluestore_compression, OPT_STR, "none")  // force|aggressive|passive|none
-OPTION(bluestore_compression_algorithm, OPT_STR, "snappy")
+OPTION(bluestore_compression_algorithm, OPT_STR, "snappy")  // snappy|zlib|zstd|lz4
 OPTION(bluestore_compression_min_blob_size, OPT_U32, 256*1024)
 OPTION(bluestore_compression_max_blob_size, OPT_U32, 4*1024*1024)
 /*
@@ -977,11 +996,30 @@ OPTION(bluestore_compression_max_blob_size, OPT_U32, 4*1024*1024)
  * And ask for compressing at least 12.5%(1/8) off, by default.
  */
 OPTION(bluestore_compression_required_ratio, OPT_DOUBLE, .875)
+// compress the blobs of big writes on this many threads while their
+// transactions wait, parked (0 = compress them inline on the op thread).
+// read when the store is created; runtime changes are ignored
+OPTION(bluestore_compression_threads, OPT_INT, 2)
+OPTION(bluestore_compression_thread_timeout, OPT_INT, 30)
+OPTION(bluestore_compression_thread_suicide_timeout, OPT_INT, 120)
+// before compressing a blob, compress this many bytes sampled across it
+// and give up early if that does not meet the required ratio (0 = off)
+OPTION(bluestore_compression_sample_size, OPT_U32, 16*1024)
 OPTION(bluestore_cache_type, OPT_STR, "2q")   // lru, 2q
-OPTION(bluestore_onode_cache_size, OPT_U32, 16*1024)
-OPTION(bluestore_buffer_cache_size, OPT_U32, 512*1024*1024)
+// bluestore_cache_size is the whole per-OSD cache budget: onodes, buffer
+// data and the rocksdb block cache.  the meta and kv ratios set the initial
+// split (data gets the rest); with autotune the split then follows hit rates.
+OPTION(bluestore_cache_size, OPT_U64, 1024*1024*1024)
+OPTION(bluestore_cache_meta_ratio, OPT_DOUBLE, .4)    // share for onodes
+OPTION(bluestore_cache_kv_ratio, OPT_DOUBLE, .2)      // share for rocksdb block cache
+OPTION(bluestore_cache_trim_interval, OPT_DOUBLE, .2) // sec, background trim
+OPTION(bluestore_cache_autotune, OPT_BOOL, true)
+OPTION(bluestore_cache_autotune_interval, OPT_DOUBLE, 5) // sec between rebalances
+OPTION(bluestore_cache_autotune_chunk_size, OPT_U64, 32*1024*1024) // bytes moved per rebalance, and min share
+OPTION(bluestore_onode_prefetch_max, OPT_INT, 256) // max onodes loaded per prefetch_onodes() call (0 = off)
 OPTION(bluestore_kvbackend, OPT_STR, "rocksdb")
-OPTION(bluestore_allocator, OPT_STR, "bitmap")     // stupid | bitmap
+OPTION(bluestore_allocator, OPT_STR, "bitmap")     // stupid | bitmap | hybrid
+OPTION(bluestore_hybrid_alloc_max_extents, OPT_U64, 256*1024) // range tree size before spilling small extents to the bitmap
 OPTION(bluestore_freelist_type, OPT_STR, "bitmap") // extent | bitmap
 OPTION(bluestore_freelist_blocks_per_key, OPT_INT, 128)
 OPTION(bluestore_bitmapallocator_blocks_per_zone, OPT_INT, 1024) // must be power of 2 aligned, e.g., 512, 1024, 2048...
@@ -995,11 +1033,16 @@ OPTION(bluestore_sync_wal_apply, OPT_BOOL, true)     // perform initial wal work
 OPTION(bluestore_wal_threads, OPT_INT, 4)
 OPTION(bluestore_wal_thread_timeout, OPT_INT, 30)
 OPTION(bluestore_wal_thread_suicide_timeout, OPT_INT, 120)
+OPTION(bluestore_wal_batch_ops, OPT_U64, 0)    // merge wal writes from up to this many ops into one submission (0 = apply each txc on its own)
+OPTION(bluestore_wal_batch_max_age, OPT_DOUBLE, .005)  // seconds; submit a smaller batch once its oldest op is this old
+OPTION(bluestore_wal_batch_max_inflight, OPT_U64, 4)  // wal batches with aios in flight at once
 OPTION(bluestore_max_ops, OPT_U64, 512)
 OPTION(bluestore_max_bytes, OPT_U64, 64*1024*1024)
 OPTION(bluestore_wal_max_ops, OPT_U64, 512)
 OPTION(bluestore_wal_max_bytes, OPT_U64, 128*1024*1024)
 OPTION(bluestore_nid_prealloc, OPT_INT, 1024)
+OPTION(bluestore_extent_map_shard_max_size, OPT_U32, 1200)  // shard the extent map past this many bytes; split shards bigger than this
+OPTION(bluestore_extent_map_shard_min_size, OPT_U32, 150)   // merge shards smaller than this into a neighbour
 OPTION(bluestore_overlay_max_length, OPT_INT, 65536)
 OPTION(bluestore_overlay_max, OPT_INT, 0)
 OPTION(bluestore_clone_cow, OPT_BOOL, false)  // do copy-on-write for clones
@@ -1140,10 +1183,15 @@ OPTION(filestore_commit_timeout, OPT_FLOAT, 600)
 OPTION(filestore_fiemap_threshold, OPT_INT, 4096)
 OPTION(filestore_merge_threshold, OPT_INT, 10)
 OPTION(filestore_split_multiple, OPT_INT, 2)
+OPTION(filestore_split_background, OPT_BOOL, false) // queue dir splits to a background thread instead of splitting in the op
+OPTION(filestore_split_rate, OPT_INT, 2000)   // objects per second background splits may move, 0 for no limit
+OPTION(filestore_split_batch, OPT_INT, 64)    // objects moved per hold of the collection lock
 OPTION(filestore_update_to, OPT_INT, 1000)
 OPTION(filestore_blackhole, OPT_BOOL, false)     // drop any new transactions on the floor
 OPTION(filestore_fd_cache_size, OPT_INT, 128)    // FD lru size
 OPTION(filestore_fd_cache_shards, OPT_INT, 16)   // FD number of shards
+OPTION(filestore_index_cache_size, OPT_INT, 16384)  // object path lru size, 0 to disable
+OPTION(filestore_index_cache_shards, OPT_INT, 16)   // object path cache number of shards
 OPTION(filestore_ondisk_finisher_threads, OPT_INT, 1)
 OPTION(filestore_apply_finisher_threads, OPT_INT, 1)
 OPTION(filestore_dump_file, OPT_STR, "")         // file onto which store transaction dumps
@@ -1173,9 +1221,12 @@ OPTION(journal_throttle_high_multiple, OPT_DOUBLE, 0)
 OPTION(journal_throttle_max_multiple, OPT_DOUBLE, 0)
 
 OPTION(journal_align_min_size, OPT_INT, 64 << 10)  // align data payloads >= this.
+OPTION(journal_ring_size, OPT_U64, 32 << 20)  // preallocated aligned buffer entries are built in; 0 to allocate per entry
 OPTION(journal_replay_from, OPT_INT, 0)
 OPTION(journal_zero_on_create, OPT_BOOL, false)
 OPTION(journal_ignore_corruption, OPT_BOOL, false) // assume journal is not corrupt
+OPTION(journal_shards, OPT_INT, 1)  // >1: one journal file (and writer) per shard; flush + mkjournal to change
+OPTION(journal_shard_paths, OPT_STR, "")  // paths of shards 1..n-1 (e.g. partitions on the journal device); default <journal>.<i>
 OPTION(journal_discard, OPT_BOOL, false) //using ssd disk as journal, whether support discard nouse journal-data.
 
 OPTION(rados_mon_op_timeout, OPT_DOUBLE, 0) // how many seconds to wait for a response from the monitor before returning an error from a rados operation. 0 means on limit.
@@ -9,6 +9,7 @@
 #include "common/sctp_crc32.h"
 #include "common/crc32c_intel_baseline.h"
 #include "common/crc32c_intel_fast.h"
+#include "common/crc32c_intel_blocks.h"
 #include "common/crc32c_aarch64.h"
 
 /*
@@ -45,3 +46,29 @@ ceph_crc32c_func_t ceph_choose_crc32(void)
  */
 ceph_crc32c_func_t ceph_crc32c_func = ceph_choose_crc32();
 
+
+/*
+ * one block at a time, with whatever ceph_crc32c picked
+ */
+static void ceph_crc32c_blocks_generic(uint32_t crc, unsigned char const *data,
+				       unsigned block_size, unsigned blocks,
+				       uint32_t *out)
+{
+  for (; blocks; --blocks, data += block_size) {
+    *out++ = ceph_crc32c_func(crc, data, block_size);
+  }
+}
+
+ceph_crc32c_blocks_func_t ceph_choose_crc32c_blocks(void)
+{
+  ceph_arch_probe();
+
+  if (ceph_arch_intel_sse42 && ceph_crc32c_intel_blocks_exists()) {
+    return ceph_crc32c_intel_blocks;
+  }
+
+  return ceph_crc32c_blocks_generic;
+}
+
+// initialized after ceph_crc32c_func above (same translation unit)
+ceph_crc32c_blocks_func_t ceph_crc32c_blocks_func = ceph_choose_crc32c_blocks();
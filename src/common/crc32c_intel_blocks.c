@@ -0,0 +1,100 @@
+/*
+ * crc32c of many independent, equally sized blocks.
+ *
+ * The crc32 instruction has a latency of 3 cycles but a throughput of
+ * one per cycle, so a single dependent chain leaves two thirds of the
+ * unit idle.  Checksumming a blob produces one crc per csum block and
+ * the blocks do not depend on each other, so we run three of them side
+ * by side and keep the unit busy without having to stitch partial crcs
+ * back together.
+ */
+
+#include <string.h>
+
+#include "include/int_types.h"
+#include "common/crc32c_intel_blocks.h"
+
+#ifdef __x86_64__
+
+#include <nmmintrin.h>
+
+#define CRC32C_TARGET __attribute__((target("sse4.2")))
+
+static inline uint64_t load64(unsigned char const *p)
+{
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+CRC32C_TARGET
+static uint32_t crc32c_one(uint32_t crc, unsigned char const *p, unsigned len)
+{
+	uint64_t c = crc;
+	for (; len >= 8; len -= 8, p += 8)
+		c = _mm_crc32_u64(c, load64(p));
+	crc = (uint32_t)c;
+	for (; len; --len, ++p)
+		crc = _mm_crc32_u8(crc, *p);
+	return crc;
+}
+
+CRC32C_TARGET
+static void crc32c_three(uint32_t crc, unsigned char const *p,
+			 unsigned len, uint32_t *out)
+{
+	unsigned char const *p0 = p;
+	unsigned char const *p1 = p + len;
+	unsigned char const *p2 = p + 2 * len;
+	uint64_t c0 = crc, c1 = crc, c2 = crc;
+	unsigned i;
+
+	for (i = 0; i + 8 <= len; i += 8) {
+		c0 = _mm_crc32_u64(c0, load64(p0 + i));
+		c1 = _mm_crc32_u64(c1, load64(p1 + i));
+		c2 = _mm_crc32_u64(c2, load64(p2 + i));
+	}
+	out[0] = (uint32_t)c0;
+	out[1] = (uint32_t)c1;
+	out[2] = (uint32_t)c2;
+	for (; i < len; ++i) {
+		out[0] = _mm_crc32_u8(out[0], p0[i]);
+		out[1] = _mm_crc32_u8(out[1], p1[i]);
+		out[2] = _mm_crc32_u8(out[2], p2[i]);
+	}
+}
+
+void ceph_crc32c_intel_blocks(uint32_t crc, unsigned char const *data,
+			      unsigned block_size, unsigned blocks,
+			      uint32_t *out)
+{
+	for (; blocks >= 3; blocks -= 3) {
+		crc32c_three(crc, data, block_size, out);
+		data += 3 * block_size;
+		out += 3;
+	}
+	for (; blocks; --blocks) {
+		*out++ = crc32c_one(crc, data, block_size);
+		data += block_size;
+	}
+}
+
+int ceph_crc32c_intel_blocks_exists(void)
+{
+	return 1;
+}
+
+#else
+
+void ceph_crc32c_intel_blocks(uint32_t crc, unsigned char const *data,
+			      unsigned block_size, unsigned blocks,
+			      uint32_t *out)
+{
+}
+
+int ceph_crc32c_intel_blocks_exists(void)
+{
+	return 0;
+}
+
+#endif
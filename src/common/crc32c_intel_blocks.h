@@ -0,0 +1,21 @@
+#ifndef CEPH_COMMON_CRC32C_INTEL_BLOCKS_H
+#define CEPH_COMMON_CRC32C_INTEL_BLOCKS_H
+
+#include "include/int_types.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* is the multi-buffer version compiled in */
+extern int ceph_crc32c_intel_blocks_exists(void);
+
+extern void ceph_crc32c_intel_blocks(uint32_t crc, unsigned char const *data,
+				     unsigned block_size, unsigned blocks,
+				     uint32_t *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -102,6 +102,16 @@ string hobject_t::to_str() const
   return out;
 }
 
+void hobject_t::bound_encode(size_t& p) const
+{
+  p += 6;                            // ENCODE_START
+  p += sizeof(__u32) + key.length();
+  p += sizeof(__u32) + oid.name.length();
+  p += sizeof(snapid_t) + sizeof(hash) + 1;
+  p += sizeof(__u32) + nspace.length();
+  p += sizeof(pool);
+}
+
 void hobject_t::encode(bufferlist& bl) const
 {
   ENCODE_START(4, 3, bl);
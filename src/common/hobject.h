@@ -276,6 +276,8 @@ public:
 
   bool parse(const string& s);
 
+  /// cheap upper bound on the encoded size, for presizing buffers
+  void bound_encode(size_t& p) const;
   void encode(bufferlist& bl) const;
   void decode(bufferlist::iterator& bl);
   void decode(json_spirit::Value& v);
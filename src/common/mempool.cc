@@ -0,0 +1,113 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * Copyright (C) 2016 Red Hat
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+#include "include/mempool.h"
+#include "common/Formatter.h"
+
+static mempool::pool_t *pools[mempool::num_pools] = {
+#define P(x) nullptr,
+  DEFINE_MEMORY_POOLS_HELPER(P)
+#undef P
+};
+
+mempool::pool_t& mempool::get_pool(mempool::pool_index_t ix)
+{
+  // We rely on this array being initialized before any invocation of
+  // this function, even if it is called by ctors in other compilation
+  // units that are being initialized before this compilation unit.
+  mempool::pool_t *p = pools[ix];
+  if (p)
+    return *p;
+
+  // Create it on first use.  The pools are never freed: buffers and
+  // pool-allocated objects may outlive any static destructor we could
+  // hook, and their frees still need somewhere to be counted.
+  mempool::pool_t *np = new mempool::pool_t;
+  if (__sync_bool_compare_and_swap(&pools[ix], nullptr, np))
+    return *np;
+  delete np;
+  return *pools[ix];
+}
+
+const char *mempool::get_pool_name(mempool::pool_index_t ix)
+{
+#define P(x) #x,
+  static const char *names[num_pools] = {
+    DEFINE_MEMORY_POOLS_HELPER(P)
+  };
+#undef P
+  return names[ix];
+}
+
+void mempool::dump(ceph::Formatter *f)
+{
+  stats_t total;
+  f->open_object_section("mempool"); // we need (dummy?) topmost section for
+				     // JSON Formatter to print pool names.
+  f->open_object_section("by_pool");
+  for (size_t i = 0; i < num_pools; ++i) {
+    const pool_t &pool = mempool::get_pool((pool_index_t)i);
+    f->open_object_section(get_pool_name((pool_index_t)i));
+    pool.dump(f);
+    pool.get_stats(&total);
+    f->close_section();
+  }
+  f->close_section();
+  f->dump_object("total", total);
+  f->close_section();
+}
+
+// --------------------------------------------------------------
+
+size_t mempool::pool_t::allocated_bytes() const
+{
+  ssize_t result = 0;
+  for (size_t i = 0; i < num_shards; ++i) {
+    result += shard[i].bytes;
+  }
+  // per-shard counts can go negative (free on a different thread than
+  // the allocation); only the sum is meaningful, and it can be briefly
+  // negative while updates race with this read.
+  return result > 0 ? result : 0;
+}
+
+size_t mempool::pool_t::allocated_items() const
+{
+  ssize_t result = 0;
+  for (size_t i = 0; i < num_shards; ++i) {
+    result += shard[i].items;
+  }
+  return result > 0 ? result : 0;
+}
+
+void mempool::pool_t::get_stats(stats_t *total) const
+{
+  for (size_t i = 0; i < num_shards; ++i) {
+    total->items += shard[i].items;
+    total->bytes += shard[i].bytes;
+  }
+}
+
+void mempool::pool_t::dump(ceph::Formatter *f) const
+{
+  stats_t total;
+  get_stats(&total);
+  total.dump(f);
+}
+
+void mempool::stats_t::dump(ceph::Formatter *f) const
+{
+  f->dump_int("items", items);
+  f->dump_int("bytes", bytes);
+}
@@ -38,6 +38,14 @@ class SimpleLRU {
   }
 
   void _add(K key, V&& value) {
+    typename ceph::unordered_map<K, typename list<pair<K, V> >::iterator, H>::iterator i =
+      contents.find(key);
+    if (i != contents.end()) {
+      // racing adds of the same key; keep the newest value
+      i->second->second = std::move(value);
+      lru.splice(lru.begin(), lru, i->second);
+      return;
+    }
     lru.emplace_front(key, std::move(value)); // can't move key because we access it below
     contents[key] = lru.begin();
     trim_cache();
@@ -77,6 +85,13 @@ public:
     contents.erase(i);
   }
 
+  /// drop everything that isn't pinned
+  void clear() {
+    Mutex::Locker l(lock);
+    contents.clear();
+    lru.clear();
+  }
+
   void set_size(size_t new_size) {
     Mutex::Locker l(lock);
     max_size = new_size;
@@ -34,6 +34,11 @@ class Compressor {
   // this is a bit weird but we need non-const iterator to be in
   // alignment with decode methods
   virtual int decompress(bufferlist::iterator &p, size_t compressed_len, bufferlist &out) = 0;
+  // compressors that keep per-pool state (e.g. trained dictionaries)
+  // override this; the output must still decompress with decompress()
+  virtual int compress_for_pool(int64_t pool, const bufferlist &in, bufferlist &out) {
+    return compress(in, out);
+  }
 
   static CompressorRef create(CephContext *cct, const string &type);
 };
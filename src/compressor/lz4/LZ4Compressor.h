@@ -0,0 +1,81 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+#ifndef CEPH_COMPRESSION_LZ4_H
+#define CEPH_COMPRESSION_LZ4_H
+
+#include <lz4.h>
+#include <lz4hc.h>
+
+#include "include/buffer.h"
+#include "include/encoding.h"
+#include "compressor/Compressor.h"
+
+/**
+ * lz4 block format, prefixed with the u32 original length.
+ *
+ * level 0 uses the fast compressor; 1 and up use lz4hc at that level
+ * (slower to compress, same decompression speed).
+ */
+class LZ4Compressor : public Compressor {
+  int level;
+
+ public:
+  explicit LZ4Compressor(int l) : Compressor("lz4"), level(l) {}
+
+  int compress(const bufferlist &src, bufferlist &dst) override {
+    if (src.length() > LZ4_MAX_INPUT_SIZE)
+      return -1;
+    // lz4 wants contiguous input; this only copies if it is not already
+    bufferlist in(src);
+    const char *s = in.c_str();
+    int bound = LZ4_compressBound(in.length());
+    bufferptr ptr = buffer::create_page_aligned(bound);
+    int r;
+    if (level > 0) {
+      r = LZ4_compress_HC(s, ptr.c_str(), in.length(), bound, level);
+    } else {
+      r = LZ4_compress_default(s, ptr.c_str(), in.length(), bound);
+    }
+    if (r <= 0)
+      return -1;
+    ::encode((uint32_t)in.length(), dst);
+    dst.append(ptr, 0, r);
+    return 0;
+  }
+
+  int decompress(const bufferlist &src, bufferlist &dst) override {
+    bufferlist::iterator i = const_cast<bufferlist&>(src).begin();
+    return decompress(i, src.length(), dst);
+  }
+
+  int decompress(bufferlist::iterator &p,
+		 size_t compressed_len,
+		 bufferlist &dst) override {
+    if (compressed_len < 4)
+      return -1;
+    uint32_t dst_len;
+    ::decode(dst_len, p);
+    compressed_len -= 4;
+    bufferlist in;
+    p.copy(compressed_len, in);
+    bufferptr ptr(dst_len);
+    int r = LZ4_decompress_safe(in.c_str(), ptr.c_str(), in.length(),
+				dst_len);
+    if (r < 0 || (uint32_t)r != dst_len)
+      return -1;
+    dst.append(ptr);
+    return 0;
+  }
+};
+
+#endif
@@ -0,0 +1,218 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+#include <dirent.h>
+#include <stdlib.h>
+
+#include <zstd.h>
+
+#include "common/debug.h"
+#include "common/errno.h"
+#include "include/encoding.h"
+#include "ZstdCompressor.h"
+
+#define dout_subsys ceph_subsys_compressor
+#undef dout_prefix
+#define dout_prefix *_dout << "ZstdCompressor: "
+
+ZstdCompressor::ZstdCompressor(CephContext *cct)
+  : Compressor("zstd"),
+    cct(cct),
+    level(cct->_conf->compressor_zstd_level),
+    dict_max_size(cct->_conf->compressor_zstd_dict_max_size)
+{
+  if (cct->_conf->compressor_zstd_dict_dir.length()) {
+    load_dicts(cct->_conf->compressor_zstd_dict_dir);
+  }
+}
+
+ZstdCompressor::~ZstdCompressor()
+{
+  for (auto& p : id_dicts) {
+    ZSTD_freeCDict(p.second.cdict);
+    ZSTD_freeDDict(p.second.ddict);
+  }
+}
+
+void ZstdCompressor::load_dicts(const string& dir)
+{
+  DIR *d = ::opendir(dir.c_str());
+  if (!d) {
+    int r = -errno;
+    lderr(cct) << __func__ << " unable to open " << dir << ": "
+	       << cpp_strerror(r) << dendl;
+    return;
+  }
+  struct dirent *de;
+  while ((de = ::readdir(d)) != NULL) {
+    string name = de->d_name;
+    if (name.length() <= 5 ||
+	name.compare(name.length() - 5, 5, ".dict") != 0) {
+      continue;
+    }
+    char *end;
+    int64_t pool = strtoll(name.c_str(), &end, 10);
+    if (end != name.c_str() + name.length() - 5) {
+      continue;
+    }
+    bufferlist bl;
+    string err;
+    int r = bl.read_file((dir + "/" + name).c_str(), &err);
+    if (r < 0) {
+      lderr(cct) << __func__ << " unable to read " << name << ": " << err
+		 << dendl;
+      continue;
+    }
+    uint32_t id = ZSTD_getDictID_fromDict(bl.c_str(), bl.length());
+    if (id == 0) {
+      lderr(cct) << __func__ << " " << name << " is not a trained dictionary"
+		 << " (no dictionary id), ignoring" << dendl;
+      continue;
+    }
+    dict_t dict;
+    dict.id = id;
+    dict.cdict = ZSTD_createCDict(bl.c_str(), bl.length(), level);
+    dict.ddict = ZSTD_createDDict(bl.c_str(), bl.length());
+    if (!dict.cdict || !dict.ddict) {
+      lderr(cct) << __func__ << " unable to load " << name << dendl;
+      ZSTD_freeCDict(dict.cdict);
+      ZSTD_freeDDict(dict.ddict);
+      continue;
+    }
+    if (id_dicts.count(id)) {
+      // another pool shares this dictionary
+      ZSTD_freeCDict(dict.cdict);
+      ZSTD_freeDDict(dict.ddict);
+      dict = id_dicts[id];
+    } else {
+      id_dicts[id] = dict;
+    }
+    pool_dicts[pool] = dict;
+    ldout(cct, 1) << __func__ << " pool " << pool << " dict id " << id
+		  << " (" << bl.length() << " bytes)" << dendl;
+  }
+  ::closedir(d);
+}
+
+int ZstdCompressor::_compress(const dict_t *d, const bufferlist &in,
+			      bufferlist &out)
+{
+  ZSTD_CCtx *cctx = ZSTD_createCCtx();
+  if (!cctx)
+    return -ENOMEM;
+  if (d) {
+    ZSTD_CCtx_refCDict(cctx, d->cdict);
+  } else {
+    ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, level);
+  }
+  ZSTD_CCtx_setPledgedSrcSize(cctx, in.length());
+
+  bufferptr ptr = buffer::create_page_aligned(ZSTD_compressBound(in.length()));
+  ZSTD_outBuffer outbuf = { ptr.c_str(), ptr.length(), 0 };
+  size_t r = 0;
+  for (auto p = in.buffers().begin(); p != in.buffers().end(); ++p) {
+    ZSTD_inBuffer inbuf = { p->c_str(), p->length(), 0 };
+    while (inbuf.pos < inbuf.size) {
+      r = ZSTD_compressStream2(cctx, &outbuf, &inbuf, ZSTD_e_continue);
+      if (ZSTD_isError(r))
+	break;
+    }
+    if (ZSTD_isError(r))
+      break;
+  }
+  if (!ZSTD_isError(r)) {
+    ZSTD_inBuffer inbuf = { NULL, 0, 0 };
+    do {
+      r = ZSTD_compressStream2(cctx, &outbuf, &inbuf, ZSTD_e_end);
+    } while (r > 0 && !ZSTD_isError(r));
+  }
+  ZSTD_freeCCtx(cctx);
+  if (ZSTD_isError(r)) {
+    ldout(cct, 1) << __func__ << " " << ZSTD_getErrorName(r) << dendl;
+    return -EIO;
+  }
+
+  ::encode((uint32_t)in.length(), out);
+  ::encode((uint32_t)(d ? d->id : 0), out);
+  out.append(ptr, 0, outbuf.pos);
+  return 0;
+}
+
+int ZstdCompressor::compress(const bufferlist &in, bufferlist &out)
+{
+  return _compress(NULL, in, out);
+}
+
+int ZstdCompressor::compress_for_pool(int64_t pool, const bufferlist &in,
+				      bufferlist &out)
+{
+  const dict_t *d = NULL;
+  if (in.length() <= dict_max_size) {
+    auto p = pool_dicts.find(pool);
+    if (p != pool_dicts.end()) {
+      d = &p->second;
+    }
+  }
+  return _compress(d, in, out);
+}
+
+int ZstdCompressor::decompress(const bufferlist &in, bufferlist &out)
+{
+  bufferlist::iterator i = const_cast<bufferlist&>(in).begin();
+  return decompress(i, in.length(), out);
+}
+
+int ZstdCompressor::decompress(bufferlist::iterator &p,
+			       size_t compressed_len,
+			       bufferlist &out)
+{
+  if (compressed_len < 8)
+    return -1;
+  uint32_t dst_len, dict_id;
+  ::decode(dst_len, p);
+  ::decode(dict_id, p);
+  compressed_len -= 8;
+
+  ZSTD_DCtx *dctx = ZSTD_createDCtx();
+  if (!dctx)
+    return -ENOMEM;
+  if (dict_id) {
+    auto d = id_dicts.find(dict_id);
+    if (d == id_dicts.end()) {
+      lderr(cct) << __func__ << " missing dictionary " << dict_id << dendl;
+      ZSTD_freeDCtx(dctx);
+      return -ENOENT;
+    }
+    ZSTD_DCtx_refDDict(dctx, d->second.ddict);
+  }
+
+  bufferptr dst(dst_len);
+  ZSTD_outBuffer outbuf = { dst.c_str(), dst.length(), 0 };
+  size_t r = 1;  // > 0 until the frame is complete
+  while (compressed_len > 0 && r != 0 && !ZSTD_isError(r)) {
+    const char *data;
+    size_t l = p.get_ptr_and_advance(compressed_len, &data);
+    ZSTD_inBuffer inbuf = { data, l, 0 };
+    while (inbuf.pos < inbuf.size && r != 0 && !ZSTD_isError(r)) {
+      r = ZSTD_decompressStream(dctx, &outbuf, &inbuf);
+    }
+    compressed_len -= l;
+  }
+  ZSTD_freeDCtx(dctx);
+  if (ZSTD_isError(r) || r != 0 || outbuf.pos != dst_len) {
+    ldout(cct, 1) << __func__ << " corrupt input"
+		  << (ZSTD_isError(r) ? ZSTD_getErrorName(r) : "") << dendl;
+    return -1;
+  }
+  out.append(dst);
+  return 0;
+}
@@ -0,0 +1,66 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+#ifndef CEPH_COMPRESSION_ZSTD_H
+#define CEPH_COMPRESSION_ZSTD_H
+
+#include <map>
+
+#include "compressor/Compressor.h"
+
+struct ZSTD_CDict_s;
+struct ZSTD_DDict_s;
+
+/**
+ * zstd, optionally with trained dictionaries.
+ *
+ * Output is a u32 original length and a u32 dictionary id (0 for none)
+ * followed by a single zstd frame.
+ *
+ * Dictionaries are loaded from compressor_zstd_dict_dir, one file per
+ * pool named <pool id>.dict (e.g. as produced by 'zstd --train').  They
+ * are only used by compress_for_pool() for inputs of at most
+ * compressor_zstd_dict_max_size (64K) bytes; bigger inputs have enough
+ * history of their own.  BlueStore only compresses blobs bigger than
+ * its min_alloc_size, so with the defaults dictionaries apply to small
+ * writes on SSD but not on HDD.  decompress() finds the dictionary by
+ * id, so a dictionary must stay in the directory as long as anything
+ * compressed with it is around.
+ */
+class ZstdCompressor : public Compressor {
+  CephContext *cct;
+  int level;
+  uint64_t dict_max_size;
+
+  struct dict_t {
+    uint32_t id;
+    ZSTD_CDict_s *cdict;
+    ZSTD_DDict_s *ddict;
+  };
+  // loaded by the constructor and read-only after that
+  std::map<int64_t, dict_t> pool_dicts; ///< pool -> dictionary
+  std::map<uint32_t, dict_t> id_dicts;  ///< dict id -> dictionary
+
+  void load_dicts(const string& dir);
+  int _compress(const dict_t *d, const bufferlist &in, bufferlist &out);
+
+public:
+  explicit ZstdCompressor(CephContext *cct);
+  ~ZstdCompressor();
+
+  int compress(const bufferlist &in, bufferlist &out) override;
+  int compress_for_pool(int64_t pool, const bufferlist &in, bufferlist &out) override;
+  int decompress(const bufferlist &in, bufferlist &out) override;
+  int decompress(bufferlist::iterator &p, size_t compressed_len, bufferlist &out) override;
+};
+
+#endif
@@ -126,6 +126,7 @@ namespace buffer CEPH_BUFFER_API {
   class raw;
   class raw_malloc;
   class raw_static;
+  class raw_claim_buffer;
   class raw_mmap_pages;
   class raw_posix_aligned;
   class raw_hack_aligned;
@@ -147,6 +148,9 @@ namespace buffer CEPH_BUFFER_API {
   raw* create_malloc(unsigned len);
   raw* claim_malloc(unsigned len, char *buf);
   raw* create_static(unsigned len, char *buf);
+  /// wrap memory owned elsewhere; release(arg, buf) runs when the last ref goes
+  raw* claim_buffer(unsigned len, char *buf,
+		    void (*release)(void *arg, char *buf), void *arg);
   raw* create_aligned(unsigned len, unsigned align);
   raw* create_page_aligned(unsigned len);
   raw* create_zero_copy(unsigned len, int fd, int64_t *offset);
@@ -167,6 +171,66 @@ namespace buffer CEPH_BUFFER_API {
     void release();
 
   public:
+    /// lightweight forward iterator over a single contiguous ptr
+    ///
+    /// This is used by the denc decoders: unlike list::iterator there
+    /// are no segments to walk, so each access is a bounds check and a
+    /// pointer bump.
+    class iterator {
+      const ptr *bp;        ///< parent ptr
+      const char *start;    ///< starting pointer into bp->c_str()
+      const char *pos;      ///< current position
+      const char *end_ptr;  ///< bp->c_str() + bp->length()
+
+    public:
+      iterator() : bp(nullptr), start(nullptr), pos(nullptr),
+		   end_ptr(nullptr) {}
+      iterator(const ptr *p, size_t offset)
+	: bp(p),
+	  start(p->have_raw() ? p->c_str() + offset : nullptr),
+	  pos(start),
+	  end_ptr(p->have_raw() ? p->c_str() + p->length() : nullptr) {
+	if (start > end_ptr)
+	  throw end_of_buffer();
+      }
+
+      /// return the current position and advance by len bytes
+      const char *get_pos_add(size_t len) {
+	const char *r = pos;
+	advance(len);
+	return r;
+      }
+
+      /// return a (shallow) ptr to the next len bytes and advance
+      ptr get_ptr(size_t len) {
+	size_t off = pos - bp->c_str();
+	advance(len);
+	return ptr(*bp, off, len);
+      }
+
+      void advance(size_t len) {
+	if (len > (size_t)(end_ptr - pos))
+	  throw end_of_buffer();
+	pos += len;
+      }
+
+      const char *get_pos() const {
+	return pos;
+      }
+      const char *get_end() const {
+	return end_ptr;
+      }
+      size_t get_offset() const {
+	return pos - start;
+      }
+      size_t get_remaining() const {
+	return end_ptr - pos;
+      }
+      bool end() const {
+	return pos == end_ptr;
+      }
+    };
+
     ptr() : _raw(0), _off(0), _len(0) {}
     // cppcheck-suppress noExplicitConstructor
     ptr(raw *r);
@@ -184,6 +248,10 @@ namespace buffer CEPH_BUFFER_API {
 
     bool have_raw() const { return _raw ? true:false; }
 
+    iterator begin(size_t offset=0) const {
+      return iterator(this, offset);
+    }
+
     raw *clone();
     void swap(ptr& other);
     ptr& make_shareable();
@@ -221,6 +289,11 @@ namespace buffer CEPH_BUFFER_API {
     unsigned raw_length() const;
     int raw_nref() const;
 
+    /// mempool (mempool::pool_index_t) the underlying raw is charged to
+    int get_mempool() const;
+    void reassign_to_mempool(int pool);
+    void try_assign_to_mempool(int pool);
+
     void copy_out(unsigned o, unsigned l, char *dest) const;
 
     bool can_zero_copy() const;
@@ -378,6 +451,54 @@ namespace buffer CEPH_BUFFER_API {
       }
     };
 
+    /// append into a single contiguous, pre-sized region
+    ///
+    /// The constructor reserves len bytes of tail space in the list's
+    /// append_buffer; callers then write through raw pointers and the
+    /// bytes actually used are added to the list when the appender is
+    /// destroyed.  The list must not be modified while an appender is
+    /// outstanding, and no more than len bytes may be written.
+    class CEPH_BUFFER_API contiguous_appender {
+      list& bl;
+      char *start;
+      char *pos;
+      char *end_ptr;
+
+      contiguous_appender(const contiguous_appender&) = delete;
+      contiguous_appender& operator=(const contiguous_appender&) = delete;
+
+    public:
+      contiguous_appender(list& l, size_t len);
+      ~contiguous_appender();
+
+      /// return the current position and advance by len bytes
+      char *get_pos_add(size_t len) {
+	char *r = pos;
+	pos += len;
+	assert(pos <= end_ptr);
+	return r;
+      }
+      char *get_pos() {
+	return pos;
+      }
+      /// number of bytes written so far
+      size_t get_logical_offset() const {
+	return pos - start;
+      }
+
+      void append(const char *p, size_t len) {
+	memcpy(get_pos_add(len), p, len);
+      }
+      void append(const ptr& p) {
+	if (p.length())
+	  append(p.c_str(), p.length());
+      }
+      void append(const list& l) {
+	for (const auto& p : l.buffers())
+	  append(p);
+      }
+    };
+
   private:
     mutable iterator last_p;
     int zero_copy_to_fd(int fd) const;
@@ -450,6 +571,11 @@ namespace buffer CEPH_BUFFER_API {
 
     bool is_zero() const;
 
+    /// charge all referenced raw buffers to the given mempool
+    void reassign_to_mempool(int pool);
+    /// as above, but leave buffers already assigned to a pool alone
+    void try_assign_to_mempool(int pool);
+
     // modifiers
     void clear() {
       _buffers.clear();
@@ -561,6 +687,9 @@ namespace buffer CEPH_BUFFER_API {
     void append(const list& bl);
     void append(std::istream& in);
     void append_zero(unsigned len);
+
+    /// make sure the next len bytes of appends land in one contiguous buffer
+    void reserve(size_t len);
     
     /*
      * get a char
@@ -29,4 +29,31 @@ static inline uint32_t ceph_crc32c(uint32_t crc, unsigned char const *data, unsi
 	return ceph_crc32c_func(crc, data, length);
 }
 
+typedef void (*ceph_crc32c_blocks_func_t)(uint32_t crc, unsigned char const *data, unsigned block_size, unsigned blocks, uint32_t *out);
+
+extern ceph_crc32c_blocks_func_t ceph_crc32c_blocks_func;
+
+extern ceph_crc32c_blocks_func_t ceph_choose_crc32c_blocks(void);
+
+/**
+ * calculate crc32c of each of a run of equally sized blocks
+ *
+ * Each block is checksummed on its own, starting from the same
+ * initial value; this is what a per-block checksum (e.g. BlueStore's
+ * csum_data) needs, and lets the implementation work on several
+ * blocks at once.
+ *
+ * @param crc initial value for every block
+ * @param data pointer to the first block (must not be NULL)
+ * @param block_size length of each block
+ * @param blocks number of blocks
+ * @param out array of (at least) blocks crcs
+ */
+static inline void ceph_crc32c_blocks(uint32_t crc, unsigned char const *data,
+				      unsigned block_size, unsigned blocks,
+				      uint32_t *out)
+{
+	ceph_crc32c_blocks_func(crc, data, block_size, blocks, out);
+}
+
 #endif
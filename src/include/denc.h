@@ -0,0 +1,720 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * Copyright (C) 2016 Red Hat
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+// If you are not familiar with encoding.h, start there.  denc is an
+// alternative, template-driven encoding scheme for hot types.  Every
+// type supplies three operations through denc_traits<T>:
+//
+//  - bound_encode(const T&, size_t& p): add an upper bound on the
+//    encoded size to p.  This is cheap (often a compile-time constant
+//    per field) and is done once up front.
+//  - encode(const T&, bufferlist::contiguous_appender& p): encode into
+//    a single pre-sized contiguous buffer.  No per-field capacity checks
+//    or list walking.
+//  - decode(T&, bufferptr::iterator& p): decode from a single contiguous
+//    buffer with a pointer bump per field.
+//
+// The wire format is identical to the equivalent encoding.h and
+// small_encoding.h encoders, so a type can be switched over without an
+// on-disk or on-wire format change.
+//
+// Classes normally implement all three with a single templated
+// function using the DENC() macro:
+//
+//   struct foo_t {
+//     uint64_t a;
+//     uint32_t b;
+//     DENC(foo_t, v, p) {
+//       DENC_START(1, 1, p);
+//       denc(v.a, p);
+//       denc_varint(v.b, p);
+//       DENC_FINISH(p);
+//     }
+//   };
+//   WRITE_CLASS_DENC(foo_t)
+//
+// WRITE_CLASS_DENC also defines the legacy ::encode(const T&, bufferlist&)
+// and ::decode(T&, bufferlist::iterator&) entry points, so existing
+// callers (and containers in encoding.h) keep working.
+
+#ifndef CEPH_DENC_H
+#define CEPH_DENC_H
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "include/int_types.h"
+#include "include/intarith.h"
+#include "include/byteorder.h"
+#include "include/buffer.h"
+#include "include/encoding.h"
+#include "include/assert.h"
+
+template<typename T, typename VVV=void>
+struct denc_traits {
+  static constexpr bool supported = false;
+  static constexpr bool bounded = false;
+};
+
+
+// ---------------------------------------------------------------------
+// raw types
+
+#define WRITE_RAW_DENC(type)						\
+  template<>								\
+  struct denc_traits<type> {						\
+    static constexpr bool supported = true;				\
+    static constexpr bool bounded = true;				\
+    static void bound_encode(const type& o, size_t& p) {		\
+      p += sizeof(type);						\
+    }									\
+    static void encode(const type& o,					\
+		       buffer::list::contiguous_appender& p) {		\
+      memcpy(p.get_pos_add(sizeof(type)), &o, sizeof(type));		\
+    }									\
+    static void decode(type& o, buffer::ptr::iterator& p) {		\
+      memcpy(&o, p.get_pos_add(sizeof(type)), sizeof(type));		\
+    }									\
+  };
+
+WRITE_RAW_DENC(__u8)
+#ifndef _CHAR_IS_SIGNED
+WRITE_RAW_DENC(__s8)
+#endif
+WRITE_RAW_DENC(char)
+WRITE_RAW_DENC(ceph_le64)
+WRITE_RAW_DENC(ceph_le32)
+WRITE_RAW_DENC(ceph_le16)
+
+
+// ---------------------------------------------------------------------
+// integer types (little endian on the wire)
+
+#define WRITE_INT_DENC(itype, etype)					\
+  template<>								\
+  struct denc_traits<itype> {						\
+    static constexpr bool supported = true;				\
+    static constexpr bool bounded = true;				\
+    static void bound_encode(const itype& o, size_t& p) {		\
+      p += sizeof(itype);						\
+    }									\
+    static void encode(const itype& o,					\
+		       buffer::list::contiguous_appender& p) {		\
+      ceph_##etype e;							\
+      e = o;								\
+      memcpy(p.get_pos_add(sizeof(e)), &e, sizeof(e));			\
+    }									\
+    static void decode(itype& o, buffer::ptr::iterator& p) {		\
+      ceph_##etype e;							\
+      memcpy(&e, p.get_pos_add(sizeof(e)), sizeof(e));			\
+      o = e;								\
+    }									\
+  };
+
+WRITE_INT_DENC(uint64_t, le64)
+WRITE_INT_DENC(int64_t, le64)
+WRITE_INT_DENC(uint32_t, le32)
+WRITE_INT_DENC(int32_t, le32)
+WRITE_INT_DENC(uint16_t, le16)
+WRITE_INT_DENC(int16_t, le16)
+
+template<>
+struct denc_traits<bool> {
+  static constexpr bool supported = true;
+  static constexpr bool bounded = true;
+  static void bound_encode(const bool& o, size_t& p) {
+    p += 1;
+  }
+  static void encode(const bool& o, buffer::list::contiguous_appender& p) {
+    *p.get_pos_add(1) = o ? 1 : 0;
+  }
+  static void decode(bool& o, buffer::ptr::iterator& p) {
+    o = *p.get_pos_add(1);
+  }
+};
+
+
+// ---------------------------------------------------------------------
+// the generic entry points
+
+template<typename T, typename traits=denc_traits<T>>
+inline typename std::enable_if<traits::supported>::type
+denc(const T& o, size_t& p)
+{
+  traits::bound_encode(o, p);
+}
+
+template<typename T, typename traits=denc_traits<T>>
+inline typename std::enable_if<traits::supported>::type
+denc(const T& o, buffer::list::contiguous_appender& p)
+{
+  traits::encode(o, p);
+}
+
+template<typename T, typename traits=denc_traits<T>>
+inline typename std::enable_if<traits::supported>::type
+denc(T& o, buffer::ptr::iterator& p)
+{
+  traits::decode(o, p);
+}
+
+
+// ---------------------------------------------------------------------
+// varints
+//
+// These match the small_encode_* encoders in small_encoding.h byte for
+// byte.  The bound is the worst case for the integer width.
+
+template<typename T>
+inline void denc_varint(T v, size_t& p) {
+  p += sizeof(T) + 2;
+}
+
+template<typename T>
+inline void denc_varint(T v, buffer::list::contiguous_appender& p) {
+  uint8_t byte = v & 0x7f;
+  v >>= 7;
+  while (v) {
+    byte |= 0x80;
+    *(__u8*)p.get_pos_add(1) = byte;
+    byte = (v & 0x7f);
+    v >>= 7;
+  }
+  *(__u8*)p.get_pos_add(1) = byte;
+}
+
+template<typename T>
+inline void denc_varint(T& v, buffer::ptr::iterator& p) {
+  uint8_t byte = *(__u8*)p.get_pos_add(1);
+  v = byte & 0x7f;
+  int shift = 7;
+  while (byte & 0x80) {
+    byte = *(__u8*)p.get_pos_add(1);
+    v |= (T)(byte & 0x7f) << shift;
+    shift += 7;
+  }
+}
+
+// signed varint: low bit = 1 = negative, 0 = positive
+template<typename T>
+inline void denc_signed_varint(T v, size_t& p) {
+  p += sizeof(T) + 2;
+}
+
+template<typename T>
+inline void denc_signed_varint(T v, buffer::list::contiguous_appender& p) {
+  uint8_t byte = 0;
+  if (v < 0) {
+    v = -v;
+    byte = 1;
+  }
+  byte |= (v & 0x3f) << 1;
+  v >>= 6;
+  while (v) {
+    byte |= 0x80;
+    *(__u8*)p.get_pos_add(1) = byte;
+    byte = (v & 0x7f);
+    v >>= 7;
+  }
+  *(__u8*)p.get_pos_add(1) = byte;
+}
+
+template<typename T>
+inline void denc_signed_varint(T& v, buffer::ptr::iterator& p) {
+  uint8_t byte = *(__u8*)p.get_pos_add(1);
+  bool negative = byte & 1;
+  v = (byte & 0x7e) >> 1;
+  int shift = 6;
+  while (byte & 0x80) {
+    byte = *(__u8*)p.get_pos_add(1);
+    v |= (T)(byte & 0x7f) << shift;
+    shift += 7;
+  }
+  if (negative) {
+    v = -v;
+  }
+}
+
+// varint + lowz: low 2 bits = number of low zero nibbles
+template<typename T>
+inline void denc_varint_lowz(T v, size_t& p) {
+  p += sizeof(T) + 2;
+}
+
+template<typename T>
+inline void denc_varint_lowz(T v, buffer::list::contiguous_appender& p) {
+  int lowz = v ? (ctz(v) / 4) : 0;
+  uint8_t byte = std::min(lowz, 3);
+  v >>= byte * 4;
+  byte |= (((uint8_t)v << 2) & 0x7c);
+  v >>= 5;
+  while (v) {
+    byte |= 0x80;
+    *(__u8*)p.get_pos_add(1) = byte;
+    byte = (v & 0x7f);
+    v >>= 7;
+  }
+  *(__u8*)p.get_pos_add(1) = byte;
+}
+
+template<typename T>
+inline void denc_varint_lowz(T& v, buffer::ptr::iterator& p) {
+  uint8_t byte = *(__u8*)p.get_pos_add(1);
+  int shift = (byte & 3) * 4;
+  v = ((byte >> 2) & 0x1f) << shift;
+  shift += 5;
+  while (byte & 0x80) {
+    byte = *(__u8*)p.get_pos_add(1);
+    v |= (T)(byte & 0x7f) << shift;
+    shift += 7;
+  }
+}
+
+// LBA: see small_encode_lba() for the layout
+inline void denc_lba(uint64_t v, size_t& p) {
+  p += sizeof(uint32_t) + 6;
+}
+
+inline void denc_lba(uint64_t v, buffer::list::contiguous_appender& p) {
+  int low_zero_nibbles = v ? (int)(ctz(v) / 4) : 0;
+  int pos;
+  uint32_t word;
+  int t = low_zero_nibbles - 3;
+  if (t < 0) {
+    pos = 3;
+    word = 0x7;
+  } else if (t < 3) {
+    v >>= (low_zero_nibbles * 4);
+    pos = t + 1;
+    word = (1 << t) - 1;
+  } else {
+    v >>= 20;
+    pos = 3;
+    word = 0x3;
+  }
+  word |= (v << pos) & 0x7fffffff;
+  v >>= 31 - pos;
+  if (!v) {
+    denc(word, p);
+    return;
+  }
+  word |= 0x80000000;
+  denc(word, p);
+  uint8_t byte = v & 0x7f;
+  v >>= 7;
+  while (v) {
+    byte |= 0x80;
+    *(__u8*)p.get_pos_add(1) = byte;
+    byte = (v & 0x7f);
+    v >>= 7;
+  }
+  *(__u8*)p.get_pos_add(1) = byte;
+}
+
+inline void denc_lba(uint64_t& v, buffer::ptr::iterator& p) {
+  uint32_t word;
+  denc(word, p);
+  int shift;
+  switch (word & 7) {
+  case 0:
+  case 2:
+  case 4:
+  case 6:
+    v = (uint64_t)(word & 0x7ffffffe) << (12 - 1);
+    shift = 12 + 30;
+    break;
+  case 1:
+  case 5:
+    v = (uint64_t)(word & 0x7ffffffc) << (16 - 2);
+    shift = 16 + 29;
+    break;
+  case 3:
+    v = (uint64_t)(word & 0x7ffffff8) << (20 - 3);
+    shift = 20 + 28;
+    break;
+  case 7:
+  default:
+    v = (uint64_t)(word & 0x7ffffff8) >> 3;
+    shift = 28;
+  }
+  uint8_t byte = word >> 24;
+  while (byte & 0x80) {
+    byte = *(__u8*)p.get_pos_add(1);
+    v |= (uint64_t)(byte & 0x7f) << shift;
+    shift += 7;
+  }
+}
+
+
+// ---------------------------------------------------------------------
+// strings and buffers (u32 length prefix, as in encoding.h)
+
+template<>
+struct denc_traits<std::string> {
+  static constexpr bool supported = true;
+  static constexpr bool bounded = false;
+  static void bound_encode(const std::string& s, size_t& p) {
+    p += sizeof(uint32_t) + s.size();
+  }
+  static void encode(const std::string& s,
+		     buffer::list::contiguous_appender& p) {
+    uint32_t len = s.size();
+    denc(len, p);
+    if (len)
+      p.append(s.data(), len);
+  }
+  static void decode(std::string& s, buffer::ptr::iterator& p) {
+    uint32_t len;
+    denc(len, p);
+    s.assign(p.get_pos_add(len), len);
+  }
+};
+
+// bufferptrs are deep copied on decode, like ::decode(bufferptr&): the
+// source is usually a large kv value we do not want to pin.
+template<>
+struct denc_traits<buffer::ptr> {
+  static constexpr bool supported = true;
+  static constexpr bool bounded = false;
+  static void bound_encode(const buffer::ptr& v, size_t& p) {
+    p += sizeof(uint32_t) + v.length();
+  }
+  static void encode(const buffer::ptr& v,
+		     buffer::list::contiguous_appender& p) {
+    uint32_t len = v.length();
+    denc(len, p);
+    p.append(v);
+  }
+  static void decode(buffer::ptr& v, buffer::ptr::iterator& p) {
+    uint32_t len;
+    denc(len, p);
+    v = buffer::copy(p.get_pos_add(len), len);
+  }
+};
+
+template<>
+struct denc_traits<buffer::list> {
+  static constexpr bool supported = true;
+  static constexpr bool bounded = false;
+  static void bound_encode(const buffer::list& v, size_t& p) {
+    p += sizeof(uint32_t) + v.length();
+  }
+  static void encode(const buffer::list& v,
+		     buffer::list::contiguous_appender& p) {
+    uint32_t len = v.length();
+    denc(len, p);
+    p.append(v);
+  }
+  static void decode(buffer::list& v, buffer::ptr::iterator& p) {
+    uint32_t len;
+    denc(len, p);
+    v.clear();
+    if (len)
+      v.append(p.get_pos_add(len), len);
+  }
+};
+
+
+// ---------------------------------------------------------------------
+// containers (u32 count, as in encoding.h)
+
+template<typename T, typename Alloc>
+struct denc_traits<
+  std::vector<T, Alloc>,
+  typename std::enable_if<denc_traits<T>::supported>::type> {
+  typedef denc_traits<T> traits;
+  static constexpr bool supported = true;
+  static constexpr bool bounded = false;
+  static void bound_encode(const std::vector<T, Alloc>& s, size_t& p) {
+    p += sizeof(uint32_t);
+    if (traits::bounded && !s.empty()) {
+      size_t elem_size = 0;
+      denc(s.front(), elem_size);
+      p += elem_size * s.size();
+    } else {
+      for (const auto& e : s)
+	denc(e, p);
+    }
+  }
+  static void encode(const std::vector<T, Alloc>& s,
+		     buffer::list::contiguous_appender& p) {
+    uint32_t n = s.size();
+    denc(n, p);
+    for (const auto& e : s)
+      denc(e, p);
+  }
+  static void decode(std::vector<T, Alloc>& s, buffer::ptr::iterator& p) {
+    uint32_t n;
+    denc(n, p);
+    s.clear();
+    s.resize(n);
+    for (auto& e : s)
+      denc(e, p);
+  }
+};
+
+template<typename A, typename B, typename Comp, typename Alloc>
+struct denc_traits<
+  std::map<A, B, Comp, Alloc>,
+  typename std::enable_if<denc_traits<A>::supported &&
+			  denc_traits<B>::supported>::type> {
+  static constexpr bool supported = true;
+  static constexpr bool bounded = false;
+  static void bound_encode(const std::map<A, B, Comp, Alloc>& s,
+			   size_t& p) {
+    p += sizeof(uint32_t);
+    for (const auto& e : s) {
+      denc(e.first, p);
+      denc(e.second, p);
+    }
+  }
+  static void encode(const std::map<A, B, Comp, Alloc>& s,
+		     buffer::list::contiguous_appender& p) {
+    uint32_t n = s.size();
+    denc(n, p);
+    for (const auto& e : s) {
+      denc(e.first, p);
+      denc(e.second, p);
+    }
+  }
+  static void decode(std::map<A, B, Comp, Alloc>& s,
+		     buffer::ptr::iterator& p) {
+    uint32_t n;
+    denc(n, p);
+    s.clear();
+    while (n--) {
+      A k;
+      denc(k, p);
+      denc(s[k], p);
+    }
+  }
+};
+
+
+// vector with a varint element count, as in small_encode_obj()
+template<typename T>
+inline void denc_small_vector(const std::vector<T>& v, size_t& p) {
+  denc_varint(v.size(), p);
+  if (denc_traits<T>::bounded && !v.empty()) {
+    size_t elem_size = 0;
+    denc(v.front(), elem_size);
+    p += elem_size * v.size();
+  } else {
+    for (const auto& e : v)
+      denc(e, p);
+  }
+}
+
+template<typename T>
+inline void denc_small_vector(const std::vector<T>& v,
+			      buffer::list::contiguous_appender& p) {
+  denc_varint(v.size(), p);
+  for (const auto& e : v)
+    denc(e, p);
+}
+
+template<typename T>
+inline void denc_small_vector(std::vector<T>& v, buffer::ptr::iterator& p) {
+  size_t n;
+  denc_varint(n, p);
+  v.clear();
+  v.resize(n);
+  for (auto& e : v)
+    denc(e, p);
+}
+
+
+// ---------------------------------------------------------------------
+// class helpers
+
+// Versioned envelope, identical on the wire to ENCODE_START/DECODE_START:
+// u8 struct_v, u8 struct_compat, u32 struct_len.
+#define DENC_HELPERS							\
+  /* bound_encode */							\
+  static void _denc_start(size_t& p,					\
+			  __u8 *struct_v,				\
+			  __u8 *struct_compat,				\
+			  char **, uint32_t *) {			\
+    p += 2 + 4;								\
+  }									\
+  static void _denc_finish(size_t& p,					\
+			   __u8 *struct_v,				\
+			   __u8 *struct_compat,				\
+			   char **, uint32_t *) { }			\
+  /* encode */								\
+  static void _denc_start(buffer::list::contiguous_appender& p,		\
+			  __u8 *struct_v,				\
+			  __u8 *struct_compat,				\
+			  char **len_pos,				\
+			  uint32_t *) {					\
+    denc(*struct_v, p);							\
+    denc(*struct_compat, p);						\
+    *len_pos = p.get_pos_add(4);					\
+  }									\
+  static void _denc_finish(buffer::list::contiguous_appender& p,	\
+			   __u8 *struct_v,				\
+			   __u8 *struct_compat,				\
+			   char **len_pos,				\
+			   uint32_t *) {				\
+    ceph_le32 len;							\
+    len = p.get_pos() - *len_pos - sizeof(uint32_t);			\
+    memcpy(*len_pos, &len, sizeof(len));				\
+  }									\
+  /* decode */								\
+  static void _denc_start(buffer::ptr::iterator& p,			\
+			  __u8 *struct_v,				\
+			  __u8 *struct_compat,				\
+			  char **start_pos,				\
+			  uint32_t *struct_len) {			\
+    __u8 v = *struct_v;							\
+    denc(*struct_v, p);							\
+    denc(*struct_compat, p);						\
+    if (v < *struct_compat)						\
+      throw buffer::malformed_input(std::string(__PRETTY_FUNCTION__) +	\
+	" unknown encoding version > " + std::to_string(v));		\
+    denc(*struct_len, p);						\
+    if (*struct_len > p.get_remaining())				\
+      throw buffer::malformed_input(DECODE_ERR_PAST(			\
+	__PRETTY_FUNCTION__));						\
+    *start_pos = const_cast<char*>(p.get_pos());			\
+  }									\
+  static void _denc_finish(buffer::ptr::iterator& p,			\
+			   __u8 *struct_v,				\
+			   __u8 *struct_compat,				\
+			   char **start_pos,				\
+			   uint32_t *struct_len) {			\
+    const char *pos = p.get_pos();					\
+    const char *end = *start_pos + *struct_len;				\
+    if (pos > end)							\
+      throw buffer::malformed_input(DECODE_ERR_PAST(			\
+	__PRETTY_FUNCTION__));						\
+    if (pos < end)							\
+      p.advance(end - pos);						\
+  }
+
+#define DENC_START(v, compat, p)					\
+  __u8 struct_v = v;							\
+  __u8 struct_compat = compat;						\
+  char *_denc_pos;							\
+  uint32_t _denc_u32;							\
+  _denc_start(p, &struct_v, &struct_compat, &_denc_pos, &_denc_u32);	\
+  do {
+
+#define DENC_FINISH(p)							\
+  } while (false);							\
+  _denc_finish(p, &struct_v, &struct_compat, &_denc_pos, &_denc_u32);
+
+// Define bound_encode/encode/decode members in terms of a single
+// templated body.  Type is the enclosing class, v the object and p the
+// size/appender/iterator.
+#define DENC(Type, v, p)						\
+  DENC_HELPERS								\
+  void bound_encode(size_t& p) const {					\
+    _denc_friend(*this, p);						\
+  }									\
+  void encode(buffer::list::contiguous_appender& p) const {		\
+    _denc_friend(*this, p);						\
+  }									\
+  void decode(buffer::ptr::iterator& p) {				\
+    _denc_friend(*this, p);						\
+  }									\
+  template<typename _T, typename _P>					\
+  friend typename std::enable_if<std::is_same<_T, Type>::value ||	\
+				 std::is_same<_T, const Type>::value>::type \
+  _denc_friend(_T& v, _P& p)
+
+
+// Encode a denc type into a bufferlist: one bound pass, one allocation,
+// one contiguous encode.
+template<typename T, typename traits=denc_traits<T>>
+inline typename std::enable_if<traits::supported>::type
+denc_encode(const T& o, buffer::list& bl)
+{
+  size_t len = 0;
+  traits::bound_encode(o, len);
+  buffer::list::contiguous_appender a(bl, len);
+  traits::encode(o, a);
+}
+
+// Decode a denc type from a bufferlist::iterator.  If the rest of the
+// current segment covers what is left of the list we decode in place.
+// Otherwise we try the current segment, then a contiguous copy of a
+// window that doubles until the object fits: copying the whole
+// remainder each time would make a run of decodes from one fragmented
+// list quadratic.  A window that is too short can fail with any decode
+// error (DENC_START checks struct_len against it and throws
+// malformed_input), so we only give up once it covers the remainder.
+template<typename T, typename traits=denc_traits<T>>
+inline typename std::enable_if<traits::supported>::type
+denc_decode(T& o, buffer::list::iterator& p)
+{
+  if (p.end())
+    throw buffer::end_of_buffer();
+  unsigned remaining = p.get_remaining();
+  buffer::ptr tmp = p.get_current_ptr();
+  if (tmp.length() == remaining) {
+    buffer::ptr::iterator cp = tmp.begin();
+    traits::decode(o, cp);
+    p.advance(cp.get_offset());
+    return;
+  }
+  while (true) {
+    T t;
+    buffer::ptr::iterator cp = tmp.begin();
+    try {
+      traits::decode(t, cp);
+    } catch (buffer::error&) {
+      if (tmp.length() == remaining)
+	throw;
+      unsigned want = std::min<unsigned>(remaining, tmp.length() * 2);
+      buffer::list::iterator w = p;
+      w.copy(want, tmp);
+      continue;
+    }
+    o = std::move(t);
+    p.advance(cp.get_offset());
+    return;
+  }
+}
+
+#define _DECLARE_CLASS_DENC(cl, _bounded)				\
+  template<>								\
+  struct denc_traits<cl> {						\
+    static constexpr bool supported = true;				\
+    static constexpr bool bounded = _bounded;				\
+    static void bound_encode(const cl& v, size_t& p) {			\
+      v.bound_encode(p);						\
+    }									\
+    static void encode(const cl& v,					\
+		       buffer::list::contiguous_appender& p) {		\
+      v.encode(p);							\
+    }									\
+    static void decode(cl& v, buffer::ptr::iterator& p) {		\
+      v.decode(p);							\
+    }									\
+  };									\
+  inline void encode(const cl& c, bufferlist& bl, uint64_t features=0) { \
+    denc_encode(c, bl);							\
+  }									\
+  inline void decode(cl& c, bufferlist::iterator& p) {			\
+    denc_decode(c, p);							\
+  }
+
+#define WRITE_CLASS_DENC(cl) _DECLARE_CLASS_DENC(cl, false)
+#define WRITE_CLASS_DENC_BOUNDED(cl) _DECLARE_CLASS_DENC(cl, true)
+
+#endif
@@ -0,0 +1,289 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * Copyright (C) 2016 Red Hat
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+#ifndef CEPH_MEMPOOL_H
+#define CEPH_MEMPOOL_H
+
+#include <cstddef>
+#include <atomic>
+#include <list>
+#include <map>
+#include <set>
+#include <vector>
+#include <unordered_map>
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "include/page.h"
+
+namespace ceph {
+  class Formatter;
+}
+
+// Memory pools
+// ------------
+//
+// A memory pool is a named bucket of byte and item counters.  Anything
+// allocated "in" a pool is charged to it on allocation and credited
+// back on free, so we can answer "where did the RSS go?" for a running
+// daemon without a heap profiler.
+//
+// Memory gets into a pool in one of three ways:
+//
+//  - STL containers declared through the pool's namespace, e.g.
+//
+//      mempool::osd_pglog::map<hobject_t, pg_log_entry_t*> objects;
+//
+//    which is a std::map using mempool::pool_allocator.
+//
+//  - Classes that are allocated with new/delete and declare
+//    MEMPOOL_CLASS_HELPERS() in the class body plus
+//    MEMPOOL_DEFINE_OBJECT_FACTORY(Type, name, pool) in one .cc file.
+//
+//  - Buffers.  Every buffer::raw starts out in buffer_anon and can be
+//    moved with bufferptr::reassign_to_mempool() or
+//    bufferlist::reassign_to_mempool().
+//
+// Counters are sharded by thread so that the accounting does not turn
+// into a global cache line ping-pong; reading a pool's totals sums the
+// shards and is therefore approximate while allocations are in flight.
+//
+// The current totals can be dumped with the 'dump_mempools' admin
+// socket command.
+//
+// To add a pool, add it to the list below.
+
+#define DEFINE_MEMORY_POOLS_HELPER(f) \
+  f(buffer_anon)			    \
+  f(bluestore_meta_onode)		    \
+  f(bluestore_meta_other)		    \
+  f(bluestore_data)			    \
+  f(osd_pglog)				    \
+  f(osdmap)
+
+namespace mempool {
+
+// enum mempool_index_t { mempool_buffer_anon, ..., num_pools };
+enum pool_index_t {
+#define P(x) mempool_##x,
+  DEFINE_MEMORY_POOLS_HELPER(P)
+#undef P
+  num_pools
+};
+
+const char *get_pool_name(pool_index_t ix);
+
+// must be a power of 2
+static const size_t num_shard_bits = 5;
+static const size_t num_shards = 1 << num_shard_bits;
+
+struct shard_t {
+  std::atomic<ssize_t> bytes = {0};
+  std::atomic<ssize_t> items = {0};
+  char __padding[128 - 2 * sizeof(std::atomic<ssize_t>)];
+} __attribute__ ((aligned (128)));
+
+struct stats_t {
+  ssize_t items = 0;
+  ssize_t bytes = 0;
+  void dump(ceph::Formatter *f) const;
+};
+
+class pool_t {
+  shard_t shard[num_shards];
+
+public:
+  void adjust_count(ssize_t items, ssize_t bytes) {
+    shard_t &s = shard[pick_a_shard()];
+    s.items += items;
+    s.bytes += bytes;
+  }
+
+  size_t allocated_bytes() const;
+  size_t allocated_items() const;
+  void get_stats(stats_t *total) const;
+  void dump(ceph::Formatter *f) const;
+
+  static size_t pick_a_shard() {
+    // Dirt cheap, see:
+    //   http://fossies.org/dox/glibc-2.24/pthread__self_8c_source.html
+    // The pthread_t is a pointer to the thread's stack/TCB and all
+    // threads are at least a page apart, so shift off the page offset
+    // bits and keep the low bits of what is left.
+    size_t me = (size_t)pthread_self();
+    return (me >> CEPH_PAGE_SHIFT) & (num_shards - 1);
+  }
+};
+
+pool_t& get_pool(pool_index_t ix);
+
+/// dump all pools, and a total
+void dump(ceph::Formatter *f);
+
+
+// STL allocator charging its allocations to a pool
+template<pool_index_t pool_ix, typename T>
+class pool_allocator {
+  pool_t *pool;
+
+public:
+  typedef pool_allocator<pool_ix, T> allocator_type;
+  typedef T value_type;
+  typedef value_type *pointer;
+  typedef const value_type * const_pointer;
+  typedef value_type& reference;
+  typedef const value_type& const_reference;
+  typedef std::size_t size_type;
+  typedef std::ptrdiff_t difference_type;
+
+  template<typename U> struct rebind {
+    typedef pool_allocator<pool_ix, U> other;
+  };
+
+  pool_allocator() : pool(&get_pool(pool_ix)) {}
+  template<typename U>
+  pool_allocator(const pool_allocator<pool_ix, U>&)
+    : pool(&get_pool(pool_ix)) {}
+
+  T* allocate(size_t n, void *p = nullptr) {
+    size_t total = sizeof(T) * n;
+    pool->adjust_count(n, total);
+    return reinterpret_cast<T*>(new char[total]);
+  }
+
+  void deallocate(T* p, size_t n) {
+    size_t total = sizeof(T) * n;
+    pool->adjust_count(-(ssize_t)n, -(ssize_t)total);
+    delete[] reinterpret_cast<char*>(p);
+  }
+
+  void destroy(T* p) {
+    p->~T();
+  }
+
+  template<class U>
+  void destroy(U *p) {
+    p->~U();
+  }
+
+  void construct(T* p, const T& val) {
+    ::new ((void *)p) T(val);
+  }
+
+  template<class U, class... Args> void construct(U* p, Args&&... args) {
+    ::new((void *)p) U(std::forward<Args>(args)...);
+  }
+
+  bool operator==(const pool_allocator&) const { return true; }
+  bool operator!=(const pool_allocator&) const { return false; }
+};
+
+
+// Namespace mempool
+
+#define P(x)								\
+  namespace x {								\
+    static const mempool::pool_index_t id = mempool::mempool_##x;	\
+    template<typename v>						\
+    using pool_allocator = mempool::pool_allocator<id, v>;		\
+									\
+    template<typename k,typename v, typename cmp = std::less<k> >	\
+    using map = std::map<k, v, cmp,					\
+			 pool_allocator<std::pair<const k,v>>>;		\
+									\
+    template<typename k,typename v, typename cmp = std::less<k> >	\
+    using multimap = std::multimap<k,v,cmp,				\
+				   pool_allocator<std::pair<const k,	\
+							    v>>>;	\
+									\
+    template<typename k, typename cmp = std::less<k> >			\
+    using set = std::set<k,cmp,pool_allocator<k>>;			\
+									\
+    template<typename v>						\
+    using list = std::list<v,pool_allocator<v>>;			\
+									\
+    template<typename v>						\
+    using vector = std::vector<v,pool_allocator<v>>;			\
+									\
+    template<typename k, typename v,					\
+	     typename h=std::hash<k>,					\
+	     typename eq = std::equal_to<k>>				\
+    using unordered_map =						\
+      std::unordered_map<k,v,h,eq,pool_allocator<std::pair<const k,v>>>;\
+									\
+    template<typename k, typename v,					\
+	     typename h=std::hash<k>,					\
+	     typename eq = std::equal_to<k>>				\
+    using unordered_multimap =						\
+      std::unordered_multimap<k,v,h,eq,					\
+			      pool_allocator<std::pair<const k,v>>>;	\
+									\
+    inline size_t allocated_bytes() {					\
+      return mempool::get_pool(id).allocated_bytes();			\
+    }									\
+    inline size_t allocated_items() {					\
+      return mempool::get_pool(id).allocated_items();			\
+    }									\
+  };
+
+DEFINE_MEMORY_POOLS_HELPER(P)
+
+#undef P
+
+};
+
+
+// Use this for any type that is contained by a container (unless it
+// is a class you defined; see below).
+#define MEMPOOL_DECLARE_FACTORY(obj, factoryname, pool)			\
+  namespace mempool {							\
+    namespace pool {							\
+      extern pool_allocator<obj> alloc_##factoryname;			\
+    }									\
+  }
+
+#define MEMPOOL_DEFINE_FACTORY(obj, factoryname, pool)			\
+  namespace mempool {							\
+    namespace pool {							\
+      pool_allocator<obj> alloc_##factoryname;				\
+    }									\
+  }
+
+// Use this for each class that belongs to a mempool.  For example,
+//
+//   class T {
+//     MEMPOOL_CLASS_HELPERS();
+//     ...
+//   };
+//
+#define MEMPOOL_CLASS_HELPERS()						\
+  void *operator new(size_t size);					\
+  void *operator new[](size_t size) noexcept {				\
+    assert(0 == "no array new");					\
+    return nullptr; }							\
+  void  operator delete(void *);					\
+  void  operator delete[](void *) { assert(0 == "no array delete"); }
+
+// Use this in some particular .cc file to match each class with a
+// MEMPOOL_CLASS_HELPERS().
+#define MEMPOOL_DEFINE_OBJECT_FACTORY(obj,factoryname,pool)		\
+  MEMPOOL_DEFINE_FACTORY(obj, factoryname, pool)			\
+  void *obj::operator new(size_t size) {				\
+    return mempool::pool::alloc_##factoryname.allocate(1); \
+  }									\
+  void obj::operator delete(void *p)  {					\
+    return mempool::pool::alloc_##factoryname.deallocate((obj*)p, 1);	\
+  }
+
+#endif
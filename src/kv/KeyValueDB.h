@@ -281,6 +281,19 @@ public:
     return -EOPNOTSUPP;
   }
 
+  /// resize the block cache; may also be called before open()
+  virtual int set_cache_size(uint64_t s) {
+    return -EOPNOTSUPP;
+  }
+  /// bytes currently held in the block cache
+  virtual int64_t get_cache_usage() const {
+    return -EOPNOTSUPP;
+  }
+  /// cumulative block cache hits and misses since open()
+  virtual int get_cache_hits(uint64_t *hits, uint64_t *misses) const {
+    return -EOPNOTSUPP;
+  }
+
   virtual ~KeyValueDB() {}
 
   /// compact the underlying store
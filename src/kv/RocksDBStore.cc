@@ -16,6 +16,7 @@
 #include "rocksdb/write_batch.h"
 #include "rocksdb/slice.h"
 #include "rocksdb/cache.h"
+#include "rocksdb/statistics.h"
 #include "rocksdb/filter_policy.h"
 #include "rocksdb/utilities/convenience.h"
 #include "rocksdb/merge_operator.h"
@@ -169,6 +170,10 @@ int RocksDBStore::tryInterpret(const string key, const string val, rocksdb::Opti
     int ret = string2bool(val, disableWAL);
     if (ret != 0)
       return ret;
+  } else if (key == "collect_cache_stats") {
+    int ret = string2bool(val, collect_cache_stats);
+    if (ret != 0)
+      return ret;
   } else {
     //unrecognize config options.
     return -EINVAL;
@@ -279,15 +284,23 @@ int RocksDBStore::do_open(ostream &out, bool create_if_missing)
     opt.env = static_cast<rocksdb::Env*>(priv);
   }
 
-  auto cache = rocksdb::NewLRUCache(g_conf->rocksdb_cache_size, g_conf->rocksdb_cache_shard_bits);
+  if (!cache_size) {
+    cache_size = g_conf->rocksdb_cache_size;
+  }
+  bbt_cache = rocksdb::NewLRUCache(cache_size, g_conf->rocksdb_cache_shard_bits);
   rocksdb::BlockBasedTableOptions bbt_opts;
   bbt_opts.block_size = g_conf->rocksdb_block_size;
-  bbt_opts.block_cache = cache;
+  bbt_opts.block_cache = bbt_cache;
   opt.table_factory.reset(rocksdb::NewBlockBasedTableFactory(bbt_opts));
   dout(10) << __func__ << " set block size to " << g_conf->rocksdb_block_size
-           << " cache size to " << g_conf->rocksdb_cache_size
+           << " cache size to " << cache_size
            << " num of cache shards to " << (1 << g_conf->rocksdb_cache_shard_bits) << dendl;
 
+  if (collect_cache_stats) {
+    dbstats = rocksdb::CreateDBStatistics();
+    opt.statistics = dbstats;
+  }
+
   opt.merge_operator.reset(new MergeOperatorRouter(*this));
   status = rocksdb::DB::Open(opt, path, &db);
   if (!status.ok()) {
@@ -317,6 +330,34 @@ int RocksDBStore::do_open(ostream &out, bool create_if_missing)
   return 0;
 }
 
+int RocksDBStore::set_cache_size(uint64_t s)
+{
+  cache_size = s;
+  if (bbt_cache) {
+    bbt_cache->SetCapacity(s);
+  }
+  dout(10) << __func__ << " " << s << dendl;
+  return 0;
+}
+
+int64_t RocksDBStore::get_cache_usage() const
+{
+  if (!bbt_cache) {
+    return -ENOENT;
+  }
+  return bbt_cache->GetUsage();
+}
+
+int RocksDBStore::get_cache_hits(uint64_t *hits, uint64_t *misses) const
+{
+  if (!dbstats) {
+    return -ENOENT;
+  }
+  *hits = dbstats->getTickerCount(rocksdb::BLOCK_CACHE_HIT);
+  *misses = dbstats->getTickerCount(rocksdb::BLOCK_CACHE_MISS);
+  return 0;
+}
+
 int RocksDBStore::_test_init(const string& dir)
 {
   rocksdb::Options options;
@@ -481,14 +522,34 @@ int RocksDBStore::get(
     const std::set<string> &keys,
     std::map<string, bufferlist> *out)
 {
+  if (keys.size() == 1) {
+    // not worth MultiGet's setup for one key
+    bufferlist bl;
+    if (get(prefix, *keys.begin(), &bl) == 0)
+      (*out)[*keys.begin()].claim_append(bl);
+    return 0;
+  }
   utime_t start = ceph_clock_now(g_ceph_context);
+  // one MultiGet reads all the keys from the same version and shares
+  // the memtable/sst lookups setup
+  std::vector<std::string> bounds;
+  std::vector<rocksdb::Slice> slices;
+  // the slices point into bounds; it must not reallocate under them
+  bounds.reserve(keys.size());
+  slices.reserve(keys.size());
   for (std::set<string>::const_iterator i = keys.begin();
        i != keys.end(); ++i) {
-    std::string value;
-    std::string bound = combine_strings(prefix, *i);
-    auto status = db->Get(rocksdb::ReadOptions(), rocksdb::Slice(bound), &value);
-    if (status.ok())
-      (*out)[*i].append(value);
+    bounds.push_back(combine_strings(prefix, *i));
+    slices.push_back(rocksdb::Slice(bounds.back()));
+  }
+  std::vector<std::string> values;
+  std::vector<rocksdb::Status> status =
+    db->MultiGet(rocksdb::ReadOptions(), slices, &values);
+  unsigned n = 0;
+  for (std::set<string>::const_iterator i = keys.begin();
+       i != keys.end(); ++i, ++n) {
+    if (status[n].ok())
+      (*out)[*i].append(values[n]);
   }
   utime_t lat = ceph_clock_now(g_ceph_context) - start;
   logger->inc(l_rocksdb_gets);
@@ -41,6 +41,7 @@ namespace rocksdb{
   class DB;
   class Env;
   class Cache;
+  class Statistics;
   class FilterPolicy;
   class Snapshot;
   class Slice;
@@ -62,6 +63,9 @@ class RocksDBStore : public KeyValueDB {
   void *priv;
   rocksdb::DB *db;
   rocksdb::Env *env;
+  std::shared_ptr<rocksdb::Cache> bbt_cache;   ///< block cache
+  std::shared_ptr<rocksdb::Statistics> dbstats; ///< if collect_cache_stats
+  uint64_t cache_size;  ///< 0 means rocksdb_cache_size
   string options_str;
   int do_open(ostream &out, bool create_if_missing);
 
@@ -90,6 +94,7 @@ public:
   /// compact the underlying rocksdb store
   bool compact_on_mount;
   bool disableWAL;
+  bool collect_cache_stats;  ///< track block cache hits/misses
   void compact();
 
   int tryInterpret(const string key, const string val, rocksdb::Options &opt);
@@ -119,11 +124,13 @@ public:
     priv(p),
     db(NULL),
     env(static_cast<rocksdb::Env*>(p)),
+    cache_size(0),
     compact_queue_lock("RocksDBStore::compact_thread_lock"),
     compact_queue_stop(false),
     compact_thread(this),
     compact_on_mount(false),
-    disableWAL(false)
+    disableWAL(false),
+    collect_cache_stats(false)
   {}
 
   ~RocksDBStore();
@@ -297,6 +304,10 @@ err:
     return total_size;
   }
 
+  int set_cache_size(uint64_t s) override;
+  int64_t get_cache_usage() const override;
+  int get_cache_hits(uint64_t *hits, uint64_t *misses) const override;
+
 
 protected:
   WholeSpaceIterator _get_iterator();
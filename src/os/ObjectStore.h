@@ -55,6 +55,11 @@ enum {
   l_os_j_wr,
   l_os_j_wr_bytes,
   l_os_j_full,
+  l_os_j_copied_bytes,
+  l_os_index_lookup,
+  l_os_index_cache_hit,
+  l_os_index_syscalls,
+  l_os_index_split_moved,
   l_os_committing,
   l_os_commit,
   l_os_commit_len,
@@ -2199,6 +2204,24 @@ public:
     return collection_list(c->get_cid(), start, end, sort_bitwise, max, ls, next);
   }
 
+  /**
+   * hint that the given objects are about to be accessed
+   *
+   * Callers that walk a collection (scrub, backfill) can pass the next
+   * batch of objects from collection_list so the backend can load their
+   * metadata in one go instead of one lookup per object.  This is only
+   * a hint: it has no effect on semantics, and may do nothing.
+   *
+   * @param c collection
+   * @param oids objects, ideally in collection_list order
+   */
+  virtual void prefetch_onodes(const coll_t& c,
+			       const vector<ghobject_t>& oids) {}
+  virtual void prefetch_onodes(CollectionHandle &c,
+			       const vector<ghobject_t>& oids) {
+    prefetch_onodes(c->get_cid(), oids);
+  }
+
 
   /// OMAP
   /// Get omap contents
@@ -2301,6 +2324,21 @@ public:
 
   virtual int flush_journal() { return -EOPNOTSUPP; }
 
+  /**
+   * presplit_collection -- split a collection's on-disk directories ahead of time
+   *
+   * For backends that hash objects into directories, queue splitting
+   * them down to the given depth in the background, so that the
+   * splits don't happen later under load.
+   *
+   * @param c collection
+   * @param depth target directory depth
+   * @returns 0 if queued, or an error code
+   */
+  virtual int presplit_collection(const coll_t& c, unsigned depth) {
+    return -EOPNOTSUPP;
+  }
+
   virtual int dump_journal(ostream& out) { return -EOPNOTSUPP; }
 
   virtual int snapshot(const string& name) { return -EOPNOTSUPP; }
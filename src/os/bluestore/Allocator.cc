@@ -4,6 +4,7 @@
 #include "Allocator.h"
 #include "StupidAllocator.h"
 #include "BitMapAllocator.h"
+#include "HybridAllocator.h"
 #include "common/debug.h"
 
 #define dout_subsys ceph_subsys_bluestore
@@ -15,6 +16,8 @@ Allocator *Allocator::create(string type,
     return new StupidAllocator;
   } else if (type == "bitmap") {
     return new BitMapAllocator(size, block_size);
+  } else if (type == "hybrid") {
+    return new HybridAllocator(block_size);
   }
   derr << "Allocator::" << __func__ << " unknown alloc type " << type << dendl;
   return NULL;
@@ -18,6 +18,7 @@
 #include <unistd.h>
 
 #include "KernelDevice.h"
+#include "MemDevice.h"
 #if defined(HAVE_SPDK)
 #include "NVMEDevice.h"
 #endif
@@ -45,19 +46,25 @@ void IOContext::aio_wait()
 
 BlockDevice *BlockDevice::create(const string& path, aio_callback_t cb, void *cbpriv)
 {
-  string type = "kernel";
-  char buf[PATH_MAX];
-  int r = ::readlink(path.c_str(), buf, sizeof(buf));
-  if (r >= 0) {
-    char *bname = ::basename(buf);
-    if (strncmp(bname, SPDK_PREFIX, sizeof(SPDK_PREFIX)-1) == 0)
-      type = "ust-nvme";
+  string type = g_conf->bdev_type;
+  if (type.empty()) {
+    type = "kernel";
+    char buf[PATH_MAX];
+    int r = ::readlink(path.c_str(), buf, sizeof(buf));
+    if (r >= 0) {
+      char *bname = ::basename(buf);
+      if (strncmp(bname, SPDK_PREFIX, sizeof(SPDK_PREFIX)-1) == 0)
+	type = "ust-nvme";
+    }
   }
   dout(1) << __func__ << " path " << path << " type " << type << dendl;
 
   if (type == "kernel") {
     return new KernelDevice(cb, cbpriv);
   }
+  if (type == "mem" || type == "null") {
+    return new MemDevice(cb, cbpriv, type == "null");
+  }
 #if defined(HAVE_SPDK)
   if (type == "ust-nvme") {
     return new NVMEDevice(cb, cbpriv);
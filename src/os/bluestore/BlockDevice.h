@@ -43,6 +43,7 @@ struct IOContext {
   std::atomic_int num_running = {0};
   std::atomic_int num_reading = {0};
   std::atomic_int num_waiting = {0};
+  int64_t shard_hint = -1;  ///< picks the aio queue (e.g., pg hash); -1 if none
 
   explicit IOContext(void *p)
     : priv(p)
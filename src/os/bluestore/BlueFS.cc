@@ -72,6 +72,22 @@ void BlueFS::_init_logger()
 		    "Bytes written to WAL");
   b.add_u64_counter(l_bluefs_bytes_written_sst, "bytes_written_sst",
 		    "Bytes written to SSTs");
+  b.add_u64(l_bluefs_log_snapshot_bytes, "log_snapshot_bytes",
+	    "Size of the namespace snapshot at the head of the log");
+  b.add_u64_counter(l_bluefs_log_snapshot_reencoded, "log_snapshot_reencoded",
+		    "Snapshot entries re-encoded by log compaction");
+  b.add_u64(l_bluefs_log_replay_bytes, "log_replay_bytes",
+	    "Size of the metadata log replayed at mount");
+  b.add_time(l_bluefs_log_replay_lat, "log_replay_lat",
+	     "Time spent replaying the metadata log at mount");
+  b.add_u64_counter(l_bluefs_read_cache_hit, "read_cache_hit",
+		    "Random read chunks found in the extent cache");
+  b.add_u64_counter(l_bluefs_read_cache_miss, "read_cache_miss",
+		    "Random read chunks fetched from the device");
+  b.add_u64(l_bluefs_read_cache_bytes, "read_cache_bytes",
+	    "Bytes in the extent cache");
+  b.add_u64_counter(l_bluefs_readahead_bytes, "readahead_bytes",
+		    "Bytes read ahead into the extent cache");
   logger = b.create_perf_counters();
   g_ceph_context->get_perfcounters_collection()->add(logger);
 }
@@ -84,9 +100,10 @@ void BlueFS::_shutdown_logger()
 
 void BlueFS::_update_logger_stats()
 {
-  // we must be holding the lock
+  // we must be holding lock and log_lock
   logger->set(l_bluefs_num_files, file_map.size());
   logger->set(l_bluefs_log_bytes, log_writer->file->fnode.size);
+  logger->set(l_bluefs_read_cache_bytes, cache.get_bytes());
 
   if (alloc[BDEV_WAL]) {
     logger->set(l_bluefs_wal_total_bytes, block_total[BDEV_WAL]);
@@ -138,11 +155,14 @@ void BlueFS::add_block_extent(unsigned id, uint64_t offset, uint64_t length)
   assert(bdev[id]->get_size() >= offset + length);
   block_all[id].insert(offset, length);
   block_total[id] += length;
+  alloc_snap_bl.clear();
 
   if (id < alloc.size() && alloc[id]) {
+    std::unique_lock<std::mutex> ll(log_lock);
     log_t.op_alloc_add(id, offset, length);
-    int r = _flush_and_sync_log(l);
+    int r = _flush_and_sync_log(ll);
     assert(r == 0);
+    _update_logger_stats();
     alloc[id]->init_add_free(offset, length);
   }
 
@@ -170,9 +190,14 @@ int BlueFS::reclaim_blocks(unsigned id, uint64_t want,
 
   block_all[id].erase(*offset, *length);
   block_total[id] -= *length;
-  log_t.op_alloc_rm(id, *offset, *length);
-  r = _flush_and_sync_log(l);
-  assert(r == 0);
+  alloc_snap_bl.clear();
+  {
+    std::unique_lock<std::mutex> ll(log_lock);
+    log_t.op_alloc_rm(id, *offset, *length);
+    r = _flush_and_sync_log(ll);
+    assert(r == 0);
+    _update_logger_stats();
+  }
 
   if (logger)
     logger->inc(l_bluefs_reclaim_bytes, *length);
@@ -184,6 +209,7 @@ int BlueFS::reclaim_blocks(unsigned id, uint64_t want,
 uint64_t BlueFS::get_fs_usage()
 {
   std::lock_guard<std::mutex> l(lock);
+  std::lock_guard<std::mutex> ll(log_lock);
   uint64_t total_bytes = 0;
   for (auto& p : file_map) {
     total_bytes += p.second->fnode.get_allocated();
@@ -240,7 +266,8 @@ int BlueFS::get_block_extents(unsigned id, interval_set<uint64_t> *extents)
 
 int BlueFS::mkfs(uuid_d osd_uuid)
 {
-  std::unique_lock<std::mutex> l(lock);
+  std::lock_guard<std::mutex> l(lock);
+  std::unique_lock<std::mutex> ll(log_lock);
   dout(1) << __func__
 	  << " osd_uuid " << osd_uuid
 	  << dendl;
@@ -278,7 +305,7 @@ int BlueFS::mkfs(uuid_d osd_uuid)
       log_t.op_alloc_add(bdev, q.get_start(), q.get_len());
     }
   }
-  _flush_and_sync_log(l);
+  _flush_and_sync_log(ll);
 
   // write supers
   super.log_fnode = log_file->fnode;
@@ -291,6 +318,7 @@ int BlueFS::mkfs(uuid_d osd_uuid)
   log_writer = NULL;
   block_all.clear();
   block_total.clear();
+  alloc_snap_bl.clear();
   _stop_alloc();
   _shutdown_logger();
 
@@ -345,7 +373,11 @@ int BlueFS::mount()
   block_total.resize(MAX_BDEV, 0);
   _init_alloc();
 
-  r = _replay(false);
+  {
+    utime_t start = ceph_clock_now(NULL);
+    r = _replay(false);
+    replay_lat = ceph_clock_now(NULL) - start;
+  }
   if (r < 0) {
     derr << __func__ << " failed to replay log: " << cpp_strerror(r) << dendl;
     _stop_alloc();
@@ -369,6 +401,11 @@ int BlueFS::mount()
            << dendl;
 
   _init_logger();
+  cache.set_max_bytes(g_conf->bluefs_cache_size);
+  logger->set(l_bluefs_log_replay_bytes, log_writer->pos);
+  logger->tset(l_bluefs_log_replay_lat, replay_lat);
+  dout(1) << __func__ << " replayed 0x" << std::hex << log_writer->pos
+	  << std::dec << " bytes of log in " << replay_lat << dendl;
   return 0;
 
  out:
@@ -390,6 +427,8 @@ void BlueFS::umount()
   dir_map.clear();
   super = bluefs_super_t();
   log_t.clear();
+  alloc_snap_bl.clear();
+  cache.clear();
   _shutdown_logger();
 }
 
@@ -793,6 +832,7 @@ void BlueFS::_drop_link(FileRef file)
     dout(20) << __func__ << " destroying " << file->fnode << dendl;
     assert(file->num_reading.load() == 0);
     log_t.op_file_remove(file->fnode.ino);
+    cache.invalidate(file->fnode.ino);
     for (auto& r : file->fnode.extents) {
       alloc[r.bdev]->release(r.offset, r.length);
     }
@@ -828,7 +868,24 @@ int BlueFS::_read_random(
 	     << std::hex << len << std::dec << dendl;
   }
 
-  int ret = 0;
+  if (cache.enabled() && !h->ignore_eof) {
+    _read_random_cached(h, off, len, out);
+  } else {
+    _read_random_direct(h, off, len, out);
+  }
+  int ret = len;
+
+  dout(20) << __func__ << " got " << ret << dendl;
+  --h->file->num_reading;
+  return ret;
+}
+
+void BlueFS::_read_random_direct(
+  FileReader *h,
+  uint64_t off,
+  size_t len,
+  char *out)
+{
   while (len > 0) {
     uint64_t x_off = 0;
     vector<bluefs_extent_t>::iterator p = h->file->fnode.seek(off, &x_off);
@@ -845,13 +902,74 @@ int BlueFS::_read_random(
     assert(r == 0);
     off += l;
     len -= l;
-    ret += l;
     out += l;
   }
+}
 
-  dout(20) << __func__ << " got " << ret << dendl;
-  --h->file->num_reading;
-  return ret;
+void BlueFS::_read_random_cached(
+  FileReader *h,
+  uint64_t off,
+  size_t len,
+  char *out)
+{
+  const uint64_t chunk_size = ExtentCache::CHUNK_SIZE;
+  uint64_t ino = h->file->fnode.ino;
+  uint64_t size = h->file->fnode.size;
+  uint64_t end = off + len;
+
+  // two back-to-back reads make a sequential reader (e.g., a compaction
+  // input); fetch up to bluefs_max_prefetch past the end of each miss.
+  bool sequential = h->readahead;
+  if (off == h->ra_pos.load()) {
+    if (++h->ra_seq >= 2)
+      sequential = true;
+  } else {
+    h->ra_seq = 0;
+  }
+  h->ra_pos = end;
+
+  while (off < end) {
+    uint64_t chunk_off = off & ~(chunk_size - 1);
+    bufferlist bl;
+    if (cache.lookup(ino, chunk_off, &bl)) {
+      dout(20) << __func__ << " hit 0x" << std::hex << chunk_off << "~"
+	       << bl.length() << std::dec << dendl;
+      logger->inc(l_bluefs_read_cache_hit);
+    } else {
+      logger->inc(l_bluefs_read_cache_miss);
+      uint64_t fetch_end = chunk_off + chunk_size;
+      if (sequential) {
+	fetch_end = MAX(fetch_end,
+			ROUND_UP_TO(end + g_conf->bluefs_max_prefetch,
+				    chunk_size));
+      }
+      fetch_end = MIN(fetch_end, size);
+      dout(20) << __func__ << " miss 0x" << std::hex << chunk_off
+	       << ", fetching 0x" << chunk_off << "~" << fetch_end - chunk_off
+	       << std::dec << dendl;
+      bufferptr fetched = buffer::create(fetch_end - chunk_off);
+      _read_random_direct(h, chunk_off, fetch_end - chunk_off,
+			  fetched.c_str());
+      for (uint64_t o = chunk_off; o < fetch_end; o += chunk_size) {
+	bufferlist cbl;
+	cbl.append(buffer::copy(fetched.c_str() + o - chunk_off,
+				MIN(chunk_size, fetch_end - o)));
+	cache.insert(ino, o, cbl);
+	if (o == chunk_off) {
+	  bl.claim(cbl);
+	}
+      }
+      uint64_t wanted_end = MIN(ROUND_UP_TO(end, chunk_size), size);
+      if (fetch_end > wanted_end) {
+	logger->inc(l_bluefs_readahead_bytes, fetch_end - wanted_end);
+      }
+    }
+    assert(chunk_off + bl.length() > off);
+    uint64_t l = MIN(end, chunk_off + bl.length()) - off;
+    bl.copy(off - chunk_off, l, out);
+    off += l;
+    out += l;
+  }
 }
 
 int BlueFS::_read(
@@ -940,11 +1058,78 @@ int BlueFS::_read(
   return ret;
 }
 
+void BlueFS::ExtentCache::set_max_bytes(uint64_t max)
+{
+  std::lock_guard<std::mutex> l(lock);
+  max_bytes = max;
+  _trim(max);
+}
+
+bool BlueFS::ExtentCache::lookup(uint64_t ino, uint64_t offset,
+				 bufferlist *bl)
+{
+  std::lock_guard<std::mutex> l(lock);
+  auto p = chunks.find(make_pair(ino, offset));
+  if (p == chunks.end())
+    return false;
+  lru.erase(lru.iterator_to(p->second));
+  lru.push_front(p->second);
+  *bl = p->second.bl;
+  return true;
+}
+
+void BlueFS::ExtentCache::insert(uint64_t ino, uint64_t offset,
+				 bufferlist& bl)
+{
+  std::lock_guard<std::mutex> l(lock);
+  auto r = chunks.emplace(make_pair(ino, offset), Chunk());
+  Chunk& c = r.first->second;
+  if (r.second) {
+    c.ino = ino;
+    c.offset = offset;
+  } else {
+    bytes -= c.bl.length();
+    lru.erase(lru.iterator_to(c));
+  }
+  c.bl = bl;
+  bytes += c.bl.length();
+  lru.push_front(c);
+  _trim(max_bytes);
+}
+
+void BlueFS::ExtentCache::invalidate(uint64_t ino, uint64_t offset,
+				     uint64_t length)
+{
+  if (!enabled())
+    return;  // max_bytes only changes at mount and umount
+  std::lock_guard<std::mutex> l(lock);
+  auto p = chunks.lower_bound(make_pair(ino, offset & ~(CHUNK_SIZE - 1)));
+  while (p != chunks.end() &&
+	 p->first.first == ino &&
+	 (length == 0 || p->first.second < offset + length)) {
+    bytes -= p->second.bl.length();
+    lru.erase(lru.iterator_to(p->second));
+    chunks.erase(p++);
+  }
+}
+
+void BlueFS::ExtentCache::_trim(uint64_t max)
+{
+  while (bytes > max) {
+    assert(!lru.empty());
+    Chunk& c = lru.back();
+    lru.pop_back();
+    bytes -= c.bl.length();
+    chunks.erase(make_pair(c.ino, c.offset));
+  }
+}
+
 void BlueFS::_invalidate_cache(FileRef f, uint64_t offset, uint64_t length)
 {
   dout(10) << __func__ << " file " << f->fnode
 	   << " 0x" << std::hex << offset << "~" << length << std::dec
            << dendl;
+  cache.invalidate(f->fnode.ino, offset, length);
   if (offset & ~super.block_mask()) {
     offset &= super.block_mask();
     length = ROUND_UP_TO(length, super.block_size);
@@ -978,6 +1163,9 @@ void BlueFS::compact_log()
 {
   std::unique_lock<std::mutex> l(lock);
   if (g_conf->bluefs_compact_log_sync) {
+     std::unique_lock<std::mutex> ll(log_lock);
+     while (log_flushing)
+       log_cond.wait(ll);
      _compact_log_sync();
   } else {
     _compact_log_async(l);
@@ -986,6 +1174,10 @@ void BlueFS::compact_log()
 
 bool BlueFS::_should_compact_log()
 {
+  if (new_log_writer) {
+    dout(10) << __func__ << " async compaction already in progress" << dendl;
+    return false;
+  }
   uint64_t current = log_writer->file->fnode.size;
   uint64_t expected = _estimate_log_size();
   float ratio = (float)current / (float)expected;
@@ -1004,31 +1196,59 @@ void BlueFS::_compact_log_dump_metadata(bluefs_transaction_t *t)
   t->uuid = super.uuid;
   dout(20) << __func__ << " op_init" << dendl;
 
+  // reuse the encoding of anything that has not changed since the last
+  // snapshot; the ops are simply concatenated in op_bl.
+  unsigned reencoded = 0;
   t->op_init();
-  for (unsigned bdev = 0; bdev < MAX_BDEV; ++bdev) {
-    interval_set<uint64_t>& p = block_all[bdev];
-    for (interval_set<uint64_t>::iterator q = p.begin(); q != p.end(); ++q) {
-      dout(20) << __func__ << " op_alloc_add " << bdev << " 0x"
-               << std::hex << q.get_start() << "~" << q.get_len() << std::dec
-               << dendl;
-      t->op_alloc_add(bdev, q.get_start(), q.get_len());
+  if (alloc_snap_bl.length() == 0) {
+    bluefs_transaction_t s;
+    for (unsigned bdev = 0; bdev < MAX_BDEV; ++bdev) {
+      interval_set<uint64_t>& p = block_all[bdev];
+      for (interval_set<uint64_t>::iterator q = p.begin(); q != p.end(); ++q) {
+	dout(20) << __func__ << " op_alloc_add " << bdev << " 0x"
+		 << std::hex << q.get_start() << "~" << q.get_len() << std::dec
+		 << dendl;
+	s.op_alloc_add(bdev, q.get_start(), q.get_len());
+      }
     }
+    alloc_snap_bl.claim(s.op_bl);
+    ++reencoded;
   }
+  t->op_bl.append(alloc_snap_bl);
   for (auto& p : file_map) {
     if (p.first == 1)
       continue;
-    dout(20) << __func__ << " op_file_update " << p.second->fnode << dendl;
-    t->op_file_update(p.second->fnode);
+    File *file = p.second.get();
+    if (file->snap_bl.length() == 0) {
+      dout(20) << __func__ << " op_file_update " << file->fnode << dendl;
+      bluefs_transaction_t s;
+      s.op_file_update(file->fnode);
+      file->snap_bl.claim(s.op_bl);
+      ++reencoded;
+    }
+    t->op_bl.append(file->snap_bl);
   }
   for (auto& p : dir_map) {
-    dout(20) << __func__ << " op_dir_create " << p.first << dendl;
-    t->op_dir_create(p.first);
-    for (auto& q : p.second->file_map) {
-      dout(20) << __func__ << " op_dir_link " << p.first << "/" << q.first
-	       << " to " << q.second->fnode.ino << dendl;
-      t->op_dir_link(p.first, q.first, q.second->fnode.ino);
+    Dir *dir = p.second.get();
+    if (dir->snap_bl.length() == 0) {
+      dout(20) << __func__ << " op_dir_create " << p.first << dendl;
+      bluefs_transaction_t s;
+      s.op_dir_create(p.first);
+      for (auto& q : dir->file_map) {
+	dout(20) << __func__ << " op_dir_link " << p.first << "/" << q.first
+		 << " to " << q.second->fnode.ino << dendl;
+	s.op_dir_link(p.first, q.first, q.second->fnode.ino);
+      }
+      dir->snap_bl.claim(s.op_bl);
+      ++reencoded;
     }
+    t->op_bl.append(dir->snap_bl);
   }
+  dout(10) << __func__ << " re-encoded " << reencoded << " of "
+	   << file_map.size() + dir_map.size() << " entries, snapshot is 0x"
+	   << std::hex << t->op_bl.length() << std::dec << " bytes" << dendl;
+  logger->inc(l_bluefs_log_snapshot_reencoded, reencoded);
+  logger->set(l_bluefs_log_snapshot_bytes, t->op_bl.length());
 }
 
 void BlueFS::_compact_log_sync()
@@ -1109,6 +1329,7 @@ void BlueFS::_compact_log_sync()
 void BlueFS::_compact_log_async(std::unique_lock<std::mutex>& l)
 {
   dout(10) << __func__ << dendl;
+  std::unique_lock<std::mutex> ll(log_lock);
   File *log_file = log_writer->file.get();
 
   // 1. allocate new log space and jump to it.
@@ -1128,7 +1349,7 @@ void BlueFS::_compact_log_async(std::unique_lock<std::mutex>& l)
   // write the new entries
   log_t.op_file_update(log_file->fnode);
   log_t.op_jump(log_seq, old_log_jump_to);
-  _flush_and_sync_log(l, 0, old_log_jump_to);
+  _flush_and_sync_log(ll, 0, old_log_jump_to);
 
   // 2. prepare compacted log
   bluefs_transaction_t t;
@@ -1157,8 +1378,9 @@ void BlueFS::_compact_log_async(std::unique_lock<std::mutex>& l)
   new_log_writer->append(bl);
 
   // 3. flush
+  ll.unlock();
   _flush(new_log_writer, true);
-  lock.unlock();
+  l.unlock();
 
   // 4. wait
   dout(10) << __func__ << " waiting for compacted log to sync" << dendl;
@@ -1166,7 +1388,10 @@ void BlueFS::_compact_log_async(std::unique_lock<std::mutex>& l)
   flush_bdev();
 
   // 5. retake lock
-  lock.lock();
+  l.lock();
+  ll.lock();
+  while (log_flushing)
+    log_cond.wait(ll);
 
   // 6. update our log fnode
   // discard first old_log_jump_to extents
@@ -1210,9 +1435,11 @@ void BlueFS::_compact_log_async(std::unique_lock<std::mutex>& l)
   ++super.version;
   _write_super();
 
-  lock.unlock();
+  ll.unlock();
+  l.unlock();
   flush_bdev();
-  lock.lock();
+  l.lock();
+  ll.lock();
 
   // 8. release old space
   dout(10) << __func__ << " release old log extents " << old_extents << dendl;
@@ -1220,9 +1447,9 @@ void BlueFS::_compact_log_async(std::unique_lock<std::mutex>& l)
     alloc[r.bdev]->release(r.offset, r.length);
   }
 
-  // delete the new log, remove from the dirty files list
+  // delete the new log
+  assert(new_log->dirty_seq == 0);
   _close_writer(new_log_writer);
-  dirty_files.erase(dirty_files.iterator_to(*new_log));
   new_log_writer = nullptr;
   new_log = nullptr;
   log_cond.notify_all();
@@ -1243,8 +1470,8 @@ void BlueFS::_pad_bl(bufferlist& bl)
 
 void BlueFS::flush_log()
 {
-  std::unique_lock<std::mutex> l(lock);
-  _flush_and_sync_log(l);
+  std::unique_lock<std::mutex> ll(log_lock);
+  _flush_and_sync_log(ll);
 }
 
 int BlueFS::_flush_and_sync_log(std::unique_lock<std::mutex>& l,
@@ -1312,7 +1539,7 @@ int BlueFS::_flush_and_sync_log(std::unique_lock<std::mutex>& l,
     log_writer->file->fnode.size = jump_to;
   }
 
-  // drop lock while we wait for io
+  // drop log_lock while we wait for io
   l.unlock();
   wait_for_aio(log_writer);
   flush_bdev();
@@ -1342,7 +1569,6 @@ int BlueFS::_flush_and_sync_log(std::unique_lock<std::mutex>& l,
              << " already > out seq " << seq
              << ", we lost a race against another log flush, done" << dendl;
   }
-  _update_logger_stats();
 
   return 0;
 }
@@ -1352,7 +1578,6 @@ int BlueFS::_flush_range(FileWriter *h, uint64_t offset, uint64_t length)
   dout(10) << __func__ << " " << h << " pos 0x" << std::hex << h->pos
 	   << " 0x" << offset << "~" << length << std::dec
 	   << " to " << h->file->fnode << dendl;
-  assert(!h->file->deleted);
   assert(h->file->num_readers.load() == 0);
 
   if (offset + length <= h->pos)
@@ -1364,6 +1589,16 @@ int BlueFS::_flush_range(FileWriter *h, uint64_t offset, uint64_t length)
              << std::hex << offset << "~" << length << std::dec
              << dendl;
   }
+
+  // the fnode and the log are shared with everyone else, so update them
+  // under log_lock.  the log writer (ino 1) and the compacted log being
+  // written by _compact_log_async (ino 0) are never dirtied, and their
+  // callers already own them.
+  std::unique_lock<std::mutex> ll(log_lock, std::defer_lock);
+  if (h->file->fnode.ino > 1) {
+    ll.lock();
+  }
+  assert(!h->file->deleted);
   assert(offset <= h->file->fnode.size);
 
   uint64_t allocated = h->file->fnode.get_allocated();
@@ -1374,7 +1609,7 @@ int BlueFS::_flush_range(FileWriter *h, uint64_t offset, uint64_t length)
   if (allocated < offset + length) {
     // we should never run out of log space here; see the min runway check
     // in _flush_and_sync_log.
-    assert(h->file->fnode.ino != 1);
+    assert(h->file->fnode.ino > 1);
     int r = _allocate(h->file->fnode.prefer_bdev,
 		      offset + length - allocated,
 		      &h->file->fnode.extents);
@@ -1388,7 +1623,7 @@ int BlueFS::_flush_range(FileWriter *h, uint64_t offset, uint64_t length)
   }
   if (h->file->fnode.size < offset + length) {
     h->file->fnode.size = offset + length;
-    if (h->file->fnode.ino != 1) {
+    if (h->file->fnode.ino > 1) {
       // we do not need to dirty the log file when the file size
       // changes because replay is smart enough to discover it on its
       // own.
@@ -1397,7 +1632,7 @@ int BlueFS::_flush_range(FileWriter *h, uint64_t offset, uint64_t length)
   }
   if (must_dirty) {
     h->file->fnode.mtime = ceph_clock_now(NULL);
-    log_t.op_file_update(h->file->fnode);
+    _log_file_update(h->file.get());
     if (h->file->dirty_seq == 0) {
       dirty_files.push_back(*h->file);
       dout(20) << __func__ << " dirty_seq = " << log_seq + 1
@@ -1409,13 +1644,27 @@ int BlueFS::_flush_range(FileWriter *h, uint64_t offset, uint64_t length)
     h->file->dirty_seq = log_seq + 1;
   }
   dout(20) << __func__ << " file now " << h->file->fnode << dendl;
+  cache.invalidate(h->file->fnode.ino, offset, length);
 
   uint64_t x_off = 0;
-  vector<bluefs_extent_t>::iterator p = h->file->fnode.seek(offset, &x_off);
-  assert(p != h->file->fnode.extents.end());
-  dout(20) << __func__ << " in " << *p << " x_off 0x"
+  vector<bluefs_extent_t>::iterator q = h->file->fnode.seek(offset, &x_off);
+  assert(q != h->file->fnode.extents.end());
+  dout(20) << __func__ << " in " << *q << " x_off 0x"
            << std::hex << x_off << std::dec << dendl;
 
+  // copy the extents we write to: once log_lock is dropped, preallocate()
+  // may append to fnode.extents and invalidate any iterator into it
+  vector<bluefs_extent_t> extents;
+  for (uint64_t want = x_off + length; want > 0; ++q) {
+    assert(q != h->file->fnode.extents.end());
+    extents.push_back(*q);
+    want -= MIN(want, q->length);
+  }
+  vector<bluefs_extent_t>::iterator p = extents.begin();
+  if (ll.owns_lock()) {
+    ll.unlock();
+  }
+
   unsigned partial = x_off & ~super.block_mask();
   bufferlist bl;
   if (partial) {
@@ -1537,9 +1786,12 @@ int BlueFS::_truncate(FileWriter *h, uint64_t offset)
 {
   dout(10) << __func__ << " 0x" << std::hex << offset << std::dec
            << " file " << h->file->fnode << dendl;
-  if (h->file->deleted) {
-    dout(10) << __func__ << "  deleted, no-op" << dendl;
-    return 0;
+  {
+    std::lock_guard<std::mutex> ll(log_lock);
+    if (h->file->deleted) {
+      dout(10) << __func__ << "  deleted, no-op" << dendl;
+      return 0;
+    }
   }
   // truncate off unflushed data?
   if (h->pos < offset &&
@@ -1556,6 +1808,7 @@ int BlueFS::_truncate(FileWriter *h, uint64_t offset)
     if (r < 0)
       return r;
   }
+  std::lock_guard<std::mutex> ll(log_lock);
   if (offset == h->file->fnode.size) {
     return 0;  // no-op!
   }
@@ -1563,26 +1816,30 @@ int BlueFS::_truncate(FileWriter *h, uint64_t offset)
     assert(0 == "truncate up not supported");
   }
   assert(h->file->fnode.size >= offset);
+  cache.invalidate(h->file->fnode.ino, offset);
   h->file->fnode.size = offset;
-  log_t.op_file_update(h->file->fnode);
+  _log_file_update(h->file.get());
   return 0;
 }
 
-int BlueFS::_fsync(FileWriter *h, std::unique_lock<std::mutex>& l)
+int BlueFS::_fsync(FileWriter *h)
 {
   dout(10) << __func__ << " " << h << " " << h->file->fnode << dendl;
   int r = _flush(h, true);
   if (r < 0)
      return r;
-  uint64_t old_dirty_seq = h->file->dirty_seq;
-  lock.unlock();
+  uint64_t old_dirty_seq;
+  {
+    std::lock_guard<std::mutex> ll(log_lock);
+    old_dirty_seq = h->file->dirty_seq;
+  }
   wait_for_aio(h);
-  lock.lock();
   if (old_dirty_seq) {
+    std::unique_lock<std::mutex> ll(log_lock);
     uint64_t s = log_seq;
     dout(20) << __func__ << " file metadata was dirty (" << old_dirty_seq
 	     << ") on " << h->file->fnode << ", flushing log" << dendl;
-    _flush_and_sync_log(l, old_dirty_seq);
+    _flush_and_sync_log(ll, old_dirty_seq);
     assert(h->file->dirty_seq == 0 ||  // cleaned
 	   h->file->dirty_seq > s);    // or redirtied by someone else
   }
@@ -1672,7 +1929,7 @@ int BlueFS::_preallocate(FileRef f, uint64_t off, uint64_t len)
     int r = _allocate(f->fnode.prefer_bdev, want, &f->fnode.extents);
     if (r < 0)
       return r;
-    log_t.op_file_update(f->fnode);
+    _log_file_update(f.get());
   }
   return 0;
 }
@@ -1680,6 +1937,7 @@ int BlueFS::_preallocate(FileRef f, uint64_t off, uint64_t len)
 void BlueFS::sync_metadata()
 {
   std::unique_lock<std::mutex> l(lock);
+  std::unique_lock<std::mutex> ll(log_lock);
   if (log_t.empty()) {
     dout(10) << __func__ << " - no pending log events" << dendl;
     return;
@@ -1691,17 +1949,19 @@ void BlueFS::sync_metadata()
       p->commit_start();
     }
   }
-  _flush_and_sync_log(l);
+  _flush_and_sync_log(ll);
   for (auto p : alloc) {
     if (p) {
       p->commit_finish();
     }
   }
+  _update_logger_stats();
 
   if (_should_compact_log()) {
     if (g_conf->bluefs_compact_log_sync) {
       _compact_log_sync();
     } else {
+      ll.unlock();
       _compact_log_async(l);
     }
   }
@@ -1718,6 +1978,7 @@ int BlueFS::open_for_write(
   bool overwrite)
 {
   std::lock_guard<std::mutex> l(lock);
+  std::lock_guard<std::mutex> ll(log_lock);
   dout(10) << __func__ << " " << dirname << "/" << filename << dendl;
   map<string,DirRef>::iterator p = dir_map.find(dirname);
   DirRef dir;
@@ -1745,6 +2006,7 @@ int BlueFS::open_for_write(
     file->fnode.mtime = ceph_clock_now(NULL);
     file_map[ino_last] = file;
     dir->file_map[filename] = file;
+    dir->snap_bl.clear();
     ++file->refs;
     create = true;
   } else {
@@ -1759,6 +2021,7 @@ int BlueFS::open_for_write(
 	       << ") file " << filename
 	       << " already exists, truncate + overwrite" << dendl;
       file->fnode.size = 0;
+      cache.invalidate(file->fnode.ino);
       for (auto& p : file->fnode.extents) {
         alloc[p.bdev]->release(p.offset, p.length);
       }
@@ -1782,7 +2045,7 @@ int BlueFS::open_for_write(
   dout(20) << __func__ << " mapping " << dirname << "/" << filename
 	   << " to bdev " << (int)file->fnode.prefer_bdev << dendl;
 
-  log_t.op_file_update(file->fnode);
+  _log_file_update(file.get());
   if (create)
     log_t.op_dir_link(dirname, filename, file->fnode.ino);
 
@@ -1866,6 +2129,7 @@ int BlueFS::rename(
   const string& new_dirname, const string& new_filename)
 {
   std::lock_guard<std::mutex> l(lock);
+  std::lock_guard<std::mutex> ll(log_lock);
   dout(10) << __func__ << " " << old_dirname << "/" << old_filename
 	   << " -> " << new_dirname << "/" << new_filename << dendl;
   map<string,DirRef>::iterator p = dir_map.find(old_dirname);
@@ -1904,6 +2168,8 @@ int BlueFS::rename(
 
   new_dir->file_map[new_filename] = file;
   old_dir->file_map.erase(old_filename);
+  new_dir->snap_bl.clear();
+  old_dir->snap_bl.clear();
 
   log_t.op_dir_link(new_dirname, new_filename, file->fnode.ino);
   log_t.op_dir_unlink(old_dirname, old_filename);
@@ -1913,6 +2179,7 @@ int BlueFS::rename(
 int BlueFS::mkdir(const string& dirname)
 {
   std::lock_guard<std::mutex> l(lock);
+  std::lock_guard<std::mutex> ll(log_lock);
   dout(10) << __func__ << " " << dirname << dendl;
   map<string,DirRef>::iterator p = dir_map.find(dirname);
   if (p != dir_map.end()) {
@@ -1927,6 +2194,7 @@ int BlueFS::mkdir(const string& dirname)
 int BlueFS::rmdir(const string& dirname)
 {
   std::lock_guard<std::mutex> l(lock);
+  std::lock_guard<std::mutex> ll(log_lock);
   dout(10) << __func__ << " " << dirname << dendl;
   map<string,DirRef>::iterator p = dir_map.find(dirname);
   if (p == dir_map.end()) {
@@ -1956,6 +2224,7 @@ int BlueFS::stat(const string& dirname, const string& filename,
 		 uint64_t *size, utime_t *mtime)
 {
   std::lock_guard<std::mutex> l(lock);
+  std::lock_guard<std::mutex> ll(log_lock);
   dout(10) << __func__ << " " << dirname << "/" << filename << dendl;
   map<string,DirRef>::iterator p = dir_map.find(dirname);
   if (p == dir_map.end()) {
@@ -1984,6 +2253,7 @@ int BlueFS::lock_file(const string& dirname, const string& filename,
 		      FileLock **plock)
 {
   std::lock_guard<std::mutex> l(lock);
+  std::lock_guard<std::mutex> ll(log_lock);
   dout(10) << __func__ << " " << dirname << "/" << filename << dendl;
   map<string,DirRef>::iterator p = dir_map.find(dirname);
   if (p == dir_map.end()) {
@@ -2002,8 +2272,9 @@ int BlueFS::lock_file(const string& dirname, const string& filename,
     file->fnode.mtime = ceph_clock_now(NULL);
     file_map[ino_last] = file;
     dir->file_map[filename] = file;
+    dir->snap_bl.clear();
     ++file->refs;
-    log_t.op_file_update(file->fnode);
+    _log_file_update(file);
     log_t.op_dir_link(dirname, filename, file->fnode.ino);
   } else {
     file = q->second.get();
@@ -2060,6 +2331,7 @@ int BlueFS::readdir(const string& dirname, vector<string> *ls)
 int BlueFS::unlink(const string& dirname, const string& filename)
 {
   std::lock_guard<std::mutex> l(lock);
+  std::lock_guard<std::mutex> ll(log_lock);
   dout(10) << __func__ << " " << dirname << "/" << filename << dendl;
   map<string,DirRef>::iterator p = dir_map.find(dirname);
   if (p == dir_map.end()) {
@@ -2075,6 +2347,7 @@ int BlueFS::unlink(const string& dirname, const string& filename)
   }
   FileRef file = q->second;
   dir->file_map.erase(filename);
+  dir->snap_bl.clear();
   log_t.op_dir_unlink(dirname, filename);
   _drop_link(file);
   return 0;
@@ -35,6 +35,14 @@ enum {
   l_bluefs_files_written_sst,
   l_bluefs_bytes_written_wal,
   l_bluefs_bytes_written_sst,
+  l_bluefs_log_snapshot_bytes,
+  l_bluefs_log_snapshot_reencoded,
+  l_bluefs_log_replay_bytes,
+  l_bluefs_log_replay_lat,
+  l_bluefs_read_cache_hit,
+  l_bluefs_read_cache_miss,
+  l_bluefs_read_cache_bytes,
+  l_bluefs_readahead_bytes,
   l_bluefs_last,
 };
 
@@ -58,6 +66,7 @@ public:
     bool locked;
     bool deleted;
     boost::intrusive::list_member_hook<> dirty_item;
+    bufferlist snap_bl;  ///< our op_file_update in the log snapshot, or empty
 
     std::atomic_int num_readers, num_writers;
     std::atomic_int num_reading;
@@ -97,6 +106,7 @@ public:
 
   struct Dir : public RefCountedObject {
     map<string,FileRef> file_map;
+    bufferlist snap_bl;  ///< our create + link ops in the log snapshot, or empty
 
     friend void intrusive_ptr_add_ref(Dir *d) {
       d->get();
@@ -114,7 +124,7 @@ public:
     bufferlist tail_block;  ///< existing partial block at end of file, if any
     int writer_type = 0;    ///< WRITER_*
 
-    std::mutex lock;
+    std::mutex lock;        ///< buffer, pos, tail_block and io submission
     std::array<IOContext*,MAX_BDEV> iocv; ///< for each bdev
 
     FileWriter(FileRef f)
@@ -170,6 +180,11 @@ public:
     FileReaderBuffer buf;
     bool random;
     bool ignore_eof;        ///< used when reading our log file
+    bool readahead = false; ///< always read ahead through the extent cache
+
+    // sequential access detection for random readers; racy, but only a hint
+    std::atomic<uint64_t> ra_pos = {0};  ///< end of the previous read
+    std::atomic<unsigned> ra_seq = {0};  ///< back-to-back reads so far
 
     FileReader(FileRef f, uint64_t mpf, bool rand, bool ie)
       : file(f),
@@ -189,7 +204,73 @@ public:
   };
 
 private:
+  /*
+   * Data cache shared by all random readers, in CHUNK_SIZE pieces.
+   * We do O_DIRECT io, so without it every read that misses the
+   * RocksDB block cache goes to the device.  Disabled when max_bytes
+   * is 0 (bluefs_cache_size).
+   */
+  struct ExtentCache {
+    static const uint64_t CHUNK_SIZE = 65536;
+
+    struct Chunk {
+      uint64_t ino = 0, offset = 0;
+      bufferlist bl;
+      boost::intrusive::list_member_hook<> lru_item;
+    };
+    typedef boost::intrusive::list<
+      Chunk,
+      boost::intrusive::member_hook<
+	Chunk,
+	boost::intrusive::list_member_hook<>,
+	&Chunk::lru_item> > lru_list_t;
+
+    std::mutex lock;
+    map<pair<uint64_t,uint64_t>,Chunk> chunks;  ///< (ino, offset) -> chunk
+    lru_list_t lru;                             ///< most recent first
+    uint64_t bytes = 0;
+    uint64_t max_bytes = 0;
+
+    bool enabled() const {
+      return max_bytes > 0;
+    }
+    void set_max_bytes(uint64_t max);
+    bool lookup(uint64_t ino, uint64_t offset, bufferlist *bl);
+    void insert(uint64_t ino, uint64_t offset, bufferlist& bl);
+    /// drop chunks overlapping offset~length; length 0 means to eof
+    void invalidate(uint64_t ino, uint64_t offset = 0, uint64_t length = 0);
+    void clear() {
+      set_max_bytes(0);
+    }
+    uint64_t get_bytes() {
+      std::lock_guard<std::mutex> l(lock);
+      return bytes;
+    }
+
+  private:
+    void _trim(uint64_t max);
+  } cache;
+
+  /*
+   * Locking.  In order, outermost first:
+   *
+   *  lock             - the namespace (dir_map, file_map, ino_last),
+   *                     block_all/block_total and log compaction.
+   *  FileWriter::lock - one writer's buffer, position and aio.
+   *  log_lock         - log_t, log_seq*, log_writer, dirty_files, and any
+   *                     change to a File's fnode or dirty_seq.
+   *
+   * A WAL append + fsync only takes its own writer lock and, if the
+   * file's metadata changed, log_lock; it never waits behind namespace
+   * operations or another file's flush.  Readers take no lock at all:
+   * a file with readers has no writer (see the num_readers asserts).
+   * Nobody holds log_lock or the writer lock while waiting for io,
+   * except the log flusher, which drops log_lock while its aio is in
+   * flight and uses log_flushing to keep others out.  cache.lock is
+   * innermost and only held for lookups and updates.
+   */
   std::mutex lock;
+  std::mutex log_lock;
 
   PerfCounters *logger = nullptr;
 
@@ -205,13 +286,24 @@ private:
   FileWriter *log_writer = 0;  ///< writer for the log
   bluefs_transaction_t log_t;  ///< pending, unwritten log transaction
   bool log_flushing = false;   ///< true while flushing the log
-  std::condition_variable log_cond;
+  std::condition_variable log_cond; ///< with log_lock
 
   uint64_t new_log_jump_to = 0;
   uint64_t old_log_jump_to = 0;
   FileRef new_log = nullptr;
   FileWriter *new_log_writer = nullptr;
 
+  /*
+   * The head of the log is a snapshot of the whole namespace, written
+   * by compaction; replay starts there and applies the tail.  The
+   * snapshot is assembled from per-File and per-Dir encodings that are
+   * kept around between compactions and only rebuilt for whatever
+   * changed, so the cost of a compaction scales with the churn since
+   * the last one rather than with the number of files.
+   */
+  bufferlist alloc_snap_bl;        ///< block_all part of the snapshot, or empty
+  utime_t replay_lat;              ///< time the mount replay took
+
   /*
    * There are up to 3 block devices:
    *
@@ -237,12 +329,20 @@ private:
   FileRef _get_file(uint64_t ino);
   void _drop_link(FileRef f);
 
+  // caller holds log_lock
+  void _log_file_update(File *f) {
+    f->snap_bl.clear();
+    log_t.op_file_update(f->fnode);
+  }
+
   int _allocate(uint8_t bdev, uint64_t len, vector<bluefs_extent_t> *ev);
+  // caller holds h->lock, or log_lock if h is the log writer
   int _flush_range(FileWriter *h, uint64_t offset, uint64_t length);
   int _flush(FileWriter *h, bool force);
   void wait_for_aio(FileWriter *h);  // safe to call without a lock
-  int _fsync(FileWriter *h, std::unique_lock<std::mutex>& l);
+  int _fsync(FileWriter *h);
 
+  // l holds log_lock
   int _flush_and_sync_log(std::unique_lock<std::mutex>& l,
 			  uint64_t want_seq = 0,
 			  uint64_t jump_to = 0);
@@ -271,6 +371,10 @@ private:
     uint64_t offset, ///< [in] offset
     size_t len,      ///< [in] this many bytes
     char *out);      ///< [out] optional: or copy it here
+  void _read_random_direct(FileReader *h, uint64_t offset, size_t len,
+			   char *out);
+  void _read_random_cached(FileReader *h, uint64_t offset, size_t len,
+			   char *out);
 
   void _invalidate_cache(FileRef f, uint64_t offset, uint64_t length);
 
@@ -322,7 +426,7 @@ public:
     bool random = false);
 
   void close_writer(FileWriter *h) {
-    std::lock_guard<std::mutex> l(lock);
+    // no lock needed; this only waits for h's aio and frees it
     _close_writer(h);
   }
 
@@ -359,16 +463,16 @@ public:
 		     uint64_t *offset, uint32_t *length);
 
   void flush(FileWriter *h) {
-    std::lock_guard<std::mutex> l(lock);
+    std::lock_guard<std::mutex> l(h->lock);
     _flush(h, false);
   }
   void flush_range(FileWriter *h, uint64_t offset, uint64_t length) {
-    std::lock_guard<std::mutex> l(lock);
+    std::lock_guard<std::mutex> l(h->lock);
     _flush_range(h, offset, length);
   }
   int fsync(FileWriter *h) {
-    std::unique_lock<std::mutex> l(lock);
-    return _fsync(h, l);
+    std::lock_guard<std::mutex> l(h->lock);
+    return _fsync(h);
   }
   int read(FileReader *h, FileReaderBuffer *buf, uint64_t offset, size_t len,
 	   bufferlist *outbl, char *out) {
@@ -377,6 +481,10 @@ public:
     // atomics and asserts).
     return _read(h, buf, offset, len, outbl, out);
   }
+  /// true if random reads go through the extent cache (with readahead)
+  bool has_read_cache() const {
+    return cache.enabled();
+  }
   int read_random(FileReader *h, uint64_t offset, size_t len,
 		  char *out) {
     // no need to hold the global lock here; we only touch h and
@@ -385,15 +493,15 @@ public:
     return _read_random(h, offset, len, out);
   }
   void invalidate_cache(FileRef f, uint64_t offset, uint64_t len) {
-    std::lock_guard<std::mutex> l(lock);
+    std::lock_guard<std::mutex> l(log_lock);
     _invalidate_cache(f, offset, len);
   }
   int preallocate(FileRef f, uint64_t offset, uint64_t len) {
-    std::lock_guard<std::mutex> l(lock);
+    std::lock_guard<std::mutex> l(log_lock);
     return _preallocate(f, offset, len);
   }
   int truncate(FileWriter *h, uint64_t offset) {
-    std::lock_guard<std::mutex> l(lock);
+    std::lock_guard<std::mutex> l(h->lock);
     return _truncate(h, offset);
   }
 
@@ -100,12 +100,14 @@ class BlueRocksRandomAccessFile : public rocksdb::RandomAccessFile {
   // Used by the file_reader_writer to decide if the ReadAhead wrapper
   // should simply forward the call and do not enact buffering or locking.
   bool ShouldForwardRawRequest() const {
-    return false;
+    return fs->has_read_cache();
   }
 
   // For cases when read-ahead is implemented in the platform dependent
   // layer
-  void EnableReadAhead() {}
+  void EnableReadAhead() {
+    h->readahead = true;
+  }
 
   // Tries to get an unique ID for this file that will be the same each time
   // the file is opened (and will stay the same while the file is open).
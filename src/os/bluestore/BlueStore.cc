@@ -33,6 +33,18 @@
 
 #define dout_subsys ceph_subsys_bluestore
 
+// bluestore_meta_onode
+MEMPOOL_DEFINE_OBJECT_FACTORY(BlueStore::Onode, bluestore_onode,
+			      bluestore_meta_onode);
+
+// bluestore_meta_other
+MEMPOOL_DEFINE_OBJECT_FACTORY(BlueStore::Buffer, bluestore_buffer,
+			      bluestore_meta_other);
+MEMPOOL_DEFINE_OBJECT_FACTORY(BlueStore::Blob, bluestore_blob,
+			      bluestore_meta_other);
+MEMPOOL_DEFINE_OBJECT_FACTORY(BlueStore::Bnode, bluestore_bnode,
+			      bluestore_meta_other);
+
 const string PREFIX_SUPER = "S";   // field -> value
 const string PREFIX_STAT = "T";    // field -> value(int64 array)
 const string PREFIX_COLL = "C";    // collection name -> cnode_t
@@ -40,6 +52,9 @@ const string PREFIX_OBJ = "O";     // object name -> onode_t
 const string PREFIX_OMAP = "M";    // u64 + keyname -> value
 const string PREFIX_WAL = "L";     // id -> wal_transaction_t
 const string PREFIX_ALLOC = "B";   // u64 offset -> u64 length (freelist)
+const string PREFIX_EXTENT_SHARD = "X"; // onode key + u32 offset -> shard
+const string PREFIX_SHARED_BLOB = "D"; // bnode key + u64 id -> blob_t
+const string PREFIX_PACK = "P";    // u64 unit [+ u32 block offset] -> ''
 
 // write a label in the first block.  always use this size.  note that
 // bluefs makes a matching assumption about the location of its
@@ -49,6 +64,12 @@ const string PREFIX_ALLOC = "B";   // u64 offset -> u64 length (freelist)
 // for bluefs, label (4k) + bluefs super (4k), means we start at 8k.
 #define BLUEFS_START  8192
 
+// extent map shards start at 32-bit logical offsets (see
+// bluestore_onode_t::shard_info), but the last shard runs to the end of
+// the object, however big it is.
+#define EXTENT_SHARD_MAX_OFFSET 0xffffffffull
+#define EXTENT_MAP_END          0xffffffffffffffffull
+
 /*
  * object name key structure
  *
@@ -396,6 +417,34 @@ static int get_key_object(const string& key, ghobject_t *oid)
   return 0;
 }
 
+static void get_extent_shard_key(const string& onode_key, uint32_t offset,
+				 string *key)
+{
+  key->clear();
+  key->append(onode_key);
+  _key_encode_u32(offset, key);
+}
+
+static void get_shared_blob_key(const string& bnode_key, int64_t id,
+				string *key)
+{
+  key->clear();
+  key->append(bnode_key);
+  _key_encode_u64(id, key);
+}
+
+
+static void get_pack_unit_key(uint64_t unit, string *key)
+{
+  key->clear();
+  _key_encode_u64(unit, key);
+}
+
+static void get_pack_block_key(uint64_t unit, uint64_t offset, string *key)
+{
+  get_pack_unit_key(unit, key);
+  _key_encode_u32(offset - unit, key);
+}
 
 // '-' < '.' < '~'
 static void get_omap_header(uint64_t id, string *out)
@@ -489,6 +538,68 @@ BlueStore::Cache *BlueStore::Cache::create(string type)
   assert(0 == "unrecognized cache type");
 }
 
+#undef dout_prefix
+#define dout_prefix *_dout << "bluestore.Cache(" << this << ") "
+
+void BlueStore::Cache::trim(
+  uint64_t target_bytes,
+  float target_meta_ratio,
+  float bytes_per_onode)
+{
+  std::lock_guard<std::mutex> l(lock);
+  uint64_t current_meta = _get_num_onodes() * bytes_per_onode;
+  uint64_t current_buffer = _get_buffer_bytes();
+  uint64_t current = current_meta + current_buffer;
+
+  uint64_t target_meta = target_bytes * target_meta_ratio;
+  uint64_t target_buffer = target_bytes - target_meta;
+
+  if (current <= target_bytes) {
+    dout(30) << __func__
+	     << " shard target " << pretty_si_t(target_bytes)
+	     << " ratio " << target_meta_ratio << " ("
+	     << pretty_si_t(target_meta) << " + "
+	     << pretty_si_t(target_buffer) << "), "
+	     << " current " << pretty_si_t(current) << " ("
+	     << pretty_si_t(current_meta) << " + "
+	     << pretty_si_t(current_buffer) << ")"
+	     << dendl;
+    return;
+  }
+
+  // free buffer data down to its share first, then onodes
+  uint64_t need_to_free = current - target_bytes;
+  uint64_t free_buffer = 0;
+  uint64_t free_meta = 0;
+  if (current_buffer > target_buffer) {
+    free_buffer = current_buffer - target_buffer;
+    if (free_buffer > need_to_free) {
+      free_buffer = need_to_free;
+    }
+  }
+  free_meta = need_to_free - free_buffer;
+
+  uint64_t max_buffer = current_buffer - free_buffer;
+  uint64_t max_meta = current_meta - free_meta;
+  uint64_t max_onodes = max_meta / bytes_per_onode;
+
+  dout(20) << __func__
+	   << " shard target " << pretty_si_t(target_bytes)
+	   << " ratio " << target_meta_ratio << " ("
+	   << pretty_si_t(target_meta) << " + "
+	   << pretty_si_t(target_buffer) << "), "
+	   << " current " << pretty_si_t(current) << " ("
+	   << pretty_si_t(current_meta) << " + "
+	   << pretty_si_t(current_buffer) << "),"
+	   << " need_to_free " << pretty_si_t(need_to_free) << " ("
+	   << pretty_si_t(free_meta) << " + "
+	   << pretty_si_t(free_buffer) << ")"
+	   << " -> max " << max_onodes << " onodes + "
+	   << max_buffer << " buffer"
+	   << dendl;
+  _trim(max_onodes, max_buffer);
+}
+
 // LRUCache
 #undef dout_prefix
 #define dout_prefix *_dout << "bluestore.LRUCache(" << this << ") "
@@ -500,10 +611,8 @@ void BlueStore::LRUCache::_touch_onode(OnodeRef& o)
   onode_lru.push_front(*o);
 }
 
-void BlueStore::LRUCache::trim(uint64_t onode_max, uint64_t buffer_max)
+void BlueStore::LRUCache::_trim(uint64_t onode_max, uint64_t buffer_max)
 {
-  std::lock_guard<std::mutex> l(lock);
-
   dout(20) << __func__ << " onodes " << onode_lru.size() << " / " << onode_max
 	   << " buffers " << buffer_size << " / " << buffer_max
 	   << dendl;
@@ -694,10 +803,8 @@ void BlueStore::TwoQCache::_adjust_buffer_size(Buffer *b, int64_t delta)
   }
 }
 
-void BlueStore::TwoQCache::trim(uint64_t onode_max, uint64_t buffer_max)
+void BlueStore::TwoQCache::_trim(uint64_t onode_max, uint64_t buffer_max)
 {
-  std::lock_guard<std::mutex> l(lock);
-
   dout(20) << __func__ << " onodes " << onode_lru.size() << " / " << onode_max
 	   << " buffers " << buffer_bytes << " / " << buffer_max
 	   << dendl;
@@ -975,6 +1082,7 @@ void BlueStore::BufferSpace::read(
 {
   std::lock_guard<std::mutex> l(cache->lock);
   res.clear();
+  uint64_t want = length;
   uint64_t end = offset + length;
   for (auto i = _data_lower_bound(offset);
        i != buffer_map.end() && offset < end && i->first < end;
@@ -1019,6 +1127,13 @@ void BlueStore::BufferSpace::read(
       }
     }
   }
+
+  uint64_t hit = 0;
+  for (auto& p : res) {
+    hit += p.second.length();
+  }
+  cache->stats.buffer_hit_bytes += hit;
+  cache->stats.buffer_miss_bytes += want - hit;
 }
 
 void BlueStore::BufferSpace::finish_write(uint64_t seq)
@@ -1058,13 +1173,28 @@ void BlueStore::BufferSpace::finish_write(uint64_t seq)
 #undef dout_prefix
 #define dout_prefix *_dout << "bluestore.OnodeSpace(" << this << " in " << cache << ") "
 
-void BlueStore::OnodeSpace::add(const ghobject_t& oid, OnodeRef o)
+BlueStore::OnodeRef BlueStore::OnodeSpace::add(const ghobject_t& oid,
+						OnodeRef o)
 {
   std::lock_guard<std::mutex> l(cache->lock);
+  auto p = onode_map.find(oid);
+  if (p != onode_map.end()) {
+    // readers only hold the collection lock shared, so another one may
+    // have loaded it first
+    dout(30) << __func__ << " " << oid << " " << o
+	     << " raced, returning existing " << p->second << dendl;
+    return p->second;
+  }
   dout(30) << __func__ << " " << oid << " " << o << dendl;
-  assert(onode_map.count(oid) == 0);
   onode_map[oid] = o;
   cache->_add_onode(o, 1);
+  return o;
+}
+
+bool BlueStore::OnodeSpace::contains(const ghobject_t& oid)
+{
+  std::lock_guard<std::mutex> l(cache->lock);
+  return onode_map.count(oid);
 }
 
 BlueStore::OnodeRef BlueStore::OnodeSpace::lookup(const ghobject_t& oid)
@@ -1074,9 +1204,11 @@ BlueStore::OnodeRef BlueStore::OnodeSpace::lookup(const ghobject_t& oid)
   ceph::unordered_map<ghobject_t,OnodeRef>::iterator p = onode_map.find(oid);
   if (p == onode_map.end()) {
     dout(30) << __func__ << " " << oid << " miss" << dendl;
+    ++cache->stats.onode_misses;
     return OnodeRef();
   }
   dout(30) << __func__ << " " << oid << " hit " << p->second << dendl;
+  ++cache->stats.onode_hits;
   cache->_touch_onode(p->second);
   return p->second;
 }
@@ -1176,26 +1308,47 @@ void BlueStore::Blob::discard_unallocated()
 #undef dout_prefix
 #define dout_prefix *_dout << "bluestore.blobmap(" << this << ") "
 
-void BlueStore::BlobMap::encode(bufferlist& bl) const
+void BlueStore::BlobMap::bound_encode(size_t& p) const
+{
+  p += sizeof(uint32_t);
+  for (auto& b : blob_map) {
+    denc(b.id, p);
+    denc(b.blob, p);
+  }
+}
+
+void BlueStore::BlobMap::encode(bufferlist::contiguous_appender& p,
+				 bool spanning_only) const
 {
-  uint32_t n = blob_map.size();
-  ::encode(n, bl);
-  for (auto p = blob_map.begin(); n--; ++p) {
-    ::encode(p->id, bl);
-    ::encode(p->blob, bl);
+  uint32_t n = 0;
+  for (auto& b : blob_map) {
+    if (!spanning_only || b.spanning) {
+      ++n;
+    }
+  }
+  denc(n, p);
+  for (auto q = blob_map.begin(); n; ++q) {
+    if (spanning_only && !q->spanning) {
+      continue;
+    }
+    denc(q->id, p);
+    denc(q->blob, p);
+    --n;
   }
 }
 
-void BlueStore::BlobMap::decode(bufferlist::iterator& p, Cache *c)
+void BlueStore::BlobMap::decode(bufferptr::iterator& p, Cache *c,
+				bool spanning)
 {
   assert(blob_map.empty());
   uint32_t n;
-  ::decode(n, p);
+  denc(n, p);
   while (n--) {
     int64_t id;
-    ::decode(id, p);
+    denc(id, p);
     Blob *b = new Blob(id, c);
-    ::decode(b->blob, p);
+    b->spanning = spanning;
+    denc(b->blob, p);
     b->get();
     blob_map.insert(*b);
   }
@@ -1263,7 +1416,8 @@ BlueStore::Collection::Collection(BlueStore *ns, Cache *cs, coll_t c)
     cid(c),
     lock("BlueStore::Collection::lock", true, false),
     exists(true),
-    bnode_set(MAX(16, g_conf->bluestore_onode_cache_size / 128)),
+    // roughly one bucket per 128 cached onodes of ~4 KB each
+    bnode_set(MAX(16, g_conf->bluestore_cache_size / (128 * 4096))),
     onode_map(cs)
 {
 }
@@ -1287,21 +1441,53 @@ BlueStore::BnodeRef BlueStore::Collection::get_bnode(
   b = new Bnode(hash, key, &bnode_set);
   dout(10) << __func__ << " hash " << std::hex << hash << std::dec
 	   << " created " << b << dendl;
+  bnode_set.add(b.get());
+  return b;
+}
 
+BlueStore::BlobRef BlueStore::Collection::get_shared_blob(
+  BnodeRef& b,
+  int64_t id)
+{
+  std::lock_guard<std::mutex> l(b->lock);
+  BlobRef blob = b->blob_map.get(id);
+  if (blob) {
+    return blob;
+  }
+
+  string key;
+  get_shared_blob_key(b->key, id, &key);
   bufferlist v;
-  int r = store->db->get(PREFIX_OBJ, key, &v);
-  if (r >= 0) {
-    assert(v.length() > 0);
-    bufferlist::iterator p = v.begin();
-    b->blob_map.decode(p, cache);
-    dout(10) << __func__ << " hash " << std::hex << hash << std::dec
-	     << " loaded blob_map " << b->blob_map << dendl;
-  } else {
-    dout(10) << __func__ << " hash " <<std::hex << hash << std::dec
-	     << " missed, new blob_map" << dendl;
+  int r = store->db->get(PREFIX_SHARED_BLOB, key, &v);
+  if (r < 0) {
+    dout(10) << __func__ << " hash " << std::hex << b->hash << std::dec
+	     << " id " << id << " dne" << dendl;
+    return nullptr;
+  }
+  assert(v.length() > 0);
+  if (!v.is_contiguous())
+    v.rebuild();
+  blob = new Blob(0, cache);
+  bufferptr::iterator p = v.front().begin();
+  denc(blob->blob, p);
+  b->blob_map.claim(blob, id);
+  store->logger->inc(l_bluestore_shared_blob_loads);
+  dout(10) << __func__ << " hash " << std::hex << b->hash << std::dec
+	   << " loaded " << *blob << dendl;
+  return blob;
+}
+
+void BlueStore::Collection::load_shared_blobs(BnodeRef& b)
+{
+  KeyValueDB::Iterator it = store->db->get_iterator(PREFIX_SHARED_BLOB);
+  for (it->lower_bound(b->key);
+       it->valid() && it->key().compare(0, b->key.size(), b->key) == 0;
+       it->next()) {
+    string k = it->key();
+    uint64_t id;
+    _key_decode_u64(k.c_str() + b->key.size(), &id);
+    get_shared_blob(b, id);
   }
-  bnode_set.add(b.get());
-  return b;
 }
 
 BlueStore::OnodeRef BlueStore::Collection::get_onode(
@@ -1344,15 +1530,82 @@ BlueStore::OnodeRef BlueStore::Collection::get_onode(
   } else {
     // loaded
     assert(r >=0);
-    on = new Onode(&onode_map, oid, key);
-    on->exists = true;
-    bufferlist::iterator p = v.begin();
-    ::decode(on->onode, p);
-    on->blob_map.decode(p, cache);
+    on = _decode_onode(oid, key, v);
   }
   o.reset(on);
-  onode_map.add(oid, o);
-  return o;
+  return onode_map.add(oid, o);
+}
+
+BlueStore::Onode *BlueStore::Collection::_decode_onode(
+  const ghobject_t& oid,
+  const string& key,
+  bufferlist& v)
+{
+  Onode *on = new Onode(&onode_map, oid, key);
+  on->exists = true;
+  if (!v.is_contiguous())
+    v.rebuild();
+  bufferptr::iterator p = v.front().begin();
+  denc(on->onode, p);
+  // if the extent map is sharded only the spanning blobs live here;
+  // the rest are loaded along with their shard
+  on->blob_map.decode(p, cache, !on->onode.extent_map_shards.empty());
+  on->extent_shards.resize(on->onode.extent_map_shards.size());
+  return on;
+}
+
+int BlueStore::Collection::prefetch_onodes(const vector<ghobject_t>& oids)
+{
+  assert(lock.is_locked());
+
+  // onode keys sort in object order, so a batch from collection_list is
+  // a contiguous run of PREFIX_OBJ; walk it with one iterator instead of
+  // doing a get per object.
+  map<string,const ghobject_t*> want;
+  unsigned max = g_conf->bluestore_onode_prefetch_max;
+  for (auto& oid : oids) {
+    if (want.size() >= max)
+      break;
+    if (!contains(oid) || onode_map.contains(oid))
+      continue;
+    string key;
+    get_object_key(oid, &key);
+    want[key] = &oid;
+  }
+  if (want.empty())
+    return 0;
+
+  dout(20) << __func__ << " " << cid << " " << want.size() << " of "
+	   << oids.size() << " from " << pretty_binary_string(want.begin()->first)
+	   << dendl;
+
+  // what we skip over are objects that were already cached (or not
+  // asked for); past a few of those it is cheaper to seek
+  const unsigned max_skip = 8;
+  int loaded = 0;
+  KeyValueDB::Iterator it = store->db->get_iterator(PREFIX_OBJ);
+  it->lower_bound(want.begin()->first);
+  for (auto& w : want) {
+    unsigned skipped = 0;
+    while (it->valid() && it->key() < w.first) {
+      if (++skipped > max_skip) {
+	it->lower_bound(w.first);
+	break;
+      }
+      it->next();
+    }
+    if (!it->valid())
+      break;
+    if (it->key() != w.first)
+      continue;   // gone; a later get_onode will find that out again
+    bufferlist v = it->value();
+    OnodeRef o(_decode_onode(*w.second, w.first, v));
+    onode_map.add(*w.second, o);
+    ++loaded;
+    it->next();
+  }
+  dout(20) << __func__ << " " << cid << " loaded " << loaded << dendl;
+  return loaded;
 }
 
 
@@ -1366,7 +1619,8 @@ BlueStore::OnodeRef BlueStore::Collection::get_onode(
 static void aio_cb(void *priv, void *priv2)
 {
   BlueStore *store = static_cast<BlueStore*>(priv);
-  store->_txc_aio_finish(priv2);
+  BlueStore::AioContext *c = static_cast<BlueStore::AioContext*>(priv2);
+  c->aio_finish(store);
 }
 
 BlueStore::BlueStore(CephContext *cct, const string& path)
@@ -1384,6 +1638,8 @@ BlueStore::BlueStore(CephContext *cct, const string& path)
     coll_lock("BlueStore::coll_lock"),
     nid_last(0),
     nid_max(0),
+    blobid_last(0),
+    blobid_max(0),
     throttle_ops(cct, "bluestore_max_ops", cct->_conf->bluestore_max_ops),
     throttle_bytes(cct, "bluestore_max_bytes", cct->_conf->bluestore_max_bytes),
     throttle_wal_ops(cct, "bluestore_wal_max_ops",
@@ -1402,16 +1658,28 @@ BlueStore::BlueStore(CephContext *cct, const string& path)
 	     cct->_conf->bluestore_wal_thread_timeout,
 	     cct->_conf->bluestore_wal_thread_suicide_timeout,
 	     &wal_tp),
+    compress_tp(cct,
+		"BlueStore::compress_tp",
+		"tp_compress",
+		cct->_conf->bluestore_compression_threads),
+    compress_wq(this,
+		cct->_conf->bluestore_compression_thread_timeout,
+		cct->_conf->bluestore_compression_thread_suicide_timeout,
+		&compress_tp),
     m_finisher_num(1),
     kv_sync_thread(this),
     kv_stop(false),
+    kv_finalize_thread(this),
     logger(NULL),
+    mempool_thread(this),
     csum_type(bluestore_blob_t::CSUM_CRC32C),
-    sync_wal_apply(cct->_conf->bluestore_sync_wal_apply)
+    sync_wal_apply(cct->_conf->bluestore_sync_wal_apply),
+    wal_batch_ops(cct->_conf->bluestore_wal_batch_ops)
 {
   _init_logger();
   g_ceph_context->_conf->add_observer(this);
   set_cache_shards(1);
+  _set_cache_sizes();
 
   if (cct->_conf->bluestore_shard_finishers) {
     m_finisher_num = cct->_conf->osd_op_num_shards;
@@ -1454,6 +1722,10 @@ const char **BlueStore::get_tracked_conf_keys() const
     "bluestore_compression_algorithm",
     "bluestore_compression_min_blob_size",
     "bluestore_compression_max_blob_size",
+    "bluestore_cache_size",
+    "bluestore_cache_meta_ratio",
+    "bluestore_cache_kv_ratio",
+    "bluestore_cache_autotune",
     NULL
   };
   return KEYS;
@@ -1472,6 +1744,241 @@ void BlueStore::handle_conf_change(const struct md_config_t *conf,
       changed.count("bluestore_compression_max_blob_size")) {
     _set_compression();
   }
+  if (changed.count("bluestore_cache_size") ||
+      changed.count("bluestore_cache_meta_ratio") ||
+      changed.count("bluestore_cache_kv_ratio") ||
+      changed.count("bluestore_cache_autotune")) {
+    _set_cache_sizes();
+  }
+}
+
+void BlueStore::_set_cache_sizes()
+{
+  std::lock_guard<std::mutex> l(cache_conf_lock);
+  uint64_t size = g_conf->bluestore_cache_size;
+  float meta = g_conf->bluestore_cache_meta_ratio;
+  float kv = g_conf->bluestore_cache_kv_ratio;
+  if (meta < 0 || kv < 0 || meta + kv > 1.0) {
+    derr << __func__ << " bluestore_cache_meta_ratio (" << meta
+	 << ") + bluestore_cache_kv_ratio (" << kv
+	 << ") must be in range [0,1.0], using .4 and .2" << dendl;
+    meta = .4;
+    kv = .2;
+  }
+  cache_size = size;
+  cache_ratio = cache_ratio_t(meta, kv);
+  cache_autotune = g_conf->bluestore_cache_autotune;
+  // a closed or half-open db picks the size up in _open_db()
+  if (mounted) {
+    db->set_cache_size(size * kv);
+  }
+  _update_cache_logger(size, cache_ratio_t(meta, kv));
+  dout(10) << __func__ << " cache_size " << size
+	   << " meta_ratio " << meta
+	   << " kv_ratio " << kv
+	   << " autotune " << cache_autotune << dendl;
+}
+
+void BlueStore::_update_cache_logger(uint64_t size, cache_ratio_t r)
+{
+  logger->set(l_bluestore_cache_meta_bytes, size * r.meta);
+  logger->set(l_bluestore_cache_data_bytes, size * (1.0 - r.meta - r.kv));
+  logger->set(l_bluestore_cache_kv_bytes, size * r.kv);
+}
+
+/*
+ * Split the onode+buffer budget between the cache shards in proportion
+ * to how much each was used over the last interval, so that a few hot
+ * PGs are not starved by an even split.  The split is smoothed across
+ * intervals and every shard keeps a floor so that an idle shard can
+ * warm up again.
+ */
+void BlueStore::_balance_cache_shards()
+{
+  size_t n = cache_shards.size();
+  if (!cache_autotune || n < 2) {
+    return;
+  }
+
+  // demand, in (roughly) block sized accesses
+  vector<uint64_t> demand(n);
+  uint64_t total = 0;
+  for (size_t i = 0; i < n; ++i) {
+    Cache *c = cache_shards[i];
+    uint64_t onodes = 0, buffer_bytes = 0;
+    Cache::stats_t cur;
+    c->add_stats(&onodes, &buffer_bytes, &cur);
+    demand[i] =
+      (cur.onode_hits - c->last_shard_stats.onode_hits) +
+      (cur.onode_misses - c->last_shard_stats.onode_misses) +
+      ((cur.buffer_hit_bytes - c->last_shard_stats.buffer_hit_bytes) +
+       (cur.buffer_miss_bytes - c->last_shard_stats.buffer_miss_bytes)) /
+      block_size;
+    c->last_shard_stats = cur;
+    total += demand[i];
+  }
+  if (total == 0) {
+    return;  // idle; keep what we have
+  }
+
+  const float floor = 0.25 / (float)n;
+  vector<float> ratio(n);
+  float sum = 0;
+  for (size_t i = 0; i < n; ++i) {
+    float want = (float)demand[i] / (float)total;
+    ratio[i] = MAX(floor, (cache_shards[i]->shard_ratio + want) / 2);
+    sum += ratio[i];
+  }
+  for (size_t i = 0; i < n; ++i) {
+    cache_shards[i]->shard_ratio = ratio[i] / sum;
+    dout(20) << __func__ << " shard " << i << " demand " << demand[i]
+	     << " ratio " << ratio[i] / sum << dendl;
+  }
+}
+
+/*
+ * Move one chunk of the cache budget from the consumer (onodes, buffer
+ * data or the kv block cache) that needs it least to the one that
+ * needs it most.
+ *
+ * A consumer that is not using its share gives up memory first.
+ * Otherwise the budget moves from the lowest to the highest miss rate
+ * over the last interval, but only to a consumer that is actually full
+ * (a high miss rate in a cache with free space is a cold cache, not a
+ * small one) and only if the rates differ enough to be worth it.
+ */
+void BlueStore::_balance_cache()
+{
+  enum { META = 0, DATA, KV, NUM };
+  static const char *names[NUM] = { "meta", "data", "kv" };
+
+  uint64_t num_onodes = 0;
+  uint64_t buffer_bytes = 0;
+  Cache::stats_t cur;
+  for (auto i : cache_shards) {
+    i->add_stats(&num_onodes, &buffer_bytes, &cur);
+  }
+  uint64_t kv_hits = 0, kv_misses = 0;
+  int64_t kv_used = db ? db->get_cache_usage() : -1;
+  bool have_kv_stats = db && db->get_cache_hits(&kv_hits, &kv_misses) == 0;
+
+  // the counters are cumulative; work on this interval's deltas
+  uint64_t hits[NUM], misses[NUM];
+  hits[META] = cur.onode_hits - cache_last_stats.onode_hits;
+  misses[META] = cur.onode_misses - cache_last_stats.onode_misses;
+  hits[DATA] = cur.buffer_hit_bytes - cache_last_stats.buffer_hit_bytes;
+  misses[DATA] = cur.buffer_miss_bytes - cache_last_stats.buffer_miss_bytes;
+  hits[KV] = have_kv_stats ? kv_hits - kv_last_hits : 0;
+  misses[KV] = have_kv_stats ? kv_misses - kv_last_misses : 0;
+  cache_last_stats = cur;
+  kv_last_hits = kv_hits;
+  kv_last_misses = kv_misses;
+
+  logger->inc(l_bluestore_onode_hits, hits[META]);
+  logger->inc(l_bluestore_onode_misses, misses[META]);
+  logger->inc(l_bluestore_buffer_hit_bytes, hits[DATA]);
+  logger->inc(l_bluestore_buffer_miss_bytes, misses[DATA]);
+
+  // hold off conf changes until our update is published, so that we
+  // never overwrite new ratios with ones derived from the old
+  std::lock_guard<std::mutex> l(cache_conf_lock);
+  uint64_t cache_size = this->cache_size;
+  if (!cache_autotune || cache_size == 0) {
+    return;
+  }
+
+  float ratio[NUM];
+  cache_ratio_t cur_ratio = cache_ratio;
+  ratio[META] = cur_ratio.meta;
+  ratio[KV] = cur_ratio.kv;
+  ratio[DATA] = 1.0 - ratio[META] - ratio[KV];
+
+  uint64_t share[NUM], used[NUM];
+  float miss_rate[NUM];
+  for (int i = 0; i < NUM; ++i) {
+    share[i] = cache_size * ratio[i];
+    uint64_t total = hits[i] + misses[i];
+    miss_rate[i] = total ? (float)misses[i] / (float)total : 0;
+  }
+  used[META] = num_onodes * bytes_per_onode;
+  used[DATA] = buffer_bytes;
+  // without usage or stats from the kv store we can't reason about it;
+  // leave its share alone
+  bool kv_balanced = kv_used >= 0 && have_kv_stats;
+  used[KV] = kv_balanced ? kv_used : share[KV];
+
+  uint64_t chunk = g_conf->bluestore_cache_autotune_chunk_size;
+  int donor = -1, recipient = -1;
+  for (int i = 0; i < NUM; ++i) {
+    if (i == KV && !kv_balanced)
+      continue;
+    if (share[i] < 2 * chunk)
+      continue;  // keep at least one chunk each
+    if (used[i] + chunk <= share[i] &&
+	(donor < 0 || share[i] - used[i] > share[donor] - used[donor])) {
+      donor = i;  // idle memory
+    }
+  }
+  for (int i = 0; i < NUM; ++i) {
+    if (i == KV && !kv_balanced)
+      continue;
+    if (used[i] + chunk < share[i] || misses[i] == 0)
+      continue;  // not full, or not missing
+    if (recipient < 0 || miss_rate[i] > miss_rate[recipient])
+      recipient = i;
+  }
+  if (recipient >= 0 && donor < 0) {
+    for (int i = 0; i < NUM; ++i) {
+      if (i == recipient || (i == KV && !kv_balanced) || share[i] < 2 * chunk)
+	continue;
+      if (miss_rate[recipient] - miss_rate[i] < .05)
+	continue;  // not worth churning
+      if (donor < 0 || miss_rate[i] < miss_rate[donor])
+	donor = i;
+    }
+  }
+
+  dout(20) << __func__ << " chunk " << pretty_si_t(chunk);
+  for (int i = 0; i < NUM; ++i) {
+    *_dout << " " << names[i] << " " << pretty_si_t(used[i]) << "/"
+	   << pretty_si_t(share[i]) << " miss " << miss_rate[i];
+  }
+  *_dout << dendl;
+
+  if (recipient < 0 || donor < 0 || donor == recipient) {
+    return;
+  }
+
+  float delta = (float)chunk / (float)cache_size;
+  ratio[donor] -= delta;
+  ratio[recipient] += delta;
+  dout(10) << __func__ << " moved " << pretty_si_t(chunk)
+	   << " from " << names[donor] << " to " << names[recipient]
+	   << " -> meta " << ratio[META] << " data " << ratio[DATA]
+	   << " kv " << ratio[KV] << dendl;
+  cache_ratio = cache_ratio_t(ratio[META], ratio[KV]);
+  if (donor == KV || recipient == KV) {
+    db->set_cache_size(cache_size * ratio[KV]);
+  }
+  _update_cache_logger(cache_size, cache_ratio_t(ratio[META], ratio[KV]));
+}
+
+void BlueStore::_update_bytes_per_onode()
+{
+  // Onodes are the only thing charged to bluestore_meta_onode; the rest
+  // of the in-memory metadata (blobs, bnodes, buffer heads) hangs off
+  // them, so charge it to the onodes too.
+  size_t num_onodes = mempool::bluestore_meta_onode::allocated_items();
+  if (num_onodes == 0) {
+    return;
+  }
+  size_t meta_bytes =
+    mempool::bluestore_meta_onode::allocated_bytes() +
+    mempool::bluestore_meta_other::allocated_bytes();
+  bytes_per_onode = (float)meta_bytes / (float)num_onodes;
+  dout(20) << __func__ << " " << num_onodes << " onodes, "
+	   << pretty_si_t(meta_bytes) << " -> " << bytes_per_onode
+	   << " bytes per onode" << dendl;
 }
 
 void BlueStore::_set_compression()
@@ -1502,6 +2009,10 @@ void BlueStore::_set_compression()
       alg = "snappy";
     } else if (g_conf->bluestore_compression_algorithm == "zlib") {
       alg = "zlib";
+    } else if (g_conf->bluestore_compression_algorithm == "zstd") {
+      alg = "zstd";
+    } else if (g_conf->bluestore_compression_algorithm == "lz4") {
+      alg = "lz4";
     } else if (g_conf->bluestore_compression_algorithm.length()) {
       derr << __func__ << " unrecognized compression algorithm '"
 	   << g_conf->bluestore_compression_algorithm << "'"
@@ -1560,16 +2071,45 @@ void BlueStore::_init_logger()
   b.add_time_avg(l_bluestore_compress_lat, "compress_lat", "Average compress latency");
   b.add_time_avg(l_bluestore_decompress_lat, "decompress_lat", "Average decompress latency");
   b.add_u64(l_bluestore_compress_success_count, "compress_success_count", "Sum for beneficial compress ops");
+  b.add_u64_counter(l_bluestore_compress_rejected_count, "compress_rejected_count", "Sum for compress ops that did not meet the required ratio");
+  b.add_u64_counter(l_bluestore_compress_sample_rejected_count, "compress_sample_rejected_count", "Sum for blobs left uncompressed after compressing a sample");
+  b.add_u64_counter(l_bluestore_compress_in_bytes, "compress_in_bytes", "Sum for bytes of blobs stored compressed");
+  b.add_u64_counter(l_bluestore_compress_out_bytes, "compress_out_bytes", "Sum for bytes those blobs compressed to");
+  b.add_u64_counter(l_bluestore_compress_inline_count, "compress_inline_count", "Sum for blobs compressed while applying the txc, not ahead of it");
 
   b.add_u64(l_bluestore_write_pad_bytes, "write_pad_bytes", "Sum for write-op padded bytes");
   b.add_u64(l_bluestore_wal_write_ops, "wal_write_ops", "Sum for wal write op");
   b.add_u64(l_bluestore_wal_write_bytes, "wal_write_bytes", "Sum for wal write bytes");
+  b.add_time_avg(l_bluestore_wal_batch_lat, "wal_batch_lat", "Average wal batch aio latency");
+  b.add_u64_avg(l_bluestore_wal_batch_ops, "wal_batch_ops", "Average wal ops per batch");
+  b.add_u64_avg(l_bluestore_wal_batch_aios, "wal_batch_aios", "Average aios per wal batch, after merging");
+  b.add_u64_avg(l_bluestore_wal_batch_bytes, "wal_batch_bytes", "Average bytes per wal batch");
+  b.add_time_avg(l_bluestore_kv_flush_lat, "kv_flush_lat", "Average kv_sync thread block device flush latency");
+  b.add_time_avg(l_bluestore_kv_commit_lat, "kv_commit_lat", "Average kv_sync thread kv commit latency");
+  b.add_time_avg(l_bluestore_kv_lat, "kv_lat", "Average kv_sync thread latency per batch");
+  b.add_time_avg(l_bluestore_kv_finalize_lat, "kv_finalize_lat", "Average kv_finalize thread latency per batch");
   b.add_u64(l_bluestore_write_penalty_read_ops, " write_penalty_read_ops", "Sum for write penalty read ops");
   b.add_u64(l_bluestore_allocated, "bluestore_allocated", "Sum for allocated bytes");
   b.add_u64(l_bluestore_stored, "bluestore_stored", "Sum for stored bytes");
   b.add_u64(l_bluestore_compressed, "bluestore_compressed", "Sum for stored compressed bytes");
   b.add_u64(l_bluestore_compressed_allocated, "bluestore_compressed_allocated", "Sum for bytes allocated for compressed data");
   b.add_u64(l_bluestore_compressed_original, "bluestore_compressed_original", "Sum for original bytes that were compressed");
+  b.add_u64_counter(l_bluestore_onode_hits, "bluestore_onode_hits", "Sum for onode-lookups hit in the cache");
+  b.add_u64_counter(l_bluestore_onode_misses, "bluestore_onode_misses", "Sum for onode-lookups missed in the cache");
+  b.add_u64_counter(l_bluestore_buffer_hit_bytes, "bluestore_buffer_hit_bytes", "Sum for bytes of read hit in the cache");
+  b.add_u64_counter(l_bluestore_buffer_miss_bytes, "bluestore_buffer_miss_bytes", "Sum for bytes of read missed in the cache");
+  b.add_u64(l_bluestore_cache_meta_bytes, "bluestore_cache_meta_bytes", "Cache budget for onodes");
+  b.add_u64(l_bluestore_cache_data_bytes, "bluestore_cache_data_bytes", "Cache budget for buffer data");
+  b.add_u64(l_bluestore_cache_kv_bytes, "bluestore_cache_kv_bytes", "Cache budget for the kv block cache");
+  b.add_u64_counter(l_bluestore_onode_write_bytes, "bluestore_onode_write_bytes", "Sum for bytes of onode values written");
+  b.add_u64_counter(l_bluestore_extent_shard_write_bytes, "bluestore_extent_shard_write_bytes", "Sum for bytes of extent map shards written");
+  b.add_u64_counter(l_bluestore_extent_shard_loads, "bluestore_extent_shard_loads", "Sum for extent map shards loaded on demand");
+  b.add_u64_counter(l_bluestore_onode_reshard, "bluestore_onode_reshard", "Sum for extent map shard splits and merges");
+  b.add_u64_counter(l_bluestore_shared_blob_loads, "bluestore_shared_blob_loads", "Sum for shared blobs loaded on demand");
+  b.add_u64_counter(l_bluestore_shared_blob_writes, "bluestore_shared_blob_writes", "Sum for shared blob records written");
+  b.add_u64_counter(l_bluestore_onode_prefetch, "bluestore_onode_prefetch", "Sum for onodes loaded by prefetch_onodes");
+  b.add_u64_counter(l_bluestore_write_small_packed, "bluestore_write_small_packed", "Sum for small writes stored in packed blobs");
+  b.add_u64(l_bluestore_packed_units, "bluestore_packed_units", "Allocation units shared by packed blobs");
   logger = b.create_perf_counters();
   g_ceph_context->get_perfcounters_collection()->add(logger);
 }
@@ -1593,6 +2133,36 @@ void BlueStore::_shutdown_logger()
 {
   g_ceph_context->get_perfcounters_collection()->remove(logger);
   delete logger;
+  for (auto& p : pool_loggers) {
+    g_ceph_context->get_perfcounters_collection()->remove(p.second);
+    delete p.second;
+  }
+  pool_loggers.clear();
+}
+
+PerfCounters *BlueStore::_get_pool_logger(int64_t pool)
+{
+  if (pool < 0) {
+    return nullptr;
+  }
+  std::lock_guard<std::mutex> l(pool_logger_lock);
+  auto p = pool_loggers.find(pool);
+  if (p != pool_loggers.end()) {
+    return p->second;
+  }
+  // created on first use and kept until shutdown, even if the pool goes
+  PerfCountersBuilder b(g_ceph_context, "bluestore-pool-" + stringify(pool),
+			l_bluestore_pool_first, l_bluestore_pool_last);
+  b.add_time_avg(l_bluestore_pool_compress_lat, "compress_lat", "Average compress latency");
+  b.add_u64_counter(l_bluestore_pool_compress_success_count, "compress_success_count", "Sum for beneficial compress ops");
+  b.add_u64_counter(l_bluestore_pool_compress_rejected_count, "compress_rejected_count", "Sum for compress ops that did not meet the required ratio");
+  b.add_u64_counter(l_bluestore_pool_compress_sample_rejected_count, "compress_sample_rejected_count", "Sum for blobs left uncompressed after compressing a sample");
+  b.add_u64_counter(l_bluestore_pool_compress_in_bytes, "compress_in_bytes", "Sum for bytes of blobs stored compressed");
+  b.add_u64_counter(l_bluestore_pool_compress_out_bytes, "compress_out_bytes", "Sum for bytes those blobs compressed to");
+  PerfCounters *pl = b.create_perf_counters();
+  g_ceph_context->get_perfcounters_collection()->add(pl);
+  pool_loggers[pool] = pl;
+  return pl;
 }
 
 int BlueStore::get_block_device_fsid(const string& path, uuid_d *fsid)
@@ -1801,6 +2371,7 @@ int BlueStore::_open_fm(bool create)
       bl.append(freelist_type);
       t->set(PREFIX_SUPER, "freelist_type", bl);
     }
+    _prepare_ondisk_format_super(t);
     fm->create(bdev->get_size(), t);
 
     uint64_t reserved = 0;
@@ -1923,6 +2494,209 @@ void BlueStore::_close_alloc()
   alloc->shutdown();
   delete alloc;
   alloc = NULL;
+
+  // the pack units are allocator space too
+  pack_units.clear();
+  pack_open = false;
+}
+
+int BlueStore::_open_pack()
+{
+  assert(pack_units.empty());
+  KeyValueDB::Iterator it = db->get_iterator(PREFIX_PACK);
+  for (it->lower_bound(string()); it->valid(); it->next()) {
+    string k = it->key();
+    const char *p = k.c_str();
+    uint64_t unit;
+    p = _key_decode_u64(p, &unit);
+    PackUnit& u = pack_units[unit];
+    // nothing more is handed out of a unit we did not open this time
+    u.next = min_alloc_size;
+    if (k.length() > 8) {
+      uint32_t off;
+      _key_decode_u32(p, &off);
+      u.live.insert(unit + off, block_size);
+    }
+  }
+
+  // units that were opened but never got a committed slice
+  KeyValueDB::Transaction t = db->get_transaction();
+  uint64_t num_empty = 0;
+  for (auto p = pack_units.begin(); p != pack_units.end(); ) {
+    if (!p->second.live.empty()) {
+      ++p;
+      continue;
+    }
+    string key;
+    get_pack_unit_key(p->first, &key);
+    t->rmkey(PREFIX_PACK, key);
+    fm->release(p->first, min_alloc_size, t);
+    alloc->init_add_free(p->first, min_alloc_size);
+    ++num_empty;
+    pack_units.erase(p++);
+  }
+  if (num_empty) {
+    db->submit_transaction_sync(t);
+  }
+  dout(10) << __func__ << " " << pack_units.size() << " units, released "
+	   << num_empty << " empty" << dendl;
+  return 0;
+}
+
+int BlueStore::_pack_open_unit(uint64_t *unit)
+{
+  // the unit must be allocated before any slice of it can commit, and
+  // those can come from any sequencer, so do it in its own transaction
+  int r = alloc->reserve(min_alloc_size);
+  if (r < 0)
+    return r;
+  uint64_t offset;
+  uint32_t length;
+  r = alloc->allocate(min_alloc_size, min_alloc_size, 0, &offset, &length);
+  assert(r == 0 && length == min_alloc_size);
+
+  KeyValueDB::Transaction t = db->get_transaction();
+  fm->allocate(offset, length, t);
+  string key;
+  get_pack_unit_key(offset, &key);
+  bufferlist bl;
+  t->set(PREFIX_PACK, key, bl);
+  r = db->submit_transaction_sync(t);
+  assert(r == 0);
+
+  dout(20) << __func__ << " 0x" << std::hex << offset << std::dec << dendl;
+  *unit = offset;
+  return 0;
+}
+
+void BlueStore::_pack_release_unit(uint64_t unit)
+{
+  dout(20) << __func__ << " 0x" << std::hex << unit << std::dec << dendl;
+  KeyValueDB::Transaction t = db->get_transaction();
+  string key;
+  get_pack_unit_key(unit, &key);
+  t->rmkey(PREFIX_PACK, key);
+  fm->release(unit, min_alloc_size, t);
+  // no need to wait: anything that reuses the space commits after this
+  int r = db->submit_transaction(t);
+  assert(r == 0);
+  if (!g_conf->bluestore_debug_no_reuse_blocks) {
+    alloc->release(unit, min_alloc_size);
+  }
+}
+
+int BlueStore::_pack_alloc(uint64_t length, uint64_t *offset)
+{
+  assert(length < min_alloc_size);
+  assert(length % block_size == 0);
+  uint64_t retired = 0;
+  bool release_retired = false;
+  std::unique_lock<std::mutex> l(pack_lock);
+  while (!pack_open || pack_units[pack_cur].next + length > min_alloc_size) {
+    if (pack_opening) {
+      pack_cond.wait(l);
+      continue;
+    }
+    // opening a unit waits for a sync commit; _txc_finalize_pack takes
+    // pack_lock in the kv path, so don't hold it meanwhile
+    pack_opening = true;
+    l.unlock();
+    uint64_t unit;
+    int r = _pack_open_unit(&unit);
+    l.lock();
+    pack_opening = false;
+    pack_cond.notify_all();
+    if (r < 0)
+      return r;
+
+    // retire the unit we were filling; if nothing of it survived it
+    // can go back right away, otherwise the last release frees it
+    if (pack_open) {
+      auto u = pack_units.find(pack_cur);
+      assert(u != pack_units.end());
+      if (u->second.live.empty() && u->second.pending == 0) {
+	retired = pack_cur;
+	release_retired = true;
+	pack_units.erase(u);
+      }
+    }
+    pack_units[unit];
+    pack_cur = unit;
+    pack_open = true;
+    logger->set(l_bluestore_packed_units, pack_units.size());
+  }
+  PackUnit& u = pack_units[pack_cur];
+  *offset = pack_cur + u.next;
+  u.next += length;
+  u.pending += length;
+  dout(20) << __func__ << " 0x" << std::hex << *offset << "~" << length
+	   << std::dec << dendl;
+  l.unlock();
+
+  if (release_retired) {
+    _pack_release_unit(retired);
+  }
+  return 0;
+}
+
+void BlueStore::_txc_finalize_pack(TransContext *txc,
+				   KeyValueDB::Transaction t)
+{
+  // pull slices of pack units out of allocated/released: the freelist
+  // already has the whole unit, we just track blocks within it
+  std::lock_guard<std::mutex> l(pack_lock);
+  if (pack_units.empty())
+    return;
+  auto take = [&](interval_set<uint64_t>& s, bool allocate) {
+    interval_set<uint64_t> mine;
+    for (auto p = s.begin(); p != s.end(); ++p) {
+      uint64_t pos = p.get_start();
+      uint64_t end = pos + p.get_len();
+      while (pos < end) {
+	uint64_t unit = P2ALIGN(pos, min_alloc_size);
+	uint64_t len = MIN(end, unit + min_alloc_size) - pos;
+	auto u = pack_units.find(unit);
+	if (u != pack_units.end()) {
+	  mine.insert(pos, len);
+	  for (uint64_t b = pos; b < pos + len; b += block_size) {
+	    string key;
+	    get_pack_block_key(unit, b, &key);
+	    if (allocate) {
+	      bufferlist bl;
+	      t->set(PREFIX_PACK, key, bl);
+	    } else {
+	      t->rmkey(PREFIX_PACK, key);
+	    }
+	  }
+	  if (allocate) {
+	    assert(u->second.pending >= len);
+	    u->second.pending -= len;
+	    u->second.live.insert(pos, len);
+	  } else {
+	    u->second.live.erase(pos, len);
+	    if (u->second.live.empty() && u->second.pending == 0 &&
+		!(pack_open && unit == pack_cur)) {
+	      dout(20) << __func__ << " release unit 0x" << std::hex << unit
+		       << std::dec << dendl;
+	      string key;
+	      get_pack_unit_key(unit, &key);
+	      t->rmkey(PREFIX_PACK, key);
+	      fm->release(unit, min_alloc_size, t);
+	      if (!g_conf->bluestore_debug_no_reuse_blocks) {
+		alloc->release(unit, min_alloc_size);
+	      }
+	      pack_units.erase(u);
+	    }
+	  }
+	}
+	pos += len;
+      }
+    }
+    s.subtract(mine);
+  };
+  take(txc->allocated, true);
+  take(txc->released, false);
+  logger->set(l_bluestore_packed_units, pack_units.size());
 }
 
 int BlueStore::_open_fsid(bool create)
@@ -2262,9 +3036,14 @@ int BlueStore::_open_db(bool create)
   FreelistManager::setup_merge_operators(db);
   db->set_merge_operator(PREFIX_STAT, merge_op);
 
-  if (kv_backend == "rocksdb")
+  if (kv_backend == "rocksdb") {
     options = g_conf->bluestore_rocksdb_options;
+    if (cache_autotune) {
+      options += ",collect_cache_stats=true";
+    }
+  }
   db->init(options);
+  db->set_cache_size(cache_size * cache_ratio.load().kv);
   if (create)
     r = db->create_and_open(err);
   else
@@ -2294,8 +3073,12 @@ free_bluefs:
 void BlueStore::_close_db()
 {
   assert(db);
-  delete db;
-  db = NULL;
+  {
+    // _set_cache_sizes() uses db under this lock
+    std::lock_guard<std::mutex> l(cache_conf_lock);
+    delete db;
+    db = NULL;
+  }
   if (bluefs) {
     bluefs->umount();
     delete bluefs;
@@ -2762,6 +3545,10 @@ void BlueStore::set_cache_shards(unsigned num)
   for (unsigned i = old; i < num; ++i) {
     cache_shards[i] = Cache::create(g_conf->bluestore_cache_type);
   }
+  // start with an even split; _balance_cache_shards() adjusts it
+  for (auto i : cache_shards) {
+    i->shard_ratio = 1.0 / (float)num;
+  }
 }
 
 int BlueStore::mount()
@@ -2820,6 +3607,12 @@ int BlueStore::mount()
   if (r < 0)
     goto out_db;
 
+  if (ondisk_format < latest_ondisk_format) {
+    r = _upgrade_super();
+    if (r < 0)
+      goto out_db;
+  }
+
   r = _open_fm(false);
   if (r < 0)
     goto out_db;
@@ -2828,6 +3621,10 @@ int BlueStore::mount()
   if (r < 0)
     goto out_fm;
 
+  r = _open_pack();
+  if (r < 0)
+    goto out_alloc;
+
   r = _open_collections();
   if (r < 0)
     goto out_alloc;
@@ -2846,7 +3643,10 @@ int BlueStore::mount()
     f->start();
   }
   wal_tp.start();
+  compress_tp.start();
   kv_sync_thread.create("bstore_kv_sync");
+  kv_finalize_thread.create("bstore_kv_final");
+  mempool_thread.init();
 
   r = _wal_replay();
   if (r < 0)
@@ -2855,13 +3655,18 @@ int BlueStore::mount()
   _set_csum();
   _set_compression();
 
-  mounted = true;
+  {
+    std::lock_guard<std::mutex> l(cache_conf_lock);
+    mounted = true;
+  }
   return 0;
 
  out_stop:
+  mempool_thread.shutdown();
   _kv_stop();
   wal_wq.drain();
   wal_tp.stop();
+  compress_tp.stop();
   for (auto f : finishers) {
     f->wait_for_empty();
     f->stop();
@@ -2888,6 +3693,13 @@ int BlueStore::umount()
   assert(mounted);
   dout(1) << __func__ << dendl;
 
+  dout(20) << __func__ << " stopping mempool thread" << dendl;
+  mempool_thread.shutdown();
+
+  // parked txcs are applied by the compress workers
+  dout(20) << __func__ << " draining compress_wq" << dendl;
+  compress_wq.drain();
+
   _sync();
   _reap_collections();
   coll_map.clear();
@@ -2898,6 +3710,8 @@ int BlueStore::umount()
   wal_wq.drain();
   dout(20) << __func__ << " stopping wal_tp" << dendl;
   wal_tp.stop();
+  dout(20) << __func__ << " stopping compress_tp" << dendl;
+  compress_tp.stop();
   for (auto f : finishers) {
     dout(20) << __func__ << " draining finisher" << dendl;
     f->wait_for_empty();
@@ -2906,7 +3720,11 @@ int BlueStore::umount()
   }
   dout(20) << __func__ << " closing" << dendl;
 
-  mounted = false;
+  {
+    // conf changes stop resizing the kv cache from here on
+    std::lock_guard<std::mutex> l(cache_conf_lock);
+    mounted = false;
+  }
   _close_alloc();
   _close_fm();
   _close_db();
@@ -2939,11 +3757,45 @@ void apply(uint64_t off,
   }
 }
 
+bool BlueStore::_fsck_mark_used(
+  uint64_t offset, uint64_t length,
+  boost::dynamic_bitset<> &used_blocks,
+  map<uint64_t,boost::dynamic_bitset<>> &used_pack_blocks)
+{
+  bool already_allocated = false;
+  auto test_set = [&](uint64_t pos, boost::dynamic_bitset<> &bs) {
+    if (bs.test(pos)) {
+      already_allocated = true;
+    } else {
+      bs.set(pos);
+    }
+  };
+  if (used_pack_blocks.empty()) {
+    apply(offset, length, min_alloc_size, used_blocks, test_set);
+    return already_allocated;
+  }
+  uint64_t pos = offset;
+  uint64_t end = offset + length;
+  while (pos < end) {
+    uint64_t unit = P2ALIGN(pos, min_alloc_size);
+    uint64_t len = MIN(end, unit + min_alloc_size) - pos;
+    auto p = used_pack_blocks.find(unit);
+    if (p != used_pack_blocks.end()) {
+      apply(pos - unit, len, block_size, p->second, test_set);
+    } else {
+      apply(pos, len, min_alloc_size, used_blocks, test_set);
+    }
+    pos += len;
+  }
+  return already_allocated;
+}
+
 int BlueStore::_fsck_verify_blob_map(
   string what,
   const BlobMap& blob_map,
   map<int64_t,bluestore_extent_ref_map_t>& v,
   boost::dynamic_bitset<> &used_blocks,
+  map<uint64_t,boost::dynamic_bitset<>> &used_pack_blocks,
   store_statfs_t& expected_statfs)
 {
   int errors = 0;
@@ -2978,17 +3830,8 @@ int BlueStore::_fsck_verify_blob_map(
       if (compressed) {
         expected_statfs.compressed_allocated += p.length;
       }
-      bool already_allocated = false;
-      apply( 
-        p.offset, p.length, min_alloc_size, used_blocks,
-        [&](uint64_t pos, boost::dynamic_bitset<> &bs) {
-          if (bs.test(pos)) {
-            already_allocated = true;
-          } else {
-            bs.set(pos);
-          }
-        }
-      );
+      bool already_allocated = _fsck_mark_used(
+        p.offset, p.length, used_blocks, used_pack_blocks);
 
       if (already_allocated) {
 	derr << " " << what << " extent 0x" << std::hex
@@ -3020,7 +3863,9 @@ int BlueStore::fsck()
   int errors = 0;
   set<uint64_t> used_nids;
   set<uint64_t> used_omap_head;
+  set<string> used_bnode_keys;
   boost::dynamic_bitset<> used_blocks;
+  map<uint64_t,boost::dynamic_bitset<>> used_pack_blocks;  ///< unit -> blocks
   KeyValueDB::Iterator it;
   BnodeRef bnode;
   map<int64_t,bluestore_extent_ref_map_t> hash_shared;
@@ -3054,6 +3899,14 @@ int BlueStore::fsck()
   if (r < 0)
     goto out_db;
 
+  // an old-format store can't be checked as is, and fsck on mount
+  // runs before mount gets to convert it
+  if (ondisk_format < latest_ondisk_format) {
+    r = _upgrade_super();
+    if (r < 0)
+      goto out_db;
+  }
+
   r = _open_fm(false);
   if (r < 0)
     goto out_db;
@@ -3068,6 +3921,16 @@ int BlueStore::fsck()
 
   used_blocks.resize(
     ROUND_UP_TO(bdev->get_size(), min_alloc_size) / min_alloc_size);
+  // packed blobs share allocation units, so those (and only those) are
+  // tracked by block
+  it = db->get_iterator(PREFIX_PACK);
+  for (it->lower_bound(string()); it->valid(); it->next()) {
+    uint64_t unit;
+    _key_decode_u64(it->key().c_str(), &unit);
+    boost::dynamic_bitset<>& bs = used_pack_blocks[unit];
+    if (bs.empty())
+      bs.resize(min_alloc_size / block_size);
+  }
   apply(
     0, BLUEFS_START, min_alloc_size, used_blocks,
     [&](uint64_t pos, boost::dynamic_bitset<> &bs) {
@@ -3132,11 +3995,16 @@ int BlueStore::fsck()
 	      bnode->blob_map,
 	      hash_shared,
 	      used_blocks,
+	      used_pack_blocks,
 	      expected_statfs);
 	  bnode = c->get_bnode(o->oid.hobj.get_hash());
+	  c->load_shared_blobs(bnode);
+	  used_bnode_keys.insert(bnode->key);
 	  hash_shared.clear();
 	}
 	dout(10) << __func__ << "  " << oid << dendl;
+	std::lock_guard<std::mutex> el(o->extent_lock);
+	_fault_range(o, 0, EXTENT_MAP_END);
 	_dump_onode(o, 30);
 	if (o->onode.nid) {
 	  if (used_nids.count(o->onode.nid)) {
@@ -3175,6 +4043,7 @@ int BlueStore::fsck()
 	  o->blob_map,
 	  local_blobs,
 	  used_blocks,
+	  used_pack_blocks,
 	  expected_statfs);
 	// omap
 	while (o->onode.omap_head) {
@@ -3220,6 +4089,7 @@ int BlueStore::fsck()
       bnode->blob_map,
       hash_shared,
       used_blocks,
+      used_pack_blocks,
       expected_statfs);
     hash_shared.clear();
     bnode.reset();
@@ -3247,7 +4117,12 @@ int BlueStore::fsck()
           dout(30) << __func__ << "  bad bnode key "
                    << pretty_binary_string(it->key()) << dendl;
           ++errors;
-        }
+        } else {
+	  // shared blobs have their own records since ondisk format 1
+	  derr << __func__ << " stray old-format bnode "
+	       << pretty_binary_string(it->key()) << dendl;
+	  ++errors;
+	}
 	continue;
       }
 
@@ -3280,6 +4155,27 @@ int BlueStore::fsck()
     }
   }
 
+  dout(1) << __func__ << " checking for orphan shared blobs" << dendl;
+  it = db->get_iterator(PREFIX_SHARED_BLOB);
+  if (it) {
+    for (it->lower_bound(string()); it->valid(); it->next()) {
+      string key = it->key();
+      if (key.size() != 2 + 8 + 4 + 8) {
+	derr << __func__ << " bad shared blob key "
+	     << pretty_binary_string(key) << dendl;
+	++errors;
+	continue;
+      }
+      if (used_bnode_keys.count(key.substr(0, 2 + 8 + 4)) == 0) {
+	uint64_t id;
+	_key_decode_u64(key.c_str() + 2 + 8 + 4, &id);
+	derr << __func__ << " orphan shared blob " << id << " of bnode "
+	     << pretty_binary_string(key.substr(0, 2 + 8 + 4)) << dendl;
+	++errors;
+      }
+    }
+  }
+
   dout(1) << __func__ << " checking for stray omap data" << dendl;
   it = db->get_iterator(PREFIX_OMAP);
   if (it) {
@@ -3315,13 +4211,41 @@ int BlueStore::fsck()
 	       << " ops " << wt.ops.size()
 	       << " released 0x" << std::hex << wt.released << std::dec << dendl;
       for (auto e = wt.released.begin(); e != wt.released.end(); ++e) {
-        apply(
-          e.get_start(), e.get_len(), min_alloc_size, used_blocks,
-          [&](uint64_t pos, boost::dynamic_bitset<> &bs) {
-            bs.set(pos);
-          }
-        );
+        _fsck_mark_used(e.get_start(), e.get_len(), used_blocks,
+			used_pack_blocks);
+      }
+    }
+  }
+
+  dout(1) << __func__ << " checking pack units" << dendl;
+  {
+    // every live block of a unit must belong to some blob; the rest of
+    // the unit is allocated in the freelist but owned by nobody else
+    it = db->get_iterator(PREFIX_PACK);
+    for (it->lower_bound(string()); it->valid(); it->next()) {
+      string k = it->key();
+      if (k.length() <= 8)
+	continue;
+      uint64_t unit;
+      const char *p = _key_decode_u64(k.c_str(), &unit);
+      uint32_t off;
+      _key_decode_u32(p, &off);
+      if (!used_pack_blocks[unit].test(off / block_size)) {
+	derr << __func__ << " pack unit 0x" << std::hex << unit
+	     << " block 0x" << off << std::dec << " is not referenced"
+	     << dendl;
+	++errors;
+      }
+    }
+    // the unit as a whole is what the freelist knows about
+    for (auto& p : used_pack_blocks) {
+      uint64_t pos = p.first / min_alloc_size;
+      if (used_blocks.test(pos)) {
+	derr << __func__ << " pack unit 0x" << std::hex << p.first << std::dec
+	     << " is also allocated to something else" << dendl;
+	++errors;
       }
+      used_blocks.set(pos);
     }
   }
 
@@ -3400,11 +4324,22 @@ void BlueStore::_sync()
   // flush aios in flight
   bdev->flush();
 
-  std::unique_lock<std::mutex> l(kv_lock);
-  while (!kv_committing.empty() ||
-	 !kv_queue.empty()) {
-    dout(20) << " waiting for kv to commit" << dendl;
-    kv_sync_cond.wait(l);
+  {
+    std::unique_lock<std::mutex> l(kv_lock);
+    while (!kv_committing.empty() ||
+	   !kv_queue.empty()) {
+      dout(20) << " waiting for kv to commit" << dendl;
+      kv_sync_cond.wait(l);
+    }
+  }
+  {
+    std::unique_lock<std::mutex> l(kv_finalize_lock);
+    while (!kv_committing_to_finalize.empty() ||
+	   !wal_cleaning_to_finalize.empty() ||
+	   kv_finalize_in_progress) {
+      dout(20) << " waiting for kv to finalize" << dendl;
+      kv_finalize_sync_cond.wait(l);
+    }
   }
 
   dout(10) << __func__ << " done" << dendl;
@@ -3427,6 +4362,17 @@ int BlueStore::statfs(struct store_statfs_t *buf)
     }
   }
 
+  {
+    // pack units are gone from the allocator as a whole, but blobs are
+    // only charged for their slices: what we haven't handed out yet is
+    // still available.  (slices freed in a unit that is still in use
+    // are neither until the whole unit goes back.)
+    std::lock_guard<std::mutex> l(pack_lock);
+    for (auto& p : pack_units) {
+      buf->available += min_alloc_size - p.second.next;
+    }
+  }
+
   bufferlist bl;
   int r = db->get(PREFIX_STAT, "bluestore_statfs", &bl);
   if (r >= 0) {
@@ -3539,9 +4485,7 @@ bool BlueStore::exists(CollectionHandle &c_, const ghobject_t& oid)
       r = false;
   }
 
-  c->cache->trim(
-    g_conf->bluestore_onode_cache_size,
-    g_conf->bluestore_buffer_cache_size);
+  _trim_cache(c->cache);
 
   return r;
 }
@@ -3580,9 +4524,7 @@ int BlueStore::stat(
     st->st_nlink = 1;
   }
 
-  c->cache->trim(
-    g_conf->bluestore_onode_cache_size,
-    g_conf->bluestore_buffer_cache_size);
+  _trim_cache(c->cache);
   return 0;
 }
 
@@ -3636,9 +4578,7 @@ int BlueStore::read(
   }
 
  out:
-  c->cache->trim(
-    g_conf->bluestore_onode_cache_size,
-    g_conf->bluestore_buffer_cache_size);
+  _trim_cache(c->cache);
   dout(10) << __func__ << " " << cid << " " << oid
 	   << " 0x" << std::hex << offset << "~" << length << std::dec
 	   << " = " << r << dendl;
@@ -3712,6 +4652,10 @@ int BlueStore::_do_read(
   }
 
   o->flush();
+
+  // the lextents we need may not be loaded yet
+  std::unique_lock<std::mutex> extent_locker(o->extent_lock);
+  _fault_range(o, offset, length);
   _dump_onode(o);
 
   ready_regions_t ready_regions;
@@ -3776,6 +4720,7 @@ int BlueStore::_do_read(
     }
     ++lp;
   }
+  extent_locker.unlock();
 
   //enumerate and read/decompress desired blobs
   blobs2read_t::iterator b2r_it = blobs2read.begin();
@@ -3969,6 +4914,7 @@ int BlueStore::fiemap(
     if (!o || !o->exists) {
       return -ENOENT;
     }
+    std::lock_guard<std::mutex> el(o->extent_lock);
     _dump_onode(o);
 
     dout(20) << __func__ << " 0x" << std::hex << offset << "~" << length
@@ -3981,6 +4927,7 @@ int BlueStore::fiemap(
     if (offset + length > o->onode.size) {
       length = o->onode.size - offset;
     }
+    _fault_range(o, offset, length);
 
     eend = o->onode.extent_map.end();
     ep = o->onode.extent_map.lower_bound(offset);
@@ -4018,9 +4965,7 @@ int BlueStore::fiemap(
   }
 
  out:
-  c->cache->trim(
-    g_conf->bluestore_onode_cache_size,
-    g_conf->bluestore_buffer_cache_size);
+  _trim_cache(c->cache);
   ::encode(m, bl);
   dout(20) << __func__ << " 0x" << std::hex << offset << "~" << length
 	   << " size = 0 (" << m << ")" << std::dec << dendl;
@@ -4069,9 +5014,7 @@ int BlueStore::getattr(
     r = 0;
   }
  out:
-  c->cache->trim(
-    g_conf->bluestore_onode_cache_size,
-    g_conf->bluestore_buffer_cache_size);
+  _trim_cache(c->cache);
   dout(10) << __func__ << " " << c->cid << " " << oid << " " << name
 	   << " = " << r << dendl;
   return r;
@@ -4113,9 +5056,7 @@ int BlueStore::getattrs(
   }
 
  out:
-  c->cache->trim(
-    g_conf->bluestore_onode_cache_size,
-    g_conf->bluestore_buffer_cache_size);
+  _trim_cache(c->cache);
   dout(10) << __func__ << " " << c->cid << " " << oid
 	   << " = " << r << dendl;
   return r;
@@ -4173,6 +5114,30 @@ int BlueStore::collection_list(
   return collection_list(c, start, end, sort_bitwise, max, ls, pnext);
 }
 
+void BlueStore::prefetch_onodes(
+  const coll_t& cid,
+  const vector<ghobject_t>& oids)
+{
+  CollectionHandle c = _get_collection(cid);
+  if (!c)
+    return;
+  prefetch_onodes(c, oids);
+}
+
+void BlueStore::prefetch_onodes(
+  CollectionHandle &c_,
+  const vector<ghobject_t>& oids)
+{
+  Collection *c = static_cast<Collection*>(c_.get());
+  dout(15) << __func__ << " " << c->cid << " " << oids.size() << " objects"
+	   << dendl;
+  if (!c->exists || g_conf->bluestore_onode_prefetch_max <= 0)
+    return;
+  RWLock::RLocker l(c->lock);
+  int r = c->prefetch_onodes(oids);
+  logger->inc(l_bluestore_onode_prefetch, r);
+}
+
 int BlueStore::collection_list(
   CollectionHandle &c_, ghobject_t start, ghobject_t end,
   bool sort_bitwise, int max,
@@ -4292,9 +5257,7 @@ int BlueStore::collection_list(
   }
 
  out:
-  c->cache->trim(
-    g_conf->bluestore_onode_cache_size,
-    g_conf->bluestore_buffer_cache_size);
+  _trim_cache(c->cache);
   dout(10) << __func__ << " " << c->cid
 	   << " start " << start << " end " << end << " max " << max
 	   << " = " << r << ", ls.size() = " << ls->size()
@@ -4706,6 +5669,34 @@ ObjectMap::ObjectMapIterator BlueStore::get_omap_iterator(
 
 int BlueStore::_open_super_meta()
 {
+  // ondisk format
+  {
+    ondisk_format = 0;
+    int compat_ondisk_format = 0;
+    bufferlist bl;
+    db->get(PREFIX_SUPER, "ondisk_format", &bl);
+    bufferlist::iterator p = bl.begin();
+    try {
+      ::decode(ondisk_format, p);
+    } catch (buffer::error& e) {
+    }
+    bl.clear();
+    db->get(PREFIX_SUPER, "min_compat_ondisk_format", &bl);
+    p = bl.begin();
+    try {
+      ::decode(compat_ondisk_format, p);
+    } catch (buffer::error& e) {
+    }
+    dout(10) << __func__ << " ondisk_format " << ondisk_format
+	     << " compat_ondisk_format " << compat_ondisk_format << dendl;
+    if (latest_ondisk_format < compat_ondisk_format) {
+      derr << __func__ << " compat_ondisk_format is "
+	   << compat_ondisk_format << " but we only understand version "
+	   << latest_ondisk_format << dendl;
+      return -EPERM;
+    }
+  }
+
   // nid
   {
     nid_max = 0;
@@ -4720,6 +5711,20 @@ int BlueStore::_open_super_meta()
     nid_last = nid_max;
   }
 
+  // blobid
+  {
+    blobid_max = 0;
+    bufferlist bl;
+    db->get(PREFIX_SUPER, "blobid_max", &bl);
+    bufferlist::iterator p = bl.begin();
+    try {
+      ::decode(blobid_max, p);
+    } catch (buffer::error& e) {
+    }
+    dout(10) << __func__ << " old blobid_max " << blobid_max << dendl;
+    blobid_last = blobid_max;
+  }
+
   // freelist
   {
     bufferlist bl;
@@ -4751,6 +5756,96 @@ int BlueStore::_open_super_meta()
   return 0;
 }
 
+void BlueStore::_prepare_ondisk_format_super(KeyValueDB::Transaction& t)
+{
+  dout(10) << __func__ << " ondisk_format " << latest_ondisk_format
+	   << " min_compat_ondisk_format " << min_compat_ondisk_format
+	   << dendl;
+  ondisk_format = latest_ondisk_format;
+  {
+    bufferlist bl;
+    ::encode(ondisk_format, bl);
+    t->set(PREFIX_SUPER, "ondisk_format", bl);
+  }
+  {
+    bufferlist bl;
+    ::encode(min_compat_ondisk_format, bl);
+    t->set(PREFIX_SUPER, "min_compat_ondisk_format", bl);
+  }
+}
+
+int BlueStore::_upgrade_super()
+{
+  dout(1) << __func__ << " from " << ondisk_format << " to "
+	  << latest_ondisk_format << dendl;
+  assert(ondisk_format < latest_ondisk_format);
+  KeyValueDB::Transaction t = db->get_transaction();
+
+  if (ondisk_format == 0) {
+    // split each bnode's blob_map into one record per shared blob.  the
+    // ids are kept (lextents refer to them); the store-wide allocator
+    // just has to start past all of them.
+    uint64_t num = 0, max_id = 0;
+    string key;
+    KeyValueDB::Iterator it = db->get_iterator(PREFIX_OBJ);
+    for (it->lower_bound(string()); it->valid(); it->next()) {
+      if (!is_bnode_key(it->key())) {
+	continue;
+      }
+      string bnode_key = it->key();
+      bufferlist v = it->value();
+      if (!v.is_contiguous())
+	v.rebuild();
+      BlobMap bm;
+      bufferptr::iterator p = v.front().begin();
+      try {
+	bm.decode(p, nullptr);
+      } catch (buffer::error& e) {
+	derr << __func__ << " failed to decode blob_map of bnode "
+	     << pretty_binary_string(bnode_key) << dendl;
+	bm._clear();
+	return -EIO;
+      }
+      for (auto& b : bm.blob_map) {
+	size_t bound = 0;
+	denc(b.blob, bound);
+	bufferlist bl;
+	{
+	  bufferlist::contiguous_appender app(bl, bound);
+	  denc(b.blob, app);
+	}
+	get_shared_blob_key(bnode_key, b.id, &key);
+	t->set(PREFIX_SHARED_BLOB, key, bl);
+	max_id = MAX(max_id, (uint64_t)b.id);
+	++num;
+      }
+      dout(20) << __func__ << " bnode " << pretty_binary_string(bnode_key)
+	       << " blob_map " << bm << dendl;
+      bm._clear();
+      t->rmkey(PREFIX_OBJ, bnode_key);
+    }
+    if (max_id > blobid_max) {
+      blobid_max = max_id;
+      blobid_last = blobid_max;
+      bufferlist bl;
+      ::encode(blobid_max, bl);
+      t->set(PREFIX_SUPER, "blobid_max", bl);
+    }
+    dout(1) << __func__ << " converted " << num << " shared blobs, blobid_max "
+	    << blobid_max << dendl;
+  }
+  // 1 -> 2: nothing to convert; a format 1 store has no pack units, but
+  // an older version must not open one that does
+
+  _prepare_ondisk_format_super(t);
+  int r = db->submit_transaction_sync(t);
+  if (r < 0) {
+    derr << __func__ << " failed to commit: " << cpp_strerror(r) << dendl;
+    return r;
+  }
+  return 0;
+}
+
 void BlueStore::_assign_nid(TransContext *txc, OnodeRef o)
 {
   if (o->onode.nid)
@@ -4767,9 +5862,28 @@ void BlueStore::_assign_nid(TransContext *txc, OnodeRef o)
   }
 }
 
+int64_t BlueStore::_assign_blobid(TransContext *txc)
+{
+  std::lock_guard<std::mutex> l(blobid_lock);
+  int64_t bid = ++blobid_last;
+  dout(20) << __func__ << " " << bid << dendl;
+  if (blobid_last > blobid_max) {
+    blobid_max += g_conf->bluestore_nid_prealloc;
+    bufferlist bl;
+    ::encode(blobid_max, bl);
+    txc->t->set(PREFIX_SUPER, "blobid_max", bl);
+    dout(10) << __func__ << " blobid_max now " << blobid_max << dendl;
+  }
+  return bid;
+}
+
 BlueStore::TransContext *BlueStore::_txc_create(OpSequencer *osr)
 {
   TransContext *txc = new TransContext(osr);
+  if (osr->parent) {
+    // complete on the aio queue that matches the op shard
+    txc->ioc.shard_hint = osr->parent->shard_hint.pgid.ps();
+  }
   txc->t = db->get_transaction();
   osr->queue_new(txc);
   dout(20) << __func__ << " osr " << osr << " = " << txc
@@ -4816,7 +5930,7 @@ void BlueStore::_txc_state_proc(TransContext *txc)
       return;
 
     case TransContext::STATE_IO_DONE:
-      //assert(txc->osr->qlock.is_locked());  // see _txc_finish_io
+      // in order for this osr; see _txc_finish_io
       txc->log_state_latency(logger, l_bluestore_state_io_done_lat);
       txc->state = TransContext::STATE_KV_QUEUED;
       for (auto& b : txc->blobs) {
@@ -4850,7 +5964,9 @@ void BlueStore::_txc_state_proc(TransContext *txc)
       txc->log_state_latency(logger, l_bluestore_state_kv_done_lat);
       if (txc->wal_txn) {
 	txc->state = TransContext::STATE_WAL_QUEUED;
-	if (sync_wal_apply) {
+	if (wal_batch_ops) {
+	  _deferred_queue(txc);
+	} else if (sync_wal_apply) {
 	  _wal_apply(txc);
 	} else {
 	  wal_wq.queue(txc);
@@ -4900,70 +6016,491 @@ void BlueStore::_txc_finish_io(TransContext *txc)
   /*
    * we need to preserve the order of kv transactions,
    * even though aio will complete in any order.
+   *
+   * Usually our predecessor is already past IO_DONE; then only we can
+   * advance last_io_done_seq and we do so without qlock.  Otherwise we
+   * park under qlock and whoever completes the gap drains us.  The
+   * store to last_io_done_seq and the num_io_parked check (and the
+   * reverse on the parking side) ensure one side always sees the other.
+   *
+   * Once handed to _txc_state_proc the txc may commit and be freed at
+   * any time, so take what we need from it (and a ref on its osr) first.
+   * For the same reason io_done is only set under qlock: until then no
+   * drainer can claim the txc, and after it we hold qlock, which the
+   * txc needs to be removed from osr->q.
    */
-
-  OpSequencer *osr = txc->osr.get();
-  std::lock_guard<std::mutex> l(osr->qlock);
+  OpSequencerRef osr = txc->osr;
+  uint64_t seq = txc->seq;
   txc->state = TransContext::STATE_IO_DONE;
-
-  OpSequencer::q_list_t::iterator p = osr->q.iterator_to(*txc);
-  while (p != osr->q.begin()) {
-    --p;
-    if (p->state < TransContext::STATE_IO_DONE) {
-      dout(20) << __func__ << " " << txc << " blocked by " << &*p << " "
-	       << p->get_state_name() << dendl;
+  if (osr->last_io_done_seq.load() == seq - 1 &&
+      !txc->io_claimed.exchange(true)) {
+    _txc_state_proc(txc);
+    osr->last_io_done_seq = seq;
+    if (osr->num_io_parked.load() == 0) {
       return;
     }
-    if (p->state > TransContext::STATE_IO_DONE) {
-      ++p;
-      break;
+    std::lock_guard<std::mutex> l(osr->qlock);
+    _osr_drain_io_done(osr.get());
+    return;
+  }
+
+  std::lock_guard<std::mutex> l(osr->qlock);
+  dout(20) << __func__ << " " << txc << " seq " << seq
+	   << " blocked, last_io_done_seq " << osr->last_io_done_seq.load()
+	   << dendl;
+  txc->io_done = true;
+  txc->io_parked = true;
+  ++osr->num_io_parked;
+  _osr_drain_io_done(osr.get());
+}
+
+void BlueStore::_osr_drain_io_done(OpSequencer *osr)
+{
+  // caller holds osr->qlock
+  uint64_t next = osr->last_io_done_seq.load() + 1;
+  OpSequencer::q_list_t::iterator p = osr->q.begin();
+  while (p != osr->q.end() && p->seq < next) {
+    ++p;
+  }
+  while (p != osr->q.end() &&
+	 p->seq == next &&
+	 p->io_done.load() &&
+	 !p->io_claimed.exchange(true)) {
+    TransContext *txc = &*p++;
+    if (txc->io_parked) {
+      txc->io_parked = false;
+      --osr->num_io_parked;
     }
+    _txc_state_proc(txc);
+    osr->last_io_done_seq = next++;
   }
-  do {
-    _txc_state_proc(&*p++);
-  } while (p != osr->q.end() &&
-	   p->state == TransContext::STATE_IO_DONE);
 }
 
 void BlueStore::_txc_write_nodes(TransContext *txc, KeyValueDB::Transaction t)
 {
   dout(20) << __func__ << " txc " << txc
 	   << " onodes " << txc->onodes
-	   << " bnodes " << txc->bnodes
+	   << " shared_blobs " << txc->shared_blobs.size()
 	   << dendl;
 
   // finalize onodes
   for (set<OnodeRef>::iterator p = txc->onodes.begin();
        p != txc->onodes.end();
        ++p) {
-    bufferlist bl;
-    ::encode((*p)->onode, bl);
-    unsigned first_part = bl.length();
-    (*p)->blob_map.encode(bl);
-    dout(20) << "  onode " << (*p)->oid << " is " << bl.length()
-	     << " (" << first_part << " onode + "
-	     << (bl.length() - first_part) << " blob_map)" << dendl;
-    t->set(PREFIX_OBJ, (*p)->key, bl);
+    OnodeRef o = *p;
+    _txc_write_onode(o, t);
 
     std::lock_guard<std::mutex> l((*p)->flush_lock);
     (*p)->flush_txns.insert(txc);
   }
 
-  // finalize bnodes
-  for (set<BnodeRef>::iterator p = txc->bnodes.begin();
-       p != txc->bnodes.end();
+  // finalize shared blobs
+  string key;
+  for (auto& p : txc->shared_blobs) {
+    const BlobRef& b = p.first;
+    if (b->id == 0) {
+      continue;  // erased below
+    }
+    size_t bound = 0;
+    denc(b->blob, bound);
+    bufferlist bl;
+    {
+      bufferlist::contiguous_appender app(bl, bound);
+      denc(b->blob, app);
+    }
+    get_shared_blob_key(p.second->key, b->id, &key);
+    dout(20) << "  shared_blob " << std::hex << p.second->hash << std::dec
+	     << " id " << b->id << " is " << bl.length() << dendl;
+    t->set(PREFIX_SHARED_BLOB, key, bl);
+    logger->inc(l_bluestore_shared_blob_writes);
+  }
+  for (auto& p : txc->shared_blobs_rm) {
+    get_shared_blob_key(p.first->key, p.second, &key);
+    dout(20) << "  shared_blob " << std::hex << p.first->hash << std::dec
+	     << " id " << p.second << " removed" << dendl;
+    t->rmkey(PREFIX_SHARED_BLOB, key);
+  }
+}
+
+void BlueStore::_txc_write_onode(OnodeRef& o, KeyValueDB::Transaction t)
+{
+  std::lock_guard<std::mutex> l(o->extent_lock);
+
+  if (o->extent_shards.empty() && o->onode.extent_map.size() > 1) {
+    // start sharding once the inline extent map gets too big to rewrite
+    // on every update; _write_extent_shards() splits it up from here.
+    bufferlist bl;
+    o->onode.encode_lextents(0, EXTENT_MAP_END, bl);
+    size_t bytes = bl.length();
+    o->blob_map.bound_encode(bytes);
+    if (bytes > g_conf->bluestore_extent_map_shard_max_size) {
+      dout(20) << __func__ << " " << o->oid << " extent map is ~" << bytes
+	       << " bytes, sharding" << dendl;
+      o->onode.extent_map_shards.resize(1);
+      o->extent_shards.resize(1);
+      o->extent_shards[0].loaded = true;
+      o->extent_shards[0].dirty = true;
+    }
+  }
+  if (!o->extent_shards.empty()) {
+    _write_extent_shards(o, t);
+  }
+
+  // encode onode and blob_map into a single contiguous buffer
+  bool sharded = !o->extent_shards.empty();
+  size_t bound = 0;
+  denc(o->onode, bound);
+  o->blob_map.bound_encode(bound);
+  bufferlist bl;
+  unsigned first_part;
+  {
+    bufferlist::contiguous_appender app(bl, bound);
+    denc(o->onode, app);
+    first_part = app.get_logical_offset();
+    o->blob_map.encode(app, sharded);
+  }
+  dout(20) << "  onode " << o->oid << " is " << bl.length()
+	   << " (" << first_part << " onode + "
+	   << (bl.length() - first_part) << " blob_map)"
+	   << (sharded ? " sharded" : "") << dendl;
+  t->set(PREFIX_OBJ, o->key, bl);
+  logger->inc(l_bluestore_onode_write_bytes, bl.length());
+}
+
+// extent map shards
+//
+// Once an onode's extent map gets big it is cut into shards by logical
+// offset (onode.extent_map_shards), each stored under its own key with
+// the blobs only its lextents reference.  Blobs referenced from more
+// than one shard are marked spanning and stay in the onode value.  A
+// write only re-encodes the shards it dirtied, and shards are loaded on
+// demand, so a small overwrite of a big object costs a small kv update.
+// Shards stay in memory as long as the onode is cached.
+//
+// Writers mutate the extent map under the collection write lock; readers
+// only hold the read lock, so they fault shards in under o->extent_lock,
+// which _txc_write_onode() takes as well.
+
+void BlueStore::_fault_range(OnodeRef& o, uint64_t offset, uint64_t length)
+{
+  auto& shards = o->onode.extent_map_shards;
+  if (shards.empty() || length == 0) {
+    return;
+  }
+  uint64_t end = length > EXTENT_MAP_END - offset ?
+    EXTENT_MAP_END : offset + length;
+  unsigned last = o->seek_shard(end - 1);
+  for (unsigned i = o->seek_shard(offset); i <= last; ++i) {
+    if (o->extent_shards[i].loaded) {
+      continue;
+    }
+    string key;
+    get_extent_shard_key(o->key, shards[i].offset, &key);
+    bufferlist v;
+    int r = db->get(PREFIX_EXTENT_SHARD, key, &v);
+    if (r < 0) {
+      derr << __func__ << " " << o->oid << " missing shard 0x" << std::hex
+	   << shards[i].offset << std::dec << dendl;
+      assert(0 == "missing extent map shard");
+    }
+    dout(20) << __func__ << " " << o->oid << " shard " << i << " 0x"
+	     << std::hex << shards[i].offset << std::dec
+	     << " is " << v.length() << " bytes" << dendl;
+    if (!v.is_contiguous())
+      v.rebuild();
+    bufferptr::iterator p = v.front().begin();
+    o->onode.decode_lextents(p);
+
+    // blob ids are only unique within the shard, so give the local blobs
+    // fresh ones and point the lextents at those.
+    map<int64_t,int64_t> ids;
+    uint32_t n;
+    denc(n, p);
+    while (n--) {
+      int64_t id;
+      denc(id, p);
+      BlobRef b = o->blob_map.new_blob(o->space->cache);
+      denc(b->blob, p);
+      ids[id] = b->id;
+    }
+    uint64_t shard_end = i + 1 < shards.size() ?
+      shards[i + 1].offset : EXTENT_MAP_END;
+    for (auto q = o->onode.extent_map.lower_bound(shards[i].offset);
+	 q != o->onode.extent_map.end() && q->first < shard_end;
+	 ++q) {
+      auto id = ids.find(q->second.blob);
+      if (id != ids.end()) {
+	q->second.blob = id->second;
+      }
+    }
+    o->extent_shards[i].loaded = true;
+    logger->inc(l_bluestore_extent_shard_loads);
+  }
+}
+
+void BlueStore::_fault_write_range(OnodeRef& o, uint64_t offset,
+				   uint64_t length)
+{
+  if (o->extent_shards.empty()) {
+    return;
+  }
+  // the small write path looks just outside the range for a blob to
+  // reuse and for lextents to pad against
+  uint64_t pad = MAX(min_alloc_size, g_conf->bluestore_max_csum_block);
+  uint64_t start = offset > pad ? offset - pad : 0;
+  _fault_range(o, start, offset + length + pad - start);
+
+  // punched lextents are deref'd against every lextent in their blob's
+  // logical range, which may reach into other shards
+  uint64_t end = offset + length;
+  for (auto p = o->onode.seek_lextent(offset);
+       p != o->onode.extent_map.end() && p->first < end;
        ++p) {
-    if ((*p)->blob_map.empty()) {
-      dout(20) << "  bnode " << std::hex << (*p)->hash << std::dec
-	       << " blob_map is empty" << dendl;
-      t->rmkey(PREFIX_OBJ, (*p)->key);
-    } else {
-      bufferlist bl;
-      (*p)->blob_map.encode(bl);
-      dout(20) << "  bnode " << std::hex << (*p)->hash << std::dec
-	       << " blob_map is " << bl.length() << dendl;
-      t->set(PREFIX_OBJ, (*p)->key, bl);
+    if (p->second.blob < 0) {
+      continue;
+    }
+    BlobRef b = o->blob_map.get(p->second.blob);
+    assert(b);
+    _fault_range(o, p->first - p->second.offset,
+		 b->blob.get_logical_length());
+  }
+}
+
+void BlueStore::_split_extent_shards(OnodeRef& o)
+{
+  auto& shards = o->onode.extent_map_shards;
+  auto& state = o->extent_shards;
+
+  // a shard owns the lextents that start in it, and they may not run
+  // past its end.  cut any that were written (or merged by
+  // compress_extent_map) across a boundary.
+  for (unsigned i = 1; i < shards.size(); ++i) {
+    if (!state[i - 1].dirty && !state[i].dirty) {
+      continue;
+    }
+    uint64_t b = shards[i].offset;
+    auto p = o->onode.find_lextent(b - 1);
+    if (p == o->onode.extent_map.end() ||
+	p->first + p->second.length <= b) {
+      continue;
+    }
+    uint64_t front = b - p->first;
+    dout(20) << __func__ << " split 0x" << std::hex << p->first << std::dec
+	     << ": " << p->second << " at shard " << i << dendl;
+    o->onode.extent_map[b] = bluestore_lextent_t(
+      p->second.blob,
+      p->second.offset + front,
+      p->second.length - front);
+    p->second.length = front;
+    assert(state[i].loaded);
+    state[i].dirty = true;
+  }
+
+  // blobs now referenced from more than one shard move to the onode.
+  // only loaded shards can reference a blob that is not spanning yet, and
+  // every reference lies within the blob's logical range.
+  for (unsigned i = 0; i < shards.size(); ++i) {
+    if (!state[i].dirty) {
+      continue;
+    }
+    uint64_t start = shards[i].offset;
+    uint64_t end = i + 1 < shards.size() ? shards[i + 1].offset : EXTENT_MAP_END;
+    set<int64_t> checked;
+    for (auto p = o->onode.extent_map.lower_bound(start);
+	 p != o->onode.extent_map.end() && p->first < end;
+	 ++p) {
+      if (p->second.blob < 0 || !checked.insert(p->second.blob).second) {
+	continue;
+      }
+      BlobRef b = o->blob_map.get(p->second.blob);
+      assert(b);
+      if (b->spanning) {
+	continue;
+      }
+      uint64_t bstart = p->first - p->second.offset;
+      uint64_t bend = bstart + b->blob.get_logical_length();
+      if (bstart >= start && bend <= end) {
+	continue;
+      }
+      for (auto q = o->onode.seek_lextent(bstart);
+	   q != o->onode.extent_map.end() && q->first < bend;
+	   ++q) {
+	if (q->second.blob != b->id ||
+	    (q->first >= start && q->first < end)) {
+	  continue;
+	}
+	unsigned j = o->seek_shard(q->first);
+	dout(20) << __func__ << " blob " << *b << " is also in shard " << j
+		 << ", now spanning" << dendl;
+	b->spanning = true;
+	state[j].dirty = true;
+	break;
+      }
+    }
+  }
+}
+
+size_t BlueStore::_encode_extent_shard(OnodeRef& o, unsigned i,
+				       bufferlist& bl, unsigned *num)
+{
+  auto& shards = o->onode.extent_map_shards;
+  uint64_t start = shards[i].offset;
+  uint64_t end = i + 1 < shards.size() ? shards[i + 1].offset : EXTENT_MAP_END;
+
+  bl.clear();
+  o->onode.encode_lextents(start, end, bl);
+
+  set<int64_t> ids;
+  *num = 0;
+  for (auto p = o->onode.extent_map.lower_bound(start);
+       p != o->onode.extent_map.end() && p->first < end;
+       ++p) {
+    ++*num;
+    if (p->second.blob >= 0) {
+      ids.insert(p->second.blob);
+    }
+  }
+  vector<BlobRef> blobs;
+  size_t bound = sizeof(uint32_t);
+  for (auto id : ids) {
+    BlobRef b = o->blob_map.get(id);
+    assert(b);
+    if (!b->spanning) {
+      denc(b->id, bound);
+      denc(b->blob, bound);
+      blobs.push_back(b);
+    }
+  }
+  {
+    bufferlist::contiguous_appender app(bl, bound);
+    uint32_t n = blobs.size();
+    denc(n, app);
+    for (auto& b : blobs) {
+      denc(b->id, app);
+      denc(b->blob, app);
+    }
+  }
+  return bl.length();
+}
+
+void BlueStore::_write_extent_shards(OnodeRef& o, KeyValueDB::Transaction t)
+{
+  auto& shards = o->onode.extent_map_shards;
+  auto& state = o->extent_shards;
+  uint64_t max_size = g_conf->bluestore_extent_map_shard_max_size;
+  uint64_t min_size = g_conf->bluestore_extent_map_shard_min_size;
+
+  _split_extent_shards(o);
+
+  // encode the dirty shards, splitting the ones that grew too big in
+  // half and folding the ones that shrank too far into a neighbour.
+  vector<bufferlist> encoded(shards.size());
+  bool resharded = false;
+  unsigned i = 0;
+  while (i < shards.size()) {
+    if (!state[i].dirty) {
+      ++i;
+      continue;
+    }
+    unsigned num;
+    shards[i].bytes = _encode_extent_shard(o, i, encoded[i], &num);
+    if (shards[i].bytes > max_size && num > 1) {
+      auto p = o->onode.extent_map.lower_bound(shards[i].offset);
+      for (unsigned n = num / 2; n > 0; --n) {
+	++p;
+      }
+      if (p->first < EXTENT_SHARD_MAX_OFFSET) {
+	dout(20) << __func__ << " " << o->oid << " shard " << i << " is "
+		 << shards[i].bytes << " bytes, splitting at 0x" << std::hex
+		 << p->first << std::dec << dendl;
+	bluestore_onode_t::shard_info s;
+	s.offset = p->first;
+	s.bytes = shards[i].bytes;  // until it is encoded; see merge below
+	shards.insert(shards.begin() + i + 1, s);
+	Onode::extent_shard_t st = state[i];
+	state.insert(state.begin() + i + 1, st);
+	encoded.insert(encoded.begin() + i + 1, bufferlist());
+	resharded = true;
+	logger->inc(l_bluestore_onode_reshard);
+	continue;
+      }
+    }
+    if (shards[i].bytes < min_size && shards.size() > 1) {
+      // fold into the smaller neighbour, as long as that stays under max
+      unsigned j;
+      if (i == 0) {
+	j = 1;
+      } else if (i + 1 == shards.size()) {
+	j = i - 1;
+      } else {
+	j = shards[i - 1].bytes < shards[i + 1].bytes ? i - 1 : i + 1;
+      }
+      if (shards[i].bytes + shards[j].bytes <= max_size) {
+	unsigned keep = MIN(i, j), drop = MAX(i, j);
+	dout(20) << __func__ << " " << o->oid << " shard " << i << " is "
+		 << shards[i].bytes << " bytes, merging " << drop
+		 << " into " << keep << dendl;
+	_fault_range(o, shards[j].offset, 1);
+	string key;
+	get_extent_shard_key(o->key, shards[drop].offset, &key);
+	t->rmkey(PREFIX_EXTENT_SHARD, key);
+	shards[keep].bytes += shards[drop].bytes;
+	state[keep].dirty = true;
+	shards.erase(shards.begin() + drop);
+	state.erase(state.begin() + drop);
+	encoded.erase(encoded.begin() + drop);
+	resharded = true;
+	logger->inc(l_bluestore_onode_reshard);
+	i = keep;
+	continue;
+      }
+    }
+    ++i;
+  }
+
+  if (shards.size() == 1) {
+    // small enough to go back inline
+    dout(20) << __func__ << " " << o->oid << " unsharding" << dendl;
+    string key;
+    get_extent_shard_key(o->key, shards[0].offset, &key);
+    t->rmkey(PREFIX_EXTENT_SHARD, key);
+    shards.clear();
+    state.clear();
+    for (auto& b : o->blob_map.blob_map) {
+      b.spanning = false;
+    }
+    return;
+  }
+
+  if (resharded) {
+    // new boundaries may have cut through some blobs' references
+    _split_extent_shards(o);
+  }
+  for (i = 0; i < shards.size(); ++i) {
+    if (!state[i].dirty) {
+      continue;
+    }
+    unsigned num;
+    if (resharded) {
+      shards[i].bytes = _encode_extent_shard(o, i, encoded[i], &num);
     }
+    string key;
+    get_extent_shard_key(o->key, shards[i].offset, &key);
+    dout(20) << __func__ << " " << o->oid << " shard " << i << " 0x"
+	     << std::hex << shards[i].offset << std::dec << " is "
+	     << encoded[i].length() << " bytes" << dendl;
+    t->set(PREFIX_EXTENT_SHARD, key, encoded[i]);
+    logger->inc(l_bluestore_extent_shard_write_bytes, encoded[i].length());
+    state[i].dirty = false;
+  }
+}
+
+void BlueStore::_rmkey_extent_shards(OnodeRef& o, KeyValueDB::Transaction t)
+{
+  string key;
+  for (auto& s : o->onode.extent_map_shards) {
+    get_extent_shard_key(o->key, s.offset, &key);
+    t->rmkey(PREFIX_EXTENT_SHARD, key);
   }
 }
 
@@ -5061,9 +6598,7 @@ void BlueStore::_osr_reap_done(OpSequencer *osr)
   }
 
   if (c) {
-    c->cache->trim(
-      g_conf->bluestore_onode_cache_size,
-      g_conf->bluestore_buffer_cache_size);
+    _trim_cache(c->cache);
   }
 }
 
@@ -5074,6 +6609,8 @@ void BlueStore::_txc_finalize_kv(TransContext *txc, KeyValueDB::Transaction t)
 	   << " released 0x" << txc->released
 	   << std::dec << dendl;
 
+  _txc_finalize_pack(txc, t);
+
   // We have to handle the case where we allocate *and* deallocate the
   // same region in this transaction.  The freelist doesn't like that.
   // (Actually, the only thing that cares is the BitmapFreelistManager
@@ -5131,12 +6668,29 @@ void BlueStore::_kv_sync_thread()
   while (true) {
     assert(kv_committing.empty());
     assert(wal_cleaning.empty());
+    bool deferred = false;
+    double deferred_wait = 0;
+    if (wal_batch_ops) {
+      // submitting may complete wal txcs inline, which takes kv_lock
+      bool force = kv_stop;
+      deferred_kick = false;
+      l.unlock();
+      deferred = _deferred_try_submit(force, &deferred_wait);
+      l.lock();
+    }
     if (kv_queue.empty() && wal_cleanup_queue.empty()) {
-      if (kv_stop)
+      if (deferred_kick)
+	continue;
+      // finalizing may still queue wal work for us
+      if (kv_stop && !deferred && _kv_finalize_idle())
 	break;
       dout(20) << __func__ << " sleep" << dendl;
       kv_sync_cond.notify_all();
-      kv_cond.wait(l);
+      if (deferred_wait > 0) {
+	kv_cond.wait_for(l, std::chrono::duration<double>(deferred_wait));
+      } else {
+	kv_cond.wait(l);
+      }
       dout(20) << __func__ << " wake" << dendl;
     } else {
       dout(20) << __func__ << " committing " << kv_queue.size()
@@ -5153,6 +6707,8 @@ void BlueStore::_kv_sync_thread()
 
       // flush/barrier on block device
       bdev->flush();
+      utime_t after_flush = ceph_clock_now(NULL);
+      logger->tinc(l_bluestore_kv_flush_lat, after_flush - start);
 
       if (!g_conf->bluestore_sync_transaction &&
 	  !g_conf->bluestore_sync_submit_transaction) {
@@ -5196,29 +6752,42 @@ void BlueStore::_kv_sync_thread()
 	get_wal_key(wt.seq, &key);
 	t->rm_single_key(PREFIX_WAL, key);
       }
+      utime_t before_commit = ceph_clock_now(NULL);
       int r = db->submit_transaction_sync(t);
       assert(r == 0);
 
       utime_t finish = ceph_clock_now(NULL);
       utime_t dur = finish - start;
+      logger->tinc(l_bluestore_kv_commit_lat, finish - before_commit);
+      logger->tinc(l_bluestore_kv_lat, dur);
       dout(20) << __func__ << " committed " << kv_committing.size()
 	       << " cleaned " << wal_cleaning.size()
 	       << " in " << dur << dendl;
-      while (!kv_committing.empty()) {
-	TransContext *txc = kv_committing.front();
-	_txc_state_proc(txc);
-	kv_committing.pop_front();
-      }
-      while (!wal_cleaning.empty()) {
-	TransContext *txc = wal_cleaning.front();
-	_txc_state_proc(txc);
-	wal_cleaning.pop_front();
-      }
 
-      alloc->commit_finish();
+      {
+	std::lock_guard<std::mutex> fl(kv_finalize_lock);
+	if (kv_committing_to_finalize.empty()) {
+	  kv_committing_to_finalize.swap(kv_committing);
+	} else {
+	  kv_committing_to_finalize.insert(
+	    kv_committing_to_finalize.end(),
+	    kv_committing.begin(),
+	    kv_committing.end());
+	  kv_committing.clear();
+	}
+	if (wal_cleaning_to_finalize.empty()) {
+	  wal_cleaning_to_finalize.swap(wal_cleaning);
+	} else {
+	  wal_cleaning_to_finalize.insert(
+	    wal_cleaning_to_finalize.end(),
+	    wal_cleaning.begin(),
+	    wal_cleaning.end());
+	  wal_cleaning.clear();
+	}
+	kv_finalize_cond.notify_one();
+      }
 
-      // this is as good a place as any ...
-      _reap_collections();
+      alloc->commit_finish();
 
       if (bluefs) {
 	if (!bluefs_gift_extents.empty()) {
@@ -5232,6 +6801,88 @@ void BlueStore::_kv_sync_thread()
   dout(10) << __func__ << " finish" << dendl;
 }
 
+void BlueStore::_kv_finalize_thread()
+{
+  deque<TransContext*> kv_committed, wal_cleaned;
+  dout(10) << __func__ << " start" << dendl;
+  std::unique_lock<std::mutex> l(kv_finalize_lock);
+  while (true) {
+    assert(kv_committed.empty());
+    assert(wal_cleaned.empty());
+    if (kv_committing_to_finalize.empty() &&
+	wal_cleaning_to_finalize.empty()) {
+      if (kv_finalize_stop)
+	break;
+      dout(20) << __func__ << " sleep" << dendl;
+      kv_finalize_sync_cond.notify_all();
+      kv_finalize_cond.wait(l);
+      dout(20) << __func__ << " wake" << dendl;
+    } else {
+      dout(20) << __func__ << " kv_committed " << kv_committing_to_finalize
+	       << " wal_cleaned " << wal_cleaning_to_finalize << dendl;
+      kv_committed.swap(kv_committing_to_finalize);
+      wal_cleaned.swap(wal_cleaning_to_finalize);
+      kv_finalize_in_progress = true;
+      utime_t start = ceph_clock_now(NULL);
+      l.unlock();
+
+      while (!kv_committed.empty()) {
+	TransContext *txc = kv_committed.front();
+	_txc_state_proc(txc);
+	kv_committed.pop_front();
+      }
+      while (!wal_cleaned.empty()) {
+	TransContext *txc = wal_cleaned.front();
+	_txc_state_proc(txc);
+	wal_cleaned.pop_front();
+      }
+
+      // this is as good a place as any ...
+      _reap_collections();
+
+      logger->tinc(l_bluestore_kv_finalize_lat,
+		   ceph_clock_now(NULL) - start);
+
+      l.lock();
+      kv_finalize_in_progress = false;
+      l.unlock();
+
+      // a stopping kv_sync thread waits for us to go idle
+      {
+	std::lock_guard<std::mutex> kl(kv_lock);
+	if (kv_stop)
+	  kv_cond.notify_all();
+      }
+      l.lock();
+    }
+  }
+  dout(10) << __func__ << " finish" << dendl;
+}
+
+void *BlueStore::MempoolThread::entry()
+{
+  Mutex::Locker l(lock);
+  utime_t next_balance = ceph_clock_now(g_ceph_context);
+  next_balance += g_conf->bluestore_cache_autotune_interval;
+  while (!stop) {
+    store->_update_bytes_per_onode();
+    utime_t now = ceph_clock_now(g_ceph_context);
+    if (now >= next_balance) {
+      store->_balance_cache();
+      store->_balance_cache_shards();
+      next_balance = now;
+      next_balance += g_conf->bluestore_cache_autotune_interval;
+    }
+    for (auto i : store->cache_shards) {
+      store->_trim_cache(i);
+    }
+    utime_t wait;
+    wait += g_conf->bluestore_cache_trim_interval;
+    cond.WaitInterval(g_ceph_context, lock, wait);
+  }
+  return NULL;
+}
+
 bluestore_wal_op_t *BlueStore::_get_wal_op(TransContext *txc, OnodeRef o)
 {
   if (!txc->wal_txn) {
@@ -5315,6 +6966,213 @@ int BlueStore::_do_wal_op(TransContext *txc, bluestore_wal_op_t& wo)
   return 0;
 }
 
+void BlueStore::DeferredBatch::prepare_write(uint64_t offset, bufferlist& bl)
+{
+  uint64_t end = offset + bl.length();
+  auto p = extents.lower_bound(offset);
+  if (p != extents.begin()) {
+    --p;
+    uint64_t pend = p->first + p->second.length();
+    if (pend <= offset) {
+      ++p;
+    } else {
+      // p starts before us; keep its head, and its tail if it covers us
+      if (pend > end) {
+	bufferlist tail;
+	tail.substr_of(p->second, end - p->first, pend - end);
+	extents[end].swap(tail);
+      }
+      bufferlist head;
+      head.substr_of(p->second, 0, offset - p->first);
+      p->second.swap(head);
+      ++p;
+    }
+  }
+  while (p != extents.end() && p->first < end) {
+    uint64_t pend = p->first + p->second.length();
+    if (pend <= end) {
+      extents.erase(p++);
+      continue;
+    }
+    bufferlist tail;
+    tail.substr_of(p->second, end - p->first, pend - end);
+    extents.erase(p);
+    extents[end].swap(tail);
+    break;
+  }
+  extents[offset] = bl;
+}
+
+void BlueStore::_deferred_queue(TransContext *txc)
+{
+  bluestore_wal_transaction_t& wt = *txc->wal_txn;
+  dout(20) << __func__ << " txc " << txc << " seq " << wt.seq << dendl;
+
+  if (g_conf->bluestore_inject_wal_apply_delay) {
+    dout(20) << __func__ << " bluestore_inject_wal_apply_delay "
+	     << g_conf->bluestore_inject_wal_apply_delay
+	     << dendl;
+    utime_t t;
+    t.set_from_double(g_conf->bluestore_inject_wal_apply_delay);
+    t.sleep();
+    dout(20) << __func__ << " finished sleep" << dendl;
+  }
+
+  {
+    std::lock_guard<std::mutex> l(deferred_lock);
+    if (!deferred_pending) {
+      deferred_pending = new DeferredBatch;
+      deferred_pending->start = ceph_clock_now(g_ceph_context);
+    }
+    DeferredBatch *b = deferred_pending;
+    b->txcs.push_back(txc);
+    for (auto& wo : wt.ops) {
+      switch (wo.op) {
+      case bluestore_wal_op_t::OP_WRITE:
+	{
+	  dout(20) << __func__ << " write " << wo.extents << dendl;
+	  logger->inc(l_bluestore_wal_write_ops);
+	  logger->inc(l_bluestore_wal_write_bytes, wo.data.length());
+	  bufferlist::iterator p = wo.data.begin();
+	  for (auto& e : wo.extents) {
+	    bufferlist bl;
+	    p.copy(e.length, bl);
+	    b->prepare_write(e.offset, bl);
+	  }
+	}
+	break;
+
+      default:
+	assert(0 == "unrecognized wal op");
+      }
+      ++b->num_ops;
+    }
+  }
+
+  // the kv thread decides when to submit
+  std::lock_guard<std::mutex> l(kv_lock);
+  deferred_kick = true;
+  kv_cond.notify_one();
+}
+
+bool BlueStore::_deferred_try_submit(bool force, double *wait)
+{
+  DeferredBatch *b = nullptr;
+  bool busy;
+  {
+    std::lock_guard<std::mutex> l(deferred_lock);
+    if (deferred_pending &&
+	deferred_running.size() < g_conf->bluestore_wal_batch_max_inflight) {
+      double age = ceph_clock_now(g_ceph_context) - deferred_pending->start;
+      double max_age = g_conf->bluestore_wal_batch_max_age;
+      if (force || deferred_pending->num_ops >= wal_batch_ops ||
+	  age >= max_age) {
+	// a batch that overwrites blocks an earlier one is still writing
+	// must not race with it; wait for that one to complete (which
+	// wakes us up again)
+	interval_set<uint64_t> ranges;
+	for (auto& p : deferred_pending->extents) {
+	  ranges.insert(p.first, p.second.length());
+	}
+	bool overlaps = false;
+	for (auto r : deferred_running) {
+	  interval_set<uint64_t> both;
+	  both.intersection_of(ranges, r->ranges);
+	  if (!both.empty()) {
+	    overlaps = true;
+	    break;
+	  }
+	}
+	if (overlaps) {
+	  dout(20) << __func__ << " pending batch overlaps one in flight"
+		   << dendl;
+	} else {
+	  b = deferred_pending;
+	  b->ranges.swap(ranges);
+	  deferred_running.push_back(b);
+	  deferred_pending = nullptr;
+	}
+      } else {
+	*wait = max_age - age;
+      }
+    }
+    busy = deferred_pending || !deferred_running.empty();
+  }
+  if (b && !_deferred_submit(b)) {
+    // nothing went async (e.g., no libaio); we own completion
+    _deferred_aio_finish(b);
+  }
+  return busy;
+}
+
+bool BlueStore::_deferred_submit(DeferredBatch *b)
+{
+  dout(10) << __func__ << " " << b->txcs.size() << " txcs "
+	   << b->num_ops << " ops "
+	   << b->extents.size() << " extents" << dendl;
+  for (auto txc : b->txcs) {
+    txc->log_state_latency(logger, l_bluestore_state_wal_queued_lat);
+    txc->state = TransContext::STATE_WAL_AIO_WAIT;
+  }
+
+  // merge adjacent extents into single writes
+  uint64_t aios = 0, bytes = 0;
+  auto p = b->extents.begin();
+  while (p != b->extents.end()) {
+    uint64_t offset = p->first;
+    bufferlist bl;
+    while (p != b->extents.end() &&
+	   p->first == offset + bl.length()) {
+      bl.claim_append(p->second);
+      ++p;
+    }
+    dout(20) << __func__ << " write 0x" << std::hex << offset << "~"
+	     << bl.length() << std::dec << dendl;
+    bytes += bl.length();
+    ++aios;
+    int r = bdev->aio_write(offset, bl, &b->ioc, false);
+    assert(r == 0);
+  }
+  b->extents.clear();
+
+  logger->inc(l_bluestore_wal_batch_ops, b->num_ops);
+  logger->inc(l_bluestore_wal_batch_aios, aios);
+  logger->inc(l_bluestore_wal_batch_bytes, bytes);
+  b->start = ceph_clock_now(g_ceph_context);
+  if (!b->ioc.has_aios()) {
+    return false;
+  }
+  bdev->aio_submit(&b->ioc);
+  return true;
+}
+
+void BlueStore::_deferred_aio_finish(DeferredBatch *b)
+{
+  dout(10) << __func__ << " " << b->txcs.size() << " txcs" << dendl;
+  logger->tinc(l_bluestore_wal_batch_lat,
+	       ceph_clock_now(g_ceph_context) - b->start);
+
+  // retire batches in the order they were submitted, one thread at a
+  // time, so that txcs finish their wal (and free the space they
+  // release) in the same order as with a single batch in flight
+  std::unique_lock<std::mutex> l(deferred_lock);
+  b->io_done = true;
+  if (deferred_finishing)
+    return;  // whoever is retiring will pick us up
+  deferred_finishing = true;
+  while (!deferred_running.empty() && deferred_running.front()->io_done) {
+    DeferredBatch *d = deferred_running.front();
+    deferred_running.pop_front();
+    l.unlock();
+    for (auto txc : d->txcs) {
+      _txc_state_proc(txc);
+    }
+    delete d;
+    l.lock();
+  }
+  deferred_finishing = false;
+}
+
 int BlueStore::_wal_replay()
 {
   dout(10) << __func__ << " start" << dendl;
@@ -5381,9 +7239,58 @@ int BlueStore::queue_transactions(
   txc->oncommit = ondisk;
 
   for (vector<Transaction>::iterator p = tls.begin(); p != tls.end(); ++p) {
-    (*p).set_osr(osr);
     txc->ops += (*p).get_num_ops();
     txc->bytes += (*p).get_num_bytes();
+  }
+
+  throttle_ops.get(txc->ops);
+  throttle_bytes.get(txc->bytes);
+  throttle_wal_ops.get(txc->ops);
+  throttle_wal_bytes.get(txc->bytes);
+
+  // compress big writes on compress_tp before applying anything.  the
+  // txc is parked until they are done, and so is every later txc on this
+  // osr, so ops still apply in order.
+  if (compress_tp.get_num_threads() > 0) {
+    for (vector<Transaction>::iterator p = tls.begin(); p != tls.end(); ++p) {
+      _txc_prepare_compress(txc, &(*p));
+    }
+  }
+  vector<CompressJob*> jobs;
+  for (auto& j : txc->compress_jobs) {
+    jobs.push_back(&j);
+  }
+  bool parked = false;
+  {
+    std::lock_guard<std::mutex> l(osr->qlock);
+    if (!jobs.empty() || !osr->parked.empty()) {
+      txc->tls = std::move(tls);
+      txc->compress_pending = jobs.size();
+      osr->parked.push_back(txc);
+      parked = true;
+    }
+  }
+  if (parked) {
+    dout(20) << __func__ << " txc " << txc << " parked with " << jobs.size()
+	     << " compress jobs" << dendl;
+    // txc may be applied and gone as soon as the last job is queued
+    for (auto j : jobs) {
+      compress_wq.queue(j);
+    }
+    return 0;
+  }
+
+  _txc_build(txc, tls);
+
+  // execute (start)
+  _txc_state_proc(txc);
+  return 0;
+}
+
+void BlueStore::_txc_build(TransContext *txc, vector<Transaction>& tls)
+{
+  for (vector<Transaction>::iterator p = tls.begin(); p != tls.end(); ++p) {
+    (*p).set_osr(txc->osr.get());
     _txc_add_transaction(txc, &(*p));
   }
 
@@ -5410,15 +7317,183 @@ int BlueStore::queue_transactions(
     get_wal_key(txc->wal_txn->seq, &key);
     txc->t->set(PREFIX_WAL, key, bl);
   }
+}
 
-  throttle_ops.get(txc->ops);
-  throttle_bytes.get(txc->bytes);
-  throttle_wal_ops.get(txc->ops);
-  throttle_wal_bytes.get(txc->bytes);
+void BlueStore::_txc_compress_done(TransContext *txc)
+{
+  OpSequencerRef osr = txc->osr;
+  {
+    std::lock_guard<std::mutex> l(osr->qlock);
+    assert(txc->compress_pending > 0);
+    if (--txc->compress_pending > 0) {
+      return;
+    }
+  }
+  _osr_resume_parked(osr.get());
+}
 
-  // execute (start)
-  _txc_state_proc(txc);
-  return 0;
+void BlueStore::_osr_resume_parked(OpSequencer *osr)
+{
+  // one thread at a time applies parked txcs, in order; whoever readies
+  // the head while it is busy leaves it to pick that up
+  std::unique_lock<std::mutex> l(osr->qlock);
+  if (osr->resuming) {
+    return;
+  }
+  osr->resuming = true;
+  while (!osr->parked.empty() && osr->parked.front()->compress_pending == 0) {
+    TransContext *txc = osr->parked.front();
+    l.unlock();
+    dout(20) << __func__ << " txc " << txc << dendl;
+    _txc_build(txc, txc->tls);
+    txc->tls.clear();
+    txc->compress_jobs.clear();  // any we guessed wrong
+    l.lock();
+    // only now may later txcs skip the queue
+    osr->parked.pop_front();
+    l.unlock();
+    _txc_state_proc(txc);
+    l.lock();
+  }
+  osr->resuming = false;
+}
+
+void BlueStore::_txc_prepare_compress(TransContext *txc, Transaction *t)
+{
+  // _do_write_big cuts the blobs of a write once the txc is applied; guess
+  // them here from the ops alone.  alloc hints set earlier in the same
+  // transaction are taken into account, ones already on the onode are
+  // not.  a wrong guess costs only time: _take_compressed only hands out
+  // a result whose input matches a blob byte for byte.
+  CompressorRef c = compressor;
+  if (!c || comp_mode == COMP_NONE) {
+    return;
+  }
+  map<pair<uint32_t,uint32_t>,uint32_t> hints;
+  Transaction::iterator i = t->begin();
+  try {
+    while (i.have_op()) {
+      Transaction::Op *op = i.decode_op();
+      uint32_t cid = op->cid, oid = op->oid;
+      pair<uint32_t,uint32_t> obj(cid, oid);
+      // keep the data iterator in step with _txc_add_transaction
+      switch (op->op) {
+      case Transaction::OP_WRITE:
+	{
+	  bufferlist bl;
+	  i.decode_bl(bl);
+	  if (bl.length() != op->len) {
+	    break;
+	  }
+	  auto h = hints.find(obj);
+	  _txc_prepare_compress_write(
+	    txc, c, i.get_cid(cid), op->off, bl,
+	    h == hints.end() ? 0 : h->second);
+	}
+	break;
+
+      case Transaction::OP_SETALLOCHINT:
+	hints[obj] = op->alloc_hint_flags;
+	break;
+
+      case Transaction::OP_COLL_HINT:
+      case Transaction::OP_OMAP_SETHEADER:
+	{
+	  bufferlist bl;
+	  i.decode_bl(bl);
+	}
+	break;
+
+      case Transaction::OP_SETATTR:
+	{
+	  i.decode_string();
+	  bufferlist bl;
+	  i.decode_bl(bl);
+	}
+	break;
+
+      case Transaction::OP_SETATTRS:
+	{
+	  map<string,bufferptr> aset;
+	  i.decode_attrset(aset);
+	}
+	break;
+
+      case Transaction::OP_RMATTR:
+	i.decode_string();
+	break;
+
+      case Transaction::OP_OMAP_SETKEYS:
+	{
+	  bufferlist bl;
+	  i.decode_attrset_bl(&bl);
+	}
+	break;
+
+      case Transaction::OP_OMAP_RMKEYS:
+	{
+	  bufferlist bl;
+	  i.decode_keyset_bl(&bl);
+	}
+	break;
+
+      case Transaction::OP_OMAP_RMKEYRANGE:
+	i.decode_string();
+	i.decode_string();
+	break;
+
+      case Transaction::OP_COLL_SETATTR:
+      case Transaction::OP_COLL_RMATTR:
+      case Transaction::OP_COLL_RENAME:
+	// not supported; _txc_add_transaction will complain
+	return;
+      }
+    }
+  } catch (buffer::error& e) {
+    dout(10) << __func__ << " txc " << txc << " stopped guessing: "
+	     << e.what() << dendl;
+  }
+}
+
+void BlueStore::_txc_prepare_compress_write(
+  TransContext *txc,
+  CompressorRef& c,
+  const coll_t& cid,
+  uint64_t offset,
+  bufferlist& bl,
+  unsigned alloc_hints)
+{
+  // mirrors the head/middle/tail split in _do_write and the blob cut in
+  // _do_write_big
+  uint64_t length = bl.length();
+  uint64_t end = offset + length;
+  if (length == 0 || !_want_compress(alloc_hints) ||
+      (offset / min_alloc_size == (end - 1) / min_alloc_size &&
+       length != min_alloc_size)) {
+    return;
+  }
+  uint64_t head_length = P2NPHASE(offset, min_alloc_size);
+  uint64_t tail_length = P2PHASE(end, min_alloc_size);
+  uint64_t middle_length = length - head_length - tail_length;
+  uint64_t max_blob_len = MIN(middle_length,
+			      _want_large_blobs(alloc_hints) ?
+			      comp_max_blob_size : comp_min_blob_size);
+  spg_t pgid;
+  int64_t pool = cid.is_pg(&pgid) ? pgid.pool() : -1;
+  uint64_t pos = head_length;
+  while (middle_length > 0) {
+    uint64_t l = MIN(max_blob_len, middle_length);
+    if (l > min_alloc_size) {
+      txc->compress_jobs.emplace_back();
+      CompressJob& j = txc->compress_jobs.back();
+      j.txc = txc;
+      j.c = c;
+      j.pool = pool;
+      j.in.substr_of(bl, pos, l);
+    }
+    pos += l;
+    middle_length -= l;
+  }
 }
 
 void BlueStore::_txc_aio_submit(TransContext *txc)
@@ -6120,6 +8195,35 @@ void BlueStore::_do_write_small(
     ++ep;
   }
 
+  // nothing else (that we are not overwriting) in this allocation unit
+  // of the object: a packed blob just big enough for the data will do.
+  // otherwise the object is filling the unit in, so give it a whole one
+  // that later small writes can go straight into.
+  uint64_t pack_start = P2ALIGN(offset, block_size);
+  uint64_t pack_len = P2ROUNDUP(end, block_size) - pack_start;
+  uint64_t unit_start = P2ALIGN(offset, min_alloc_size);
+  uint64_t unit_end = unit_start + min_alloc_size;
+  if (g_conf->bluestore_pack_small_blobs &&
+      ondisk_format >= 2 &&
+      pack_len < min_alloc_size &&
+      !o->onode.has_any_lextents(unit_start, offset - unit_start) &&
+      !o->onode.has_any_lextents(end, unit_end - end)) {
+    b = o->blob_map.new_blob(c->cache);
+    uint64_t b_off = offset - pack_start;
+    _buffer_cache_write(txc, b, b_off, bl, wctx->buffered ? 0 : Buffer::FLAG_NOCACHE);
+    _pad_zeros(&bl, &b_off, block_size);
+    assert(b_off == 0 && bl.length() == pack_len);
+    bluestore_lextent_t lex(b->id, offset - pack_start, length);
+    o->onode.set_lextent(offset, lex, &b->blob, &wctx->lex_old);
+    txc->statfs_delta.stored() += lex.length;
+    dout(20) << __func__ << "  lex 0x" << std::hex << offset << std::dec
+	     << ": " << lex << dendl;
+    dout(20) << __func__ << "  packed " << b->id << ": " << *b << dendl;
+    wctx->write(b, pack_len, 0, bl, false, true);
+    logger->inc(l_bluestore_write_small_packed);
+    return;
+  }
+
   // new blob.
   b = o->blob_map.new_blob(c->cache);
   unsigned alloc_len = min_alloc_size;
@@ -6170,8 +8274,112 @@ void BlueStore::_do_write_big(
   }
 }
 
+bool BlueStore::_want_compress(unsigned alloc_hints)
+{
+  return
+    (comp_mode == COMP_FORCE) ||
+    (comp_mode == COMP_AGGRESSIVE &&
+     (alloc_hints & CEPH_OSD_ALLOC_HINT_FLAG_INCOMPRESSIBLE) == 0) ||
+    (comp_mode == COMP_PASSIVE &&
+     (alloc_hints & CEPH_OSD_ALLOC_HINT_FLAG_COMPRESSIBLE));
+}
+
+bool BlueStore::_want_large_blobs(unsigned alloc_hints)
+{
+  return
+    (alloc_hints & CEPH_OSD_ALLOC_HINT_FLAG_SEQUENTIAL_READ) &&
+    (alloc_hints & CEPH_OSD_ALLOC_HINT_FLAG_RANDOM_READ) == 0 &&
+    (alloc_hints & (CEPH_OSD_ALLOC_HINT_FLAG_IMMUTABLE|
+		    CEPH_OSD_ALLOC_HINT_FLAG_APPEND_ONLY)) &&
+    (alloc_hints & CEPH_OSD_ALLOC_HINT_FLAG_RANDOM_WRITE) == 0;
+}
+
+void BlueStore::_compress(CompressJob *j)
+{
+  utime_t start = ceph_clock_now(g_ceph_context);
+  uint64_t len = j->in.length();
+  PerfCounters *plogger = _get_pool_logger(j->pool);
+
+  // incompressible data usually looks that way throughout, so try a few
+  // slices spread across the blob before paying for the whole thing
+  const unsigned slices = 4;
+  uint64_t sample = g_conf->bluestore_compression_sample_size;
+  if (sample && len >= sample * slices) {
+    uint64_t slice = sample / slices;
+    bufferlist s, t;
+    for (unsigned i = 0; i < slices; ++i) {
+      bufferlist sl;
+      sl.substr_of(j->in, (len - slice) * i / (slices - 1), slice);
+      s.claim_append(sl);
+    }
+    // compress the sample the way the blob will be: a pool dictionary
+    // only applies up to compressor_zstd_dict_max_size, and would make
+    // a big blob look better than it is
+    int r;
+    if (len <= g_conf->compressor_zstd_dict_max_size)
+      r = j->c->compress_for_pool(j->pool, s, t);
+    else
+      r = j->c->compress(s, t);
+    if (r < 0 ||
+	t.length() > s.length() * g_conf->bluestore_compression_required_ratio) {
+      dout(20) << __func__ << " sample 0x" << std::hex << s.length()
+	       << " -> 0x" << t.length() << std::dec
+	       << ", skipping 0x" << std::hex << len << std::dec << dendl;
+      j->sample_rejected = true;
+      utime_t lat = ceph_clock_now(g_ceph_context) - start;
+      logger->tinc(l_bluestore_compress_lat, lat);
+      if (plogger)
+	plogger->tinc(l_bluestore_pool_compress_lat, lat);
+      return;
+    }
+  }
+
+  bluestore_compression_header_t chdr;
+  chdr.type = bluestore_blob_t::get_comp_alg_type(j->c->get_type());
+  // FIXME: memory alignment here is bad
+  bufferlist t;
+  int r = j->c->compress_for_pool(j->pool, j->in, t);
+  if (r < 0) {
+    derr << __func__ << " compress of 0x" << std::hex << len << std::dec
+	 << " failed: " << cpp_strerror(r) << dendl;
+  } else {
+    chdr.length = t.length();
+    ::encode(chdr, j->out);
+    j->out.claim_append(t);
+  }
+  utime_t lat = ceph_clock_now(g_ceph_context) - start;
+  logger->tinc(l_bluestore_compress_lat, lat);
+  if (plogger)
+    plogger->tinc(l_bluestore_pool_compress_lat, lat);
+}
+
+bool BlueStore::_take_compressed(
+  TransContext *txc,
+  CompressorRef& c,
+  int64_t pool,
+  bufferlist& in,
+  CompressJob *j)
+{
+  // normally the first one, as blobs are cut in the order we guessed them
+  for (auto p = txc->compress_jobs.begin();
+       p != txc->compress_jobs.end();
+       ++p) {
+    if (p->c == c &&
+	p->pool == pool &&
+	p->in.length() == in.length() &&
+	p->in.contents_equal(in)) {
+      j->out.claim(p->out);
+      j->sample_rejected = p->sample_rejected;
+      txc->compress_jobs.erase(p);
+      return true;
+    }
+  }
+  return false;
+}
+
 int BlueStore::_do_alloc_write(
   TransContext *txc,
+  CollectionRef& c,
   WriteContext *wctx)
 {
   dout(20) << __func__ << " txc " << txc
@@ -6180,7 +8388,8 @@ int BlueStore::_do_alloc_write(
 
   uint64_t need = 0;
   for (auto &wi : wctx->writes) {
-    need += wi.blob_length;
+    if (!wi.packed)
+      need += wi.blob_length;
   }
   int r = alloc->reserve(need);
   if (r < 0) {
@@ -6189,6 +8398,18 @@ int BlueStore::_do_alloc_write(
     return r;
   }
 
+  CompressorRef comp;
+  int64_t pool = -1;
+  PerfCounters *plogger = nullptr;
+  if (wctx->compress) {
+    comp = compressor;
+    spg_t pgid;
+    if (c->cid.is_pg(&pgid)) {
+      pool = pgid.pool();
+    }
+    plogger = _get_pool_logger(pool);
+  }
+
   uint64_t hint = 0;
   for (auto& wi : wctx->writes) {
     BlobRef b = wi.b;
@@ -6197,28 +8418,25 @@ int BlueStore::_do_alloc_write(
     uint64_t final_length = wi.blob_length;
     uint64_t csum_length = wi.blob_length;
     unsigned csum_order = block_size_order;
-    bufferlist compressed_bl;
-    CompressorRef c;
     bool compressed = false;
-    if (wctx->compress &&
-	wi.blob_length > min_alloc_size &&
-	(c = compressor) != nullptr) {
-
-      utime_t start = ceph_clock_now(g_ceph_context);
-
-      // compress
+    CompressJob j;
+    if (comp && wi.blob_length > min_alloc_size) {
       assert(b_off == 0);
       assert(wi.blob_length == l->length());
-      bluestore_compression_header_t chdr;
-      chdr.type = bluestore_blob_t::get_comp_alg_type(c->get_type());
-      // FIXME: memory alignment here is bad
-      bufferlist t;
-
-      c->compress(*l, t);
-
-      chdr.length = t.length();
-      ::encode(chdr, compressed_bl);
-      compressed_bl.claim_append(t);
+      if (!_take_compressed(txc, comp, pool, wi.bl, &j)) {
+	j.c = comp;
+	j.pool = pool;
+	j.in = wi.bl;
+	_compress(&j);
+	logger->inc(l_bluestore_compress_inline_count);
+      }
+    }
+    if (j.sample_rejected) {
+      logger->inc(l_bluestore_compress_sample_rejected_count);
+      if (plogger)
+	plogger->inc(l_bluestore_pool_compress_sample_rejected_count);
+    } else if (j.out.length()) {
+      bufferlist& compressed_bl = j.out;
       uint64_t rawlen = compressed_bl.length();
       uint64_t newlen = P2ROUNDUP(rawlen, min_alloc_size);
       uint64_t dstlen = final_length *
@@ -6231,7 +8449,7 @@ int BlueStore::_do_alloc_write(
 	logger->inc(l_bluestore_write_pad_bytes, newlen - rawlen);
 	dout(20) << __func__ << hex << "  compressed 0x" << wi.blob_length
 		 << " -> 0x" << rawlen << " => 0x" << newlen
-		 << " with " << chdr.type
+		 << " with " << comp->get_type()
 		 << dec << dendl;
 	txc->statfs_delta.compressed() += rawlen;
 	txc->statfs_delta.compressed_original() += l->length();
@@ -6243,14 +8461,23 @@ int BlueStore::_do_alloc_write(
 	b->blob.set_compressed(wi.blob_length, rawlen);
 	compressed = true;
         logger->inc(l_bluestore_compress_success_count);
+	logger->inc(l_bluestore_compress_in_bytes, wi.blob_length);
+	logger->inc(l_bluestore_compress_out_bytes, rawlen);
+	if (plogger) {
+	  plogger->inc(l_bluestore_pool_compress_success_count);
+	  plogger->inc(l_bluestore_pool_compress_in_bytes, wi.blob_length);
+	  plogger->inc(l_bluestore_pool_compress_out_bytes, rawlen);
+	}
       } else {
 	dout(20) << __func__ << hex << "  compressed 0x" << l->length()
-                 << " -> 0x" << rawlen << " with " << chdr.type
+                 << " -> 0x" << rawlen << " with " << comp->get_type()
                  << ", which is more than required 0x" << dstlen
                  << ", leaving uncompressed"
                  << dec << dendl;
+	logger->inc(l_bluestore_compress_rejected_count);
+	if (plogger)
+	  plogger->inc(l_bluestore_pool_compress_rejected_count);
       }
-      logger->tinc(l_bluestore_compress_lat, ceph_clock_now(g_ceph_context) - start);
     }
     if (!compressed) {
       b->blob.set_flag(bluestore_blob_t::FLAG_MUTABLE);
@@ -6265,21 +8492,36 @@ int BlueStore::_do_alloc_write(
       }
     }
 
-    int count = 0;
-    std::vector<AllocExtent> extents = 
-                std::vector<AllocExtent>(final_length / min_alloc_size);
+    if (wi.packed) {
+      uint64_t offset;
+      int r = _pack_alloc(final_length, &offset);
+      if (r < 0) {
+	derr << __func__ << " failed to allocate packed 0x" << std::hex
+	     << final_length << std::dec << dendl;
+	if (need > 0)
+	  alloc->unreserve(need);
+	return r;
+      }
+      txc->allocated.insert(offset, final_length);
+      txc->statfs_delta.allocated() += final_length;
+      b->blob.extents.push_back(bluestore_pextent_t(offset, final_length));
+    } else {
+      int count = 0;
+      std::vector<AllocExtent> extents =
+		  std::vector<AllocExtent>(final_length / min_alloc_size);
 
-    int r = alloc->alloc_extents(final_length, min_alloc_size, max_alloc_size,
-                                 hint, &extents, &count);
+      int r = alloc->alloc_extents(final_length, min_alloc_size, max_alloc_size,
+				   hint, &extents, &count);
 
-    need -= final_length;
-    assert(r == 0);
-    for (int i = 0; i < count; i++) {
-      bluestore_pextent_t e = bluestore_pextent_t(extents[i]);
-      txc->allocated.insert(e.offset, e.length);
-      txc->statfs_delta.allocated() += e.length;
-      b->blob.extents.push_back(e);
-      hint = e.end();
+      need -= final_length;
+      assert(r == 0);
+      for (int i = 0; i < count; i++) {
+	bluestore_pextent_t e = bluestore_pextent_t(extents[i]);
+	txc->allocated.insert(e.offset, e.length);
+	txc->statfs_delta.allocated() += e.length;
+	b->blob.extents.push_back(e);
+	hint = e.end();
+      }
     }
 
     dout(20) << __func__ << " blob " << *b
@@ -6350,7 +8592,7 @@ void BlueStore::_wctx_finish(
       }
     }
     if (l.blob < 0) {
-      txc->write_bnode(o->bnode);
+      txc->write_shared_blob(o->bnode, b);
     }
   }
   for (auto br : blobs2remove) {
@@ -6359,6 +8601,7 @@ void BlueStore::_wctx_finish(
     if (br.first) {
       o->blob_map.erase(br.second);
     } else {
+      txc->rm_shared_blob(o->bnode, br.second->id);
       o->bnode->blob_map.erase(br.second);
     }
   }
@@ -6390,6 +8633,9 @@ int BlueStore::_do_write(
     return 0;
   }
 
+  _fault_write_range(o, offset, length);
+  o->dirty_range(offset, length);
+
   uint64_t end = offset + length;
 
   WriteContext wctx;
@@ -6406,18 +8652,9 @@ int BlueStore::_do_write(
 
   // compression parameters
   unsigned alloc_hints = o->onode.alloc_hint_flags;
-  wctx.compress =
-    (comp_mode == COMP_FORCE) ||
-    (comp_mode == COMP_AGGRESSIVE &&
-     (alloc_hints & CEPH_OSD_ALLOC_HINT_FLAG_INCOMPRESSIBLE) == 0) ||
-    (comp_mode == COMP_PASSIVE &&
-     (alloc_hints & CEPH_OSD_ALLOC_HINT_FLAG_COMPRESSIBLE));
+  wctx.compress = _want_compress(alloc_hints);
 
-  if ((alloc_hints & CEPH_OSD_ALLOC_HINT_FLAG_SEQUENTIAL_READ) &&
-      (alloc_hints & CEPH_OSD_ALLOC_HINT_FLAG_RANDOM_READ) == 0 &&
-      (alloc_hints & (CEPH_OSD_ALLOC_HINT_FLAG_IMMUTABLE|
-			CEPH_OSD_ALLOC_HINT_FLAG_APPEND_ONLY)) &&
-      (alloc_hints & CEPH_OSD_ALLOC_HINT_FLAG_RANDOM_WRITE) == 0) {
+  if (_want_large_blobs(alloc_hints)) {
     dout(20) << __func__ << " will prefer large blob and csum sizes" << dendl;
     wctx.comp_blob_size = comp_max_blob_size;
     wctx.csum_order = min_alloc_size_order;
@@ -6460,7 +8697,7 @@ int BlueStore::_do_write(
     }
   }
 
-  r = _do_alloc_write(txc, &wctx);
+  r = _do_alloc_write(txc, c, &wctx);
   if (r < 0) {
     derr << __func__ << " _do_alloc_write failed with " << cpp_strerror(r)
 	 << dendl;
@@ -6534,6 +8771,9 @@ int BlueStore::_do_zero(TransContext *txc,
   // they may touch.
   o->flush();
 
+  _fault_write_range(o, offset, length);
+  o->dirty_range(offset, length);
+
   WriteContext wctx;
   o->onode.punch_hole(offset, length, &wctx.lex_old);
   _wctx_finish(txc, c, o, &wctx);
@@ -6562,6 +8802,9 @@ int BlueStore::_do_truncate(
     // they may touch.
     o->flush();
 
+    _fault_write_range(o, offset, o->onode.size - offset);
+    o->dirty_range(offset, o->onode.size - offset);
+
     WriteContext wctx;
     o->onode.punch_hole(offset, o->onode.size, &wctx.lex_old);
     _wctx_finish(txc, c, o, &wctx);
@@ -6600,6 +8843,8 @@ int BlueStore::_do_remove(
     _do_omap_clear(txc, o->onode.omap_head);
   }
   o->exists = false;
+  _rmkey_extent_shards(o, txc->t);
+  o->extent_shards.clear();
   o->onode = bluestore_onode_t();
   txc->onodes.erase(o);
   txc->t->rmkey(PREFIX_OBJ, o->key);
@@ -6893,6 +9138,8 @@ int BlueStore::_clone(TransContext *txc,
     goto out;
 
   if (g_conf->bluestore_clone_cow) {
+    _fault_range(oldo, 0, EXTENT_MAP_END);
+    _fault_range(newo, 0, EXTENT_MAP_END);
     if (!oldo->onode.extent_map.empty()) {
       if (!oldo->bnode) {
 	oldo->bnode = c->get_bnode(newo->oid.hobj.get_hash());
@@ -6909,7 +9156,7 @@ int BlueStore::_clone(TransContext *txc,
           if (moved_blobs.count(p.second.blob) == 0) {
             b = oldo->blob_map.get(p.second.blob);
             oldo->blob_map.erase(b);
-            newo->bnode->blob_map.claim(b);
+            newo->bnode->blob_map.claim(b, _assign_blobid(txc));
             moved_blobs[p.second.blob] = b->id;
             dout(30) << __func__ << "  moving old onode blob " << p.second.blob
                     << " to bnode blob " << b->id << dendl;
@@ -6928,12 +9175,16 @@ int BlueStore::_clone(TransContext *txc,
 	}
 	newo->onode.extent_map[p.first] = p.second;
         assert(p.second.blob < 0);
-	newo->bnode->blob_map.get(-p.second.blob)->blob.get_ref(p.second.offset, p.second.length);
+	BlobRef b = c->get_shared_blob(newo->bnode, -p.second.blob);
+	assert(b);
+	b->blob.get_ref(p.second.offset, p.second.length);
+	txc->write_shared_blob(newo->bnode, b);
 	txc->statfs_delta.stored() += p.second.length;
       }
+      newo->dirty_range(0, EXTENT_MAP_END);
       _dump_onode(newo);
-      txc->write_bnode(newo->bnode);
       if (!moved_blobs.empty()) {
+	oldo->dirty_range(0, EXTENT_MAP_END);
 	txc->write_onode(oldo);
       }
     }
@@ -7046,6 +9297,11 @@ int BlueStore::_rename(TransContext *txc,
     assert(txc->onodes.count(newo) == 0);
   }
 
+  // extent shards are keyed by the onode key; move them along
+  _fault_range(oldo, 0, EXTENT_MAP_END);
+  _rmkey_extent_shards(oldo, txc->t);
+  oldo->dirty_range(0, EXTENT_MAP_END);
+
   txc->t->rmkey(PREFIX_OBJ, oldo->key);
   txc->write_onode(oldo);
   newo = oldo;
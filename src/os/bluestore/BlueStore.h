@@ -20,6 +20,7 @@
 #include <unistd.h>
 
 #include <atomic>
+#include <deque>
 #include <mutex>
 #include <condition_variable>
 
@@ -32,6 +33,7 @@
 #include "include/assert.h"
 #include "include/unordered_map.h"
 #include "include/memory.h"
+#include "include/mempool.h"
 #include "common/Finisher.h"
 #include "compressor/Compressor.h"
 #include "os/ObjectStore.h"
@@ -61,18 +63,59 @@ enum {
   l_bluestore_compress_lat,
   l_bluestore_decompress_lat,
   l_bluestore_compress_success_count,
+  l_bluestore_compress_rejected_count,
+  l_bluestore_compress_sample_rejected_count,
+  l_bluestore_compress_in_bytes,
+  l_bluestore_compress_out_bytes,
+  l_bluestore_compress_inline_count,
   l_bluestore_write_pad_bytes,
   l_bluestore_wal_write_ops,
   l_bluestore_wal_write_bytes,
+  l_bluestore_wal_batch_lat,
+  l_bluestore_wal_batch_ops,
+  l_bluestore_wal_batch_aios,
+  l_bluestore_wal_batch_bytes,
+  l_bluestore_kv_flush_lat,
+  l_bluestore_kv_commit_lat,
+  l_bluestore_kv_lat,
+  l_bluestore_kv_finalize_lat,
   l_bluestore_write_penalty_read_ops,
   l_bluestore_allocated,
   l_bluestore_stored,
   l_bluestore_compressed,
   l_bluestore_compressed_allocated,
   l_bluestore_compressed_original,
+  l_bluestore_onode_hits,
+  l_bluestore_onode_misses,
+  l_bluestore_buffer_hit_bytes,
+  l_bluestore_buffer_miss_bytes,
+  l_bluestore_cache_meta_bytes,
+  l_bluestore_cache_data_bytes,
+  l_bluestore_cache_kv_bytes,
+  l_bluestore_onode_write_bytes,
+  l_bluestore_extent_shard_write_bytes,
+  l_bluestore_extent_shard_loads,
+  l_bluestore_onode_reshard,
+  l_bluestore_shared_blob_loads,
+  l_bluestore_shared_blob_writes,
+  l_bluestore_onode_prefetch,
+  l_bluestore_write_small_packed,
+  l_bluestore_packed_units,
   l_bluestore_last
 };
 
+/// per-pool compression counters, in "bluestore-pool-<id>"
+enum {
+  l_bluestore_pool_first = 732600,
+  l_bluestore_pool_compress_lat,
+  l_bluestore_pool_compress_success_count,
+  l_bluestore_pool_compress_rejected_count,
+  l_bluestore_pool_compress_sample_rejected_count,
+  l_bluestore_pool_compress_in_bytes,
+  l_bluestore_pool_compress_out_bytes,
+  l_bluestore_pool_last
+};
+
 class BlueStore : public ObjectStore,
 		  public md_config_obs_t {
   // -----------------------------------------------------
@@ -95,6 +138,8 @@ public:
 
   /// cached buffer
   struct Buffer {
+    MEMPOOL_CLASS_HELPERS();
+
     enum {
       STATE_EMPTY,     ///< empty buffer -- used for cache history
       STATE_CLEAN,     ///< clean data that is up to date
@@ -195,6 +240,7 @@ public:
     void _add_buffer(Buffer *b, int level, Buffer *near) {
       cache->_audit("_add_buffer start");
       buffer_map[b->offset].reset(b);
+      b->data.try_assign_to_mempool(mempool::mempool_bluestore_data);
       if (b->is_writing()) {
         writing_map[b->seq].push_back(*b);
       } else {
@@ -286,8 +332,11 @@ public:
 
   /// in-memory blob metadata and associated cached buffers (if any)
   struct Blob : public boost::intrusive::set_base_hook<> {
+    MEMPOOL_CLASS_HELPERS();
+
     std::atomic_int nref;  ///< reference count
     int64_t id = 0;          ///< id
+    bool spanning = false;   ///< referenced from more than one extent shard
     bluestore_blob_t blob;   ///< blob metadata
     BufferSpace bc;          ///< buffer cache
 
@@ -333,8 +382,11 @@ public:
 
     blob_map_t blob_map;
 
-    void encode(bufferlist& bl) const;
-    void decode(bufferlist::iterator& p, Cache *c);
+    void bound_encode(size_t& p) const;
+    /// encode all blobs, or only spanning ones if the onode is sharded
+    void encode(bufferlist::contiguous_appender& p,
+		bool spanning_only = false) const;
+    void decode(bufferptr::iterator& p, Cache *c, bool spanning = false);
 
     bool empty() const {
       return blob_map.empty();
@@ -357,9 +409,9 @@ public:
       return b;
     }
 
-    void claim(BlobRef b) {
+    void claim(BlobRef b, int64_t id) {
       assert(b->id == 0);
-      b->id = get_new_id();
+      b->id = id;
       b->get();
       blob_map.insert(*b);
     }
@@ -395,14 +447,18 @@ public:
     }
   };
 
-  /// an in-memory extent-map, shared by a group of objects (w/ same hash value)
+  /// the shared blobs of a group of objects (w/ same hash value).  each
+  /// blob is stored under its own key and loaded on demand.
   struct Bnode : public boost::intrusive::unordered_set_base_hook<> {
+    MEMPOOL_CLASS_HELPERS();
+
     std::atomic_int nref;        ///< reference count
     uint32_t hash;
-    string key;           ///< key under PREFIX_OBJ where we are stored
+    string key;           ///< prefix of our shared blobs' keys
     BnodeSet *bnode_set;  ///< reference to the containing set
 
-    BlobMap blob_map;
+    std::mutex lock;      ///< protect blob_map from concurrent loads
+    BlobMap blob_map;     ///< loaded shared blobs
 
     Bnode(uint32_t h, const string& k, BnodeSet *s)
       : nref(0),
@@ -470,6 +526,8 @@ public:
 
   /// an in-memory object
   struct Onode {
+    MEMPOOL_CLASS_HELPERS();
+
     std::atomic_int nref;  ///< reference count
 
     ghobject_t oid;
@@ -485,6 +543,14 @@ public:
 
     BlobMap blob_map;       ///< local blobs (this onode onode)
 
+    /// in-memory state of each onode.extent_map_shards entry
+    struct extent_shard_t {
+      bool loaded = false;  ///< lextents and local blobs are in memory
+      bool dirty = false;   ///< needs to be re-encoded on the next write
+    };
+    vector<extent_shard_t> extent_shards;
+    std::mutex extent_lock; ///< readers fault in shards under this
+
     std::mutex flush_lock;  ///< protect flush_txns
     std::condition_variable flush_cond;   ///< wait here for unapplied txns
     set<TransContext*> flush_txns;   ///< committing or wal txns
@@ -497,6 +563,7 @@ public:
 	exists(false) {
     }
 
+    /// shared blobs must already be loaded (see Collection::get_blob)
     BlobRef get_blob(int64_t id) {
       if (id < 0) {
 	assert(bnode);
@@ -505,6 +572,30 @@ public:
       return blob_map.get(id);
     }
 
+    /// index of the extent map shard covering offset
+    unsigned seek_shard(uint64_t offset) const {
+      auto& shards = onode.extent_map_shards;
+      auto p = std::upper_bound(
+	shards.begin(), shards.end(), offset,
+	[](uint64_t o, const bluestore_onode_t::shard_info& s) {
+	  return o < s.offset;
+	});
+      assert(p != shards.begin());
+      return p - shards.begin() - 1;
+    }
+
+    /// mark the shards overlapping a logical range dirty
+    void dirty_range(uint64_t offset, uint64_t length) {
+      if (extent_shards.empty() || length == 0) {
+	return;
+      }
+      unsigned last = seek_shard(offset + length - 1);
+      for (unsigned i = seek_shard(offset); i <= last; ++i) {
+	assert(extent_shards[i].loaded);
+	extent_shards[i].dirty = true;
+      }
+    }
+
     void flush();
     void get() {
       ++nref;
@@ -520,6 +611,26 @@ public:
   struct Cache {
     std::mutex lock;                ///< protect lru and other structures
 
+    /// cumulative hit/miss counts, protected by lock
+    struct stats_t {
+      uint64_t onode_hits = 0;
+      uint64_t onode_misses = 0;
+      uint64_t buffer_hit_bytes = 0;
+      uint64_t buffer_miss_bytes = 0;
+
+      void add(const stats_t& o) {
+	onode_hits += o.onode_hits;
+	onode_misses += o.onode_misses;
+	buffer_hit_bytes += o.buffer_hit_bytes;
+	buffer_miss_bytes += o.buffer_miss_bytes;
+      }
+    } stats;
+
+    /// this shard's fraction of the onode+buffer budget; see
+    /// _balance_cache_shards()
+    std::atomic<float> shard_ratio = {1.0};
+    stats_t last_shard_stats;  ///< for _balance_cache_shards()
+
     static Cache *create(string type);
 
     virtual ~Cache() {}
@@ -533,7 +644,22 @@ public:
     virtual void _adjust_buffer_size(Buffer *b, int64_t delta) = 0;
     virtual void _touch_buffer(Buffer *b) = 0;
 
-    virtual void trim(uint64_t onode_max, uint64_t buffer_max) = 0;
+    virtual uint64_t _get_num_onodes() = 0;
+    virtual uint64_t _get_buffer_bytes() = 0;
+
+    /// trim to target_bytes, split between onodes and buffer data
+    void trim(uint64_t target_bytes, float target_meta_ratio,
+	      float bytes_per_onode);
+
+    /// add our onode count, buffer bytes and hit stats to the totals
+    void add_stats(uint64_t *onodes, uint64_t *buffer_bytes, stats_t *s) {
+      std::lock_guard<std::mutex> l(lock);
+      *onodes += _get_num_onodes();
+      *buffer_bytes += _get_buffer_bytes();
+      s->add(stats);
+    }
+
+    virtual void _trim(uint64_t onode_max, uint64_t buffer_max) = 0;
 
 #ifdef DEBUG_CACHE
     virtual void _audit(const char *s) = 0;
@@ -604,7 +730,14 @@ public:
       _audit("_touch_buffer end");
     }
 
-    void trim(uint64_t onode_max, uint64_t buffer_max) override;
+    uint64_t _get_num_onodes() override {
+      return onode_lru.size();
+    }
+    uint64_t _get_buffer_bytes() override {
+      return buffer_size;
+    }
+
+    void _trim(uint64_t onode_max, uint64_t buffer_max) override;
 
 #ifdef DEBUG_CACHE
     void _audit(const char *s) override;
@@ -679,7 +812,14 @@ public:
       _audit("_touch_buffer end");
     }
 
-    void trim(uint64_t onode_max, uint64_t buffer_max) override;
+    uint64_t _get_num_onodes() override {
+      return onode_lru.size();
+    }
+    uint64_t _get_buffer_bytes() override {
+      return buffer_bytes;
+    }
+
+    void _trim(uint64_t onode_max, uint64_t buffer_max) override;
 
 #ifdef DEBUG_CACHE
     void _audit(const char *s) override;
@@ -695,8 +835,11 @@ public:
       clear();
     }
 
-    void add(const ghobject_t& oid, OnodeRef o);
+    /// add o, or return the onode already there if we raced
+    OnodeRef add(const ghobject_t& oid, OnodeRef o);
     OnodeRef lookup(const ghobject_t& o);
+    /// like lookup, but leaves the lru and hit stats alone
+    bool contains(const ghobject_t& o);
     void rename(OnodeRef& o, const ghobject_t& old_oid,
 		const ghobject_t& new_oid);
     void clear();
@@ -725,16 +868,27 @@ public:
     OnodeRef get_onode(const ghobject_t& oid, bool create);
     BnodeRef get_bnode(uint32_t hash);
 
+    /// load the onodes of oids not already cached in one kv sweep
+    int prefetch_onodes(const vector<ghobject_t>& oids);
+
+    Onode *_decode_onode(const ghobject_t& oid, const string& key,
+			 bufferlist& v);
+
     BlobRef get_blob(OnodeRef& o, int64_t blob) {
       if (blob < 0) {
 	if (!o->bnode) {
 	  o->bnode = get_bnode(o->oid.hobj.get_hash());
 	}
-	return o->bnode->blob_map.get(-blob);
+	return get_shared_blob(o->bnode, -blob);
       }
       return o->blob_map.get(blob);
     }
 
+    /// get a shared blob, loading it if needed
+    BlobRef get_shared_blob(BnodeRef& b, int64_t id);
+    /// load all of a bnode's shared blobs (for fsck)
+    void load_shared_blobs(BnodeRef& b);
+
     const coll_t &get_cid() override {
       return cid;
     }
@@ -776,7 +930,26 @@ public:
   class OpSequencer;
   typedef boost::intrusive_ptr<OpSequencer> OpSequencerRef;
 
-  struct TransContext {
+  /// aio completion target; aio_cb dispatches through this
+  struct AioContext {
+    virtual void aio_finish(BlueStore *store) = 0;
+    virtual ~AioContext() {}
+  };
+
+  struct TransContext;
+
+  /// a blob's worth of write data, compressed ahead on compress_tp while
+  /// its txc is parked, or inline if nobody saw it coming
+  struct CompressJob {
+    TransContext *txc = nullptr; ///< parked txc waiting for us
+    CompressorRef c;
+    int64_t pool = -1;           ///< pool the data belongs to
+    bufferlist in;               ///< raw blob data
+    bufferlist out;              ///< chdr + compressed data, if we got any
+    bool sample_rejected = false; ///< sample did not compress; skipped
+  };
+
+  struct TransContext : public AioContext {
     typedef enum {
       STATE_PREPARE,
       STATE_AIO_WAIT,
@@ -827,7 +1000,8 @@ public:
     uint64_t ops, bytes;
 
     set<OnodeRef> onodes;     ///< these onodes need to be updated/written
-    set<BnodeRef> bnodes;     ///< these bnodes need to be updated/written
+    map<BlobRef,BnodeRef> shared_blobs;  ///< these shared blobs need to be written
+    set<pair<BnodeRef,int64_t> > shared_blobs_rm; ///< and these removed
     set<BlobRef> blobs;       ///< these blobs need to be updated on io completion
 
     KeyValueDB::Transaction t; ///< then we will commit this
@@ -902,6 +1076,11 @@ public:
     uint64_t seq = 0;
     utime_t start;
 
+    // see _txc_finish_io
+    std::atomic_bool io_done = {false};     ///< aio complete
+    std::atomic_bool io_claimed = {false};  ///< someone is moving us to kv
+    bool io_parked = false;                 ///< waiting on predecessor (qlock)
+
     struct DeferredCsum {
       OnodeRef onode;
       int64_t blob;
@@ -914,6 +1093,11 @@ public:
 
     list<DeferredCsum> deferred_csum;
 
+    // see _txc_prepare_compress
+    vector<Transaction> tls;          ///< our ops, while we are parked
+    list<CompressJob> compress_jobs;  ///< write data compressed ahead
+    unsigned compress_pending = 0;    ///< jobs not done yet (osr->qlock)
+
     explicit TransContext(OpSequencer *o)
       : state(STATE_PREPARE),
 	osr(o),
@@ -923,7 +1107,7 @@ public:
 	onreadable(NULL),
 	onreadable_sync(NULL),
 	wal_txn(NULL),
-	ioc(this),
+	ioc(static_cast<AioContext*>(this)),
 	start(ceph_clock_now(g_ceph_context)) {
       //cout << "txc new " << this << std::endl;
     }
@@ -935,13 +1119,20 @@ public:
     void write_onode(OnodeRef &o) {
       onodes.insert(o);
     }
-    void write_bnode(BnodeRef &e) {
-      bnodes.insert(e);
+    void write_shared_blob(BnodeRef &e, BlobRef &b) {
+      shared_blobs[b] = e;
+    }
+    void rm_shared_blob(BnodeRef &e, int64_t id) {
+      shared_blobs_rm.insert(make_pair(e, id));
     }
 
     void add_deferred_csum(OnodeRef& o, int64_t b, uint64_t bo, bufferlist& bl) {
       deferred_csum.emplace_back(TransContext::DeferredCsum(o, b, bo, bl));
     }
+
+    void aio_finish(BlueStore *store) override {
+      store->_txc_state_proc(this);
+    }
   };
 
   class OpSequencer : public Sequencer_impl {
@@ -972,6 +1163,16 @@ public:
 
     uint64_t last_seq = 0;
 
+    /// seq of the last txc to leave STATE_IO_DONE.  txcs completing in
+    /// order advance this without qlock; see _txc_finish_io.
+    std::atomic<uint64_t> last_io_done_seq = {0};
+    std::atomic_int num_io_parked = {0};  ///< txcs done ahead of their turn
+
+    /// txcs waiting for their compress jobs, or behind one that is.  they
+    /// apply their ops in order once ready; see _osr_resume_parked.
+    deque<TransContext*> parked;
+    bool resuming = false;  ///< someone is applying parked txcs (qlock)
+
     OpSequencer()
 	//set the qlock to PTHREAD_MUTEX_RECURSIVE mode
       : parent(NULL) {
@@ -1029,6 +1230,44 @@ public:
     }
   };
 
+  class CompressWQ : public ThreadPool::WorkQueue<CompressJob> {
+    BlueStore *store;
+    deque<CompressJob*> job_queue;
+
+  public:
+    CompressWQ(BlueStore *s, time_t ti, time_t sti, ThreadPool *tp)
+      : ThreadPool::WorkQueue<CompressJob>("BlueStore::CompressWQ", ti, sti,
+					   tp),
+	store(s) {
+    }
+    bool _empty() {
+      return job_queue.empty();
+    }
+    bool _enqueue(CompressJob *j) {
+      job_queue.push_back(j);
+      return true;
+    }
+    void _dequeue(CompressJob *j) {
+      assert(0 == "not needed, not implemented");
+    }
+    CompressJob *_dequeue() {
+      if (job_queue.empty())
+	return NULL;
+      CompressJob *j = job_queue.front();
+      job_queue.pop_front();
+      return j;
+    }
+    void _process(CompressJob *j, ThreadPool::TPHandle &) override {
+      // j belongs to its txc, which may go away once the last job is done
+      TransContext *txc = j->txc;
+      store->_compress(j);
+      store->_txc_compress_done(txc);
+    }
+    void _clear() {
+      assert(job_queue.empty());
+    }
+  };
+
   class WALWQ : public ThreadPool::WorkQueue<TransContext> {
     // We need to order WAL items within each Sequencer.  To do that,
     // queue each txc under osr, and queue the osr's here.  When we
@@ -1096,6 +1335,27 @@ public:
     }
   };
 
+  /// wal writes from many txcs, merged by disk offset and submitted as
+  /// one set of aios; see _deferred_queue() and _deferred_try_submit()
+  struct DeferredBatch : public AioContext {
+    map<uint64_t, bufferlist> extents;  ///< disk offset -> data
+    deque<TransContext*> txcs;          ///< in the order they were queued
+    uint64_t num_ops = 0;               ///< wal ops queued
+    utime_t start;                      ///< when the first op was queued
+    interval_set<uint64_t> ranges;      ///< disk ranges written, once submitted
+    bool io_done = false;               ///< aios complete; protected by deferred_lock
+    IOContext ioc;
+
+    DeferredBatch() : ioc(static_cast<AioContext*>(this)) {}
+
+    /// queue a write, superseding older data queued for the same range
+    void prepare_write(uint64_t offset, bufferlist& bl);
+
+    void aio_finish(BlueStore *store) override {
+      store->_deferred_aio_finish(this);
+    }
+  };
+
   struct KVSyncThread : public Thread {
     BlueStore *store;
     explicit KVSyncThread(BlueStore *s) : store(s) {}
@@ -1104,6 +1364,39 @@ public:
       return NULL;
     }
   };
+  struct KVFinalizeThread : public Thread {
+    BlueStore *store;
+    explicit KVFinalizeThread(BlueStore *s) : store(s) {}
+    void *entry() {
+      store->_kv_finalize_thread();
+      return NULL;
+    }
+  };
+
+  /// periodically re-estimate onode size from the mempools and trim caches
+  struct MempoolThread : public Thread {
+    BlueStore *store;
+    Cond cond;
+    Mutex lock;
+    bool stop = false;
+  public:
+    explicit MempoolThread(BlueStore *s)
+      : store(s),
+	lock("BlueStore::MempoolThread::lock") {}
+    void *entry();
+    void init() {
+      assert(stop == false);
+      create("bstore_mempool");
+    }
+    void shutdown() {
+      lock.Lock();
+      stop = true;
+      cond.Signal();
+      lock.Unlock();
+      join();
+      stop = false;
+    }
+  };
 
   // --------------------------------------------------------
   // members
@@ -1126,10 +1419,64 @@ private:
 
   vector<Cache*> cache_shards;
 
+  // cache budget, split between onodes (meta), buffers (data) and the
+  // kv block cache; see _set_cache_sizes(), _balance_cache(), MempoolThread.
+  // conf changes and _balance_cache() update it under cache_conf_lock,
+  // which also covers conf changes against mounted and _close_db();
+  // the trim path just loads the atomics.  meta and kv live in one
+  // atomic so a reader never sees half of an update.
+  struct cache_ratio_t {
+    float meta;  ///< fraction for onodes
+    float kv;    ///< fraction for kv
+    cache_ratio_t(float m = 0, float k = 0) : meta(m), kv(k) {}
+  };
+  std::mutex cache_conf_lock;
+  std::atomic<uint64_t> cache_size = {0};  ///< bytes, all shards plus kv
+  std::atomic<cache_ratio_t> cache_ratio = {cache_ratio_t()};
+  std::atomic<float> bytes_per_onode = {4096}; ///< est. from the mempools
+  std::atomic<bool> cache_autotune = {false};
+  Cache::stats_t cache_last_stats;  ///< at last _balance_cache()
+  uint64_t kv_last_hits = 0, kv_last_misses = 0;
+
   std::mutex nid_lock;
   uint64_t nid_last;
   uint64_t nid_max;
 
+  std::mutex blobid_lock;
+  uint64_t blobid_last;
+  uint64_t blobid_max;
+
+  /// ondisk format versions:
+  ///  0: a bnode's shared blobs all live in one blob_map under its key
+  ///  1: each shared blob has its own PREFIX_SHARED_BLOB record
+  ///  2: small blobs may share allocation units (PREFIX_PACK)
+  static const int latest_ondisk_format = 2;
+  static const int min_compat_ondisk_format = 2;
+  int ondisk_format = 0;
+
+  /**
+   * allocation units shared by packed small blobs
+   *
+   * New blobs smaller than min_alloc_size get a block-aligned slice of
+   * one of these instead of an allocation unit of their own.  The whole
+   * unit is allocated in the freelist when it is opened; which blocks
+   * are in use is kept under PREFIX_PACK, one key per block, and the
+   * unit goes back to the allocator once the last one is released.
+   * Slices are handed out once; space freed in a unit is not reused
+   * until the whole unit is free.
+   */
+  struct PackUnit {
+    uint64_t next = 0;            ///< next free offset (never moves back)
+    uint64_t pending = 0;         ///< handed out, not yet committed
+    interval_set<uint64_t> live;  ///< committed slices (absolute offsets)
+  };
+  std::mutex pack_lock;
+  std::condition_variable pack_cond;  ///< wait here for pack_opening
+  map<uint64_t,PackUnit> pack_units;  ///< unit offset -> unit
+  uint64_t pack_cur = 0;              ///< unit we are filling (if pack_open)
+  bool pack_open = false;
+  bool pack_opening = false;          ///< a unit is being committed
+
   Throttle throttle_ops, throttle_bytes;          ///< submit to commit
   Throttle throttle_wal_ops, throttle_wal_bytes;  ///< submit to wal complete
 
@@ -1140,6 +1487,9 @@ private:
   ThreadPool wal_tp;
   WALWQ wal_wq;
 
+  ThreadPool compress_tp;
+  CompressWQ compress_wq;
+
   int m_finisher_num;
   vector<Finisher*> finishers;
 
@@ -1150,8 +1500,23 @@ private:
   deque<TransContext*> kv_queue, kv_committing;
   deque<TransContext*> wal_cleanup_queue, wal_cleaning;
 
+  // committed txcs are handed to the finalize thread, which runs their
+  // state transitions while the sync thread commits the next batch
+  KVFinalizeThread kv_finalize_thread;
+  std::mutex kv_finalize_lock;
+  std::condition_variable kv_finalize_cond, kv_finalize_sync_cond;
+  bool kv_finalize_stop = false;
+  bool kv_finalize_in_progress = false;
+  deque<TransContext*> kv_committing_to_finalize;
+  deque<TransContext*> wal_cleaning_to_finalize;
+
   PerfCounters *logger;
 
+  std::mutex pool_logger_lock;
+  map<int64_t,PerfCounters*> pool_loggers;  ///< see _get_pool_logger
+
+  MempoolThread mempool_thread;
+
   std::mutex reap_lock;
   list<CollectionRef> removed_collections;
 
@@ -1167,6 +1532,13 @@ private:
   uint64_t max_alloc_size; ///< maximum allocation unit (power of 2)
 
   bool sync_wal_apply;	  ///< see config option bluestore_sync_wal_apply
+  uint64_t wal_batch_ops; ///< see config option bluestore_wal_batch_ops
+
+  std::mutex deferred_lock;
+  DeferredBatch *deferred_pending = nullptr;  ///< accepting new ops
+  list<DeferredBatch*> deferred_running;  ///< aios in flight, in submit order
+  bool deferred_finishing = false;  ///< a thread is retiring deferred_running
+  bool deferred_kick = false;  ///< new deferred work; protected by kv_lock
 
   // compression options
   enum CompressionMode {
@@ -1194,6 +1566,7 @@ private:
 
   void _init_logger();
   void _shutdown_logger();
+  PerfCounters *_get_pool_logger(int64_t pool);
   int _reload_logger();
 
   int _open_path();
@@ -1204,6 +1577,18 @@ private:
   int _write_fsid();
   void _close_fsid();
   void _set_alloc_sizes();
+  void _set_cache_sizes();
+  void _update_cache_logger(uint64_t size, cache_ratio_t r);
+  void _update_bytes_per_onode();
+  void _trim_cache(Cache *c) {
+    cache_ratio_t r = cache_ratio;
+    uint64_t bytes = cache_size * (1.0 - r.kv);
+    c->trim(bytes * c->shard_ratio,
+	    r.kv < 1.0 ? r.meta / (1.0 - r.kv) : 0,
+	    bytes_per_onode);
+  }
+  void _balance_cache();
+  void _balance_cache_shards();
   int _open_bdev(bool create);
   void _close_bdev();
   int _open_db(bool create);
@@ -1212,6 +1597,11 @@ private:
   void _close_fm();
   int _open_alloc();
   void _close_alloc();
+  int _open_pack();
+  int _pack_open_unit(uint64_t *unit);
+  void _pack_release_unit(uint64_t unit);
+  int _pack_alloc(uint64_t length, uint64_t *offset);
+  void _txc_finalize_pack(TransContext *txc, KeyValueDB::Transaction t);
   int _open_collections(int *errors=0);
   void _close_collections();
 
@@ -1224,6 +1614,8 @@ private:
 			       bool create);
 
   int _open_super_meta();
+  void _prepare_ondisk_format_super(KeyValueDB::Transaction& t);
+  int _upgrade_super();
 
   int _reconcile_bluefs_freespace();
   int _balance_bluefs_freespace(vector<bluestore_pextent_t> *extents);
@@ -1234,6 +1626,7 @@ private:
   void _reap_collections();
 
   void _assign_nid(TransContext *txc, OnodeRef o);
+  int64_t _assign_blobid(TransContext *txc);
 
   void _dump_onode(OnodeRef o, int log_level=30);
   void _dump_bnode(BnodeRef b, int log_level=30);
@@ -1243,22 +1636,42 @@ private:
   TransContext *_txc_create(OpSequencer *osr);
   void _txc_update_store_statfs(TransContext *txc);
   void _txc_add_transaction(TransContext *txc, Transaction *t);
+  void _txc_prepare_compress(TransContext *txc, Transaction *t);
+  void _txc_prepare_compress_write(TransContext *txc, CompressorRef& c,
+				   const coll_t& cid, uint64_t offset,
+				   bufferlist& bl, unsigned alloc_hints);
+  void _txc_compress_done(TransContext *txc);
+  void _osr_resume_parked(OpSequencer *osr);
+  void _txc_build(TransContext *txc, vector<Transaction>& tls);
   void _txc_write_nodes(TransContext *txc, KeyValueDB::Transaction t);
+  void _txc_write_onode(OnodeRef& o, KeyValueDB::Transaction t);
+
+  // extent map shards
+  void _fault_range(OnodeRef& o, uint64_t offset, uint64_t length);
+  void _fault_write_range(OnodeRef& o, uint64_t offset, uint64_t length);
+  void _split_extent_shards(OnodeRef& o);
+  size_t _encode_extent_shard(OnodeRef& o, unsigned i, bufferlist& bl,
+			      unsigned *num);
+  void _write_extent_shards(OnodeRef& o, KeyValueDB::Transaction t);
+  void _rmkey_extent_shards(OnodeRef& o, KeyValueDB::Transaction t);
   void _txc_state_proc(TransContext *txc);
   void _txc_aio_submit(TransContext *txc);
   void _txc_finalize_kv(TransContext *txc, KeyValueDB::Transaction t);
-public:
-  void _txc_aio_finish(void *p) {
-    _txc_state_proc(static_cast<TransContext*>(p));
-  }
-private:
   void _txc_finish_io(TransContext *txc);
+  void _osr_drain_io_done(OpSequencer *osr);
   void _txc_finish_kv(TransContext *txc);
   void _txc_finish(TransContext *txc);
 
   void _osr_reap_done(OpSequencer *osr);
 
   void _kv_sync_thread();
+  void _kv_finalize_thread();
+  bool _kv_finalize_idle() {
+    std::lock_guard<std::mutex> l(kv_finalize_lock);
+    return kv_committing_to_finalize.empty() &&
+      wal_cleaning_to_finalize.empty() &&
+      !kv_finalize_in_progress;
+  }
   void _kv_stop() {
     {
       std::lock_guard<std::mutex> l(kv_lock);
@@ -1266,21 +1679,39 @@ private:
       kv_cond.notify_all();
     }
     kv_sync_thread.join();
+    {
+      std::lock_guard<std::mutex> l(kv_finalize_lock);
+      kv_finalize_stop = true;
+      kv_finalize_cond.notify_all();
+    }
+    kv_finalize_thread.join();
     kv_stop = false;
+    kv_finalize_stop = false;
   }
 
   bluestore_wal_op_t *_get_wal_op(TransContext *txc, OnodeRef o);
   int _wal_apply(TransContext *txc);
   int _wal_finish(TransContext *txc);
   int _do_wal_op(TransContext *txc, bluestore_wal_op_t& wo);
+  void _deferred_queue(TransContext *txc);
+  bool _deferred_try_submit(bool force, double *wait);
+  bool _deferred_submit(DeferredBatch *b);  ///< false if no aio pending
+  void _deferred_aio_finish(DeferredBatch *b);
   int _wal_replay();
 
   // for fsck
+  /// mark an extent used, by block within pack units and by allocation
+  /// unit elsewhere; true if any of it already was
+  bool _fsck_mark_used(
+    uint64_t offset, uint64_t length,
+    boost::dynamic_bitset<> &used_blocks,
+    map<uint64_t,boost::dynamic_bitset<>> &used_pack_blocks);
   int _fsck_verify_blob_map(
     string what,
     const BlobMap& blob_map,
     map<int64_t,bluestore_extent_ref_map_t>& v,
     boost::dynamic_bitset<> &used_blocks,
+    map<uint64_t,boost::dynamic_bitset<>> &used_pack_blocks,
     store_statfs_t& expected_statfs);
 
   void _buffer_cache_write(
@@ -1397,6 +1828,11 @@ public:
 		      bool sort_bitwise, int max,
 		      vector<ghobject_t> *ls, ghobject_t *next) override;
 
+  void prefetch_onodes(const coll_t& cid,
+		       const vector<ghobject_t>& oids) override;
+  void prefetch_onodes(CollectionHandle &c,
+		       const vector<ghobject_t>& oids) override;
+
   int omap_get(
     const coll_t& cid,                ///< [in] Collection containing oid
     const ghobject_t &oid,   ///< [in] Object containing omap
@@ -1523,14 +1959,15 @@ private:
       uint64_t b_off;
       bufferlist bl;
       bool mark_unused;
+      bool packed;     ///< small blob, allocate from a shared unit
 
-      write_item(BlobRef b, uint64_t blob_len, uint64_t o, bufferlist& bl, bool _mark_unused)
-       : b(b), blob_length(blob_len), b_off(o), bl(bl), mark_unused(_mark_unused) {}
+      write_item(BlobRef b, uint64_t blob_len, uint64_t o, bufferlist& bl, bool _mark_unused, bool _packed)
+       : b(b), blob_length(blob_len), b_off(o), bl(bl), mark_unused(_mark_unused), packed(_packed) {}
     };
     vector<write_item> writes;                 ///< blobs we're writing
 
-    void write(BlobRef b, uint64_t blob_len, uint64_t o, bufferlist& bl, bool _mark_unused) {
-      writes.emplace_back(write_item(b, blob_len, o, bl, _mark_unused));
+    void write(BlobRef b, uint64_t blob_len, uint64_t o, bufferlist& bl, bool _mark_unused, bool _packed = false) {
+      writes.emplace_back(write_item(b, blob_len, o, bl, _mark_unused, _packed));
     }
   };
 
@@ -1548,8 +1985,14 @@ private:
     uint64_t offset, uint64_t length,
     bufferlist::iterator& blp,
     WriteContext *wctx);
+  bool _want_compress(unsigned alloc_hints);
+  bool _want_large_blobs(unsigned alloc_hints);
+  void _compress(CompressJob *j);
+  bool _take_compressed(TransContext *txc, CompressorRef& c, int64_t pool,
+			bufferlist& in, CompressJob *j);
   int _do_alloc_write(
     TransContext *txc,
+    CollectionRef& c,
     WriteContext *wctx);
   void _wctx_finish(
     TransContext *txc,
@@ -0,0 +1,577 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+#include "HybridAllocator.h"
+#include "bluestore_types.h"
+#include "BlueStore.h"
+
+#define dout_subsys ceph_subsys_bluestore
+#undef dout_prefix
+#define dout_prefix *_dout << "hybridalloc "
+
+/// how many extents at or after the hint we look at before best fit
+static const unsigned HINT_PROBES = 8;
+
+HybridAllocator::HybridAllocator(int64_t bs)
+  : num_free(0),
+    num_uncommitted(0),
+    num_committing(0),
+    num_reserved(0),
+    block_size(bs),
+    max_extents(g_conf->bluestore_hybrid_alloc_max_extents),
+    bitmap_free(0),
+    last_alloc(0)
+{
+  assert(block_size > 0);
+  assert(ISP2(block_size));
+}
+
+HybridAllocator::~HybridAllocator()
+{
+}
+
+/// return the effective length of the extent if we align to alloc_unit
+static uint64_t aligned_len(uint64_t start, uint64_t len, uint64_t alloc_unit,
+			    uint64_t *aligned_start)
+{
+  uint64_t skew = start % alloc_unit;
+  if (skew)
+    skew = alloc_unit - skew;
+  *aligned_start = start + skew;
+  if (skew > len)
+    return 0;
+  else
+    return len - skew;
+}
+
+static inline uint64_t word_mask(unsigned start, unsigned len)
+{
+  return (len == 64 ? ~0ull : ((1ull << len) - 1)) << start;
+}
+
+// ---------------------------------------------------------------
+// range tree
+
+void HybridAllocator::_tree_insert(uint64_t offset, uint64_t length)
+{
+  uint64_t start, len;
+  range_tree.insert(offset, length, &start, &len);
+  if (start < offset) {
+    range_size_tree.erase(std::make_pair(offset - start, start));
+  }
+  if (start + len > offset + length) {
+    range_size_tree.erase(std::make_pair(start + len - offset - length,
+					 offset + length));
+  }
+  range_size_tree.insert(std::make_pair(len, start));
+}
+
+void HybridAllocator::_tree_remove(uint64_t start, uint64_t len,
+				   uint64_t offset, uint64_t length)
+{
+  assert(start <= offset && offset + length <= start + len);
+  range_tree.erase(offset, length);
+  range_size_tree.erase(std::make_pair(len, start));
+  if (offset > start) {
+    range_size_tree.insert(std::make_pair(offset - start, start));
+  }
+  if (start + len > offset + length) {
+    range_size_tree.insert(std::make_pair(start + len - offset - length,
+					  offset + length));
+  }
+}
+
+void HybridAllocator::_tree_spill()
+{
+  while ((uint64_t)range_tree.num_intervals() > max_extents) {
+    auto p = range_size_tree.begin();
+    uint64_t len = p->first;
+    uint64_t off = p->second;
+    dout(30) << __func__ << " " << off << "~" << len << dendl;
+    range_size_tree.erase(p);
+    range_tree.erase(off, len);
+    _bitmap_set(off / block_size, len / block_size);
+  }
+}
+
+bool HybridAllocator::_tree_pick(uint64_t want, uint64_t alloc_unit,
+				 uint64_t hint,
+				 uint64_t *offset, uint64_t *length)
+{
+  uint64_t start;
+
+  // near the hint, so that sequential allocations stay sequential
+  auto p = range_tree.lower_bound(hint);
+  for (unsigned i = 0; i < HINT_PROBES && p != range_tree.end(); ++i, ++p) {
+    if (aligned_len(p.get_start(), p.get_len(), alloc_unit, &start) >= want) {
+      *offset = start;
+      *length = want;
+      return true;
+    }
+  }
+
+  // best fit
+  for (auto q = range_size_tree.lower_bound(std::make_pair(want, (uint64_t)0));
+       q != range_size_tree.end();
+       ++q) {
+    if (aligned_len(q->second, q->first, alloc_unit, &start) >= want) {
+      *offset = start;
+      *length = want;
+      return true;
+    }
+  }
+
+  // nothing big enough; take what we can from the biggest
+  for (auto q = range_size_tree.rbegin();
+       q != range_size_tree.rend() && q->first >= alloc_unit;
+       ++q) {
+    uint64_t l = aligned_len(q->second, q->first, alloc_unit, &start);
+    if (l >= alloc_unit) {
+      *offset = start;
+      *length = l / alloc_unit * alloc_unit;
+      return true;
+    }
+  }
+  return false;
+}
+
+// ---------------------------------------------------------------
+// bitmap
+
+void HybridAllocator::_bitmap_set(uint64_t b, uint64_t n)
+{
+  bitmap_free += n * block_size;
+  while (n) {
+    bitmap_chunk_t& c = bitmap[b >> CHUNK_BITS];
+    uint64_t pos = b & (CHUNK_BLOCKS - 1);
+    uint64_t cnt = MIN(n, CHUNK_BLOCKS - pos);
+    c.num_free += cnt;
+    b += cnt;
+    n -= cnt;
+    while (cnt) {
+      unsigned s = pos % 64;
+      unsigned l = MIN(cnt, 64 - s);
+      uint64_t m = word_mask(s, l);
+      assert((c.words[pos / 64] & m) == 0);
+      c.words[pos / 64] |= m;
+      pos += l;
+      cnt -= l;
+    }
+  }
+}
+
+void HybridAllocator::_bitmap_clear(uint64_t b, uint64_t n)
+{
+  bitmap_free -= n * block_size;
+  assert(bitmap_free >= 0);
+  while (n) {
+    auto p = bitmap.find(b >> CHUNK_BITS);
+    assert(p != bitmap.end());
+    bitmap_chunk_t& c = p->second;
+    uint64_t pos = b & (CHUNK_BLOCKS - 1);
+    uint64_t cnt = MIN(n, CHUNK_BLOCKS - pos);
+    assert(c.num_free >= cnt);
+    c.num_free -= cnt;
+    b += cnt;
+    n -= cnt;
+    while (cnt) {
+      unsigned s = pos % 64;
+      unsigned l = MIN(cnt, 64 - s);
+      uint64_t m = word_mask(s, l);
+      assert((c.words[pos / 64] & m) == m);
+      c.words[pos / 64] &= ~m;
+      pos += l;
+      cnt -= l;
+    }
+    if (c.num_free == 0) {
+      bitmap.erase(p);
+    }
+  }
+}
+
+uint64_t HybridAllocator::_bitmap_next_free(uint64_t b, uint64_t end)
+{
+  while (b < end) {
+    auto p = bitmap.lower_bound(b >> CHUNK_BITS);
+    if (p == bitmap.end())
+      return end;
+    uint64_t base = p->first << CHUNK_BITS;
+    if (base > b)
+      b = base;
+    unsigned pos = b - base;
+    unsigned i = pos / 64;
+    uint64_t w = p->second.words[i] & (~0ull << (pos % 64));
+    while (true) {
+      if (w) {
+	uint64_t r = base + i * 64 + __builtin_ctzll(w);
+	return MIN(r, end);
+      }
+      if (++i == CHUNK_WORDS)
+	break;
+      w = p->second.words[i];
+    }
+    b = base + CHUNK_BLOCKS;
+  }
+  return end;
+}
+
+uint64_t HybridAllocator::_bitmap_next_used(uint64_t b, uint64_t end)
+{
+  while (b < end) {
+    auto p = bitmap.find(b >> CHUNK_BITS);
+    if (p == bitmap.end())
+      return b;
+    uint64_t base = p->first << CHUNK_BITS;
+    unsigned pos = b - base;
+    unsigned i = pos / 64;
+    uint64_t w = ~p->second.words[i] & (~0ull << (pos % 64));
+    while (true) {
+      if (w) {
+	uint64_t r = base + i * 64 + __builtin_ctzll(w);
+	return MIN(r, end);
+      }
+      if (++i == CHUNK_WORDS)
+	break;
+      w = ~p->second.words[i];
+    }
+    b = base + CHUNK_BLOCKS;
+  }
+  return end;
+}
+
+/// first block of the free run that ends at (not including) b
+uint64_t HybridAllocator::_bitmap_run_start(uint64_t b)
+{
+  while (b > 0) {
+    auto p = bitmap.find((b - 1) >> CHUNK_BITS);
+    if (p == bitmap.end())
+      return b;
+    uint64_t base = p->first << CHUNK_BITS;
+    unsigned pos = b - 1 - base;
+    int i = pos / 64;
+    unsigned sh = 63 - pos % 64;
+    uint64_t w = ~p->second.words[i] << sh;
+    while (true) {
+      if (w) {
+	return base + i * 64 + (63 - __builtin_clzll(w)) - sh + 1;
+      }
+      if (i == 0)
+	break;
+      --i;
+      sh = 0;
+      w = ~p->second.words[i];
+    }
+    b = base;
+  }
+  return 0;
+}
+
+bool HybridAllocator::_bitmap_pick(uint64_t want, uint64_t alloc_unit,
+				   uint64_t hint,
+				   uint64_t *offset, uint64_t *length)
+{
+  if (bitmap.empty())
+    return false;
+  uint64_t au = alloc_unit / block_size;
+  uint64_t want_blocks = want / block_size;
+  uint64_t end = _bitmap_end();
+  uint64_t from = MIN(hint / block_size, end);
+
+  // first fit, from the hint to the end and then wrap around
+  for (unsigned pass = 0; pass < 2; ++pass) {
+    uint64_t b = pass ? 0 : from;
+    uint64_t stop = pass ? from : end;
+    while (b < stop) {
+      uint64_t s = _bitmap_next_free(b, stop);
+      if (s >= stop)
+	break;
+      uint64_t e = _bitmap_next_used(s, end);
+      uint64_t as = ROUND_UP_TO(s, au);
+      if (as + au <= e) {
+	*offset = as * block_size;
+	*length = MIN(want_blocks, (e - as) / au * au) * block_size;
+	return true;
+      }
+      b = e;
+    }
+  }
+  return false;
+}
+
+// ---------------------------------------------------------------
+
+void HybridAllocator::_insert_free(uint64_t off, uint64_t len)
+{
+  dout(30) << __func__ << " " << off << "~" << len << dendl;
+  assert(off % block_size == 0);
+  assert(len % block_size == 0);
+
+  // pull in any neighboring space sitting in the bitmap so that it can
+  // coalesce back into a big extent
+  if (!bitmap.empty()) {
+    uint64_t b = off / block_size;
+    uint64_t e = b + len / block_size;
+    uint64_t s = _bitmap_run_start(b);
+    if (s < b) {
+      _bitmap_clear(s, b - s);
+      off = s * block_size;
+      len += (b - s) * block_size;
+    }
+    uint64_t n = _bitmap_next_used(e, _bitmap_end());
+    if (n > e) {
+      _bitmap_clear(e, n - e);
+      len += (n - e) * block_size;
+    }
+  }
+  _tree_insert(off, len);
+  _tree_spill();
+}
+
+void HybridAllocator::_remove_free(uint64_t offset, uint64_t length)
+{
+  auto p = range_tree.lower_bound(offset);
+  if (p != range_tree.end() && p.get_start() <= offset) {
+    _tree_remove(p.get_start(), p.get_len(), offset, length);
+    _tree_spill();
+  } else {
+    _bitmap_clear(offset / block_size, length / block_size);
+  }
+}
+
+int HybridAllocator::reserve(uint64_t need)
+{
+  std::lock_guard<std::mutex> l(lock);
+  dout(10) << __func__ << " need " << need << " num_free " << num_free
+	   << " num_reserved " << num_reserved << dendl;
+  if ((int64_t)need > num_free - num_reserved)
+    return -ENOSPC;
+  num_reserved += need;
+  return 0;
+}
+
+void HybridAllocator::unreserve(uint64_t unused)
+{
+  std::lock_guard<std::mutex> l(lock);
+  dout(10) << __func__ << " unused " << unused << " num_free " << num_free
+	   << " num_reserved " << num_reserved << dendl;
+  assert(num_reserved >= (int64_t)unused);
+  num_reserved -= unused;
+}
+
+int HybridAllocator::allocate(
+  uint64_t want_size, uint64_t alloc_unit, int64_t hint,
+  uint64_t *offset, uint32_t *length)
+{
+  std::lock_guard<std::mutex> l(lock);
+  dout(10) << __func__ << " want_size " << want_size
+	   << " alloc_unit " << alloc_unit
+	   << " hint " << hint
+	   << dendl;
+  assert(alloc_unit);
+  assert(alloc_unit % block_size == 0);
+  uint64_t want = ROUND_UP_TO(MAX(alloc_unit, want_size), block_size);
+
+  if (!hint)
+    hint = last_alloc;
+
+  uint64_t off, len;
+  bool from_tree = _tree_pick(want, alloc_unit, hint, &off, &len);
+  if (!from_tree && !_bitmap_pick(want, alloc_unit, hint, &off, &len)) {
+    dout(10) << __func__ << " no space, tree " << range_tree.num_intervals()
+	     << " extents, bitmap " << bitmap_free << " bytes" << dendl;
+    return -ENOSPC;
+  }
+
+  if (g_conf->bluestore_debug_small_allocations) {
+    uint64_t max =
+      alloc_unit * (rand() % g_conf->bluestore_debug_small_allocations);
+    if (max && len > max) {
+      dout(10) << __func__ << " shortening allocation of " << len << " -> "
+	       << max << " due to debug_small_allocations" << dendl;
+      len = max;
+    }
+  }
+  dout(30) << __func__ << " got " << off << "~" << len
+	   << (from_tree ? " from tree" : " from bitmap") << dendl;
+
+  _remove_free(off, len);
+  *offset = off;
+  *length = len;
+
+  num_free -= len;
+  num_reserved -= len;
+  assert(num_free >= 0);
+  assert(num_reserved >= 0);
+  last_alloc = off + len;
+  return 0;
+}
+
+int HybridAllocator::alloc_extents(
+  uint64_t want_size, uint64_t alloc_unit, uint64_t max_alloc_size,
+  int64_t hint, std::vector<AllocExtent> *extents, int *count)
+{
+  uint64_t allocated_size = 0;
+  uint64_t offset = 0;
+  uint32_t length = 0;
+  int res = 0;
+
+  if (max_alloc_size == 0) {
+    max_alloc_size = want_size;
+  }
+
+  ExtentList block_list = ExtentList(extents, 1, max_alloc_size);
+
+  while (allocated_size < want_size) {
+    res = allocate(MIN(max_alloc_size, (want_size - allocated_size)),
+       alloc_unit, hint, &offset, &length);
+    if (res != 0) {
+      /*
+       * Allocation failed.
+       */
+      break;
+    }
+    block_list.add_extents(offset, length);
+    allocated_size += length;
+    hint = offset + length;
+  }
+
+  *count = block_list.get_extent_count();
+  if (want_size - allocated_size > 0) {
+    release_extents(extents, *count);
+    return -ENOSPC;
+  }
+
+  return 0;
+}
+
+int HybridAllocator::release(
+  uint64_t offset, uint64_t length)
+{
+  std::lock_guard<std::mutex> l(lock);
+  dout(10) << __func__ << " " << offset << "~" << length << dendl;
+  uncommitted.insert(offset, length);
+  num_uncommitted += length;
+  return 0;
+}
+
+uint64_t HybridAllocator::get_free()
+{
+  std::lock_guard<std::mutex> l(lock);
+  return num_free;
+}
+
+void HybridAllocator::dump(ostream& out)
+{
+  std::lock_guard<std::mutex> l(lock);
+  dout(30) << __func__ << " tree: " << range_tree.num_intervals()
+	   << " extents (max " << max_extents << ")" << dendl;
+  for (auto p = range_tree.begin();
+       p != range_tree.end();
+       ++p) {
+    dout(30) << __func__ << "  " << p.get_start() << "~" << p.get_len() << dendl;
+  }
+  dout(30) << __func__ << " bitmap: " << bitmap_free << " bytes in "
+	   << bitmap.size() << " chunks" << dendl;
+  uint64_t end = _bitmap_end();
+  uint64_t b = _bitmap_next_free(0, end);
+  while (b < end) {
+    uint64_t e = _bitmap_next_used(b, end);
+    dout(30) << __func__ << "  " << b * block_size << "~"
+	     << (e - b) * block_size << dendl;
+    b = _bitmap_next_free(e, end);
+  }
+  dout(30) << __func__ << " committing: "
+	   << committing.num_intervals() << " extents" << dendl;
+  for (auto p = committing.begin();
+       p != committing.end();
+       ++p) {
+    dout(30) << __func__ << "  " << p.get_start() << "~" << p.get_len() << dendl;
+  }
+  dout(30) << __func__ << " uncommitted: "
+	   << uncommitted.num_intervals() << " extents" << dendl;
+  for (auto p = uncommitted.begin();
+       p != uncommitted.end();
+       ++p) {
+    dout(30) << __func__ << "  " << p.get_start() << "~" << p.get_len() << dendl;
+  }
+}
+
+void HybridAllocator::init_add_free(uint64_t offset, uint64_t length)
+{
+  std::lock_guard<std::mutex> l(lock);
+  dout(10) << __func__ << " " << offset << "~" << length << dendl;
+  uint64_t offset_adj = ROUND_UP_TO(offset, block_size);
+  if (offset_adj - offset >= length)
+    return;
+  uint64_t length_adj = P2ALIGN(length - (offset_adj - offset), block_size);
+  if (!length_adj)
+    return;
+  _insert_free(offset_adj, length_adj);
+  num_free += length_adj;
+}
+
+void HybridAllocator::init_rm_free(uint64_t offset, uint64_t length)
+{
+  std::lock_guard<std::mutex> l(lock);
+  dout(10) << __func__ << " " << offset << "~" << length << dendl;
+  // we use the same adjustment/alignment that init_add_free does
+  // above so that we can yank back some of the space.
+  uint64_t offset_adj = ROUND_UP_TO(offset, block_size);
+  if (offset_adj - offset >= length)
+    return;
+  uint64_t length_adj = P2ALIGN(length - (offset_adj - offset), block_size);
+  if (!length_adj)
+    return;
+
+  btree_interval_set<uint64_t> rm;
+  rm.insert(offset_adj, length_adj);
+  btree_interval_set<uint64_t> overlap;
+  overlap.intersection_of(rm, range_tree);
+  for (auto p = overlap.begin(); p != overlap.end(); ++p) {
+    dout(20) << __func__ << " tree rm " << p.get_start() << "~" << p.get_len()
+	     << dendl;
+    auto q = range_tree.lower_bound(p.get_start());
+    assert(q != range_tree.end());
+    _tree_remove(q.get_start(), q.get_len(), p.get_start(), p.get_len());
+  }
+  rm.subtract(overlap);
+  for (auto p = rm.begin(); p != rm.end(); ++p) {
+    dout(20) << __func__ << " bitmap rm " << p.get_start() << "~"
+	     << p.get_len() << dendl;
+    _bitmap_clear(p.get_start() / block_size, p.get_len() / block_size);
+  }
+  _tree_spill();
+  num_free -= length_adj;
+  assert(num_free >= 0);
+}
+
+void HybridAllocator::shutdown()
+{
+  dout(1) << __func__ << dendl;
+}
+
+void HybridAllocator::commit_start()
+{
+  std::lock_guard<std::mutex> l(lock);
+  dout(10) << __func__ << " releasing " << num_uncommitted
+	   << " in extents " << uncommitted.num_intervals() << dendl;
+  assert(committing.empty());
+  committing.swap(uncommitted);
+  num_committing = num_uncommitted;
+  num_uncommitted = 0;
+}
+
+void HybridAllocator::commit_finish()
+{
+  std::lock_guard<std::mutex> l(lock);
+  dout(10) << __func__ << " released " << num_committing
+	   << " in extents " << committing.num_intervals() << dendl;
+  for (auto p = committing.begin();
+       p != committing.end();
+       ++p) {
+    _insert_free(p.get_start(), p.get_len());
+  }
+  committing.clear();
+  num_free += num_committing;
+  num_committing = 0;
+}
@@ -0,0 +1,118 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+#ifndef CEPH_OS_BLUESTORE_HYBRIDALLOCATOR_H
+#define CEPH_OS_BLUESTORE_HYBRIDALLOCATOR_H
+
+#include <string.h>
+#include <mutex>
+#include <map>
+#include <set>
+
+#include "Allocator.h"
+#include "include/btree_interval_set.h"
+#include "os/bluestore/bluestore_types.h"
+
+/**
+ * Range tree for the big extents, bitmap for the crumbs.
+ *
+ * Free space lives in a btree_interval_set (plus a by-size index used
+ * for best fit) until the number of extents reaches
+ * bluestore_hybrid_alloc_max_extents.  Past that the smallest extents
+ * are spilled into a sparse bitmap with one bit per block, so memory
+ * use stays bounded no matter how fragmented the device gets, while
+ * the common case of carving an allocation out of a big extent stays
+ * O(log n).  The bitmap is only scanned when the tree has nothing
+ * usable left.
+ *
+ * Everything is kept in block_size units; like BitMapAllocator,
+ * init_add_free() and init_rm_free() trim unaligned edges.
+ */
+class HybridAllocator : public Allocator {
+  std::mutex lock;
+
+  int64_t num_free;     ///< total bytes in freelist (tree + bitmap)
+  int64_t num_uncommitted;
+  int64_t num_committing;
+  int64_t num_reserved; ///< reserved bytes
+
+  uint64_t block_size;
+  uint64_t max_extents; ///< max extents in range_tree before spilling
+
+  btree_interval_set<uint64_t> range_tree; ///< big free extents
+  std::set<std::pair<uint64_t,uint64_t> > range_size_tree; ///< (len, offset)
+
+  static const unsigned CHUNK_BITS = 15;   ///< log2(blocks per chunk)
+  static const uint64_t CHUNK_BLOCKS = 1ull << CHUNK_BITS;
+  static const unsigned CHUNK_WORDS = CHUNK_BLOCKS / 64;
+
+  struct bitmap_chunk_t {
+    uint32_t num_free = 0;           ///< set bits
+    uint64_t words[CHUNK_WORDS];     ///< 1 == free
+    bitmap_chunk_t() {
+      memset(words, 0, sizeof(words));
+    }
+  };
+  std::map<uint64_t, bitmap_chunk_t> bitmap; ///< chunk index -> chunk
+  int64_t bitmap_free;                        ///< bytes free in bitmap
+
+  btree_interval_set<uint64_t> uncommitted; ///< released but not yet usable
+  btree_interval_set<uint64_t> committing;  ///< released but not yet usable
+
+  uint64_t last_alloc;
+
+  // range tree
+  void _tree_insert(uint64_t offset, uint64_t length);
+  void _tree_remove(uint64_t start, uint64_t len,
+		    uint64_t offset, uint64_t length);
+  void _tree_spill();
+  bool _tree_pick(uint64_t want, uint64_t alloc_unit, uint64_t hint,
+		  uint64_t *offset, uint64_t *length);
+
+  // bitmap (all in blocks)
+  void _bitmap_set(uint64_t b, uint64_t n);
+  void _bitmap_clear(uint64_t b, uint64_t n);
+  uint64_t _bitmap_next_free(uint64_t b, uint64_t end);
+  uint64_t _bitmap_next_used(uint64_t b, uint64_t end);
+  uint64_t _bitmap_run_start(uint64_t b);
+  uint64_t _bitmap_end() {
+    return bitmap.empty() ? 0 : (bitmap.rbegin()->first + 1) << CHUNK_BITS;
+  }
+  bool _bitmap_pick(uint64_t want, uint64_t alloc_unit, uint64_t hint,
+		    uint64_t *offset, uint64_t *length);
+
+  void _insert_free(uint64_t offset, uint64_t length);
+  void _remove_free(uint64_t offset, uint64_t length);
+
+public:
+  explicit HybridAllocator(int64_t block_size);
+  ~HybridAllocator();
+
+  int reserve(uint64_t need);
+  void unreserve(uint64_t unused);
+
+  int alloc_extents(
+    uint64_t want_size, uint64_t alloc_unit, uint64_t max_alloc_size,
+    int64_t hint, std::vector<AllocExtent> *extents, int *count);
+
+  int allocate(
+    uint64_t want_size, uint64_t alloc_unit, int64_t hint,
+    uint64_t *offset, uint32_t *length);
+
+  int release(
+    uint64_t offset, uint64_t length);
+
+  void commit_start();
+  void commit_finish();
+
+  uint64_t get_free();
+
+  void dump(std::ostream& out);
+
+  void init_add_free(uint64_t offset, uint64_t length);
+  void init_rm_free(uint64_t offset, uint64_t length);
+
+  void shutdown();
+};
+
+#endif
@@ -26,6 +26,8 @@
 #include "common/debug.h"
 #include "common/blkdev.h"
 #include "common/align.h"
+#include "common/perf_counters.h"
+#include "include/stringify.h"
 
 #define dout_subsys ceph_subsys_bdev
 #undef dout_prefix
@@ -38,11 +40,9 @@ KernelDevice::KernelDevice(aio_callback_t cb, void *cbpriv)
     fs(NULL), aio(false), dio(false),
     debug_lock("KernelDevice::debug_lock"),
     flush_lock("KernelDevice::flush_lock"),
-    aio_queue(g_conf->bdev_aio_max_queue_depth),
     aio_callback(cb),
     aio_callback_priv(cbpriv),
     aio_stop(false),
-    aio_thread(this),
     injecting_crash(0)
 {
   zeros = buffer::create_page_aligned(1048576);
@@ -216,13 +216,46 @@ int KernelDevice::flush()
 int KernelDevice::_aio_start()
 {
   if (aio) {
-    dout(10) << __func__ << dendl;
-    int r = aio_queue.init();
-    if (r < 0) {
-      derr << __func__ << " failed: " << cpp_strerror(r) << dendl;
-      return r;
+    int n = MAX(1, g_conf->bdev_aio_queues);
+    dout(10) << __func__ << " " << n << " queues" << dendl;
+    // the same path can be open more than once in a process (e.g., by
+    // bluestore and by bluefs on a shared device), so number the device
+    // as well as the queue to keep the perf counter names unique
+    static std::atomic<unsigned> next_dev = {0};
+    string name = path.substr(path.rfind('/') + 1) + "." +
+      stringify(next_dev++);
+    for (int i = 0; i < n; ++i) {
+      AioQueue *q = new AioQueue(this, i);
+      int r = q->q.init();
+      if (r < 0) {
+	derr << __func__ << " failed: " << cpp_strerror(r) << dendl;
+	delete q;
+	_aio_stop();
+	return r;
+      }
+
+      PerfCountersBuilder b(g_ceph_context,
+			    "bdev-" + name + "-aio_queue." + stringify(i),
+			    l_bdev_first, l_bdev_last);
+      b.add_u64_counter(l_bdev_aio_submit_calls, "aio_submit_calls", "io_submit syscalls");
+      b.add_u64_counter(l_bdev_aio_submitted, "aio_submitted", "aios submitted");
+      b.add_u64_counter(l_bdev_aio_reaps, "aio_reaps", "io_getevents calls that returned completions");
+      b.add_u64_counter(l_bdev_aio_empty_polls, "aio_empty_polls", "io_getevents calls that returned nothing");
+      b.add_time_avg(l_bdev_aio_lat, "aio_lat", "Average aio latency");
+      b.add_u64_counter(l_bdev_aio_lat_16us, "aio_lat_16us", "aios completed in < 16us");
+      b.add_u64_counter(l_bdev_aio_lat_64us, "aio_lat_64us", "aios completed in 16us..64us");
+      b.add_u64_counter(l_bdev_aio_lat_256us, "aio_lat_256us", "aios completed in 64us..256us");
+      b.add_u64_counter(l_bdev_aio_lat_1ms, "aio_lat_1ms", "aios completed in 256us..1ms");
+      b.add_u64_counter(l_bdev_aio_lat_4ms, "aio_lat_4ms", "aios completed in 1ms..4ms");
+      b.add_u64_counter(l_bdev_aio_lat_16ms, "aio_lat_16ms", "aios completed in 4ms..16ms");
+      b.add_u64_counter(l_bdev_aio_lat_64ms, "aio_lat_64ms", "aios completed in 16ms..64ms");
+      b.add_u64_counter(l_bdev_aio_lat_inf, "aio_lat_inf", "aios completed in >= 64ms");
+      q->logger = b.create_perf_counters();
+      g_ceph_context->get_perfcounters_collection()->add(q->logger);
+
+      aio_queues.push_back(q);
+      q->create("bstore_aio");
     }
-    aio_thread.create("bstore_aio");
   }
   return 0;
 }
@@ -232,28 +265,71 @@ void KernelDevice::_aio_stop()
   if (aio) {
     dout(10) << __func__ << dendl;
     aio_stop = true;
-    aio_thread.join();
+    for (auto q : aio_queues) {
+      q->join();
+      q->q.shutdown();
+      g_ceph_context->get_perfcounters_collection()->remove(q->logger);
+      delete q->logger;
+      delete q;
+    }
+    aio_queues.clear();
     aio_stop = false;
-    aio_queue.shutdown();
   }
 }
 
-void KernelDevice::_aio_thread()
+KernelDevice::AioQueue *KernelDevice::_get_aio_queue(IOContext *ioc)
 {
-  dout(10) << __func__ << " start" << dendl;
-  int inject_crash_count = 0;
+  if (ioc->shard_hint >= 0) {
+    return aio_queues[ioc->shard_hint % aio_queues.size()];
+  }
+  // no hint: each submitting thread picks a queue once and sticks to it
+  static std::atomic<unsigned> next_thread = {0};
+  static thread_local unsigned thread_idx = next_thread++;
+  return aio_queues[thread_idx % aio_queues.size()];
+}
+
+static int aio_lat_bucket(utime_t lat)
+{
+  uint64_t us = lat.to_nsec() / 1000;
+  int b = l_bdev_aio_lat_16us;
+  for (uint64_t bound = 16; b < l_bdev_aio_lat_inf && us >= bound; bound <<= 2)
+    ++b;
+  return b;
+}
+
+void KernelDevice::_aio_thread(AioQueue *aq)
+{
+  dout(10) << __func__ << " " << aq->idx << " start" << dendl;
+  utime_t inject_crash_start;
+  utime_t last_event = ceph_clock_now(NULL);
+  double busy_poll = g_conf->bdev_aio_busy_poll_us / 1000000.0;
   while (!aio_stop) {
     dout(40) << __func__ << " polling" << dendl;
     int max = 16;
     FS::aio_t *aio[max];
-    int r = aio_queue.get_next_completed(g_conf->bdev_aio_poll_ms,
-					 aio, max);
+    // with busy polling, spin for a while after the last completion
+    // before going back to sleeping in the kernel
+    int timeout_ms = g_conf->bdev_aio_poll_ms;
+    if (busy_poll > 0 &&
+	(double)(ceph_clock_now(NULL) - last_event) < busy_poll) {
+      timeout_ms = 0;
+    }
+    int r = aq->q.get_next_completed(timeout_ms, aio, max);
     if (r < 0) {
       derr << __func__ << " got " << cpp_strerror(r) << dendl;
     }
+    if (r == 0) {
+      aq->logger->inc(l_bdev_aio_empty_polls);
+    }
     if (r > 0) {
       dout(30) << __func__ << " got " << r << " completed aios" << dendl;
+      utime_t now = ceph_clock_now(NULL);
+      last_event = now;
+      aq->logger->inc(l_bdev_aio_reaps);
       for (int i = 0; i < r; ++i) {
+	utime_t lat = now - aio[i]->submitted;
+	aq->logger->tinc(l_bdev_aio_lat, lat);
+	aq->logger->inc(aio_lat_bucket(lat));
 	IOContext *ioc = static_cast<IOContext*>(aio[i]->priv);
 	_aio_log_finish(ioc, aio[i]->offset, aio[i]->length);
 	int left = --ioc->num_running;
@@ -274,8 +350,12 @@ void KernelDevice::_aio_thread()
     }
     reap_ioc();
     if (g_conf->bdev_inject_crash) {
-      ++inject_crash_count;
-      if (inject_crash_count * g_conf->bdev_aio_poll_ms / 1000 >
+      // go by the clock rather than counting polls, which don't take
+      // bdev_aio_poll_ms each when we are busy polling or busy
+      utime_t now = ceph_clock_now(NULL);
+      if (inject_crash_start == utime_t())
+	inject_crash_start = now;
+      if ((double)(now - inject_crash_start) >
 	  g_conf->bdev_inject_crash + g_conf->bdev_inject_crash_flush_delay) {
 	derr << __func__ << " bdev_inject_crash trigger from aio thread"
 	     << dendl;
@@ -338,34 +418,33 @@ void KernelDevice::aio_submit(IOContext *ioc)
   ioc->num_pending -= pending;
   assert(ioc->num_pending.load() == 0);  // we should be only thread doing this
 
-  bool done = false;
-  while (!done) {
-    FS::aio_t& aio = *p;
+  if (p == e) {
+    return;
+  }
+  for (list<FS::aio_t>::iterator q = p; q != e; ++q) {
+    FS::aio_t& aio = *q;
     aio.priv = static_cast<void*>(ioc);
     dout(20) << __func__ << "  aio " << &aio << " fd " << aio.fd
 	     << " 0x" << std::hex << aio.offset << "~" << aio.length
 	     << std::dec << dendl;
-    for (vector<iovec>::iterator q = aio.iov.begin(); q != aio.iov.end(); ++q)
-      dout(30) << __func__ << "   iov " << (void*)q->iov_base
-	       << " len " << q->iov_len << dendl;
-
-    // be careful: as soon as we submit aio we race with completion.
-    // since we are holding a ref take care not to dereference txc at
-    // all after that point.
-    list<FS::aio_t>::iterator cur = p;
-    ++p;
-    done = (p == e);
-
-    // do not dereference txc (or it's contents) after we submit (if
-    // done == true and we don't loop)
-    int retries = 0;
-    int r = aio_queue.submit(*cur, &retries);
-    if (retries)
-      derr << __func__ << " retries " << retries << dendl;
-    if (r) {
-      derr << " aio submit got " << cpp_strerror(r) << dendl;
-      assert(r == 0);
-    }
+    for (vector<iovec>::iterator v = aio.iov.begin(); v != aio.iov.end(); ++v)
+      dout(30) << __func__ << "   iov " << (void*)v->iov_base
+	       << " len " << v->iov_len << dendl;
+  }
+
+  // be careful: as soon as we submit aio we race with completion.
+  // since we are holding a ref take care not to dereference txc (or
+  // ioc, or the aios) at all after that point.
+  AioQueue *aq = _get_aio_queue(ioc);
+  int retries = 0, calls = 0;
+  int r = aq->q.submit_batch(p, e, &retries, &calls);
+  aq->logger->inc(l_bdev_aio_submit_calls, calls);
+  aq->logger->inc(l_bdev_aio_submitted, pending);
+  if (retries)
+    derr << __func__ << " retries " << retries << dendl;
+  if (r) {
+    derr << " aio submit got " << cpp_strerror(r) << dendl;
+    assert(r == 0);
   }
 }
 
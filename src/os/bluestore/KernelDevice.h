@@ -22,6 +22,28 @@
 
 #include "BlockDevice.h"
 
+class PerfCounters;
+
+// per aio queue
+enum {
+  l_bdev_first = 732700,
+  l_bdev_aio_submit_calls,   ///< io_submit syscalls
+  l_bdev_aio_submitted,      ///< aios submitted
+  l_bdev_aio_reaps,          ///< io_getevents calls that returned events
+  l_bdev_aio_empty_polls,    ///< io_getevents calls that returned nothing
+  l_bdev_aio_lat,
+  // aio latency histogram, by upper bound
+  l_bdev_aio_lat_16us,
+  l_bdev_aio_lat_64us,
+  l_bdev_aio_lat_256us,
+  l_bdev_aio_lat_1ms,
+  l_bdev_aio_lat_4ms,
+  l_bdev_aio_lat_16ms,
+  l_bdev_aio_lat_64ms,
+  l_bdev_aio_lat_inf,
+  l_bdev_last
+};
+
 class KernelDevice : public BlockDevice {
   int fd_direct, fd_buffered;
   uint64_t size;
@@ -37,23 +59,37 @@ class KernelDevice : public BlockDevice {
   Mutex flush_lock;
   atomic_t io_since_flush;
 
-  FS::aio_queue_t aio_queue;
   aio_callback_t aio_callback;
   void *aio_callback_priv;
   bool aio_stop;
 
-  struct AioCompletionThread : public Thread {
+  /**
+   * An aio context and the thread that reaps it.  IOContexts with a
+   * shard_hint always use the same queue (see _get_aio_queue), so with
+   * a queue per op shard the completion is handled by a thread that
+   * only ever sees that shard's io.
+   */
+  struct AioQueue : public Thread {
     KernelDevice *bdev;
-    explicit AioCompletionThread(KernelDevice *b) : bdev(b) {}
+    unsigned idx;
+    FS::aio_queue_t q;
+    PerfCounters *logger = nullptr;
+
+    AioQueue(KernelDevice *b, unsigned i)
+      : bdev(b),
+	idx(i),
+	q(g_conf->bdev_aio_max_queue_depth) {}
     void *entry() {
-      bdev->_aio_thread();
+      bdev->_aio_thread(this);
       return NULL;
     }
-  } aio_thread;
+  };
+  vector<AioQueue*> aio_queues;
 
   std::atomic_int injecting_crash;
 
-  void _aio_thread();
+  AioQueue *_get_aio_queue(IOContext *ioc);
+  void _aio_thread(AioQueue *q);
   int _aio_start();
   void _aio_stop();
 
@@ -0,0 +1,275 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * Copyright (C) 2016 Red Hat
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "MemDevice.h"
+#include "include/types.h"
+#include "common/errno.h"
+#include "common/debug.h"
+
+#define dout_subsys ceph_subsys_bdev
+#undef dout_prefix
+#define dout_prefix *_dout << "bdev-mem(" << path << ") "
+
+// path -> mapping; see MemDevice.h
+namespace {
+struct mem_region_t {
+  char *data;
+  uint64_t size;
+};
+std::mutex regions_lock;
+std::map<string, mem_region_t> regions;
+
+char *get_region(const string& path, uint64_t size)
+{
+  std::lock_guard<std::mutex> l(regions_lock);
+  auto p = regions.find(path);
+  if (p != regions.end()) {
+    if (p->second.size == size)
+      return p->second.data;
+    ::munmap(p->second.data, p->second.size);
+    regions.erase(p);
+  }
+  void *m = MAP_FAILED;
+  if (g_conf->bdev_mem_hugepages) {
+    m = ::mmap(NULL, size, PROT_READ | PROT_WRITE,
+	       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_HUGETLB,
+	       -1, 0);
+  }
+  if (m == MAP_FAILED) {
+    m = ::mmap(NULL, size, PROT_READ | PROT_WRITE,
+	       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+	       -1, 0);
+    if (m == MAP_FAILED)
+      return nullptr;
+#ifdef MADV_HUGEPAGE
+    if (g_conf->bdev_mem_hugepages)
+      ::madvise(m, size, MADV_HUGEPAGE);
+#endif
+  }
+  regions[path] = mem_region_t{static_cast<char*>(m), size};
+  return static_cast<char*>(m);
+}
+}
+
+MemDevice::MemDevice(aio_callback_t cb, void *cbpriv, bool d)
+  : discard(d),
+    aio_callback(cb),
+    aio_callback_priv(cbpriv),
+    aio_thread(this)
+{
+  rotational = false;
+}
+
+int MemDevice::open(string p)
+{
+  path = p;
+  dout(1) << __func__ << " path " << path
+	  << (discard ? " (null)" : "") << dendl;
+
+  // take the size from the backing file, so that the store is laid out
+  // exactly as it would be on a real device of that size
+  struct stat st;
+  int r = ::stat(path.c_str(), &st);
+  if (r < 0) {
+    r = -errno;
+    derr << __func__ << " stat got " << cpp_strerror(r) << dendl;
+    return r;
+  }
+  size = st.st_size;
+  block_size = g_conf->bdev_block_size;
+
+  if (!discard) {
+    data = get_region(path, size);
+    if (!data) {
+      r = -errno;
+      derr << __func__ << " unable to map " << size << " bytes: "
+	   << cpp_strerror(r) << dendl;
+      return r;
+    }
+  }
+
+  if (g_conf->bdev_mem_aio_thread) {
+    aio_stop = false;
+    aio_thread.create("bstore_mem_aio");
+  }
+
+  dout(1) << __func__
+	  << " size " << size
+	  << " (0x" << std::hex << size << std::dec << ", "
+	  << pretty_si_t(size) << "B)"
+	  << " block_size " << block_size
+	  << " (" << pretty_si_t(block_size) << "B)"
+	  << dendl;
+  return 0;
+}
+
+void MemDevice::close()
+{
+  dout(1) << __func__ << dendl;
+  if (aio_thread.is_started()) {
+    {
+      std::lock_guard<std::mutex> l(aio_lock);
+      aio_stop = true;
+      aio_cond.notify_all();
+    }
+    aio_thread.join();
+  }
+  data = nullptr;  // the region stays with the path
+  path.clear();
+}
+
+int MemDevice::flush()
+{
+  return 0;
+}
+
+void MemDevice::_inject_latency()
+{
+  if (g_conf->bdev_mem_latency_us) {
+    utime_t t;
+    t.set_from_double(g_conf->bdev_mem_latency_us / 1000000.0);
+    t.sleep();
+  }
+}
+
+void MemDevice::_aio_finish(IOContext *ioc)
+{
+  ioc->num_running = 0;
+  // check waiting count before doing callback (which may destroy this
+  // ioc).
+  ioc->aio_wake();
+  if (ioc->priv) {
+    aio_callback(aio_callback_priv, ioc->priv);
+  }
+}
+
+void MemDevice::_aio_thread()
+{
+  dout(10) << __func__ << " start" << dendl;
+  std::unique_lock<std::mutex> l(aio_lock);
+  while (true) {
+    if (aio_queue.empty()) {
+      if (aio_stop)
+	break;
+      aio_cond.wait(l);
+      continue;
+    }
+    utime_t now = ceph_clock_now(g_ceph_context);
+    aio_batch_t b = aio_queue.front();
+    if (b.due > now) {
+      l.unlock();
+      (b.due - now).sleep();
+      l.lock();
+      continue;
+    }
+    aio_queue.pop_front();
+    l.unlock();
+    dout(20) << __func__ << " finish ioc " << b.ioc << dendl;
+    _aio_finish(b.ioc);
+    reap_ioc();
+    l.lock();
+  }
+  dout(10) << __func__ << " end" << dendl;
+}
+
+void MemDevice::aio_submit(IOContext *ioc)
+{
+  int pending = ioc->num_pending.load();
+  dout(20) << __func__ << " ioc " << ioc << " pending " << pending << dendl;
+  if (pending == 0)
+    return;
+  ioc->num_running += pending;
+  ioc->num_pending -= pending;
+
+  aio_batch_t b;
+  b.ioc = ioc;
+  b.due = ceph_clock_now(g_ceph_context);
+  b.due += (double)g_conf->bdev_mem_latency_us / 1000000.0;
+  std::lock_guard<std::mutex> l(aio_lock);
+  aio_queue.push_back(b);
+  aio_cond.notify_all();
+}
+
+int MemDevice::aio_write(
+  uint64_t off,
+  bufferlist &bl,
+  IOContext *ioc,
+  bool buffered)
+{
+  uint64_t len = bl.length();
+  dout(20) << __func__ << " 0x" << std::hex << off << "~" << len << std::dec
+	   << dendl;
+  assert(off % block_size == 0);
+  assert(len % block_size == 0);
+  assert(len > 0);
+  assert(off < size);
+  assert(off + len <= size);
+
+  if (!discard) {
+    bl.copy(0, len, data + off);
+  }
+  if (aio_thread.is_started()) {
+    // completed by _aio_thread after aio_submit
+    ++ioc->num_pending;
+  } else {
+    _inject_latency();
+  }
+  return 0;
+}
+
+int MemDevice::read(uint64_t off, uint64_t len, bufferlist *pbl,
+		    IOContext *ioc,
+		    bool buffered)
+{
+  dout(5) << __func__ << " 0x" << std::hex << off << "~" << len << std::dec
+	  << dendl;
+  assert(off % block_size == 0);
+  assert(len % block_size == 0);
+  assert(len > 0);
+  assert(off < size);
+  assert(off + len <= size);
+
+  bufferptr p = buffer::create_page_aligned(len);
+  if (discard) {
+    p.zero();
+  } else {
+    memcpy(p.c_str(), data + off, len);
+  }
+  pbl->clear();
+  pbl->push_back(std::move(p));
+  return 0;
+}
+
+int MemDevice::read_random(uint64_t off, uint64_t len, char *buf,
+			   bool buffered)
+{
+  dout(5) << __func__ << " 0x" << std::hex << off << "~" << len << std::dec
+	  << dendl;
+  assert(off + len <= size);
+  if (discard) {
+    memset(buf, 0, len);
+  } else {
+    memcpy(buf, data + off, len);
+  }
+  return 0;
+}
+
+int MemDevice::invalidate_cache(uint64_t off, uint64_t len)
+{
+  return 0;
+}
@@ -0,0 +1,104 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * Copyright (C) 2016 Red Hat
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+#ifndef CEPH_OS_BLUESTORE_MEMDEVICE_H
+#define CEPH_OS_BLUESTORE_MEMDEVICE_H
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+#include "common/Thread.h"
+#include "include/utime.h"
+#include "BlockDevice.h"
+
+/**
+ * A BlockDevice in memory, for taking the disk out of benchmarks.
+ *
+ * bdev_type = mem keeps the data in an anonymous mapping (hugepages if
+ * bdev_mem_hugepages and the system has them).  The mapping belongs to
+ * the path and outlives close(), so a store can be unmounted and
+ * mounted again, and BlueFS sharing the main device sees the same
+ * bytes, for the life of the process.
+ *
+ * bdev_type = null throws writes away and reads back zeroes.  Only the
+ * layers that never read back what they wrote (i.e., BlueStore without
+ * BlueFS) can run on it.
+ *
+ * Writes complete inline unless bdev_mem_aio_thread is set, in which
+ * case a submitted IOContext is completed from a separate thread.
+ * bdev_mem_latency_us is added to each inline write, or to each
+ * submission on the thread.
+ */
+class MemDevice : public BlockDevice {
+  uint64_t size = 0;
+  uint64_t block_size = 0;
+  string path;
+  bool discard;       ///< null device: drop writes, read zeroes
+  char *data = nullptr;
+
+  aio_callback_t aio_callback;
+  void *aio_callback_priv;
+
+  struct aio_batch_t {
+    IOContext *ioc;
+    utime_t due;
+  };
+  std::mutex aio_lock;
+  std::condition_variable aio_cond;
+  std::deque<aio_batch_t> aio_queue;
+  bool aio_stop = false;
+
+  struct AioCompletionThread : public Thread {
+    MemDevice *bdev;
+    explicit AioCompletionThread(MemDevice *b) : bdev(b) {}
+    void *entry() {
+      bdev->_aio_thread();
+      return NULL;
+    }
+  } aio_thread;
+
+  void _aio_thread();
+  void _aio_finish(IOContext *ioc);
+  void _inject_latency();
+
+public:
+  MemDevice(aio_callback_t cb, void *cbpriv, bool discard);
+
+  void aio_submit(IOContext *ioc) override;
+
+  uint64_t get_size() const override {
+    return size;
+  }
+  uint64_t get_block_size() const override {
+    return block_size;
+  }
+
+  int read(uint64_t off, uint64_t len, bufferlist *pbl,
+	   IOContext *ioc,
+	   bool buffered) override;
+  int read_random(uint64_t off, uint64_t len, char *buf,
+		  bool buffered) override;
+
+  int aio_write(uint64_t off, bufferlist& bl,
+		IOContext *ioc,
+		bool buffered) override;
+  int flush() override;
+
+  int invalidate_cache(uint64_t off, uint64_t len) override;
+  int open(string path) override;
+  void close() override;
+};
+
+#endif
@@ -124,29 +124,6 @@ void bluestore_cnode_t::generate_test_instances(list<bluestore_cnode_t*>& o)
   o.push_back(new bluestore_cnode_t(123));
 }
 
-// bluestore_pextent_t
-
-void small_encode(const vector<bluestore_pextent_t>& v, bufferlist& bl)
-{
-  size_t n = v.size();
-  small_encode_varint(n, bl);
-  for (auto e : v) {
-    e.encode(bl);
-  }
-}
-
-void small_decode(vector<bluestore_pextent_t>& v, bufferlist::iterator& p)
-{
-  size_t n;
-  small_decode_varint(n, p);
-  v.clear();
-  v.reserve(n);
-  while (n--) {
-    v.push_back(bluestore_pextent_t());
-    ::decode(v.back(), p);
-  }
-}
-
 // bluestore_extent_ref_map_t
 
 void bluestore_extent_ref_map_t::_check() const
@@ -333,35 +310,48 @@ bool bluestore_extent_ref_map_t::intersects(
   return true;  // intersects p!
 }
 
-void bluestore_extent_ref_map_t::encode(bufferlist& bl) const
+void bluestore_extent_ref_map_t::bound_encode(size_t& p) const
 {
   uint32_t n = ref_map.size();
-  small_encode_varint(n, bl);
+  denc_varint(n, p);
   if (n) {
-    auto p = ref_map.begin();
-    small_encode_varint_lowz(p->first, bl);
-    p->second.encode(bl);
-    int32_t pos = p->first;
+    size_t elem_size = 0;
+    denc_varint_lowz((int64_t)0, elem_size);
+    ref_map.begin()->second.bound_encode(elem_size);
+    p += elem_size * n;
+  }
+}
+
+void bluestore_extent_ref_map_t::encode(
+  bufferlist::contiguous_appender& p) const
+{
+  uint32_t n = ref_map.size();
+  denc_varint(n, p);
+  if (n) {
+    auto i = ref_map.begin();
+    denc_varint_lowz(i->first, p);
+    i->second.encode(p);
+    int32_t pos = i->first;
     while (--n) {
-      ++p;
-      small_encode_varint_lowz((int64_t)p->first - pos, bl);
-      p->second.encode(bl);
-      pos = p->first;
+      ++i;
+      denc_varint_lowz((int64_t)i->first - pos, p);
+      i->second.encode(p);
+      pos = i->first;
     }
   }
 }
 
-void bluestore_extent_ref_map_t::decode(bufferlist::iterator& p)
+void bluestore_extent_ref_map_t::decode(bufferptr::iterator& p)
 {
   uint32_t n;
-  small_decode_varint(n, p);
+  denc_varint(n, p);
   if (n) {
     int64_t pos;
-    small_decode_varint_lowz(pos, p);
+    denc_varint_lowz(pos, p);
     ref_map[pos].decode(p);
     while (--n) {
       int64_t delta;
-      small_decode_varint_lowz(delta, p);
+      denc_varint_lowz(delta, p);
       pos += delta;
       ref_map[pos].decode(p);
     }
@@ -458,57 +448,84 @@ string bluestore_blob_t::get_flags_string(unsigned flags)
   return s;
 }
 
-void bluestore_blob_t::encode(bufferlist& bl) const
+void bluestore_blob_t::bound_encode(size_t& p) const
 {
-  ENCODE_START(1, 1, bl);
-  small_encode(extents, bl);
-  small_encode_varint(flags, bl);
+  DENC_START(1, 1, p);
+  denc_small_vector(extents, p);
+  denc_varint(flags, p);
   if (is_compressed()) {
-    small_encode_varint_lowz(compressed_length_orig, bl);
-    small_encode_varint_lowz(compressed_length, bl);
+    denc_varint_lowz(compressed_length_orig, p);
+    denc_varint_lowz(compressed_length, p);
   }
   if (has_csum()) {
-    ::encode(csum_type, bl);
-    ::encode(csum_chunk_order, bl);
-    small_encode_buf_lowz(csum_data, bl);
+    denc(csum_type, p);
+    denc(csum_chunk_order, p);
+    denc_varint_lowz(csum_data.length(), p);
+    p += csum_data.length();
   }
   if (has_refmap()) {
-    ::encode(ref_map, bl);
+    denc(ref_map, p);
   }
   if (has_unused()) {
-    ::encode(unused_uint_t(unused.to_ullong()), bl);
+    denc(unused_uint_t(), p);
   }
-  ENCODE_FINISH(bl);
+  DENC_FINISH(p);
 }
 
-void bluestore_blob_t::decode(bufferlist::iterator& p)
+void bluestore_blob_t::encode(bufferlist::contiguous_appender& p) const
 {
-  DECODE_START(1, p);
-  small_decode(extents, p);
-  small_decode_varint(flags, p);
+  DENC_START(1, 1, p);
+  denc_small_vector(extents, p);
+  denc_varint(flags, p);
+  if (is_compressed()) {
+    denc_varint_lowz(compressed_length_orig, p);
+    denc_varint_lowz(compressed_length, p);
+  }
+  if (has_csum()) {
+    denc(csum_type, p);
+    denc(csum_chunk_order, p);
+    denc_varint_lowz(csum_data.length(), p);
+    p.append(csum_data);
+  }
+  if (has_refmap()) {
+    denc(ref_map, p);
+  }
+  if (has_unused()) {
+    denc(unused_uint_t(unused.to_ullong()), p);
+  }
+  DENC_FINISH(p);
+}
+
+void bluestore_blob_t::decode(bufferptr::iterator& p)
+{
+  DENC_START(1, 1, p);
+  denc_small_vector(extents, p);
+  denc_varint(flags, p);
   if (is_compressed()) {
-    small_decode_varint_lowz(compressed_length_orig, p);
-    small_decode_varint_lowz(compressed_length, p);
+    denc_varint_lowz(compressed_length_orig, p);
+    denc_varint_lowz(compressed_length, p);
   } else {
     compressed_length_orig = compressed_length = 0;
   }
   if (has_csum()) {
-    ::decode(csum_type, p);
-    ::decode(csum_chunk_order, p);
-    small_decode_buf_lowz(csum_data, p);
+    denc(csum_type, p);
+    denc(csum_chunk_order, p);
+    size_t len;
+    denc_varint_lowz(len, p);
+    csum_data = buffer::copy(p.get_pos_add(len), len);
   } else {
     csum_type = CSUM_NONE;
     csum_chunk_order = 0;
   }
   if (has_refmap()) {
-    ::decode(ref_map, p);
+    denc(ref_map, p);
   }
   if (has_unused()) {
     unused_uint_t val;
-    ::decode(val, p);
+    denc(val, p);
     unused = unused_t(val);
   }
-  DECODE_FINISH(p);
+  DENC_FINISH(p);
 }
 
 void bluestore_blob_t::dump(Formatter *f) const
@@ -789,18 +806,6 @@ int bluestore_blob_t::verify_csum(uint64_t b_off, const bufferlist& bl,
 }
 
 // bluestore_lextent_t
-void bluestore_lextent_t::encode(bufferlist& bl) const
-{
-  small_encode_signed_varint(blob, bl);
-  small_encode_varint_lowz(offset, bl);
-  small_encode_varint_lowz(length, bl);
-}
-void bluestore_lextent_t::decode(bufferlist::iterator& p)
-{
-  small_decode_signed_varint(blob, p);
-  small_decode_varint_lowz(offset, p);
-  small_decode_varint_lowz(length, p);
-}
 
 void bluestore_lextent_t::dump(Formatter *f) const
 {
@@ -823,68 +828,128 @@ ostream& operator<<(ostream& out, const bluestore_lextent_t& lb)
 }
 
 // bluestore_onode_t
-void small_encode(const map<uint64_t,bluestore_lextent_t>& extents, bufferlist& bl)
+
+static void denc_extent_map(size_t n, size_t& p)
+{
+  denc_varint(n, p);
+  if (n) {
+    size_t elem_size = 0;
+    denc_varint_lowz((uint64_t)0, elem_size);
+    denc(bluestore_lextent_t(), elem_size);
+    p += elem_size * n;
+  }
+}
+
+static void denc_extent_map(const map<uint64_t,bluestore_lextent_t>& extents,
+			    size_t& p)
+{
+  denc_extent_map(extents.size(), p);
+}
+
+static void denc_extent_map(
+  map<uint64_t,bluestore_lextent_t>::const_iterator i,
+  size_t n,
+  bufferlist::contiguous_appender& p)
 {
-  size_t n = extents.size();
-  small_encode_varint(n, bl);
+  denc_varint(n, p);
   if (n) {
-    auto p = extents.begin();
-    small_encode_varint_lowz(p->first, bl);
-    p->second.encode(bl);
-    uint64_t pos = p->first;
+    denc_varint_lowz(i->first, p);
+    denc(i->second, p);
+    uint64_t pos = i->first;
     while (--n) {
-      ++p;
-      small_encode_varint_lowz((uint64_t)p->first - pos, bl);
-      p->second.encode(bl);
-      pos = p->first;
+      ++i;
+      denc_varint_lowz((uint64_t)i->first - pos, p);
+      denc(i->second, p);
+      pos = i->first;
     }
   }
 }
 
-void small_decode(map<uint64_t,bluestore_lextent_t>& extents, bufferlist::iterator& p)
+static void denc_extent_map(const map<uint64_t,bluestore_lextent_t>& extents,
+			    bufferlist::contiguous_appender& p)
+{
+  denc_extent_map(extents.begin(), extents.size(), p);
+}
+
+// note: merges into extents; the caller clears it if needed
+static void denc_extent_map(map<uint64_t,bluestore_lextent_t>& extents,
+			    bufferptr::iterator& p)
 {
   size_t n;
-  extents.clear();
-  small_decode_varint(n, p);
+  denc_varint(n, p);
   if (n) {
     uint64_t pos;
-    small_decode_varint_lowz(pos, p);
-    extents[pos].decode(p);
+    denc_varint_lowz(pos, p);
+    auto hint = extents.emplace_hint(extents.lower_bound(pos), pos,
+				     bluestore_lextent_t());
+    denc(hint->second, p);
     while (--n) {
       uint64_t delta;
-      small_decode_varint_lowz(delta, p);
+      denc_varint_lowz(delta, p);
       pos += delta;
-      extents[pos].decode(p);
+      hint = extents.emplace_hint(std::next(hint), pos, bluestore_lextent_t());
+      denc(hint->second, p);
     }
   }
 }
 
-void bluestore_onode_t::encode(bufferlist& bl) const
+void bluestore_onode_t::shard_info::dump(Formatter *f) const
 {
-  ENCODE_START(1, 1, bl);
-  ::encode(nid, bl);
-  ::encode(size, bl);
-  ::encode(attrs, bl);
-  small_encode(extent_map, bl);
-  ::encode(omap_head, bl);
-  ::encode(expected_object_size, bl);
-  ::encode(expected_write_size, bl);
-  ::encode(alloc_hint_flags, bl);
-  ENCODE_FINISH(bl);
+  f->dump_unsigned("offset", offset);
+  f->dump_unsigned("bytes", bytes);
 }
 
-void bluestore_onode_t::decode(bufferlist::iterator& p)
+void bluestore_onode_t::bound_encode(size_t& p) const
 {
-  DECODE_START(1, p);
-  ::decode(nid, p);
-  ::decode(size, p);
-  ::decode(attrs, p);
-  small_decode(extent_map, p);
-  ::decode(omap_head, p);
-  ::decode(expected_object_size, p);
-  ::decode(expected_write_size, p);
-  ::decode(alloc_hint_flags, p);
-  DECODE_FINISH(p);
+  DENC_START(2, 2, p);
+  denc(nid, p);
+  denc(size, p);
+  denc(attrs, p);
+  denc_extent_map(extent_map_shards.empty() ? extent_map.size() : 0, p);
+  denc(omap_head, p);
+  denc(expected_object_size, p);
+  denc(expected_write_size, p);
+  denc(alloc_hint_flags, p);
+  denc(extent_map_shards, p);
+  DENC_FINISH(p);
+}
+
+void bluestore_onode_t::encode(bufferlist::contiguous_appender& p) const
+{
+  DENC_START(2, 2, p);
+  denc(nid, p);
+  denc(size, p);
+  denc(attrs, p);
+  // a sharded extent_map is stored with the shards, not here
+  if (extent_map_shards.empty()) {
+    denc_extent_map(extent_map, p);
+  } else {
+    denc_extent_map(extent_map.end(), 0, p);
+  }
+  denc(omap_head, p);
+  denc(expected_object_size, p);
+  denc(expected_write_size, p);
+  denc(alloc_hint_flags, p);
+  denc(extent_map_shards, p);
+  DENC_FINISH(p);
+}
+
+void bluestore_onode_t::decode(bufferptr::iterator& p)
+{
+  DENC_START(2, 2, p);
+  denc(nid, p);
+  denc(size, p);
+  denc(attrs, p);
+  extent_map.clear();
+  denc_extent_map(extent_map, p);
+  denc(omap_head, p);
+  denc(expected_object_size, p);
+  denc(expected_write_size, p);
+  denc(alloc_hint_flags, p);
+  if (struct_v >= 2) {
+    denc(extent_map_shards, p);
+  }
+  DENC_FINISH(p);
 }
 
 void bluestore_onode_t::dump(Formatter *f) const
@@ -908,6 +973,11 @@ void bluestore_onode_t::dump(Formatter *f) const
     f->close_section();
   }
   f->close_section();
+  f->open_array_section("extent_map_shards");
+  for (const auto& s : extent_map_shards) {
+    f->dump_object("shard", s);
+  }
+  f->close_section();
   f->dump_unsigned("omap_head", omap_head);
   f->dump_unsigned("expected_object_size", expected_object_size);
   f->dump_unsigned("expected_write_size", expected_write_size);
@@ -917,6 +987,13 @@ void bluestore_onode_t::dump(Formatter *f) const
 void bluestore_onode_t::generate_test_instances(list<bluestore_onode_t*>& o)
 {
   o.push_back(new bluestore_onode_t());
+  o.push_back(new bluestore_onode_t());
+  o.back()->nid = 1;
+  o.back()->size = 65536;
+  o.back()->extent_map_shards.resize(2);
+  o.back()->extent_map_shards[0].bytes = 100;
+  o.back()->extent_map_shards[1].offset = 8192;
+  o.back()->extent_map_shards[1].bytes = 200;
   // FIXME
 }
 
@@ -954,6 +1031,22 @@ int bluestore_onode_t::compress_extent_map()
   return removed;
 }
 
+void bluestore_onode_t::encode_lextents(uint64_t offset, uint64_t end,
+				       bufferlist& bl) const
+{
+  auto b = extent_map.lower_bound(offset);
+  size_t n = std::distance(b, extent_map.lower_bound(end));
+  size_t bound = 0;
+  denc_extent_map(n, bound);
+  bufferlist::contiguous_appender app(bl, bound);
+  denc_extent_map(b, n, app);
+}
+
+void bluestore_onode_t::decode_lextents(bufferptr::iterator& p)
+{
+  denc_extent_map(extent_map, p);
+}
+
 void bluestore_onode_t::punch_hole(
   uint64_t offset,
   uint64_t length,
@@ -1049,10 +1142,7 @@ bool bluestore_onode_t::deref_lextent( uint64_t offset,
     assert(offset >= lext.offset);
     //determine the range in lextents map where specific blob can be referenced to.
     uint64_t search_offset = offset - lext.offset;
-    uint64_t search_end = search_offset +
-                          (b->is_compressed() ?
-                             b->get_compressed_payload_original_length() :
-                             b->get_ondisk_length());
+    uint64_t search_end = search_offset + b->get_logical_length();
     auto lp = seek_lextent(search_offset);
     while (lp != extent_map.end() &&
            lp->first < search_end) {
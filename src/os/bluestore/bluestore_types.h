@@ -21,6 +21,7 @@
 #include "include/interval_set.h"
 #include "include/utime.h"
 #include "include/small_encoding.h"
+#include "include/denc.h"
 #include "common/hobject.h"
 
 namespace ceph {
@@ -128,40 +129,29 @@ struct bluestore_pextent_t : public AllocExtent{
     return offset != INVALID_OFFSET;
   }
 
-  void encode(bufferlist& bl) const {
-    small_encode_lba(offset, bl);
-    small_encode_varint_lowz(length, bl);
-  }
-  void decode(bufferlist::iterator& p) {
-    small_decode_lba(offset, p);
-    small_decode_varint_lowz(length, p);
+  DENC(bluestore_pextent_t, v, p) {
+    denc_lba(v.offset, p);
+    denc_varint_lowz(v.length, p);
   }
+
   void dump(Formatter *f) const;
   static void generate_test_instances(list<bluestore_pextent_t*>& ls);
 };
-WRITE_CLASS_ENCODER(bluestore_pextent_t)
+WRITE_CLASS_DENC_BOUNDED(bluestore_pextent_t)
 
 ostream& operator<<(ostream& out, const bluestore_pextent_t& o);
 
-void small_encode(const vector<bluestore_pextent_t>& v, bufferlist& bl);
-void small_decode(vector<bluestore_pextent_t>& v, bufferlist::iterator& p);
-
 /// extent_map: a map of reference counted extents
 struct bluestore_extent_ref_map_t {
   struct record_t {
     uint32_t length;
     uint32_t refs;
     record_t(uint32_t l=0, uint32_t r=0) : length(l), refs(r) {}
-    void encode(bufferlist& bl) const {
-      small_encode_varint_lowz(length, bl);
-      small_encode_varint(refs, bl);
-    }
-    void decode(bufferlist::iterator& p) {
-      small_decode_varint_lowz(length, p);
-      small_decode_varint(refs, p);
+    DENC(record_t, v, p) {
+      denc_varint_lowz(v.length, p);
+      denc_varint(v.refs, p);
     }
   };
-  WRITE_CLASS_ENCODER(record_t)
 
   map<uint32_t,record_t> ref_map;
 
@@ -189,13 +179,14 @@ struct bluestore_extent_ref_map_t {
   bool contains(uint32_t offset, uint32_t len) const;
   bool intersects(uint32_t offset, uint32_t len) const;
 
-  void encode(bufferlist& bl) const;
-  void decode(bufferlist::iterator& p);
+  void bound_encode(size_t& p) const;
+  void encode(bufferlist::contiguous_appender& p) const;
+  void decode(bufferptr::iterator& p);
   void dump(Formatter *f) const;
   static void generate_test_instances(list<bluestore_extent_ref_map_t*>& o);
 };
-WRITE_CLASS_ENCODER(bluestore_extent_ref_map_t::record_t)
-WRITE_CLASS_ENCODER(bluestore_extent_ref_map_t)
+WRITE_CLASS_DENC_BOUNDED(bluestore_extent_ref_map_t::record_t)
+WRITE_CLASS_DENC(bluestore_extent_ref_map_t)
 
 ostream& operator<<(ostream& out, const bluestore_extent_ref_map_t& rm);
 static inline bool operator==(const bluestore_extent_ref_map_t::record_t& l,
@@ -262,6 +253,8 @@ struct bluestore_blob_t {
     COMP_ALG_NONE = 0,
     COMP_ALG_SNAPPY = 1,
     COMP_ALG_ZLIB = 2,
+    COMP_ALG_ZSTD = 3,
+    COMP_ALG_LZ4 = 4,
   };
 
   static const char * get_comp_alg_name(int a) {
@@ -269,6 +262,8 @@ struct bluestore_blob_t {
     case COMP_ALG_NONE: return "none";
     case COMP_ALG_SNAPPY: return "snappy";
     case COMP_ALG_ZLIB: return "zlib";
+    case COMP_ALG_ZSTD: return "zstd";
+    case COMP_ALG_LZ4: return "lz4";
     default: return "???";
     }
   }
@@ -280,6 +275,10 @@ struct bluestore_blob_t {
       return COMP_ALG_SNAPPY;
     if (s == "zlib")
       return COMP_ALG_ZLIB;
+    if (s == "zstd")
+      return COMP_ALG_ZSTD;
+    if (s == "lz4")
+      return COMP_ALG_LZ4;
 
     assert(0 == "invalid compression algorithm");
     return COMP_ALG_NONE;
@@ -302,8 +301,10 @@ struct bluestore_blob_t {
 
   bluestore_blob_t(uint32_t f = 0) : flags(f) {}
 
-  void encode(bufferlist& bl) const;
-  void decode(bufferlist::iterator& p);
+  DENC_HELPERS
+  void bound_encode(size_t& p) const;
+  void encode(bufferlist::contiguous_appender& p) const;
+  void decode(bufferptr::iterator& p);
   void dump(Formatter *f) const;
   static void generate_test_instances(list<bluestore_blob_t*>& ls);
 
@@ -507,6 +508,12 @@ struct bluestore_blob_t {
     return len;
   }
 
+  /// length of the logical range the blob maps
+  uint32_t get_logical_length() const {
+    return is_compressed() ?
+      get_compressed_payload_original_length() : get_ondisk_length();
+  }
+
 
   size_t get_csum_value_size() const {
     switch (csum_type) {
@@ -569,7 +576,7 @@ struct bluestore_blob_t {
   int verify_csum(uint64_t b_off, const bufferlist& bl, int* b_bad_off) const;
 
 };
-WRITE_CLASS_ENCODER(bluestore_blob_t)
+WRITE_CLASS_DENC(bluestore_blob_t)
 
 ostream& operator<<(ostream& out, const bluestore_blob_t& o);
 
@@ -599,13 +606,16 @@ struct bluestore_lextent_t {
     return blob < 0;
   }
 
-  void encode(bufferlist& bl) const;
-  void decode(bufferlist::iterator& p);
+  DENC(bluestore_lextent_t, v, p) {
+    denc_signed_varint(v.blob, p);
+    denc_varint_lowz(v.offset, p);
+    denc_varint_lowz(v.length, p);
+  }
 
   void dump(Formatter *f) const;
   static void generate_test_instances(list<bluestore_lextent_t*>& o);
 };
-WRITE_CLASS_ENCODER(bluestore_lextent_t)
+WRITE_CLASS_DENC_BOUNDED(bluestore_lextent_t)
 
 ostream& operator<<(ostream& out, const bluestore_lextent_t& o);
 
@@ -614,10 +624,23 @@ typedef map<bluestore_blob_id_t, bluestore_blob_t> bluestore_blob_map_t;
 
 /// onode: per-object metadata
 struct bluestore_onode_t {
+  /// a range of the extent_map that is stored under its own key
+  struct shard_info {
+    uint32_t offset = 0;  ///< logical offset of the start of the shard
+    uint32_t bytes = 0;   ///< encoded bytes, as of the last write
+
+    DENC(shard_info, v, p) {
+      denc_varint(v.offset, p);
+      denc_varint(v.bytes, p);
+    }
+    void dump(Formatter *f) const;
+  };
+
   uint64_t nid;                        ///< numeric id (locally unique)
   uint64_t size;                       ///< object size
   map<string, bufferptr> attrs;        ///< attrs
   map<uint64_t,bluestore_lextent_t> extent_map;  ///< extent refs
+  vector<shard_info> extent_map_shards; ///< extent_map shards (if any)
   uint64_t omap_head;                  ///< id for omap root node
 
   uint32_t expected_object_size;
@@ -681,6 +704,11 @@ struct bluestore_onode_t {
   /// consolidate adjacent lextents in extent_map
   int compress_extent_map();
 
+  /// encode the lextents in [offset, end) without the rest of the onode
+  void encode_lextents(uint64_t offset, uint64_t end, bufferlist& bl) const;
+  /// decode lextents encoded by encode_lextents() into extent_map
+  void decode_lextents(bufferptr::iterator& p);
+
   /// punch a logical hole.  add lextents to deref to target list.
   void punch_hole(uint64_t offset, uint64_t length,
 		  vector<std::pair<uint64_t, bluestore_lextent_t> >*deref);
@@ -699,12 +727,15 @@ struct bluestore_onode_t {
                uint64_t min_alloc_size,
                vector<bluestore_pextent_t>* r);
 
-  void encode(bufferlist& bl) const;
-  void decode(bufferlist::iterator& p);
+  DENC_HELPERS
+  void bound_encode(size_t& p) const;
+  void encode(bufferlist::contiguous_appender& p) const;
+  void decode(bufferptr::iterator& p);
   void dump(Formatter *f) const;
   static void generate_test_instances(list<bluestore_onode_t*>& o);
 };
-WRITE_CLASS_ENCODER(bluestore_onode_t)
+WRITE_CLASS_DENC(bluestore_onode_t::shard_info)
+WRITE_CLASS_DENC(bluestore_onode_t)
 
 
 /// writeahead-logged op
@@ -190,6 +190,17 @@ protected:
       uint64_t expected_num_objs  ///< [in] expected number of objects this collection has
       ) { assert(0); return 0; }
 
+  /**
+   * Split the collection's directories in the background until every
+   * object sits at least depth levels down.
+   *
+   * @param depth - target directory depth
+   * @Return 0 if queued, an error code otherwise.
+   */
+  virtual int presplit(
+      unsigned depth  ///< [in] target directory depth
+      ) { return -EOPNOTSUPP; }
+
   /// Virtual destructor
   virtual ~CollectionIndex() {}
 };
@@ -810,6 +810,8 @@ int DBObjectMap::get_values(const ghobject_t &oid,
   Header header = lookup_map_header(hl, oid);
   if (!header)
     return -ENOENT;
+  if (!header->parent)
+    return db->get(user_prefix(header), keys, out);
   return scan(header, keys, 0, out);
 }
 
@@ -821,6 +823,17 @@ int DBObjectMap::check_keys(const ghobject_t &oid,
   Header header = lookup_map_header(hl, oid);
   if (!header)
     return -ENOENT;
+  if (!header->parent) {
+    map<string, bufferlist> got;
+    int r = db->get(user_prefix(header), keys, &got);
+    if (r < 0)
+      return r;
+    for (map<string, bufferlist>::iterator i = got.begin();
+	 i != got.end();
+	 ++i)
+      out->insert(i->first);
+    return 0;
+  }
   return scan(header, keys, out, 0);
 }
 
@@ -477,7 +477,15 @@ private:
   /// Helpers
   int _get_header(Header header, bufferlist *bl);
 
-  /// Scan keys in header into out_keys and out_values (if nonnull)
+  /**
+   * Scan keys in header into out_keys and out_values (if nonnull)
+   *
+   * This seeks an iterator per key so it can fall through to the
+   * parents; a header without a parent is read with one multi-key
+   * KeyValueDB::get instead.  That is a single MultiGet on rocksdb;
+   * leveldb (the default filestore_omap_backend) still does a Get per
+   * key, but without the iterator seeks.
+   */
   int scan(Header header,
 	   const set<string> &in_keys,
 	   set<string> *out_keys,
@@ -360,6 +360,10 @@ int FileJournal::check()
     ret = -EINVAL;
     goto done;
   }
+  if (!check_shard(header)) {
+    ret = -EINVAL;
+    goto done;
+  }
 
   dout(1) << "check: header looks ok" << dendl;
   ret = 0;
@@ -395,6 +399,8 @@ int FileJournal::create()
 
   header.start = get_top();
   header.start_seq = 0;
+  header.shard = shard_id;
+  header.num_shards = num_shards;
 
   print_header(header);
 
@@ -501,6 +507,11 @@ int FileJournal::open(uint64_t fs_op_seq)
          << ", invalid (someone else's?) journal" << dendl;
     return -EINVAL;
   }
+  if (!check_shard(header)) {
+    _close(fd);
+    fd = -1;
+    return -EINVAL;
+  }
   if (header.max_size > max_size) {
     dout(2) << "open journal size " << header.max_size << " > current " << max_size << dendl;
     return -EINVAL;
@@ -552,7 +563,7 @@ int FileJournal::open(uint64_t fs_op_seq)
       dout(10) << "open reached end of journal." << dendl;
       break;
     }
-    if (seq > next_seq) {
+    if (seq > next_seq && !sparse_seq) {
       dout(10) << "open entry " << seq << " len " << bl.length() << " > next_seq " << next_seq
 	       << ", ignoring journal contents"
 	       << dendl;
@@ -560,7 +571,7 @@ int FileJournal::open(uint64_t fs_op_seq)
       last_committed_seq = 0;
       return 0;
     }
-    if (seq == next_seq) {
+    if (seq >= next_seq) {
       dout(10) << "open reached seq " << seq << dendl;
       read_pos = old_pos;
       break;
@@ -751,11 +762,23 @@ void FileJournal::stop_writer()
 
 
 
+bool FileJournal::check_shard(const header_t &header) const
+{
+  if (header.shard == shard_id && header.num_shards == num_shards)
+    return true;
+  derr << "FileJournal: " << fn << " is journal shard " << header.shard
+       << " of " << header.num_shards << ", expected shard " << shard_id
+       << " of " << num_shards << "; flush the journal and recreate it"
+       << " to change journal_shards" << dendl;
+  return false;
+}
+
 void FileJournal::print_header(const header_t &header) const
 {
   dout(10) << "header: block_size " << header.block_size
 	   << " alignment " << header.alignment
 	   << " max_size " << header.max_size
+	   << " shard " << header.shard << "/" << header.num_shards
 	   << dendl;
   dout(10) << "header: start " << header.start << dendl;
   dout(10) << " write_pos " << write_pos << dendl;
@@ -1654,11 +1677,73 @@ int FileJournal::prepare_entry(vector<ObjectStore::Transaction>& tls, bufferlist
   }
   // footer
   ebl.append((const char*)&h, sizeof(h));
-  ebl.rebuild_aligned(CEPH_DIRECTIO_ALIGNMENT);
+  uint64_t copied = align_entry(ebl);
+  if (logger)
+    logger->inc(l_os_j_copied_bytes, copied);
   tbl->claim(ebl);
   return h.len;
 }
 
+/*
+ * Give ebl the layout rebuild_aligned() would: segments that are
+ * aligned in memory and size (typically the write payload) are kept
+ * by reference, and each run of the others is merged into one aligned
+ * segment.  With a ring those segments are carved out of it rather
+ * than allocated, and padding is zeroed instead of copied from
+ * zero_buf.  Returns the number of bytes memcpy'd.
+ */
+uint64_t FileJournal::align_entry(bufferlist& ebl)
+{
+  if (!ring) {
+    unsigned before = ebl.get_memcopy_count();
+    ebl.rebuild_aligned(CEPH_DIRECTIO_ALIGNMENT);
+    return ebl.get_memcopy_count() - before;
+  }
+
+  uint64_t copied = 0;
+  bufferlist out;
+  const std::list<bufferptr>& bufs = ebl.buffers();
+  std::list<bufferptr>::const_iterator p = bufs.begin();
+  while (p != bufs.end()) {
+    if (p->is_aligned(CEPH_DIRECTIO_ALIGNMENT) &&
+	p->is_n_align_sized(CEPH_DIRECTIO_ALIGNMENT)) {
+      out.push_back(*p);
+      ++p;
+      continue;
+    }
+    std::list<bufferptr>::const_iterator q = p;
+    unsigned len = 0;
+    do {
+      len += q->length();
+      ++q;
+    } while (q != bufs.end() &&
+	     (!q->is_aligned(CEPH_DIRECTIO_ALIGNMENT) ||
+	      !q->is_n_align_sized(CEPH_DIRECTIO_ALIGNMENT) ||
+	      (len % CEPH_DIRECTIO_ALIGNMENT)));
+
+    bufferptr bp = ring->alloc(ROUND_UP_TO(len, CEPH_PAGE_SIZE));
+    if (bp.length()) {
+      bp.set_length(len);
+    } else {
+      dout(20) << __func__ << " ring full, allocating " << len << dendl;
+      bp = buffer::create_aligned(len, CEPH_DIRECTIO_ALIGNMENT);
+    }
+    char *d = bp.c_str();
+    for (; p != q; ++p) {
+      if (p->c_str() == zero_buf) {
+	memset(d, 0, p->length());
+      } else {
+	memcpy(d, p->c_str(), p->length());
+	copied += p->length();
+      }
+      d += p->length();
+    }
+    out.push_back(bp);
+  }
+  ebl.swap(out);
+  return copied;
+}
+
 void FileJournal::submit_entry(uint64_t seq, bufferlist& e, uint32_t orig_len,
 			       Context *oncommit, TrackedOpRef osd_op)
 {
@@ -1894,6 +1979,14 @@ int FileJournal::make_writeable()
   if (r < 0)
     return r;
 
+  if (!ring && g_conf->journal_ring_size) {
+    ring = new JournalRing(g_conf->journal_ring_size);
+    if (!ring->valid()) {
+      ring->put();
+      ring = NULL;
+    }
+  }
+
   r = _open(true);
   if (r < 0)
     return r;
@@ -25,6 +25,7 @@ using std::deque;
 #include "common/Thread.h"
 #include "common/Throttle.h"
 #include "JournalThrottle.h"
+#include "JournalRing.h"
 
 
 #ifdef HAVE_LIBAIO
@@ -142,9 +143,12 @@ public:
      */
     uint64_t start_seq;
 
+    __u32 shard;        // which shard of a ShardedJournal this is
+    __u32 num_shards;   // 1 for a plain journal
+
     header_t() :
       flags(0), block_size(0), alignment(0), max_size(0), start(0),
-      committed_up_to(0), start_seq(0) {}
+      committed_up_to(0), start_seq(0), shard(0), num_shards(1) {}
 
     void clear() {
       start = block_size;
@@ -155,7 +159,7 @@ public:
     }
 
     void encode(bufferlist& bl) const {
-      __u32 v = 4;
+      __u32 v = 5;
       ::encode(v, bl);
       bufferlist em;
       {
@@ -167,6 +171,8 @@ public:
 	::encode(start, em);
 	::encode(committed_up_to, em);
 	::encode(start_seq, em);
+	::encode(shard, em);
+	::encode(num_shards, em);
       }
       ::encode(em, bl);
     }
@@ -187,6 +193,8 @@ public:
 	::decode(start, bl);
 	committed_up_to = 0;
 	start_seq = 0;
+	shard = 0;
+	num_shards = 1;
 	return;
       }
       bufferlist em;
@@ -208,6 +216,14 @@ public:
 	::decode(start_seq, t);
       else
 	start_seq = 0;
+
+      if (v > 4) {
+	::decode(shard, t);
+	::decode(num_shards, t);
+      } else {
+	shard = 0;
+	num_shards = 1;
+      }
     }
   } header;
 
@@ -242,6 +258,9 @@ private:
   off64_t write_pos;      // byte where the next entry to be written will go
   off64_t read_pos;       //
   bool discard;	  //for block journal whether support discard
+  bool sparse_seq;        // seqs may skip; don't require next_seq on open
+  uint32_t shard_id;      // our shard of a ShardedJournal
+  uint32_t num_shards;    // expected in the header; 1 if not sharded
 
 #ifdef HAVE_LIBAIO
   /// state associated with an in-flight aio request
@@ -317,6 +336,9 @@ private:
   void complete_write(uint64_t ops, uint64_t bytes);
   JournalThrottle throttle;
 
+  /// aligned space that entries are built in (NULL: allocate per entry)
+  JournalRing *ring;
+
   // write thread
   Mutex write_lock;
   bool write_stop;
@@ -331,6 +353,7 @@ private:
   int _open_file(int64_t oldsize, blksize_t blksize, bool create);
   int _dump(ostream& out, bool simple);
   void print_header(const header_t &hdr) const;
+  bool check_shard(const header_t &hdr) const;
   int read_header(header_t *hdr) const;
   bufferptr prepare_header();
   void start_writer();
@@ -352,6 +375,7 @@ private:
 
 
   void align_bl(off64_t pos, bufferlist& bl);
+  uint64_t align_entry(bufferlist& ebl);
   int write_bl(off64_t& pos, bufferlist& bl);
 
   /// read len from journal starting at in_pos and wrapping up to len
@@ -404,6 +428,9 @@ private:
     must_write_header(false),
     write_pos(0), read_pos(0),
     discard(false),
+    sparse_seq(false),
+    shard_id(0),
+    num_shards(1),
 #ifdef HAVE_LIBAIO
     aio_lock("FileJournal::aio_lock"),
     aio_ctx(0),
@@ -417,6 +444,7 @@ private:
     fd(-1),
     writing_seq(0),
     throttle(g_conf->filestore_caller_concurrency),
+    ring(NULL),
     write_lock("FileJournal::write_lock", false, true, false, g_ceph_context),
     write_stop(true),
     aio_stop(true),
@@ -438,6 +466,8 @@ private:
   }
   ~FileJournal() {
     assert(fd == -1);
+    if (ring)
+      ring->put();
     delete[] zero_buf;
     g_conf->remove_observer(this);
   }
@@ -472,6 +502,15 @@ private:
 
   void set_wait_on_full(bool b) { wait_on_full = b; }
 
+  /// entries are a subsequence of the op seqs (see ShardedJournal)
+  void set_sparse_seq(bool b) { sparse_seq = b; }
+
+  /// we are shard i of n; create() records it, check() and open() verify it
+  void set_shard(uint32_t i, uint32_t n) {
+    shard_id = i;
+    num_shards = n;
+  }
+
   // reads
 
   /// Result code for read_entry
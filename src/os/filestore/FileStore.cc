@@ -54,6 +54,7 @@
 #include "common/BackTrace.h"
 #include "include/types.h"
 #include "FileJournal.h"
+#include "ShardedJournal.h"
 
 #include "osd/osd_types.h"
 #include "include/color.h"
@@ -621,9 +622,15 @@ FileStore::FileStore(const std::string &base, const std::string &jdev, osflagbit
   plb.add_time_avg(l_os_commit_len, "commitcycle_interval", "Average interval between commits");
   plb.add_time_avg(l_os_commit_lat, "commitcycle_latency", "Average latency of commit");
   plb.add_u64_counter(l_os_j_full, "journal_full", "Journal writes while full");
+  plb.add_u64_avg(l_os_j_copied_bytes, "journal_copied_bytes", "Bytes copied preparing journal entries");
+  plb.add_u64_counter(l_os_index_lookup, "index_lookup", "Object path lookups");
+  plb.add_u64_counter(l_os_index_cache_hit, "index_cache_hit", "Object path lookups served by the index path cache");
+  plb.add_u64_counter(l_os_index_syscalls, "index_syscalls", "stat/getxattr calls made resolving object paths");
+  plb.add_u64_counter(l_os_index_split_moved, "index_split_moved", "Objects moved by background directory splits");
   plb.add_time_avg(l_os_queue_lat, "queue_transaction_latency_avg", "Store operation queue latency");
 
   logger = plb.create_perf_counters();
+  index_manager.set_logger(logger);
 
   g_ceph_context->get_perfcounters_collection()->add(logger);
   g_ceph_context->_conf->add_observer(this);
@@ -645,7 +652,7 @@ FileStore::~FileStore()
   g_ceph_context->get_perfcounters_collection()->remove(logger);
 
   if (journal)
-    journal->logger = NULL;
+    journal->set_logger(NULL);
   delete logger;
 
   if (m_filestore_do_dump) {
@@ -721,10 +728,18 @@ void FileStore::new_journal()
 {
   if (journalpath.length()) {
     dout(10) << "open_journal at " << journalpath << dendl;
-    journal = new FileJournal(fsid, &finisher, &sync_cond, journalpath.c_str(),
-			      m_journal_dio, m_journal_aio, m_journal_force_aio);
+    if (g_conf->journal_shards > 1)
+      journal = new ShardedJournal(fsid, &finisher, &sync_cond,
+				   journalpath.c_str(), g_conf->journal_shards,
+				   g_conf->journal_shard_paths,
+				   m_journal_dio, m_journal_aio,
+				   m_journal_force_aio);
+    else
+      journal = new FileJournal(fsid, &finisher, &sync_cond,
+				journalpath.c_str(), m_journal_dio,
+				m_journal_aio, m_journal_force_aio);
     if (journal)
-      journal->logger = logger;
+      journal->set_logger(logger);
   }
   return;
 }
@@ -736,7 +751,14 @@ int FileStore::dump_journal(ostream& out)
   if (!journalpath.length())
     return -EINVAL;
 
-  FileJournal *journal = new FileJournal(fsid, &finisher, &sync_cond, journalpath.c_str(), m_journal_dio);
+  Journal *journal;
+  if (g_conf->journal_shards > 1)
+    journal = new ShardedJournal(fsid, &finisher, &sync_cond,
+				 journalpath.c_str(), g_conf->journal_shards,
+				 g_conf->journal_shard_paths, m_journal_dio);
+  else
+    journal = new FileJournal(fsid, &finisher, &sync_cond,
+			      journalpath.c_str(), m_journal_dio);
   r = journal->dump(out);
   delete journal;
   return r;
@@ -1757,6 +1779,7 @@ int FileStore::mount()
   journal_start();
 
   op_tp.start();
+  index_manager.start_splitter();
   for (vector<Finisher*>::iterator it = ondisk_finishers.begin(); it != ondisk_finishers.end(); ++it) {
     (*it)->start();
   }
@@ -1862,6 +1885,7 @@ int FileStore::umount()
     wbthrottle.stop();
   }
   op_tp.stop();
+  index_manager.stop_splitter();
 
   journal_stop();
   if (!(generic_flags & SKIP_JOURNAL_REPLAY))
@@ -2092,7 +2116,7 @@ int FileStore::queue_transactions(Sequencer *posr, vector<Transaction>& tls,
       handle->suspend_tp_timeout();
 
     op_queue_reserve_throttle(o);
-    journal->reserve_throttle_and_backoff(tbl.length());
+    journal->reserve_throttle_and_backoff(tbl.length(), osr->id);
 
     if (handle)
       handle->reset_tp_timeout();
@@ -2106,7 +2130,8 @@ int FileStore::queue_transactions(Sequencer *posr, vector<Transaction>& tls,
     if (m_filestore_journal_parallel) {
       dout(5) << "queue_transactions (parallel) " << o->op << " " << o->tls << dendl;
 
-      _op_journal_transactions(tbl, orig_len, o->op, ondisk, osd_op);
+      _op_journal_transactions(tbl, orig_len, o->op, ondisk, osd_op,
+			       osr->id);
 
       // queue inside submit_manager op submission lock
       queue_op(osr, o);
@@ -2117,7 +2142,7 @@ int FileStore::queue_transactions(Sequencer *posr, vector<Transaction>& tls,
 
       _op_journal_transactions(tbl, orig_len, o->op,
 			       new C_JournaledAhead(this, osr, o, ondisk),
-			       osd_op);
+			       osd_op, osr->id);
     } else {
       assert(0);
     }
@@ -2172,7 +2197,7 @@ int FileStore::queue_transactions(Sequencer *posr, vector<Transaction>& tls,
   int r = do_transactions(tls, op);
 
   if (r >= 0) {
-    _op_journal_transactions(tbl, orig_len, op, ondisk, osd_op);
+    _op_journal_transactions(tbl, orig_len, op, ondisk, osd_op, osr->id);
   } else {
     delete ondisk;
   }
@@ -4055,6 +4080,18 @@ int FileStore::flush_journal()
   return 0;
 }
 
+int FileStore::presplit_collection(const coll_t& c, unsigned depth)
+{
+  dout(10) << __func__ << " " << c << " depth " << depth << dendl;
+  Index index;
+  int r = get_index(c, &index);
+  if (r < 0)
+    return r;
+  assert(NULL != index.index);
+  RWLock::WLocker l((index.index)->access_lock);
+  return index->presplit(depth);
+}
+
 int FileStore::snapshot(const string& name)
 {
   dout(10) << "snapshot " << name << dendl;
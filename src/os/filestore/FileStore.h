@@ -580,6 +580,7 @@ public:
 
   int flush_journal();
   int dump_journal(ostream& out);
+  int presplit_collection(const coll_t& c, unsigned depth);
 
   void set_fsid(uuid_d u) {
     fsid = u;
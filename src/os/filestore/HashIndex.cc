@@ -19,6 +19,7 @@
 
 #include "HashIndex.h"
 
+#include "common/config.h"
 #include "common/debug.h"
 #define dout_subsys ceph_subsys_filestore
 
@@ -120,6 +121,15 @@ int HashIndex::cleanup() {
     }
     return 0;
   }
+  else if (in_progress.is_bg_split()) {
+    bg_split_active = true;
+    bg_split_path = in_progress.path;
+    bg_split_depth = 0;
+    int r = load_background_split();
+    if (r < 0)
+      return r;
+    return finish_background_split();
+  }
   else
     return -EINVAL;
 }
@@ -293,6 +303,12 @@ int HashIndex::_split(
   uint32_t bits,
   CollectionIndex* dest) {
   assert(collection_version() == dest->collection_version());
+  int r = finish_background_split();
+  if (r < 0)
+    return r;
+  r = static_cast<HashIndex*>(dest)->finish_background_split();
+  if (r < 0)
+    return r;
   unsigned mkdirred = 0;
   return col_split_level(
     *this,
@@ -324,6 +340,12 @@ int HashIndex::_created(const vector<string> &path,
     return r;
 
   if (must_split(info)) {
+    if (splitter && g_conf->filestore_split_background) {
+      queue_split(path, 0);
+      return 0;
+    }
+    if (bg_split_active)
+      return 0;  // the in progress op tag is taken; a later create retries
     int r = initiate_split(path, info);
     if (r < 0)
       return r;
@@ -348,7 +370,7 @@ int HashIndex::_remove(const vector<string> &path,
   r = set_info(path, info);
   if (r < 0)
     return r;
-  if (must_merge(info)) {
+  if (must_merge(info) && !bg_split_active) {
     r = initiate_merge(path, info);
     if (r < 0)
       return r;
@@ -380,7 +402,29 @@ int HashIndex::_lookup(const ghobject_t &oid,
       break;
     path->push_back(*(next++));
   }
-  return get_mangled_name(*path, oid, mangled_name, hardlink);
+  if (!bg_split_active ||
+      path->size() != bg_split_path.size() + 1 ||
+      !std::equal(bg_split_path.begin(), bg_split_path.end(), path->begin()))
+    return get_mangled_name(*path, oid, mangled_name, hardlink);
+
+  // path is a subdir of the dir being split; oid may not have been
+  // moved down yet
+  int r = get_mangled_name(*path, oid, mangled_name, &exists);
+  if (r < 0)
+    return r;
+  if (!exists) {
+    string parent_name;
+    r = get_mangled_name(bg_split_path, oid, &parent_name, &exists);
+    if (r < 0)
+      return r;
+    if (exists) {
+      path->pop_back();
+      mangled_name->swap(parent_name);
+    }
+  }
+  if (hardlink)
+    *hardlink = exists;
+  return 0;
 }
 
 int HashIndex::_collection_list_partial(const ghobject_t &start,
@@ -399,9 +443,22 @@ int HashIndex::_collection_list_partial(const ghobject_t &start,
 }
 
 int HashIndex::prep_delete() {
+  int r = finish_background_split();
+  if (r < 0)
+    return r;
   return recursive_remove(vector<string>());
 }
 
+int HashIndex::presplit(unsigned depth) {
+  // as for pre_split_folder, merging would just undo it
+  if (merge_threshold > 0)
+    return -EINVAL;
+  if (!splitter)
+    return -EOPNOTSUPP;
+  queue_split(vector<string>(), MIN(depth, (unsigned)MAX_HASH_LEVEL));
+  return 0;
+}
+
 int HashIndex::_pre_hash_collection(uint32_t pg_num, uint64_t expected_num_objs) {
   int ret;
   vector<string> path;
@@ -601,6 +658,16 @@ int HashIndex::start_split(const vector<string> &path) {
   return fsync_dir(vector<string>());
 }
 
+int HashIndex::start_bg_split(const vector<string> &path) {
+  bufferlist bl;
+  InProgressOp op_tag(InProgressOp::BG_SPLIT, path);
+  op_tag.encode(bl);
+  int r = add_attr_path(vector<string>(), IN_PROGRESS_OP_TAG, bl);
+  if (r < 0)
+    return r;
+  return fsync_dir(vector<string>());
+}
+
 int HashIndex::start_merge(const vector<string> &path) {
   bufferlist bl;
   InProgressOp op_tag(InProgressOp::MERGE, path);
@@ -794,6 +861,352 @@ int HashIndex::complete_split(const vector<string> &path, subdir_info_s info) {
   return end_split_or_merge(path);
 }
 
+void HashIndex::queue_split(const vector<string> &path, unsigned depth) {
+  map<vector<string>, unsigned>::iterator p = queued_splits.find(path);
+  if (p != queued_splits.end()) {
+    p->second = MAX(p->second, depth);
+    return;
+  }
+  queued_splits[path] = depth;
+  splitter->queue_split(this, path);
+}
+
+int HashIndex::start_background_split(const vector<string> &path,
+				      bool *started) {
+  *started = false;
+  unsigned depth = 0;
+  map<vector<string>, unsigned>::iterator p = queued_splits.find(path);
+  if (p != queued_splits.end()) {
+    depth = p->second;
+    queued_splits.erase(p);
+  }
+  if (bg_split_active)
+    return 0;  // an earlier one failed part way; it is finished on mount
+
+  subdir_info_s info;
+  int r = get_info(path, &info);
+  if (r == -ENOENT)
+    return 0;  // merged or removed since it was queued
+  if (r < 0)
+    return r;
+  bool force = depth > path.size();
+  if (info.hash_level >= (unsigned)MAX_HASH_LEVEL ||
+      (!force && !must_split(info)))
+    return 0;
+
+  int level = info.hash_level;
+  map<string, ghobject_t> objects;
+  r = list_objects(path, 0, 0, &objects);
+  if (r < 0)
+    return r;
+  vector<string> subdirs_vec;
+  r = list_subdirs(path, &subdirs_vec);
+  if (r < 0)
+    return r;
+  set<string> subdirs;
+  subdirs.insert(subdirs_vec.begin(), subdirs_vec.end());
+
+  // When presplitting we want all 16 subdirs, otherwise the ones that
+  // wouldn't be merged right back, as in complete_split
+  set<string> to_create;
+  if (force) {
+    for (int i = 0; i < 16; ++i) {
+      if (!subdirs.count(to_hex(i)))
+	to_create.insert(to_hex(i));
+    }
+  } else {
+    map<string, uint64_t> counts;
+    for (map<string, ghobject_t>::iterator i = objects.begin();
+	 i != objects.end();
+	 ++i) {
+      vector<string> new_path;
+      get_path_components(i->second, &new_path);
+      counts[new_path[level]]++;
+    }
+    for (map<string, uint64_t>::iterator i = counts.begin();
+	 i != counts.end();
+	 ++i) {
+      subdir_info_s info_new;
+      info_new.objs = i->second;
+      info_new.hash_level = level + 1;
+      if (!subdirs.count(i->first) && !must_merge(info_new))
+	to_create.insert(i->first);
+    }
+  }
+
+  r = start_bg_split(path);
+  if (r < 0)
+    return r;
+  vector<string> dst = path;
+  dst.push_back("");
+  for (set<string>::iterator i = to_create.begin();
+       i != to_create.end();
+       ++i) {
+    subdirs.insert(*i);
+    dst[level] = *i;
+    r = create_path(dst);
+    if (r < 0)
+      return r;
+    // new objects are created in here from now on
+    subdir_info_s info_new;
+    info_new.hash_level = level + 1;
+    r = set_info(dst, info_new);
+    if (r < 0)
+      return r;
+    info.subdirs++;
+  }
+  r = set_info(path, info);
+  if (r < 0)
+    return r;
+  r = fsync_dir(path);
+  if (r < 0)
+    return r;
+
+  dout(10) << __func__ << " " << coll() << " " << path << " depth " << depth
+	   << " " << objects.size() << " objects, new subdirs " << to_create
+	   << dendl;
+  bg_split_active = true;
+  bg_split_path = path;
+  bg_split_depth = depth;
+  set_background_split_objects(objects, subdirs);
+  *started = true;
+  return 0;
+}
+
+void HashIndex::set_background_split_objects(
+  const map<string, ghobject_t> &objects,
+  const set<string> &subdirs) {
+  int level = bg_split_path.size();
+  bg_split_subdirs = subdirs;
+  bg_split_objects.clear();
+  for (map<string, ghobject_t>::const_iterator i = objects.begin();
+       i != objects.end();
+       ++i) {
+    vector<string> new_path;
+    get_path_components(i->second, &new_path);
+    if (subdirs.count(new_path[level]))
+      bg_split_objects.push_back(i->second);
+  }
+}
+
+int HashIndex::load_background_split() {
+  map<string, ghobject_t> objects;
+  int r = list_objects(bg_split_path, 0, 0, &objects);
+  if (r < 0)
+    return r;
+  vector<string> subdirs_vec;
+  r = list_subdirs(bg_split_path, &subdirs_vec);
+  if (r < 0)
+    return r;
+  set<string> subdirs;
+  subdirs.insert(subdirs_vec.begin(), subdirs_vec.end());
+  set_background_split_objects(objects, subdirs);
+  return 0;
+}
+
+int HashIndex::continue_background_split(int max, int *moved, bool *done) {
+  *moved = 0;
+  *done = true;
+  if (!bg_split_active)
+    return 0;  // finished by someone else
+
+  // The objects were listed when the split started.  New objects go to
+  // the new subdirs, so the list only goes stale by removals, and those
+  // are looked up again below.  (Their short names can change too, when
+  // an lfn chain is shortened.)
+  const vector<string> path = bg_split_path;
+  const set<string> subdirs = bg_split_subdirs;
+  int level = path.size();
+  map<string, map<string, ghobject_t> > mapped;
+  vector<ghobject_t> to_move;
+  while (!bg_split_objects.empty()) {
+    if (max > 0 && to_move.size() == (unsigned)max) {
+      *done = false;
+      break;
+    }
+    ghobject_t oid = bg_split_objects.front();
+    bg_split_objects.pop_front();
+    string short_name;
+    int exists;
+    int r = get_mangled_name(path, oid, &short_name, &exists);
+    if (r < 0)
+      return r;
+    if (!exists)
+      continue;  // removed since
+    vector<string> new_path;
+    get_path_components(oid, &new_path);
+    mapped[new_path[level]][short_name] = oid;
+    to_move.push_back(oid);
+  }
+
+  int r;
+  vector<string> dst = path;
+  dst.push_back("");
+  for (map<string, map<string, ghobject_t> >::iterator i = mapped.begin();
+       i != mapped.end();
+       ++i) {
+    dst[level] = i->first;
+    for (map<string, ghobject_t>::iterator j = i->second.begin();
+	 j != i->second.end();
+	 ++j) {
+      r = link_object(path, dst, j->second, j->first);
+      // May be a partially finished batch
+      if (r < 0 && r != -EEXIST)
+	return r;
+    }
+    r = fsync_dir(dst);
+    if (r < 0)
+      return r;
+    subdir_info_s info_new;
+    r = get_info(dst, &info_new);
+    if (r < 0)
+      return r;
+    info_new.objs += i->second.size();
+    r = set_info(dst, info_new);
+    if (r < 0)
+      return r;
+  }
+  if (!to_move.empty()) {
+    for (vector<ghobject_t>::iterator i = to_move.begin();
+	 i != to_move.end();
+	 ++i) {
+      r = remove_object(path, *i);
+      if (r < 0)
+	return r;
+    }
+    subdir_info_s info;
+    r = get_info(path, &info);
+    if (r < 0)
+      return r;
+    info.objs -= MIN(info.objs, to_move.size());
+    r = set_info(path, info);
+    if (r < 0)
+      return r;
+    r = fsync_dir(path);
+    if (r < 0)
+      return r;
+  }
+  *moved = to_move.size();
+  if (!*done)
+    return 0;
+
+  // recount, in case we picked up an interrupted batch
+  for (set<string>::iterator i = subdirs.begin(); i != subdirs.end(); ++i) {
+    dst[level] = *i;
+    r = reset_attr(dst);
+    if (r < 0)
+      return r;
+  }
+  r = reset_attr(path);
+  if (r < 0)
+    return r;
+  r = fsync_dir(path);
+  if (r < 0)
+    return r;
+  r = end_split_or_merge(path);
+  if (r < 0)
+    return r;
+  bg_split_active = false;
+  unsigned depth = bg_split_depth;
+  bg_split_depth = 0;
+  bg_split_subdirs.clear();
+  dout(10) << __func__ << " " << coll() << " " << path << " done" << dendl;
+
+  if (!splitter)
+    return 0;
+  for (set<string>::iterator i = subdirs.begin(); i != subdirs.end(); ++i) {
+    dst[level] = *i;
+    if (depth > dst.size()) {
+      queue_split(dst, depth);
+      continue;
+    }
+    subdir_info_s info_new;
+    r = get_info(dst, &info_new);
+    if (r < 0)
+      return r;
+    if (must_split(info_new))
+      queue_split(dst, 0);
+  }
+  return 0;
+}
+
+int HashIndex::finish_background_split() {
+  int moved;
+  bool done = false;
+  while (!done) {
+    int r = continue_background_split(0, &moved, &done);
+    if (r < 0)
+      return r;
+  }
+  return 0;
+}
+
+int HashIndex::list_subtree(const vector<string> &path,
+			    vector<ghobject_t> *out) {
+  map<string, ghobject_t> objects;
+  int r = list_objects(path, 0, 0, &objects);
+  if (r < 0)
+    return r;
+  for (map<string, ghobject_t>::iterator i = objects.begin();
+       i != objects.end();
+       ++i)
+    out->push_back(i->second);
+  vector<string> subdirs;
+  r = list_subdirs(path, &subdirs);
+  if (r < 0)
+    return r;
+  vector<string> sub_path = path;
+  sub_path.push_back("");
+  for (vector<string>::iterator i = subdirs.begin(); i != subdirs.end(); ++i) {
+    *sub_path.rbegin() = *i;
+    r = list_subtree(sub_path, out);
+    if (r < 0)
+      return r;
+  }
+  return 0;
+}
+
+int HashIndex::list_split_in_progress(const vector<string> &path,
+				      const ghobject_t &end,
+				      bool sort_bitwise,
+				      int max_count,
+				      ghobject_t *next,
+				      vector<ghobject_t> *out) {
+  // objects not moved yet sit above their subdir, out of hash order;
+  // this subtree is only about one split's worth of objects, so just
+  // sort it
+  vector<ghobject_t> objects;
+  int r = list_subtree(path, &objects);
+  if (r < 0)
+    return r;
+  if (sort_bitwise)
+    std::sort(objects.begin(), objects.end(), ghobject_t::BitwiseComparator());
+  else
+    std::sort(objects.begin(), objects.end(),
+	      ghobject_t::NibblewiseComparator());
+  for (vector<ghobject_t>::iterator i = objects.begin();
+       i != objects.end();
+       ++i) {
+    if (next && cmp(*i, *next, sort_bitwise) < 0)
+      continue;
+    if (max_count > 0 && out->size() == (unsigned)max_count) {
+      if (next)
+	*next = *i;
+      return 0;
+    }
+    if (cmp(*i, end, sort_bitwise) >= 0) {
+      if (next)
+	*next = ghobject_t::get_max();
+      return 0;
+    }
+    dout(20) << __func__ << " ob " << *i << dendl;
+    out->push_back(*i);
+  }
+  if (next)
+    *next = ghobject_t::get_max();
+  return 0;
+}
+
 void HashIndex::get_path_components(const ghobject_t &oid,
 				    vector<string> *path) {
   char buf[MAX_HASH_LEVEL + 1];
@@ -968,6 +1381,8 @@ int HashIndex::list_by_hash_bitwise(
   ghobject_t *next,
   vector<ghobject_t> *out)
 {
+  if (bg_split_active && path == bg_split_path)
+    return list_split_in_progress(path, end, true, max_count, next, out);
   vector<string> next_path = path;
   next_path.push_back("");
   set<string, CmpHexdigitStringBitwise> hash_prefixes;
@@ -1034,6 +1449,8 @@ int HashIndex::list_by_hash_nibblewise(
   ghobject_t *next,
   vector<ghobject_t> *out)
 {
+  if (bg_split_active && path == bg_split_path)
+    return list_split_in_progress(path, end, false, max_count, next, out);
   vector<string> next_path = path;
   next_path.push_back("");
   set<string> hash_prefixes;
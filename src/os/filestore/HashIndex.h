@@ -18,6 +18,7 @@
 #include "include/buffer_fwd.h"
 #include "include/encoding.h"
 #include "LFNIndex.h"
+#include "IndexSplitter.h"
 
 extern string reverse_hexdigit_bits_string(string l);
 
@@ -46,6 +47,15 @@ extern string reverse_hexdigit_bits_string(string l);
  * Subdirectories are created when the number of objects in a directory
  * exceed (abs(merge_threshhold)) * 16 * split_multiplier.  The number of objects in a directory
  * is encoded as subdir_info_s in an xattr on the directory.
+ *
+ * With filestore_split_background the split is queued to the
+ * IndexSplitter instead of done by the op that crossed the threshold.
+ * A background split first creates the new subdirs (new objects go
+ * there right away), then moves the existing objects down a batch at
+ * a time.  Until it is done, lookups that miss in a new subdir look in
+ * the directory being split, and listing that directory sorts its
+ * whole subtree, so each batch leaves a consistent index behind.  No
+ * merges are done in the collection meanwhile.
  */
 class HashIndex : public LFNIndex {
 private:
@@ -67,6 +77,15 @@ private:
   int merge_threshold;
   int split_multiplier;
 
+  /// background splits; protected by access_lock like the rest
+  IndexSplitter *splitter;
+  map<vector<string>, unsigned> queued_splits; ///< path -> presplit depth
+  bool bg_split_active;
+  vector<string> bg_split_path;
+  unsigned bg_split_depth;   ///< 0 unless presplitting
+  set<string> bg_split_subdirs;        ///< subdirs objects are moved to
+  list<ghobject_t> bg_split_objects;   ///< objects left to move
+
   /// Encodes current subdir state for determining when to split/merge.
   struct subdir_info_s {
     uint64_t objs;       ///< Objects in subdir.
@@ -100,6 +119,7 @@ private:
     static const int SPLIT = 0;
     static const int MERGE = 1;
     static const int COL_SPLIT = 2;
+    static const int BG_SPLIT = 3;
     int op;
     vector<string> path;
 
@@ -113,6 +133,7 @@ private:
     bool is_split() const { return op == SPLIT; }
     bool is_col_split() const { return op == COL_SPLIT; }
     bool is_merge() const { return op == MERGE; }
+    bool is_bg_split() const { return op == BG_SPLIT; }
 
     void encode(bufferlist &bl) const {
       __u8 v = 1;
@@ -142,7 +163,36 @@ public:
     double retry_probability=0) ///< [in] retry probability
     : LFNIndex(collection, base_path, index_version, retry_probability),
       merge_threshold(merge_at),
-      split_multiplier(split_multiple) {}
+      split_multiplier(split_multiple),
+      splitter(NULL),
+      bg_split_active(false),
+      bg_split_depth(0) {}
+
+  /// queue splits to s instead of doing them inline (if enabled)
+  void set_splitter(IndexSplitter *s) {
+    splitter = s;
+  }
+
+  /// @see CollectionIndex
+  int presplit(unsigned depth);
+
+  /**
+   * Begin a background split of path, queued earlier.
+   *
+   * Creates the new subdirs; *started is false if path doesn't need
+   * splitting (any more).
+   */
+  int start_background_split(
+    const vector<string> &path, ///< [in] dir to split
+    bool *started               ///< [out] split is now in progress
+    ); ///< @return Error Code, 0 on success
+
+  /// Move up to max (0 for all) objects of the split in progress
+  int continue_background_split(
+    int max,     ///< [in] max objects to move
+    int *moved,  ///< [out] objects moved
+    bool *done   ///< [out] split is complete
+    ); ///< @return Error Code, 0 on success
 
   /// @see CollectionIndex
   uint32_t collection_version() { return index_version; }
@@ -215,6 +265,10 @@ private:
   int start_split(
     const vector<string> &path ///< [in] path to split
     ); ///< @return Error Code, 0 on success
+  /// Tag root directory at beginning of background split
+  int start_bg_split(
+    const vector<string> &path ///< [in] path to split
+    ); ///< @return Error Code, 0 on success
   /// Tag root directory at beginning of split
   int start_merge(
     const vector<string> &path ///< [in] path to merge
@@ -274,6 +328,39 @@ private:
     subdir_info_s info	       ///< [in] Info attached to path
     ); /// @return Error Code, 0 on success
 
+  /// Queue path for a background split, to depth if presplitting
+  void queue_split(
+    const vector<string> &path, ///< [in] Subdir to split
+    unsigned depth              ///< [in] presplit depth, 0 if none
+    );
+
+  /// Finish the background split in progress, if any, in one go
+  int finish_background_split();
+
+  /// Set bg_split_subdirs and bg_split_objects for bg_split_path
+  void set_background_split_objects(
+    const map<string, ghobject_t> &objects, ///< [in] listing of the dir
+    const set<string> &subdirs              ///< [in] its subdirs
+    );
+
+  /// List the split in progress left by a crash or umount
+  int load_background_split();
+
+  /// List everything below path (which is being split) in order
+  int list_split_in_progress(
+    const vector<string> &path, ///< [in] Path to list
+    const ghobject_t &end,      ///< [in] List only objects < end
+    bool sort_bitwise,          ///< [in] sort bitwise
+    int max_count,              ///< [in] List at most max_count
+    ghobject_t *next,           ///< [in,out] List objects >= *next
+    vector<ghobject_t> *out     ///< [out] Listed objects
+    ); ///< @return Error Code, 0 on success
+  /// Recursively collect the objects in path and its subdirs
+  int list_subtree(
+    const vector<string> &path, ///< [in] Path to list
+    vector<ghobject_t> *out     ///< [out] Objects found
+    ); ///< @return Error Code, 0 on success
+
   /// Determine path components from hoid hash
   void get_path_components(
     const ghobject_t &oid, ///< [in] Object for which to get path components
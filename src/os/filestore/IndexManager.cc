@@ -62,6 +62,7 @@ static int get_version(const char *path, uint32_t *version) {
 }
 
 IndexManager::~IndexManager() {
+  splitter.stop();
 
   for (ceph::unordered_map<coll_t, CollectionIndex* > ::iterator it = col_indices.begin();
        it != col_indices.end(); ++it) {
@@ -100,8 +101,13 @@ int IndexManager::build_index(coll_t c, const char *path, CollectionIndex **inde
     case CollectionIndex::HASH_INDEX_TAG_2: // fall through
     case CollectionIndex::HOBJECT_WITH_POOL: {
       // Must be a HashIndex
-      *index = new HashIndex(c, path, g_conf->filestore_merge_threshold,
-				   g_conf->filestore_split_multiple, version);
+      HashIndex *hindex = new HashIndex(c, path,
+					g_conf->filestore_merge_threshold,
+					g_conf->filestore_split_multiple,
+					version);
+      hindex->set_path_cache(&path_cache);
+      hindex->set_splitter(&splitter);
+      *index = hindex;
       return 0;
     }
     default: assert(0);
@@ -109,10 +115,14 @@ int IndexManager::build_index(coll_t c, const char *path, CollectionIndex **inde
 
   } else {
     // No need to check
-    *index = new HashIndex(c, path, g_conf->filestore_merge_threshold,
-				 g_conf->filestore_split_multiple,
-				 CollectionIndex::HOBJECT_WITH_POOL,
-				 g_conf->filestore_index_retry_probability);
+    HashIndex *hindex = new HashIndex(c, path,
+				      g_conf->filestore_merge_threshold,
+				      g_conf->filestore_split_multiple,
+				      CollectionIndex::HOBJECT_WITH_POOL,
+				      g_conf->filestore_index_retry_probability);
+    hindex->set_path_cache(&path_cache);
+    hindex->set_splitter(&splitter);
+    *index = hindex;
     return 0;
   }
 }
@@ -24,6 +24,7 @@
 
 #include "CollectionIndex.h"
 #include "HashIndex.h"
+#include "IndexSplitter.h"
 
 
 /// Public type for Index
@@ -52,6 +53,8 @@ class IndexManager {
   RWLock lock; ///< Lock for Index Manager
   bool upgrade;
   ceph::unordered_map<coll_t, CollectionIndex* > col_indices;
+  IndexPathCache path_cache; ///< shared by all our indexes
+  IndexSplitter splitter;    ///< background splits for all our indexes
 
   /**
    * Index factory
@@ -69,10 +72,26 @@ class IndexManager {
 public:
   /// Constructor
   explicit IndexManager(bool upgrade) : lock("IndexManager lock"),
-		    		        upgrade(upgrade) {}
+		    		        upgrade(upgrade),
+					path_cache(g_ceph_context),
+					splitter(g_ceph_context) {}
 
   ~IndexManager();
 
+  /// where the path cache reports lookups, hits and syscalls
+  void set_logger(PerfCounters *l) {
+    path_cache.logger = l;
+    splitter.logger = l;
+  }
+
+  /// start/stop splitting directories in the background
+  void start_splitter() {
+    splitter.start();
+  }
+  void stop_splitter() {
+    splitter.stop();
+  }
+
   /**
    * Reserve and return index for c
    *
@@ -0,0 +1,130 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+#ifndef CEPH_INDEXPATHCACHE_H
+#define CEPH_INDEXPATHCACHE_H
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "common/hobject.h"
+#include "common/simple_cache.hpp"
+#include "common/config_obs.h"
+#include "common/perf_counters.h"
+#include "include/intarith.h"
+#include "os/ObjectStore.h"
+
+/**
+ * Index path cache
+ *
+ * Remembers where LFNIndex found an object (subdir components and
+ * on-disk short name, and whether it existed) so that the next lookup
+ * doesn't have to walk the hash directories and, for long names,
+ * probe the lfn xattrs again.  Shared by all the indexes of a
+ * FileStore, sharded by object hash.
+ *
+ * Every entry is tagged with the owner id of the index that added it.
+ * An index gets a fresh owner id whenever something moves files
+ * around underneath it (split, merge, lfn renames, subdir changes),
+ * which invalidates all of its entries at once; they age out of the
+ * lru.  Single objects are dropped on unlink.
+ */
+class IndexPathCache : public md_config_obs_t {
+public:
+  struct entry_t {
+    uint64_t owner;
+    std::vector<std::string> path;  ///< subdir components
+    std::string short_name;
+    bool exists;
+    entry_t() : owner(0), exists(false) {}
+  };
+
+private:
+  CephContext *cct;
+  const int registry_shards;
+  std::vector<SimpleLRU<ghobject_t, entry_t, ghobject_t::BitwiseComparator>*> registry;
+  std::atomic<uint64_t> last_owner;
+  bool enabled;
+
+  SimpleLRU<ghobject_t, entry_t, ghobject_t::BitwiseComparator> *shard(const ghobject_t &oid) {
+    return registry[oid.hobj.get_hash() % registry_shards];
+  }
+
+public:
+  PerfCounters *logger;
+
+  explicit IndexPathCache(CephContext *cct)
+    : cct(cct),
+      registry_shards(MAX(cct->_conf->filestore_index_cache_shards, 1)),
+      last_owner(0),
+      enabled(cct->_conf->filestore_index_cache_size > 0),
+      logger(NULL) {
+    cct->_conf->add_observer(this);
+    for (int i = 0; i < registry_shards; ++i)
+      registry.push_back(new SimpleLRU<ghobject_t, entry_t, ghobject_t::BitwiseComparator>(
+	MAX(cct->_conf->filestore_index_cache_size / registry_shards, 1)));
+  }
+  ~IndexPathCache() {
+    cct->_conf->remove_observer(this);
+    for (auto r : registry)
+      delete r;
+  }
+
+  /// get an owner id no existing entry carries
+  uint64_t new_owner() {
+    return ++last_owner;
+  }
+
+  bool lookup(const ghobject_t &oid, uint64_t owner, entry_t *out) {
+    if (!enabled)
+      return false;
+    return shard(oid)->lookup(oid, out) && out->owner == owner;
+  }
+
+  void add(const ghobject_t &oid, const entry_t &e) {
+    if (enabled)
+      shard(oid)->add(oid, e);
+  }
+
+  void clear(const ghobject_t &oid) {
+    shard(oid)->clear(oid);
+  }
+
+  void inc(int idx, uint64_t v = 1) {
+    if (logger)
+      logger->inc(idx, v);
+  }
+
+  /// md_config_obs_t
+  const char** get_tracked_conf_keys() const {
+    static const char* KEYS[] = {
+      "filestore_index_cache_size",
+      NULL
+    };
+    return KEYS;
+  }
+  void handle_conf_change(const md_config_t *conf,
+			  const std::set<std::string> &changed) {
+    if (changed.count("filestore_index_cache_size")) {
+      enabled = conf->filestore_index_cache_size > 0;
+      for (auto r : registry) {
+	if (!enabled)
+	  r->clear();
+	r->set_size(
+	  MAX(conf->filestore_index_cache_size / registry_shards, 1));
+      }
+    }
+  }
+};
+
+#endif
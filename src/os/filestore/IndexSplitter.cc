@@ -0,0 +1,127 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+#include "IndexSplitter.h"
+#include "HashIndex.h"
+#include "os/ObjectStore.h"
+#include "common/debug.h"
+#include "common/errno.h"
+#include "common/perf_counters.h"
+
+#define dout_subsys ceph_subsys_filestore
+#undef dout_prefix
+#define dout_prefix *_dout << "filestore(splitter) "
+
+void IndexSplitter::start()
+{
+  {
+    Mutex::Locker l(lock);
+    stopping = false;
+  }
+  create("fs_index_split");
+}
+
+void IndexSplitter::stop()
+{
+  {
+    Mutex::Locker l(lock);
+    stopping = true;
+    cond.Signal();
+  }
+  if (is_started())
+    join();
+  // anything still queued is picked up again on the next start(); a
+  // split we were in the middle of is finished by HashIndex::cleanup()
+}
+
+void IndexSplitter::queue_split(HashIndex *index, const vector<string> &path)
+{
+  Mutex::Locker l(lock);
+  dout(15) << __func__ << " " << index->coll() << " " << path << dendl;
+  queue.push_back(make_pair(index, path));
+  cond.Signal();
+}
+
+void *IndexSplitter::entry()
+{
+  Mutex::Locker l(lock);
+  while (!stopping) {
+    if (queue.empty()) {
+      cond.Wait(lock);
+      continue;
+    }
+    pair<HashIndex*, vector<string> > next = queue.front();
+    queue.pop_front();
+    lock.Unlock();
+    bool more = split(next.first, next.second);
+    lock.Lock();
+    if (!more)
+      break;
+  }
+  return 0;
+}
+
+bool IndexSplitter::split(HashIndex *index, const vector<string> &path)
+{
+  {
+    RWLock::WLocker l(index->access_lock);
+    bool started = false;
+    int r = index->start_background_split(path, &started);
+    if (r < 0) {
+      derr << __func__ << " " << index->coll() << " " << path
+	   << " failed to start: " << cpp_strerror(r) << dendl;
+      return true;
+    }
+    if (!started)
+      return true;
+  }
+  dout(10) << __func__ << " " << index->coll() << " " << path
+	   << " started" << dendl;
+
+  utime_t start = ceph_clock_now(cct);
+  uint64_t total = 0;
+  bool done = false;
+  while (!done) {
+    int moved = 0;
+    {
+      RWLock::WLocker l(index->access_lock);
+      int r = index->continue_background_split(
+	cct->_conf->filestore_split_batch, &moved, &done);
+      if (r < 0) {
+	// leave it; the lookup fallback keeps the index usable and the
+	// split is completed on the next mount
+	derr << __func__ << " " << index->coll() << " " << path
+	     << " failed: " << cpp_strerror(r) << dendl;
+	return true;
+      }
+    }
+    total += moved;
+    if (logger)
+      logger->inc(l_os_index_split_moved, moved);
+
+    Mutex::Locker l(lock);
+    if (stopping)
+      return false;
+    int rate = cct->_conf->filestore_split_rate;
+    if (!done && rate > 0 && moved > 0) {
+      utime_t interval;
+      interval.set_from_double((double)moved / rate);
+      cond.WaitInterval(cct, lock, interval);
+      if (stopping)
+	return false;
+    }
+  }
+  dout(10) << __func__ << " " << index->coll() << " " << path
+	   << " moved " << total << " objects in "
+	   << (ceph_clock_now(cct) - start) << dendl;
+  return true;
+}
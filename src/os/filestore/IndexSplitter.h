@@ -0,0 +1,69 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+#ifndef CEPH_INDEXSPLITTER_H
+#define CEPH_INDEXSPLITTER_H
+
+#include <list>
+#include <string>
+#include <vector>
+
+#include "common/Thread.h"
+#include "common/Mutex.h"
+#include "common/Cond.h"
+
+class CephContext;
+class HashIndex;
+class PerfCounters;
+
+/**
+ * IndexSplitter
+ *
+ * Splits HashIndex directories in the background, one at a time for
+ * the whole FileStore.  A split is done in batches of
+ * filestore_split_batch objects, each under the collection's
+ * access_lock, so ops on the collection only ever wait for one batch.
+ * Between batches the splitter sleeps to keep to filestore_split_rate
+ * objects per second.
+ *
+ * HashIndex decides what to split and keeps the index consistent
+ * between batches; this just runs the queue.
+ */
+class IndexSplitter : public Thread {
+  CephContext *cct;
+  Mutex lock;
+  Cond cond;
+  bool stopping;
+  std::list<std::pair<HashIndex*, std::vector<std::string> > > queue;
+
+  void *entry();
+
+  /// split one directory; false if we were asked to stop
+  bool split(HashIndex *index, const std::vector<std::string> &path);
+
+public:
+  PerfCounters *logger;
+
+  explicit IndexSplitter(CephContext *cct)
+    : cct(cct),
+      lock("IndexSplitter::lock"),
+      stopping(true),
+      logger(NULL) {}
+
+  void start();
+  void stop();
+
+  /// called by HashIndex, with its access_lock held for write
+  void queue_split(HashIndex *index, const std::vector<std::string> &path);
+};
+
+#endif
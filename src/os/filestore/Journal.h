@@ -57,10 +57,15 @@ public:
    * reserved here but not yet released using committed_thru.
    */
   virtual void reserve_throttle_and_backoff(uint64_t count) = 0;
+  /// as above; hint picks the journal shard the entry will go to
+  virtual void reserve_throttle_and_backoff(uint64_t count, uint32_t hint) {
+    reserve_throttle_and_backoff(count);
+  }
 
   virtual int dump(ostream& out) { return -EOPNOTSUPP; }
 
-  void set_wait_on_full(bool b) { wait_on_full = b; }
+  virtual void set_wait_on_full(bool b) { wait_on_full = b; }
+  virtual void set_logger(PerfCounters *l) { logger = l; }
 
   // writes
   virtual bool is_writeable() = 0;
@@ -68,15 +73,46 @@ public:
   virtual void submit_entry(uint64_t seq, bufferlist& e, uint32_t orig_len,
 			    Context *oncommit,
 			    TrackedOpRef osd_op = TrackedOpRef()) = 0;
+  /**
+   * submit_entry with a placement hint
+   *
+   * Entries with the same hint are journaled (and completed) in
+   * order; a sharded implementation may write entries with different
+   * hints in parallel.
+   */
+  virtual void submit_entry(uint64_t seq, bufferlist& e, uint32_t orig_len,
+			    Context *oncommit, TrackedOpRef osd_op,
+			    uint32_t hint) {
+    submit_entry(seq, e, orig_len, oncommit, osd_op);
+  }
   virtual void commit_start(uint64_t seq) = 0;
   virtual void committed_thru(uint64_t seq) = 0;
 
+  /**
+   * highest seq, up to seq, that a commit may cover
+   *
+   * A commit past an entry that hasn't been journaled yet would complete
+   * and trim it, and replay would start after it.  A journal that writes
+   * entries in seq order has nothing older in flight once seq is applied.
+   */
+  virtual uint64_t get_committable_seq(uint64_t seq) { return seq; }
+
   /// Read next journal entry - asserts on invalid journal
   virtual bool read_entry(
     bufferlist &bl, ///< [out] payload on successful read
     uint64_t &seq   ///< [in,out] sequence number on last successful read
     ) = 0; ///< @return true on successful read, false on journal end
 
+  /**
+   * true if replay may go on past a missing seq
+   *
+   * Asked when the entry just read is not the one after the last.  Only
+   * a journal that can lose the unacked tail of part of its entries
+   * (ShardedJournal) says yes, and only once that part has been read to
+   * its end.
+   */
+  virtual bool can_skip_missing_seq() { return false; }
+
   virtual bool should_commit_now() = 0;
 
   virtual int prepare_entry(vector<ObjectStore::Transaction>& tls, bufferlist* tbl) = 0;
@@ -0,0 +1,105 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+#include <sys/mman.h>
+
+#include "JournalRing.h"
+#include "include/assert.h"
+#include "include/intarith.h"
+#include "common/debug.h"
+#include "common/errno.h"
+
+#define dout_subsys ceph_subsys_journal
+#undef dout_prefix
+#define dout_prefix *_dout << "journalring "
+
+JournalRing::JournalRing(uint64_t s)
+  : lock("JournalRing::lock"),
+    base(NULL),
+    size(ROUND_UP_TO(s, CEPH_PAGE_SIZE)),
+    head(0)
+{
+  void *p = ::mmap(NULL, size, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED) {
+    int r = -errno;
+    derr << "JournalRing: mmap of " << size << " bytes failed: "
+	 << cpp_strerror(r) << dendl;
+    size = 0;
+    return;
+  }
+  base = static_cast<char*>(p);
+  dout(10) << "JournalRing " << size << " bytes at " << (void*)base << dendl;
+}
+
+JournalRing::~JournalRing()
+{
+  assert(live.empty());
+  if (base)
+    ::munmap(base, size);
+}
+
+buffer::ptr JournalRing::alloc(uint64_t len)
+{
+  assert(len > 0);
+  assert((len & ~CEPH_PAGE_MASK) == 0);
+  Mutex::Locker l(lock);
+  if (!base || len > size)
+    return buffer::ptr();
+
+  uint64_t off;
+  if (live.empty()) {
+    off = 0;
+  } else {
+    uint64_t tail = live.front().off;
+    if (head > tail) {
+      if (size - head >= len)
+	off = head;
+      else if (tail > len)
+	off = 0;  // wrap; the gap at the end is skipped
+      else
+	return buffer::ptr();
+    } else {
+      // wrapped; head == tail means full
+      if (tail - head > len)
+	off = head;
+      else
+	return buffer::ptr();
+    }
+  }
+  live.push_back(chunk_t(off, len));
+  head = off + len;
+  get();
+  return buffer::ptr(buffer::claim_buffer(len, base + off, _release_cb, this));
+}
+
+void JournalRing::_release_cb(void *arg, char *p)
+{
+  JournalRing *ring = static_cast<JournalRing*>(arg);
+  ring->_release(p);
+  ring->put();
+}
+
+void JournalRing::_release(char *p)
+{
+  Mutex::Locker l(lock);
+  uint64_t off = p - base;
+  std::deque<chunk_t>::iterator i = live.begin();
+  while (i != live.end() && i->off != off)
+    ++i;
+  assert(i != live.end());
+  i->freed = true;
+  while (!live.empty() && live.front().freed)
+    live.pop_front();
+}
+
+uint64_t JournalRing::get_used()
+{
+  Mutex::Locker l(lock);
+  if (live.empty())
+    return 0;
+  uint64_t tail = live.front().off;
+  if (head > tail)
+    return head - tail;
+  return size - tail + head;
+}
@@ -0,0 +1,65 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+
+#ifndef CEPH_JOURNAL_RING_H
+#define CEPH_JOURNAL_RING_H
+
+#include <deque>
+
+#include "include/buffer.h"
+#include "common/Mutex.h"
+#include "common/RefCountedObj.h"
+
+/**
+ * JournalRing
+ *
+ * A preallocated, page-aligned (mmap'd) ring that FileJournal builds
+ * entries in, instead of allocating and copying into a fresh aligned
+ * buffer for every entry.  Space is handed out as bufferptrs and goes
+ * back to the ring when the last reference to it is dropped, which for
+ * journal entries is once the write has completed.
+ *
+ * Entries are usually written, and hence released, in the order they
+ * were prepared, but not always: prepare_entry runs before the op gets
+ * its seq.  A chunk released out of order is just marked free; the tail
+ * only moves past chunks that are free.
+ *
+ * Each outstanding chunk holds a ref on the ring, so the ring outlives
+ * its owner if buffers are still in flight.
+ */
+class JournalRing : public RefCountedObject {
+  struct chunk_t {
+    uint64_t off;
+    uint64_t len;
+    bool freed;
+    chunk_t(uint64_t o, uint64_t l) : off(o), len(l), freed(false) {}
+  };
+
+  Mutex lock;
+  char *base;
+  uint64_t size;
+  uint64_t head;             ///< next free byte
+  std::deque<chunk_t> live;  ///< in allocation order; front is the tail
+
+  static void _release_cb(void *arg, char *p);
+  void _release(char *p);
+
+  ~JournalRing();
+
+public:
+  explicit JournalRing(uint64_t size);
+
+  bool valid() const {
+    return base != NULL;
+  }
+  uint64_t get_size() const {
+    return size;
+  }
+
+  /// get len bytes (a multiple of the page size); empty ptr if full
+  buffer::ptr alloc(uint64_t len);
+
+  uint64_t get_used();
+};
+
+#endif
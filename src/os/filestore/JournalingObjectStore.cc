@@ -78,7 +78,17 @@ int JournalingObjectStore::journal_replay(uint64_t fs_op_seq)
       dout(3) << "journal_replay: skipping old op seq " << seq << " <= " << op_seq << dendl;
       continue;
     }
-    assert(op_seq == seq-1);
+    if (op_seq != seq-1) {
+      // a sharded journal can lose the unacked tail of one shard while
+      // a later seq on another shard (a different sequencer) made it
+      if (!journal->can_skip_missing_seq()) {
+	derr << "journal_replay: missing op seq " << (op_seq+1)
+	     << " before " << seq << dendl;
+	assert(0 == "journal_replay: missing op seq");
+      }
+      dout(3) << "journal_replay: op seqs " << (op_seq+1) << ".." << (seq-1)
+	      << " were lost from the end of a journal shard" << dendl;
+    }
 
     dout(3) << "journal_replay: applying op seq " << seq << dendl;
     bufferlist::iterator p = bl.begin();
@@ -201,14 +211,18 @@ bool JournalingObjectStore::ApplyManager::commit_start()
     dout(10) << "commit_start blocked, all open_ops have completed" << dendl;
     {
       Mutex::Locker l(com_lock);
-      if (max_applied_seq == committed_seq) {
+      uint64_t seq = max_applied_seq;
+      if (journal)
+	seq = journal->get_committable_seq(seq);
+      assert(seq >= committed_seq);
+      if (seq == committed_seq) {
 	dout(10) << "commit_start nothing to do" << dendl;
 	blocked = false;
-	assert(commit_waiters.empty());
+	assert(max_applied_seq > committed_seq || commit_waiters.empty());
 	goto out;
       }
 
-      _committing_seq = committing_seq = max_applied_seq;
+      _committing_seq = committing_seq = seq;
 
       dout(10) << "commit_start committing " << committing_seq
 	       << ", still blocked" << dendl;
@@ -251,7 +265,7 @@ void JournalingObjectStore::ApplyManager::commit_finish()
 
 void JournalingObjectStore::_op_journal_transactions(
   bufferlist& tbl, uint32_t orig_len, uint64_t op,
-  Context *onjournal, TrackedOpRef osd_op)
+  Context *onjournal, TrackedOpRef osd_op, uint32_t hint)
 {
   if (osd_op.get())
     dout(10) << "op_journal_transactions " << op << " reqid_t "
@@ -260,7 +274,7 @@ void JournalingObjectStore::_op_journal_transactions(
     dout(10) << "op_journal_transactions " << op  << dendl;
 
   if (journal && journal->is_writeable()) {
-    journal->submit_entry(op, tbl, orig_len, onjournal, osd_op);
+    journal->submit_entry(op, tbl, orig_len, onjournal, osd_op, hint);
   } else if (onjournal) {
     apply_manager.add_waiter(op, onjournal);
   }
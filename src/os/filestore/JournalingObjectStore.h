@@ -116,7 +116,8 @@ protected:
   int journal_replay(uint64_t fs_op_seq);
 
   void _op_journal_transactions(bufferlist& tls, uint32_t orig_len, uint64_t op,
-				Context *onjournal, TrackedOpRef osd_op);
+				Context *onjournal, TrackedOpRef osd_op,
+				uint32_t hint);
 
   virtual int do_transactions(vector<ObjectStore::Transaction>& tls, uint64_t op_seq) = 0;
 
@@ -110,6 +110,8 @@ int LFNIndex::created(const ghobject_t &oid, const char *path)
     }
     goto out;
   }
+  // before _created, so a split it triggers invalidates this
+  _cache_path(oid, path_comp, short_name, true);
   r = _created(path_comp, oid, short_name);
   if (r < 0)
     goto out;
@@ -125,6 +127,8 @@ int LFNIndex::unlink(const ghobject_t &oid)
   if (r < 0) {
     goto out;
   }
+  if (path_cache)
+    path_cache->clear(oid);
   r = _remove(path, oid, short_name);
   if (r < 0) {
     goto out;
@@ -139,15 +143,63 @@ int LFNIndex::lookup(const ghobject_t &oid,
   WRAP_RETRY(
   vector<string> path;
   string short_name;
-  r = _lookup(oid, &path, &short_name, hardlink);
-  if (r < 0)
-    goto out;
+  if (!_lookup_cached(oid, &path, &short_name, hardlink)) {
+    r = _lookup(oid, &path, &short_name, hardlink);
+    if (r < 0)
+      goto out;
+    if (hardlink)
+      _cache_path(oid, path, short_name, *hardlink > 0);
+  }
   string full_path = get_full_path(path, short_name);
   *out_path = std::make_shared<Path>(full_path, this);
   r = 0;
   );
 }
 
+bool LFNIndex::_lookup_cached(const ghobject_t &oid,
+			      vector<string> *path,
+			      string *short_name,
+			      int *hardlink)
+{
+  if (!path_cache)
+    return false;
+  path_cache->inc(l_os_index_lookup);
+  IndexPathCache::entry_t e;
+  if (!hardlink || !path_cache->lookup(oid, cache_owner, &e))
+    return false;
+  if (e.exists) {
+    // the link count isn't cached; other collections can link/unlink
+    struct stat st;
+    count_syscall();
+    if (::stat(get_full_path(e.path, e.short_name).c_str(), &st) < 0) {
+      path_cache->clear(oid);
+      return false;
+    }
+    *hardlink = st.st_nlink;
+  } else {
+    *hardlink = 0;
+  }
+  path->swap(e.path);
+  short_name->swap(e.short_name);
+  path_cache->inc(l_os_index_cache_hit);
+  return true;
+}
+
+void LFNIndex::_cache_path(const ghobject_t &oid,
+			   const vector<string> &path,
+			   const string &short_name,
+			   bool exists)
+{
+  if (!path_cache)
+    return;
+  IndexPathCache::entry_t e;
+  e.owner = cache_owner;
+  e.path = path;
+  e.short_name = short_name;
+  e.exists = exists;
+  path_cache->add(oid, e);
+}
+
 int LFNIndex::pre_hash_collection(uint32_t pg_num, uint64_t expected_num_objs)
 {
   return _pre_hash_collection(pg_num, expected_num_objs);
@@ -195,6 +247,7 @@ int LFNIndex::link_object(const vector<string> &from,
   if (r < 0)
     return r;
   maybe_inject_failure();
+  invalidate_path_cache();
   r = ::link(from_path.c_str(), to_path.c_str());
   maybe_inject_failure();
   if (r < 0)
@@ -207,6 +260,7 @@ int LFNIndex::remove_objects(const vector<string> &dir,
 			     const map<string, ghobject_t> &to_remove,
 			     map<string, ghobject_t> *remaining)
 {
+  invalidate_path_cache();
   set<string> clean_chains;
   for (map<string, ghobject_t>::const_iterator to_clean = to_remove.begin();
        to_clean != to_remove.end();
@@ -272,6 +326,7 @@ int LFNIndex::move_objects(const vector<string> &from,
 {
   map<string, ghobject_t> to_move;
   int r;
+  invalidate_path_cache();
   r = list_objects(from, 0, NULL, &to_move);
   if (r < 0)
     return r;
@@ -341,6 +396,8 @@ int LFNIndex::move_subdir(
   sub_path.push_back(dir);
   string from_path(from.get_full_path_subdir(sub_path));
   string to_path(dest.get_full_path_subdir(sub_path));
+  from.invalidate_path_cache();
+  dest.invalidate_path_cache();
   int r = ::rename(from_path.c_str(), to_path.c_str());
   if (r < 0)
     return -errno;
@@ -358,6 +415,8 @@ int LFNIndex::move_object(
   string to_path;
   string to_name;
   int exists;
+  from.invalidate_path_cache();
+  dest.invalidate_path_cache();
   int r = dest.lfn_get_name(path, obj.second, &to_name, &to_path, &exists);
   if (r < 0)
     return r;
@@ -488,6 +547,7 @@ int LFNIndex::list_subdirs(const vector<string> &to_list,
 
 int LFNIndex::create_path(const vector<string> &to_create)
 {
+  invalidate_path_cache();
   maybe_inject_failure();
   int r = ::mkdir(get_full_path_subdir(to_create).c_str(), 0777);
   maybe_inject_failure();
@@ -499,6 +559,7 @@ int LFNIndex::create_path(const vector<string> &to_create)
 
 int LFNIndex::remove_path(const vector<string> &to_remove)
 {
+  invalidate_path_cache();
   maybe_inject_failure();
   int r = ::rmdir(get_full_path_subdir(to_remove).c_str());
   maybe_inject_failure();
@@ -512,6 +573,7 @@ int LFNIndex::path_exists(const vector<string> &to_check, int *exists)
 {
   string full_path = get_full_path_subdir(to_check);
   struct stat buf;
+  count_syscall();
   if (::stat(full_path.c_str(), &buf)) {
     int r = -errno;
     if (r == -ENOENT) {
@@ -732,6 +794,7 @@ int LFNIndex::lfn_get_name(const vector<string> &path,
       struct stat buf;
       string full_path = get_full_path(path, full_name);
       maybe_inject_failure();
+      count_syscall();
       r = ::stat(full_path.c_str(), &buf);
       if (r < 0) {
 	if (errno == ENOENT)
@@ -752,6 +815,7 @@ int LFNIndex::lfn_get_name(const vector<string> &path,
     candidate = lfn_get_short_name(oid, i);
     candidate_path = get_full_path(path, candidate);
     bufferptr bp;
+    count_syscall();
     r = chain_getxattr_buf(
       candidate_path.c_str(),
       get_lfn_attr().c_str(),
@@ -784,6 +848,7 @@ int LFNIndex::lfn_get_name(const vector<string> &path,
 	*out_path = candidate_path;
       if (hardlink) {
 	struct stat st;
+	count_syscall();
 	r = ::stat(candidate_path.c_str(), &st);
         if (r < 0) {
           if (errno == ENOENT)
@@ -796,6 +861,7 @@ int LFNIndex::lfn_get_name(const vector<string> &path,
       return 0;
     }
     bp = bufferptr();
+    count_syscall();
     r = chain_getxattr_buf(
       candidate_path.c_str(),
       get_alt_lfn_attr().c_str(),
@@ -803,6 +869,7 @@ int LFNIndex::lfn_get_name(const vector<string> &path,
     if (r > 0) {
       // only consider alt name if nlink > 1
       struct stat st;
+      count_syscall();
       int rc = ::stat(candidate_path.c_str(), &st);
       if (rc < 0)
 	return -errno;
@@ -920,6 +987,8 @@ int LFNIndex::lfn_unlink(const vector<string> &path,
   } else {
     string& rename_to = full_path;
     string rename_from = get_full_path(path, lfn_get_short_name(oid, i - 1));
+    // the last object in the chain takes our short name
+    invalidate_path_cache();
     maybe_inject_failure();
     int r = ::rename(rename_from.c_str(), rename_to.c_str());
     maybe_inject_failure();
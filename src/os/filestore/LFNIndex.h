@@ -28,6 +28,7 @@
 #include "common/ceph_crypto.h"
 
 #include "CollectionIndex.h"
+#include "IndexPathCache.h"
 
 /**
  * LFNIndex also encapsulates logic for manipulating
@@ -124,6 +125,25 @@ private:
   string lfn_attribute, lfn_alt_attribute;
   coll_t collection;
 
+  IndexPathCache *path_cache;
+  std::atomic<uint64_t> cache_owner; ///< tag of our valid path_cache entries
+
+  /// fill in path, short_name, hardlink from path_cache if we can
+  bool _lookup_cached(
+    const ghobject_t &oid,
+    vector<string> *path,
+    string *short_name,
+    int *hardlink);
+  void _cache_path(
+    const ghobject_t &oid,
+    const vector<string> &path,
+    const string &short_name,
+    bool exists);
+  void count_syscall() {
+    if (path_cache)
+      path_cache->inc(l_os_index_syscalls);
+  }
+
 public:
   /// Constructor
   LFNIndex(
@@ -138,7 +158,9 @@ public:
       error_injection_on(_error_injection_probability != 0),
       error_injection_probability(_error_injection_probability),
       last_failure(0), current_failure(0),
-      collection(collection) {
+      collection(collection),
+      path_cache(NULL),
+      cache_owner(0) {
     if (index_version == HASH_INDEX_TAG) {
       lfn_attribute = LFN_ATTR;
     } else {
@@ -151,6 +173,16 @@ public:
 
   coll_t coll() const { return collection; }
 
+  void set_path_cache(IndexPathCache *c) {
+    path_cache = c;
+    cache_owner = c->new_owner();
+  }
+  /// forget all cached paths; call whenever files move or are renamed
+  void invalidate_path_cache() {
+    if (path_cache)
+      cache_owner = path_cache->new_owner();
+  }
+
   /// Virtual destructor
   virtual ~LFNIndex() {}
 
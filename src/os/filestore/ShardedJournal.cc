@@ -0,0 +1,275 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+#include "ShardedJournal.h"
+#include "common/debug.h"
+#include "common/errno.h"
+#include "include/str_list.h"
+
+#define dout_subsys ceph_subsys_journal
+#undef dout_prefix
+#define dout_prefix *_dout << "journal "
+
+int ShardedJournal::get_shard_paths(const string& path, unsigned num_shards,
+				    const string& shard_paths,
+				    vector<string> *out)
+{
+  out->clear();
+  out->push_back(path);
+  if (shard_paths.length()) {
+    vector<string> v;
+    get_str_vec(shard_paths, v);
+    if (v.size() != num_shards - 1) {
+      derr << "ShardedJournal: journal_shard_paths lists " << v.size()
+	   << " paths, need " << (num_shards - 1) << " for " << num_shards
+	   << " shards" << dendl;
+      return -EINVAL;
+    }
+    out->insert(out->end(), v.begin(), v.end());
+    return 0;
+  }
+  for (unsigned i = 1; i < num_shards; ++i) {
+    char buf[16];
+    snprintf(buf, sizeof(buf), ".%u", i);
+    out->push_back(path + buf);
+  }
+  return 0;
+}
+
+ShardedJournal::ShardedJournal(uuid_d fsid, Finisher *fin, Cond *sync_cond,
+			       const char *f, unsigned num_shards,
+			       const string& shard_paths,
+			       bool dio, bool ai, bool faio)
+  : Journal(fsid, fin, sync_cond),
+    bad_paths(false),
+    heads(num_shards),
+    pending_lock("ShardedJournal::pending_lock")
+{
+  assert(num_shards > 0);
+  vector<string> paths;
+  if (get_shard_paths(f, num_shards, shard_paths, &paths) < 0) {
+    // keep going with the default paths; check/create/open will fail
+    bad_paths = true;
+    get_shard_paths(f, num_shards, string(), &paths);
+  }
+  for (unsigned i = 0; i < num_shards; ++i) {
+    FileJournal *j = new FileJournal(fsid, fin, sync_cond,
+				     paths[i].c_str(), dio, ai, faio);
+    j->set_sparse_seq(true);
+    j->set_shard(i, num_shards);
+    shards.push_back(j);
+  }
+}
+
+ShardedJournal::~ShardedJournal()
+{
+  for (auto j : shards)
+    delete j;
+}
+
+int ShardedJournal::check()
+{
+  if (bad_paths)
+    return -EINVAL;
+  for (auto j : shards) {
+    int r = j->check();
+    if (r < 0)
+      return r;
+  }
+  return 0;
+}
+
+int ShardedJournal::create()
+{
+  if (bad_paths)
+    return -EINVAL;
+  dout(2) << __func__ << " " << shards.size() << " shards" << dendl;
+  for (auto j : shards) {
+    int r = j->create();
+    if (r < 0)
+      return r;
+  }
+  return 0;
+}
+
+int ShardedJournal::open(uint64_t fs_op_seq)
+{
+  dout(2) << __func__ << " " << shards.size() << " shards fs_op_seq "
+	  << fs_op_seq << dendl;
+  // refuse a shard count or order other than the one we were created
+  // with before any shard is left open
+  int r = check();
+  if (r < 0)
+    return r;
+  for (unsigned i = 0; i < shards.size(); ++i) {
+    r = shards[i]->open(fs_op_seq);
+    if (r < 0) {
+      derr << "ShardedJournal::open: failed to open shard " << i
+	   << ": " << cpp_strerror(r) << dendl;
+      return r;
+    }
+    heads[i] = replay_head_t();
+    heads[i].next_seq = fs_op_seq + 1;
+  }
+  return 0;
+}
+
+void ShardedJournal::close()
+{
+  for (auto j : shards)
+    j->close();
+}
+
+int ShardedJournal::dump(ostream& out)
+{
+  for (auto j : shards) {
+    int r = j->dump(out);
+    if (r < 0)
+      return r;
+  }
+  return 0;
+}
+
+void ShardedJournal::flush()
+{
+  for (auto j : shards)
+    j->flush();
+}
+
+void ShardedJournal::set_wait_on_full(bool b)
+{
+  wait_on_full = b;
+  for (auto j : shards)
+    j->set_wait_on_full(b);
+}
+
+void ShardedJournal::set_logger(PerfCounters *l)
+{
+  logger = l;
+  for (auto j : shards)
+    j->set_logger(l);
+}
+
+bool ShardedJournal::is_writeable()
+{
+  for (auto j : shards) {
+    if (!j->is_writeable())
+      return false;
+  }
+  return true;
+}
+
+int ShardedJournal::make_writeable()
+{
+  for (auto j : shards) {
+    int r = j->make_writeable();
+    if (r < 0)
+      return r;
+  }
+  heads.assign(shards.size(), replay_head_t());
+  return 0;
+}
+
+void ShardedJournal::submit_entry(uint64_t seq, bufferlist& e,
+				  uint32_t orig_len, Context *oncommit,
+				  TrackedOpRef osd_op, uint32_t hint)
+{
+  {
+    Mutex::Locker l(pending_lock);
+    pending.insert(seq);
+  }
+  shard_for(hint)->submit_entry(seq, e, orig_len,
+				new C_Journaled(this, seq, oncommit), osd_op);
+}
+
+void ShardedJournal::_journaled(uint64_t seq)
+{
+  Mutex::Locker l(pending_lock);
+  pending.erase(seq);
+}
+
+uint64_t ShardedJournal::get_committable_seq(uint64_t seq)
+{
+  Mutex::Locker l(pending_lock);
+  if (!pending.empty() && *pending.begin() <= seq) {
+    dout(10) << __func__ << " " << seq << " -> " << (*pending.begin() - 1)
+	     << ", seq " << *pending.begin() << " not journaled yet" << dendl;
+    return *pending.begin() - 1;
+  }
+  return seq;
+}
+
+void ShardedJournal::commit_start(uint64_t seq)
+{
+  for (auto j : shards)
+    j->commit_start(seq);
+}
+
+void ShardedJournal::committed_thru(uint64_t seq)
+{
+  // the commit was capped by get_committable_seq(); anything older
+  // still in flight would be completed and trimmed by every shard
+  assert(get_committable_seq(seq) == seq);
+  for (auto j : shards)
+    j->committed_thru(seq);
+}
+
+bool ShardedJournal::read_entry(bufferlist &bl, uint64_t &seq)
+{
+  int best = -1;
+  for (unsigned i = 0; i < shards.size(); ++i) {
+    replay_head_t &h = heads[i];
+    if (!h.valid && !h.done) {
+      uint64_t s = h.next_seq;
+      h.bl.clear();
+      if (shards[i]->read_entry(h.bl, s)) {
+	h.seq = s;
+	h.next_seq = s + 1;
+	h.valid = true;
+      } else {
+	dout(10) << __func__ << " shard " << i << " reached end" << dendl;
+	h.done = true;
+      }
+    }
+    if (h.valid && (best < 0 || h.seq < heads[best].seq))
+      best = i;
+  }
+  if (best < 0)
+    return false;
+
+  replay_head_t &h = heads[best];
+  dout(20) << __func__ << " seq " << h.seq << " from shard " << best << dendl;
+  bl.claim(h.bl);
+  seq = h.seq;
+  h.valid = false;
+  return true;
+}
+
+bool ShardedJournal::can_skip_missing_seq()
+{
+  // read_entry() has looked at the head of every shard, so a shard
+  // that lost the seq we are missing has been read to its end
+  for (auto& h : heads) {
+    if (h.done)
+      return true;
+  }
+  return false;
+}
+
+bool ShardedJournal::should_commit_now()
+{
+  for (auto j : shards) {
+    if (j->should_commit_now())
+      return true;
+  }
+  return false;
+}
@@ -0,0 +1,142 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+
+#ifndef CEPH_SHARDEDJOURNAL_H
+#define CEPH_SHARDEDJOURNAL_H
+
+#include "FileJournal.h"
+#include "common/Mutex.h"
+
+/**
+ * A journal split over several FileJournals.
+ *
+ * Shard 0 lives at the configured journal path.  The other shards go
+ * to the paths listed in journal_shard_paths (say, more partitions of
+ * the journal device), or to "<path>.<i>" next to the journal if that
+ * is empty.  Each shard is a complete FileJournal with its own
+ * writer thread, aio context and throttle, so entries for different
+ * shards are encoded, written and completed in parallel.  Entries are
+ * placed by the hint passed to submit_entry() (the OpSequencer id),
+ * which keeps each sequencer's entries in order on a single shard.
+ *
+ * Each shard holds an increasing but sparse subsequence of the op
+ * seqs.  On replay the shards are merged back into seq order.  An
+ * unacked entry lost from the tail of one shard shows up as a gap.
+ * That is fine since the entries after it belong to other sequencers,
+ * but only once that shard has been read to its end; a gap while
+ * every shard still has entries means one was lost from the middle.
+ *
+ * Since the shards write independently, an entry may still be in
+ * flight on one shard after later seqs have been journaled and applied
+ * on another.  A commit must stop short of it: it is not on disk yet,
+ * and FileJournal would complete it and trim it, and replay would start
+ * past it.  get_committable_seq() caps a commit below the oldest entry
+ * not yet journaled on any shard, and every shard is told that cap.
+ *
+ * The number of shards is fixed when the journal is created and is
+ * recorded in each shard's header; open() refuses a mismatch.  To
+ * change it, flush the journal and run mkjournal again.
+ */
+class ShardedJournal : public Journal {
+  vector<FileJournal*> shards;
+  bool bad_paths;  ///< journal_shard_paths doesn't match the shard count
+
+  /// next entry of each shard during replay
+  struct replay_head_t {
+    bufferlist bl;
+    uint64_t seq;
+    uint64_t next_seq;  ///< seq to ask the shard for
+    bool valid;         ///< bl, seq hold an entry not yet returned
+    bool done;          ///< shard has no more entries
+    replay_head_t() : seq(0), next_seq(0), valid(false), done(false) {}
+  };
+  vector<replay_head_t> heads;
+
+  Mutex pending_lock;
+  set<uint64_t> pending;  ///< seqs submitted but not yet journaled
+
+  /// completes an entry's oncommit once its shard has journaled it
+  struct C_Journaled : public Context {
+    ShardedJournal *journal;
+    uint64_t seq;
+    Context *oncommit;
+    C_Journaled(ShardedJournal *j, uint64_t s, Context *c)
+      : journal(j), seq(s), oncommit(c) {}
+    void finish(int r) {
+      journal->_journaled(seq);
+      if (oncommit)
+	oncommit->complete(r);
+    }
+  };
+  void _journaled(uint64_t seq);
+
+  FileJournal *shard_for(uint32_t hint) {
+    return shards[hint % shards.size()];
+  }
+
+public:
+  /// shard 0 at path, the rest at shard_paths (if set) or "<path>.<i>"
+  static int get_shard_paths(const string& path, unsigned num_shards,
+			     const string& shard_paths, vector<string> *out);
+
+  ShardedJournal(uuid_d fsid, Finisher *fin, Cond *sync_cond, const char *f,
+		 unsigned num_shards, const string& shard_paths,
+		 bool dio=false, bool ai=true, bool faio=false);
+  ~ShardedJournal();
+
+  int check();
+  int create();
+  int open(uint64_t fs_op_seq);
+  void close();
+
+  int dump(ostream& out);
+
+  void flush();
+
+  void reserve_throttle_and_backoff(uint64_t count) {
+    reserve_throttle_and_backoff(count, 0);
+  }
+  void reserve_throttle_and_backoff(uint64_t count, uint32_t hint) {
+    shard_for(hint)->reserve_throttle_and_backoff(count);
+  }
+
+  void set_wait_on_full(bool b);
+  void set_logger(PerfCounters *l);
+
+  bool is_writeable();
+  int make_writeable();
+
+  void submit_entry(uint64_t seq, bufferlist& e, uint32_t orig_len,
+		    Context *oncommit,
+		    TrackedOpRef osd_op = TrackedOpRef()) {
+    submit_entry(seq, e, orig_len, oncommit, osd_op, 0);
+  }
+  void submit_entry(uint64_t seq, bufferlist& e, uint32_t orig_len,
+		    Context *oncommit, TrackedOpRef osd_op, uint32_t hint);
+  void commit_start(uint64_t seq);
+  void committed_thru(uint64_t seq);
+  uint64_t get_committable_seq(uint64_t seq);
+
+  bool read_entry(bufferlist &bl, uint64_t &seq);
+
+  bool can_skip_missing_seq();
+
+  bool should_commit_now();
+
+  int prepare_entry(vector<ObjectStore::Transaction>& tls, bufferlist* tbl) {
+    // all shards share the same block size and alignment
+    return shards[0]->prepare_entry(tls, tbl);
+  }
+};
+
+#endif
@@ -26,6 +26,8 @@
 #include <string>
 
 #include "include/types.h"
+#include "include/utime.h"
+#include "common/Clock.h"
 #include "common/Mutex.h"
 #include "common/Cond.h"
 
@@ -60,6 +62,7 @@ public:
     uint64_t offset, length;
     int rval;
     bufferlist bl;  ///< write payload (so that it remains stable for duration)
+    utime_t submitted;  ///< when we handed it to the kernel
 
     aio_t(void *p, int f) : priv(p), fd(f), rval(-1000) {
       memset(&iocb, 0, sizeof(iocb));
@@ -131,6 +134,39 @@ public:
       return 0;
     }
 
+    /// submit [begin, end) in as few io_submit calls as the kernel
+    /// allows.  Completions may arrive (and the aios be freed) as soon
+    /// as they are submitted, so the caller must not touch them after
+    /// this returns.
+    template<typename It>
+    int submit_batch(It begin, It end, int *retries, int *calls) {
+      vector<iocb*> piocb;
+      utime_t now = ceph_clock_now(NULL);
+      for (It p = begin; p != end; ++p) {
+	p->submitted = now;
+	piocb.push_back(&p->iocb);
+      }
+      // 2^16 * 125us = ~8 seconds, so max sleep is ~16 seconds
+      int attempts = 16;
+      int delay = 125;
+      size_t done = 0;
+      while (done < piocb.size()) {
+	int r = io_submit(ctx, piocb.size() - done, &piocb[done]);
+	++(*calls);
+	if (r <= 0) {
+	  if ((r == 0 || r == -EAGAIN) && attempts-- > 0) {
+	    usleep(delay);
+	    delay *= 2;
+	    (*retries)++;
+	    continue;
+	  }
+	  return r ? r : -EAGAIN;
+	}
+	done += r;
+      }
+      return 0;
+    }
+
     int get_next_completed(int timeout_ms, aio_t **paio, int max) {
       io_event event[max];
       struct timespec t = {
@@ -1876,6 +1876,45 @@ bool OSD::asok_command(string command, cmdmap_t& cmdmap, string format,
     f->close_section();
   } else if (command == "get_latest_osdmap") {
     get_latest_osdmap();
+  } else if (command == "presplit_pool") {
+    string poolstr;
+    int64_t depth = 0;
+    cmd_getval(cct, cmdmap, "pool", poolstr);
+    cmd_getval(cct, cmdmap, "depth", depth);
+    OSDMapRef curmap = service.get_osdmap();
+    int64_t pool = curmap->lookup_pg_pool_name(poolstr);
+    //If we can't find it by name then maybe id specified
+    if (pool < 0 && isdigit(poolstr[0]))
+      pool = atoll(poolstr.c_str());
+    if (pool < 0 || !curmap->have_pg_pool(pool)) {
+      ss << "Invalid pool " << poolstr;
+    } else if (depth <= 0) {
+      ss << "depth must be positive";
+    } else {
+      vector<coll_t> colls;
+      {
+	RWLock::RLocker l(pg_map_lock);
+	for (ceph::unordered_map<spg_t,PG*>::iterator it = pg_map.begin();
+	     it != pg_map.end();
+	     ++it) {
+	  if (it->first.pool() == (uint64_t)pool)
+	    colls.push_back(it->second->coll);
+	}
+      }
+      f->open_object_section("presplit");
+      f->dump_int("pool", pool);
+      f->dump_int("depth", depth);
+      f->open_array_section("pgs");
+      for (vector<coll_t>::iterator i = colls.begin(); i != colls.end(); ++i) {
+	int r = store->presplit_collection(*i, depth);
+	f->open_object_section("pg");
+	f->dump_stream("collection") << *i;
+	f->dump_int("result", r);
+	f->close_section();
+      }
+      f->close_section();
+      f->close_section();
+    }
   } else if (command == "set_heap_property") {
     string property;
     int64_t value = 0;
@@ -2322,6 +2361,15 @@ void OSD::final_init()
 				     "the mon");
   assert(r == 0);
 
+  r = admin_socket->register_command("presplit_pool",
+				     "presplit_pool " \
+				     "name=pool,type=CephString " \
+				     "name=depth,type=CephInt",
+				     asok_hook,
+				     "split the directories of this osd's pgs in pool "
+				     "down to depth, in the background");
+  assert(r == 0);
+
   r = admin_socket->register_command("set_heap_property",
 				     "set_heap_property " \
 				     "name=property,type=CephString " \
@@ -2649,6 +2697,7 @@ int OSD::shutdown()
   cct->get_admin_socket()->unregister_command("dump_watchers");
   cct->get_admin_socket()->unregister_command("dump_reservations");
   cct->get_admin_socket()->unregister_command("get_latest_osdmap");
+  cct->get_admin_socket()->unregister_command("presplit_pool");
   cct->get_admin_socket()->unregister_command("set_heap_property");
   cct->get_admin_socket()->unregister_command("get_heap_property");
   delete asok_hook;
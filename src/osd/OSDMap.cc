@@ -30,6 +30,8 @@
  
 #define dout_subsys ceph_subsys_osd
 
+MEMPOOL_DEFINE_OBJECT_FACTORY(OSDMap, osdmap, osdmap);
+
 // ----------------------------------
 // osd_info_t
 
@@ -34,6 +34,7 @@
 #include <set>
 #include <map>
 #include "include/memory.h"
+#include "include/mempool.h"
 using namespace std;
 
 //forward declaration
@@ -106,6 +107,8 @@ ostream& operator<<(ostream& out, const osd_xinfo_t& xi);
 class OSDMap {
 
 public:
+  MEMPOOL_CLASS_HELPERS();
+
   class Incremental {
   public:
     /// feature bits we were encoded with.  the subsequent OSDMap
@@ -199,6 +199,19 @@ int PGBackend::objects_list_range(
   return r;
 }
 
+void PGBackend::objects_prefetch(const vector<hobject_t> &ls)
+{
+  if (ls.empty())
+    return;
+  vector<ghobject_t> oids;
+  oids.reserve(ls.size());
+  for (auto& p : ls) {
+    oids.push_back(
+      ghobject_t(p, ghobject_t::NO_GEN, get_parent()->whoami_shard().shard));
+  }
+  store->prefetch_onodes(ch, oids);
+}
+
 int PGBackend::objects_get_attr(
   const hobject_t &hoid,
   const string &attr,
@@ -358,6 +371,7 @@ void PGBackend::be_scan_list(
 {
   dout(10) << __func__ << " scanning " << ls.size() << " objects"
            << (deep ? " deeply" : "") << dendl;
+  objects_prefetch(ls);
   int i = 0;
   for (vector<hobject_t>::const_iterator p = ls.begin();
        p != ls.end();
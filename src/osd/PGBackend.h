@@ -559,6 +559,9 @@ typedef ceph::shared_ptr<const OSDMap> OSDMapRef;
      vector<hobject_t> *ls,
      vector<ghobject_t> *gen_obs=0);
 
+   /// hint to the store that we are about to stat/read these objects
+   void objects_prefetch(const vector<hobject_t> &ls);
+
    int objects_get_attr(
      const hobject_t &hoid,
      const string &attr,
@@ -19,6 +19,7 @@
 
 // re-include our assert to clobber boost's
 #include "include/assert.h" 
+#include "include/mempool.h"
 #include "osd_types.h"
 #include "os/ObjectStore.h"
 #include <list>
@@ -76,9 +77,9 @@ struct PGLog : DoutPrefixProvider {
    * plus some methods to manipulate it all.
    */
   struct IndexedLog : public pg_log_t {
-    mutable ceph::unordered_map<hobject_t,pg_log_entry_t*> objects;  // ptrs into log.  be careful!
-    mutable ceph::unordered_map<osd_reqid_t,pg_log_entry_t*> caller_ops;
-    mutable ceph::unordered_multimap<osd_reqid_t,pg_log_entry_t*> extra_caller_ops;
+    mutable mempool::osd_pglog::unordered_map<hobject_t,pg_log_entry_t*> objects;  // ptrs into log.  be careful!
+    mutable mempool::osd_pglog::unordered_map<osd_reqid_t,pg_log_entry_t*> caller_ops;
+    mutable mempool::osd_pglog::unordered_multimap<osd_reqid_t,pg_log_entry_t*> extra_caller_ops;
 
     // recovery pointers
     list<pg_log_entry_t>::iterator complete_to;  // not inclusive of referenced item
@@ -171,7 +172,7 @@ struct PGLog : DoutPrefixProvider {
       assert(replay_version);
       assert(user_version);
       assert(return_code);
-      ceph::unordered_map<osd_reqid_t,pg_log_entry_t*>::const_iterator p;
+      mempool::osd_pglog::unordered_map<osd_reqid_t,pg_log_entry_t*>::const_iterator p;
       if (!(indexed_data & PGLOG_INDEXED_CALLER_OPS)) {
         index_caller_ops();
       }
@@ -359,7 +360,7 @@ struct PGLog : DoutPrefixProvider {
              e.extra_reqids.begin();
              j != e.extra_reqids.end();
              ++j) {
-          for (ceph::unordered_multimap<osd_reqid_t,pg_log_entry_t*>::iterator k =
+          for (mempool::osd_pglog::unordered_multimap<osd_reqid_t,pg_log_entry_t*>::iterator k =
                extra_caller_ops.find(j->first);
                k != extra_caller_ops.end() && k->first == j->first;
                ++k) {
@@ -736,7 +737,7 @@ protected:
 		       << " last_divergent_update: " << last_divergent_update
 		       << dendl;
 
-    ceph::unordered_map<hobject_t, pg_log_entry_t*>::const_iterator objiter =
+    mempool::osd_pglog::unordered_map<hobject_t, pg_log_entry_t*>::const_iterator objiter =
       log.objects.find(hoid);
     if (objiter != log.objects.end() &&
 	objiter->second->version >= first_divergent_update) {
@@ -11365,6 +11365,7 @@ void ReplicatedPG::scan_range(
   dout(10) << " got " << ls.size() << " items, next " << bi->end << dendl;
   dout(20) << ls << dendl;
 
+  pgbackend->objects_prefetch(ls);
   for (vector<hobject_t>::iterator p = ls.begin(); p != ls.end(); ++p) {
     handle.reset_tp_timeout();
     ObjectContextRef obc;
@@ -3412,8 +3412,8 @@ string pg_log_entry_t::get_key_name() const
 
 void pg_log_entry_t::encode_with_checksum(bufferlist& bl) const
 {
-  bufferlist ebl(sizeof(*this)*2);
-  encode(ebl);
+  bufferlist ebl;
+  encode(ebl);    // presizes ebl itself
   __u32 crc = ebl.crc32c(0);
   ::encode(ebl, bl);
   ::encode(crc, bl);
@@ -3431,8 +3431,37 @@ void pg_log_entry_t::decode_with_checksum(bufferlist::iterator& p)
   decode(q);
 }
 
+// upper bounds on the encoded size of the pieces of pg_log_entry_t and
+// object_info_t.  bound_encode() must never come in under what
+// encode() produces; test/osd/types.cc checks this.
+static const size_t ENCODE_START_BOUND = 6;
+static const size_t EVERSION_BOUND = sizeof(version_t) + sizeof(epoch_t);
+static const size_t REQID_BOUND = ENCODE_START_BOUND + 1 + sizeof(int64_t) +
+  sizeof(ceph_tid_t) + sizeof(int32_t);
+static const size_t ENTITY_NAME_BOUND = 1 + sizeof(int64_t);
+static const size_t WATCH_INFO_BOUND = ENCODE_START_BOUND +
+  sizeof(uint64_t) + sizeof(uint32_t) + sizeof(entity_addr_t) + 16;
+
+void pg_log_entry_t::bound_encode(size_t& p) const
+{
+  p += ENCODE_START_BOUND;
+  p += sizeof(__s32);                               // op
+  soid.bound_encode(p);
+  p += 3 * EVERSION_BOUND;                          // version, prior, revert
+  p += REQID_BOUND;
+  p += sizeof(utime_t);
+  p += sizeof(__u32) + snaps.length();
+  p += sizeof(version_t);                           // user_version
+  p += ENCODE_START_BOUND + 2 + sizeof(__u32) + mod_desc.bl.length();
+  p += sizeof(__u32) + extra_reqids.size() * (REQID_BOUND + sizeof(version_t));
+  p += sizeof(int32_t);                             // return_code
+}
+
 void pg_log_entry_t::encode(bufferlist &bl) const
 {
+  size_t bound = 0;
+  bound_encode(bound);
+  bl.reserve(bound);
   ENCODE_START(11, 4, bl);
   ::encode(op, bl);
   ::encode(soid, bl);
@@ -4483,8 +4512,35 @@ ps_t object_info_t::legacy_object_locator_to_ps(const object_t &oid,
   return ps;
 }
 
+void object_info_t::bound_encode(size_t& p) const
+{
+  p += ENCODE_START_BOUND;
+  soid.bound_encode(p);
+  // object_locator_t
+  p += ENCODE_START_BOUND + sizeof(int64_t) + sizeof(int32_t) +
+    sizeof(__u32) + soid.get_key().length() +
+    sizeof(__u32) + soid.nspace.length() + sizeof(int64_t);
+  p += sizeof(__u32);                               // category
+  p += 2 * EVERSION_BOUND;                          // version, prior_version
+  p += REQID_BOUND;                                 // last_reqid
+  p += sizeof(size) + sizeof(utime_t);
+  p += std::max(REQID_BOUND, sizeof(__u32) + snaps.size() * sizeof(snapid_t));
+  p += sizeof(truncate_seq) + sizeof(truncate_size) + 1;
+  p += sizeof(__u32) + watchers.size() * (ENTITY_NAME_BOUND + WATCH_INFO_BOUND);
+  p += EVERSION_BOUND + 1;                          // user_eversion, tmap
+  p += sizeof(__u32) + watchers.size() *
+    (sizeof(uint64_t) + ENTITY_NAME_BOUND + WATCH_INFO_BOUND);
+  p += sizeof(__u32) + sizeof(utime_t);             // flags, local_mtime
+  p += sizeof(data_digest) + sizeof(omap_digest);
+  p += sizeof(expected_object_size) + sizeof(expected_write_size) +
+    sizeof(alloc_hint_flags);
+}
+
 void object_info_t::encode(bufferlist& bl, uint64_t features) const
 {
+  size_t bound = 0;
+  bound_encode(bound);
+  bl.reserve(bound);
   object_locator_t myoloc(soid);
   map<entity_name_t, watch_info_t> old_watchers;
   for (map<pair<uint64_t, entity_name_t>, watch_info_t>::const_iterator i =
@@ -676,7 +676,8 @@ public:
   }
 
   unsigned hash_to_shard(unsigned num_shards) const {
-    if (type == TYPE_PG)
+    // a pg's temp collection is touched by the same op shard as the pg
+    if (type == TYPE_PG || type == TYPE_PG_TEMP)
       return pgid.hash_to_shard(num_shards);
     return 0;  // whatever.
   }
@@ -2633,6 +2634,8 @@ struct pg_log_entry_t {
   void encode_with_checksum(bufferlist& bl) const;
   void decode_with_checksum(bufferlist::iterator& p);
 
+  /// cheap upper bound on the encoded size, for presizing buffers
+  void bound_encode(size_t& p) const;
   void encode(bufferlist &bl) const;
   void decode(bufferlist::iterator &bl);
   void dump(Formatter *f) const;
@@ -3713,6 +3716,8 @@ struct object_info_t {
     set_omap_digest(-1);
   }
 
+  /// cheap upper bound on the encoded size, for presizing buffers
+  void bound_encode(size_t& p) const;
   void encode(bufferlist& bl, uint64_t features) const;
   void decode(bufferlist::iterator& bl);
   void decode(bufferlist& bl) {
@@ -80,6 +80,8 @@ int main(int argc, char **argv)
      "don't dump per op stats")
     ("num-writers", po::value<unsigned>()->default_value(1),
      "num write threads")
+    ("journal-shards", po::value<unsigned>()->default_value(1),
+     "number of journal shards (files) to spread the collections over")
     ;
 
   vector<string> ceph_option_strings;
@@ -124,6 +126,12 @@ int main(int argc, char **argv)
     return 1;
   }
 
+  // each collection gets its own sequencer, so ops spread over all shards
+  g_ceph_context->_conf->set_val(
+    "journal_shards",
+    boost::lexical_cast<string>(vm["journal-shards"].as<unsigned>()));
+  g_ceph_context->_conf->apply_changes(NULL);
+
   rngen_t rng;
   if (vm.count("seed"))
     rng = rngen_t(vm["seed"].as<unsigned>());
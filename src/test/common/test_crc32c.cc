@@ -8,12 +8,15 @@
 #include "include/crc32c.h"
 #include "include/utime.h"
 #include "common/Clock.h"
+#include "common/Checksummer.h"
 
 #include "gtest/gtest.h"
 
 #include "common/sctp_crc32.h"
 #include "common/crc32c_intel_baseline.h"
 #include "common/crc32c_aarch64.h"
+#include "common/crc32c_intel_blocks.h"
+#include "arch/intel.h"
 
 TEST(Crc32c, Small) {
   const char *a = "foo bar baz";
@@ -265,3 +268,118 @@ TEST(Crc32c, RangeNull) {
     ASSERT_EQ(crc, *check);
   }
 }
+
+TEST(Crc32c, Blocks) {
+  int len = 65536 + 7;
+  unsigned char *a = (unsigned char *)malloc(len);
+  for (int i = 0; i < len; i++)
+    a[i] = (i * 7) & 0xff;
+  unsigned block_sizes[] = { 1, 7, 8, 15, 512, 4096 };
+  uint32_t out[16];
+  for (unsigned bs : block_sizes) {
+    for (unsigned blocks = 1; blocks <= 16 && bs * blocks <= 65536; ++blocks) {
+      for (unsigned off = 0; off < 8; off += 3) {
+	ceph_crc32c_blocks(-1, a + off, bs, blocks, out);
+	for (unsigned i = 0; i < blocks; ++i) {
+	  ASSERT_EQ(ceph_crc32c_sctp(-1, a + off + i * bs, bs), out[i]);
+	}
+	if (ceph_arch_intel_sse42 && ceph_crc32c_intel_blocks_exists()) {
+	  ceph_crc32c_intel_blocks(1234, a + off, bs, blocks, out);
+	  for (unsigned i = 0; i < blocks; ++i) {
+	    ASSERT_EQ(ceph_crc32c_sctp(1234, a + off + i * bs, bs), out[i]);
+	  }
+	}
+      }
+    }
+  }
+  free(a);
+}
+
+template<class Alg>
+static void checksummer_check(size_t bs)
+{
+  // odd sized buffers, so that some blocks straddle two of them
+  bufferlist bl;
+  for (unsigned i = 0; i < 9; ++i) {
+    bufferptr p(bs * 3 + i * 97);
+    for (unsigned j = 0; j < p.length(); ++j)
+      p[j] = (i + j * 13) & 0xff;
+    bl.append(p);
+  }
+  size_t length = bl.length() / bs * bs;
+  size_t blocks = length / bs;
+  bufferptr csum(blocks * sizeof(typename Alg::value_t));
+  Checksummer::calculate<Alg>(bs, 0, length, bl, &csum);
+
+  // one block at a time
+  typename Alg::state_t state;
+  Alg::init(&state);
+  bufferlist::const_iterator p = bl.begin();
+  const typename Alg::value_t *pv =
+    reinterpret_cast<const typename Alg::value_t*>(csum.c_str());
+  for (size_t i = 0; i < blocks; ++i) {
+    ASSERT_EQ(Alg::calc(state, bs, p), pv[i]);
+  }
+  Alg::fini(&state);
+
+  ASSERT_EQ(-1, Checksummer::verify<Alg>(bs, 0, length, bl, csum));
+  csum[csum.length() - 1] ^= 1;
+  ASSERT_EQ((int)(length - bs),
+	    Checksummer::verify<Alg>(bs, 0, length, bl, csum));
+}
+
+TEST(Checksummer, Blocks) {
+  for (size_t bs : { 512, 4096 }) {
+    checksummer_check<Checksummer::crc32c>(bs);
+    checksummer_check<Checksummer::crc32c_16>(bs);
+    checksummer_check<Checksummer::crc32c_8>(bs);
+    checksummer_check<Checksummer::xxhash32>(bs);
+    checksummer_check<Checksummer::xxhash64>(bs);
+  }
+}
+
+template<class Alg>
+static void checksummer_bench(const char *name, const bufferlist& bl)
+{
+  size_t len = bl.length();
+  for (size_t bs : { 512, 4096, 65536 }) {
+    bufferptr csum(len / bs * sizeof(typename Alg::value_t));
+    utime_t start = ceph_clock_now(NULL);
+    for (int i = 0; i < 8; ++i) {
+      Checksummer::calculate<Alg>(bs, 0, len, bl, &csum);
+    }
+    utime_t end = ceph_clock_now(NULL);
+    float rate = (float)len * 8 / (float)(1024*1024) / (float)(end - start);
+    std::cout << name << " block " << bs << " = " << rate << " MB/sec"
+	      << std::endl;
+  }
+}
+
+// Not a pass/fail test, and slow; run it with
+// --gtest_also_run_disabled_tests.
+TEST(Checksummer, DISABLED_Performance) {
+  int len = 64 * 1024 * 1024;
+  bufferptr p = buffer::create_page_aligned(len);
+  for (int i = 0; i < len; i++)
+    p[i] = i & 0xff;
+  bufferlist bl;
+  bl.append(p);
+
+  // the old one-block-at-a-time path, for comparison
+  for (size_t bs : { 512, 4096, 65536 }) {
+    utime_t start = ceph_clock_now(NULL);
+    for (int i = 0; i < 8; ++i) {
+      for (int off = 0; off < len; off += bs) {
+	ceph_crc32c(-1, (unsigned char *)p.c_str() + off, bs);
+      }
+    }
+    utime_t end = ceph_clock_now(NULL);
+    float rate = (float)len * 8 / (float)(1024*1024) / (float)(end - start);
+    std::cout << "crc32c per block, block " << bs << " = " << rate
+	      << " MB/sec" << std::endl;
+  }
+  checksummer_bench<Checksummer::crc32c>("crc32c", bl);
+  checksummer_bench<Checksummer::crc32c_16>("crc32c_16", bl);
+  checksummer_bench<Checksummer::xxhash32>("xxhash32", bl);
+  checksummer_bench<Checksummer::xxhash64>("xxhash64", bl);
+}
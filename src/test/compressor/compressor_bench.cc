@@ -0,0 +1,167 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+/*
+ * Throughput and ratio of the compression plugins over a directory
+ * of sample objects (by default the ceph-object-corpus archive).
+ *
+ *   ceph_perf_compressor [--pool <id>] [--iterations <n>] [dir] [alg ...]
+ *
+ * Every regular file under dir is compressed and decompressed as one
+ * object.  With --pool the objects go through compress_for_pool() so a
+ * zstd dictionary from compressor_zstd_dict_dir is used.
+ */
+
+#include <dirent.h>
+#include <sys/stat.h>
+#include <iostream>
+
+#include "global/global_init.h"
+#include "global/global_context.h"
+#include "common/ceph_argparse.h"
+#include "common/Clock.h"
+#include "common/config.h"
+#include "common/errno.h"
+#include "compressor/Compressor.h"
+
+static void usage()
+{
+  cerr << "usage: ceph_perf_compressor [--pool <id>] [--iterations <n>]"
+       << " [dir] [alg ...]" << std::endl;
+  generic_client_usage();
+}
+
+static void load_dir(const string& dir, vector<bufferlist> *objs)
+{
+  DIR *d = ::opendir(dir.c_str());
+  if (!d) {
+    cerr << "unable to open " << dir << ": " << cpp_strerror(errno)
+	 << std::endl;
+    return;
+  }
+  struct dirent *de;
+  while ((de = ::readdir(d)) != NULL) {
+    if (de->d_name[0] == '.')
+      continue;
+    string path = dir + "/" + de->d_name;
+    struct stat st;
+    if (::stat(path.c_str(), &st) < 0)
+      continue;
+    if (S_ISDIR(st.st_mode)) {
+      load_dir(path, objs);
+    } else if (S_ISREG(st.st_mode) && st.st_size > 0) {
+      bufferlist bl;
+      string err;
+      if (bl.read_file(path.c_str(), &err) == 0)
+	objs->push_back(bl);
+    }
+  }
+  ::closedir(d);
+}
+
+int main(int argc, const char **argv)
+{
+  vector<const char*> args;
+  argv_to_vec(argc, argv, args);
+  env_to_vec(args);
+
+  global_init(NULL, args, CEPH_ENTITY_TYPE_CLIENT, CODE_ENVIRONMENT_UTILITY, 0);
+  common_init_finish(g_ceph_context);
+
+  int64_t pool = -1;
+  int iterations = 3;
+  vector<string> positional;
+  std::string val;
+  for (auto i = args.begin(); i != args.end(); ) {
+    if (ceph_argparse_double_dash(args, i)) {
+      break;
+    } else if (ceph_argparse_flag(args, i, "-h", "--help", (char*)NULL)) {
+      usage();
+      return 0;
+    } else if (ceph_argparse_witharg(args, i, &val, "--pool", (char*)NULL)) {
+      pool = atoll(val.c_str());
+    } else if (ceph_argparse_witharg(args, i, &val, "--iterations",
+				     (char*)NULL)) {
+      iterations = MAX(1, atoi(val.c_str()));
+    } else {
+      positional.push_back(*i);
+      ++i;
+    }
+  }
+
+  string dir = "../ceph-object-corpus/archive";
+  vector<string> algs;
+  if (!positional.empty()) {
+    dir = positional[0];
+    algs.assign(positional.begin() + 1, positional.end());
+  }
+  if (algs.empty())
+    algs = {"snappy", "zlib", "zstd", "lz4"};
+
+  vector<bufferlist> objs;
+  load_dir(dir, &objs);
+  uint64_t total = 0;
+  for (auto& bl : objs)
+    total += bl.length();
+  if (objs.empty()) {
+    cerr << "no objects found under " << dir << std::endl;
+    return 1;
+  }
+  cout << objs.size() << " objects, " << total << " bytes from " << dir
+       << std::endl;
+
+  for (auto& alg : algs) {
+    CompressorRef comp = Compressor::create(g_ceph_context, alg);
+    if (!comp) {
+      cout << alg << ": not available" << std::endl;
+      continue;
+    }
+    vector<bufferlist> compressed(objs.size());
+    uint64_t out_bytes = 0;
+    int errors = 0;
+    utime_t start = ceph_clock_now(g_ceph_context);
+    for (int it = 0; it < iterations; ++it) {
+      out_bytes = 0;
+      for (unsigned i = 0; i < objs.size(); ++i) {
+	compressed[i].clear();
+	int r = pool >= 0 ?
+	  comp->compress_for_pool(pool, objs[i], compressed[i]) :
+	  comp->compress(objs[i], compressed[i]);
+	if (r < 0)
+	  ++errors;
+	out_bytes += compressed[i].length();
+      }
+    }
+    utime_t ctime = ceph_clock_now(g_ceph_context) - start;
+
+    start = ceph_clock_now(g_ceph_context);
+    for (int it = 0; it < iterations; ++it) {
+      for (unsigned i = 0; i < objs.size(); ++i) {
+	bufferlist out;
+	if (comp->decompress(compressed[i], out) < 0 ||
+	    (it == 0 && !out.contents_equal(objs[i])))
+	  ++errors;
+      }
+    }
+    utime_t dtime = ceph_clock_now(g_ceph_context) - start;
+
+    double mb = (double)total * iterations / (1024 * 1024);
+    cout << alg
+	 << ": ratio " << (double)out_bytes / total
+	 << " compress " << mb / (double)ctime << " MB/s"
+	 << " decompress " << mb / (double)dtime << " MB/s";
+    if (errors)
+      cout << " (" << errors << " errors)";
+    cout << std::endl;
+  }
+  return 0;
+}
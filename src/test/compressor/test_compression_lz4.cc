@@ -0,0 +1,109 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph distributed storage system
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <gtest/gtest.h>
+#include "global/global_init.h"
+#include "compressor/lz4/LZ4Compressor.h"
+#include "common/ceph_argparse.h"
+#include "global/global_context.h"
+#include "common/config.h"
+#include "include/stringify.h"
+
+TEST(LZ4Compressor, compress_decompress)
+{
+  LZ4Compressor sp(0);
+  EXPECT_EQ(sp.get_type(), "lz4");
+  const char* test = "This is test text";
+  int len = strlen(test);
+  bufferlist in, out;
+  in.append(test, len);
+  int res = sp.compress(in, out);
+  EXPECT_EQ(res, 0);
+  bufferlist after;
+  res = sp.decompress(out, after);
+  EXPECT_EQ(res, 0);
+  EXPECT_TRUE(in.contents_equal(after));
+
+  after.clear();
+  size_t compressed_len = out.length();
+  out.append_zero(12);
+  auto it = out.begin();
+  res = sp.decompress(it, compressed_len, after);
+  EXPECT_EQ(res, 0);
+  EXPECT_TRUE(in.contents_equal(after));
+}
+
+TEST(LZ4Compressor, sharded_input_decompress)
+{
+  LZ4Compressor sp(0);
+  bufferlist in, out;
+  for (int i = 0; i < 64; ++i) {
+    string s(2048 + i, 'a' + i % 26);
+    in.append(s);
+  }
+  int res = sp.compress(in, out);
+  EXPECT_EQ(res, 0);
+  EXPECT_LT(out.length(), in.length());
+
+  bufferlist out2, tmp;
+  size_t offs = 0;
+  while (offs < out.length()) {
+    size_t shard_size = MIN(100, out.length() - offs);
+    tmp.substr_of(out, offs, shard_size);
+    out2.append(tmp);
+    offs += shard_size;
+  }
+
+  bufferlist after;
+  res = sp.decompress(out2, after);
+  EXPECT_EQ(res, 0);
+  EXPECT_TRUE(in.contents_equal(after));
+}
+
+TEST(LZ4Compressor, corrupt)
+{
+  LZ4Compressor sp(0);
+  bufferlist in, out;
+  in.append(string(8192, 'x'));
+  EXPECT_EQ(0, sp.compress(in, out));
+  bufferlist cut, after;
+  cut.substr_of(out, 0, out.length() - 4);
+  EXPECT_NE(0, sp.decompress(cut, after));
+}
+
+TEST(LZ4Compressor, hc)
+{
+  LZ4Compressor fast(0), hc(9);
+  bufferlist in, out_fast, out_hc, after;
+  for (int i = 0; i < 4096; ++i) {
+    in.append(stringify(i % 97));
+  }
+  EXPECT_EQ(0, fast.compress(in, out_fast));
+  EXPECT_EQ(0, hc.compress(in, out_hc));
+  EXPECT_LE(out_hc.length(), out_fast.length());
+  // same format either way
+  EXPECT_EQ(0, fast.decompress(out_hc, after));
+  EXPECT_TRUE(in.contents_equal(after));
+}
+
+int main(int argc, char **argv) {
+  vector<const char*> args;
+  argv_to_vec(argc, (const char **)argv, args);
+
+  global_init(NULL, args, CEPH_ENTITY_TYPE_CLIENT, CODE_ENVIRONMENT_UTILITY, 0);
+  common_init_finish(g_ceph_context);
+
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
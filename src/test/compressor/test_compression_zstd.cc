@@ -0,0 +1,190 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph distributed storage system
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU Lesser General Public
+ *  License as published by the Free Software Foundation; either
+ *  version 2.1 of the License, or (at your option) any later version.
+ *
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <gtest/gtest.h>
+#include <zdict.h>
+#include "global/global_init.h"
+#include "compressor/zstd/ZstdCompressor.h"
+#include "include/stringify.h"
+#include "common/ceph_argparse.h"
+#include "global/global_context.h"
+#include "common/config.h"
+
+TEST(ZstdCompressor, compress_decompress)
+{
+  ZstdCompressor sp(g_ceph_context);
+  EXPECT_EQ(sp.get_type(), "zstd");
+  const char* test = "This is test text";
+  int len = strlen(test);
+  bufferlist in, out;
+  in.append(test, len);
+  int res = sp.compress(in, out);
+  EXPECT_EQ(res, 0);
+  bufferlist after;
+  res = sp.decompress(out, after);
+  EXPECT_EQ(res, 0);
+  EXPECT_TRUE(in.contents_equal(after));
+
+  after.clear();
+  size_t compressed_len = out.length();
+  out.append_zero(12);
+  auto it = out.begin();
+  res = sp.decompress(it, compressed_len, after);
+  EXPECT_EQ(res, 0);
+  EXPECT_TRUE(in.contents_equal(after));
+}
+
+TEST(ZstdCompressor, sharded_input_decompress)
+{
+  ZstdCompressor sp(g_ceph_context);
+  bufferlist in, out;
+  for (int i = 0; i < 64; ++i) {
+    string s(2048 + i, 'a' + i % 26);
+    in.append(s);
+  }
+  int res = sp.compress(in, out);
+  EXPECT_EQ(res, 0);
+  EXPECT_LT(out.length(), in.length());
+
+  bufferlist out2, tmp;
+  size_t offs = 0;
+  while (offs < out.length()) {
+    size_t shard_size = MIN(100, out.length() - offs);
+    tmp.substr_of(out, offs, shard_size);
+    out2.append(tmp);
+    offs += shard_size;
+  }
+
+  bufferlist after;
+  res = sp.decompress(out2, after);
+  EXPECT_EQ(res, 0);
+  EXPECT_TRUE(in.contents_equal(after));
+}
+
+TEST(ZstdCompressor, corrupt)
+{
+  ZstdCompressor sp(g_ceph_context);
+  bufferlist in, out;
+  in.append(string(8192, 'x'));
+  EXPECT_EQ(0, sp.compress(in, out));
+  bufferlist cut, after;
+  cut.substr_of(out, 0, out.length() - 4);
+  EXPECT_NE(0, sp.decompress(cut, after));
+}
+
+TEST(ZstdCompressor, no_dict_for_pool)
+{
+  // without compressor_zstd_dict_dir there is nothing to use, but the
+  // output must still round trip
+  ZstdCompressor sp(g_ceph_context);
+  bufferlist in, out, after;
+  in.append(string(4096, 'y'));
+  EXPECT_EQ(0, sp.compress_for_pool(1, in, out));
+  EXPECT_EQ(0, sp.decompress(out, after));
+  EXPECT_TRUE(in.contents_equal(after));
+}
+
+static string dict_record(int i)
+{
+  return "{\"oid\": \"rbd_data.10226b8b4567." + stringify(i) +
+    "\", \"pool\": 1, \"mtime\": \"2016-10-" + stringify(i % 28 + 1) +
+    "\", \"size\": " + stringify(i * 4096) + ", \"flags\": \"dirty\"}";
+}
+
+TEST(ZstdCompressor, dict_round_trip)
+{
+  // train a dictionary for pool 1 on small records that look alike
+  string samples;
+  vector<size_t> sizes;
+  for (int i = 0; i < 2000; ++i) {
+    string s = dict_record(i);
+    samples += s;
+    sizes.push_back(s.length());
+  }
+  string dict(4096, 0);
+  size_t dict_len = ZDICT_trainFromBuffer(&dict[0], dict.length(),
+					  samples.data(), sizes.data(),
+					  sizes.size());
+  ASSERT_FALSE(ZDICT_isError(dict_len));
+  dict.resize(dict_len);
+  unsigned dict_id = ZDICT_getDictID(dict.data(), dict.length());
+  ASSERT_NE(0u, dict_id);
+
+  char dir[] = "/tmp/unittest_compression_zstd.XXXXXX";
+  ASSERT_TRUE(mkdtemp(dir) != NULL);
+  string path = string(dir) + "/1.dict";
+  {
+    bufferlist bl;
+    bl.append(dict);
+    ASSERT_EQ(0, bl.write_file(path.c_str()));
+  }
+  g_conf->set_val("compressor_zstd_dict_dir", dir);
+  g_ceph_context->_conf->apply_changes(NULL);
+
+  ZstdCompressor sp(g_ceph_context);
+  bufferlist in, with, without;
+  in.append(dict_record(12345));
+  EXPECT_EQ(0, sp.compress_for_pool(1, in, with));
+  EXPECT_EQ(0, sp.compress_for_pool(2, in, without));  // no dictionary
+  EXPECT_LT(with.length(), without.length());
+  {
+    // the dictionary id follows the original length
+    bufferlist::iterator p = with.begin();
+    uint32_t len, id;
+    ::decode(len, p);
+    ::decode(id, p);
+    EXPECT_EQ(in.length(), len);
+    EXPECT_EQ(dict_id, id);
+  }
+  bufferlist after;
+  EXPECT_EQ(0, sp.decompress(with, after));
+  EXPECT_TRUE(in.contents_equal(after));
+
+  {
+    // too big for the dictionary
+    bufferlist big, out;
+    while (big.length() <= g_conf->compressor_zstd_dict_max_size)
+      big.append(in);
+    EXPECT_EQ(0, sp.compress_for_pool(1, big, out));
+    bufferlist::iterator p = out.begin();
+    uint32_t len, id;
+    ::decode(len, p);
+    ::decode(id, p);
+    EXPECT_EQ(0u, id);
+    after.clear();
+    EXPECT_EQ(0, sp.decompress(out, after));
+    EXPECT_TRUE(big.contents_equal(after));
+  }
+
+  // without the dictionary the data can't be read back
+  ::unlink(path.c_str());
+  ::rmdir(dir);
+  g_conf->set_val("compressor_zstd_dict_dir", "");
+  g_ceph_context->_conf->apply_changes(NULL);
+  ZstdCompressor sp2(g_ceph_context);
+  after.clear();
+  EXPECT_EQ(-ENOENT, sp2.decompress(with, after));
+}
+
+int main(int argc, char **argv) {
+  vector<const char*> args;
+  argv_to_vec(argc, (const char **)argv, args);
+
+  global_init(NULL, args, CEPH_ENTITY_TYPE_CLIENT, CODE_ENVIRONMENT_UTILITY, 0);
+  common_init_finish(g_ceph_context);
+
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -2,6 +2,7 @@
 #include "include/buffer.h"
 #include "include/encoding.h"
 #include "include/small_encoding.h"
+#include "include/denc.h"
 
 #include "gtest/gtest.h"
 
@@ -400,3 +401,174 @@ TEST(small_encoding, lba) {
   }
 
 }
+
+// denc must produce exactly what the bufferlist-based encoders produce
+
+template<typename T>
+static void denc_encode_raw(T v,
+			    void (*f)(T, bufferlist::contiguous_appender&),
+			    bufferlist& bl) {
+  bufferlist::contiguous_appender a(bl, 16);
+  f(v, a);
+}
+
+TEST(denc, varint_matches_small_encoding) {
+  uint64_t v[] = {
+    0, 1, 0x7f, 0x80, 0xff, 0x1000, 0x3fff, 0x4000, 0x10001, 0x7f0001,
+    0xffffffff, 0x3fffffff000, 0x1fffffff00000, 0x41000000,
+    0xffffffffffffffffull, 0
+  };
+  for (unsigned i = 0; i == 0 || v[i]; ++i) {
+    {
+      bufferlist a, b;
+      small_encode_varint(v[i], a);
+      denc_encode_raw<uint64_t>(v[i], denc_varint<uint64_t>, b);
+      ASSERT_TRUE(a.contents_equal(b));
+      bufferptr bp = b.front();
+      auto p = bp.begin();
+      uint64_t u;
+      denc_varint(u, p);
+      ASSERT_EQ(v[i], u);
+      ASSERT_TRUE(p.end());
+    }
+    {
+      bufferlist a, b;
+      int64_t x = -(int64_t)(v[i] >> 2);
+      small_encode_signed_varint(x, a);
+      denc_encode_raw<int64_t>(x, denc_signed_varint<int64_t>, b);
+      ASSERT_TRUE(a.contents_equal(b));
+      bufferptr bp = b.front();
+      auto p = bp.begin();
+      int64_t u;
+      denc_signed_varint(u, p);
+      ASSERT_EQ(x, u);
+    }
+    {
+      bufferlist a, b;
+      small_encode_varint_lowz(v[i], a);
+      denc_encode_raw<uint64_t>(v[i], denc_varint_lowz<uint64_t>, b);
+      ASSERT_TRUE(a.contents_equal(b));
+      bufferptr bp = b.front();
+      auto p = bp.begin();
+      uint64_t u;
+      denc_varint_lowz(u, p);
+      ASSERT_EQ(v[i], u);
+    }
+    if (v[i] < (1ull << 60)) {
+      bufferlist a, b;
+      small_encode_lba(v[i], a);
+      denc_encode_raw<uint64_t>(v[i], denc_lba, b);
+      ASSERT_TRUE(a.contents_equal(b));
+      bufferptr bp = b.front();
+      auto p = bp.begin();
+      uint64_t u;
+      denc_lba(u, p);
+      ASSERT_EQ(v[i], u);
+    }
+  }
+}
+
+struct denc_test_t {
+  uint64_t a = 0;
+  uint32_t b = 0;
+  string s;
+  map<string,bufferptr> m;
+
+  DENC(denc_test_t, v, p) {
+    DENC_START(1, 1, p);
+    denc(v.a, p);
+    denc_varint(v.b, p);
+    denc(v.s, p);
+    denc(v.m, p);
+    DENC_FINISH(p);
+  }
+
+  void legacy_encode(bufferlist& bl) const {
+    ENCODE_START(1, 1, bl);
+    ::encode(a, bl);
+    small_encode_varint(b, bl);
+    ::encode(s, bl);
+    ::encode(m, bl);
+    ENCODE_FINISH(bl);
+  }
+};
+WRITE_CLASS_DENC(denc_test_t)
+
+TEST(denc, struct_matches_legacy) {
+  denc_test_t t;
+  t.a = 0x123456789abcdefull;
+  t.b = 300;
+  t.s = "foo";
+  t.m["bar"] = bufferptr("baz", 3);
+  t.m["empty"] = bufferptr();
+
+  bufferlist a, b;
+  t.legacy_encode(a);
+  ::encode(t, b);
+  ASSERT_TRUE(a.contents_equal(b));
+  ASSERT_EQ(1u, b.get_num_buffers());
+
+  // decode from a contiguous and a fragmented list
+  for (unsigned frag = 0; frag < 2; ++frag) {
+    bufferlist c;
+    if (frag) {
+      for (unsigned i = 0; i < b.length(); ++i)
+	c.append(bufferptr(&b[i], 1));
+    } else {
+      c = b;
+    }
+    ::encode((uint32_t)42, c);  // trailing data must be left alone
+    denc_test_t u;
+    auto p = c.begin();
+    ::decode(u, p);
+    ASSERT_EQ(t.a, u.a);
+    ASSERT_EQ(t.b, u.b);
+    ASSERT_EQ(t.s, u.s);
+    ASSERT_EQ(2u, u.m.size());
+    ASSERT_EQ(0, memcmp("baz", u.m["bar"].c_str(), 3));
+    ASSERT_EQ(0u, u.m["empty"].length());
+    uint32_t trailer;
+    ::decode(trailer, p);
+    ASSERT_EQ(42u, trailer);
+    ASSERT_TRUE(p.end());
+  }
+}
+
+TEST(denc, decode_many_fragmented) {
+  // a run of decodes from one list whose segments do not line up with
+  // the encoded objects
+  vector<denc_test_t> v(1000);
+  bufferlist b;
+  for (unsigned i = 0; i < v.size(); ++i) {
+    v[i].a = i;
+    v[i].b = i * 7;
+    v[i].s = string(i % 37, 'x');
+    ::encode(v[i], b);
+  }
+  bufferlist c;
+  for (unsigned off = 0; off < b.length(); off += 13) {
+    unsigned len = MIN(13, b.length() - off);
+    c.append(bufferptr(b.c_str() + off, len));
+  }
+  auto p = c.begin();
+  for (unsigned i = 0; i < v.size(); ++i) {
+    denc_test_t u;
+    ::decode(u, p);
+    ASSERT_EQ(v[i].a, u.a);
+    ASSERT_EQ(v[i].b, u.b);
+    ASSERT_EQ(v[i].s, u.s);
+  }
+  ASSERT_TRUE(p.end());
+}
+
+TEST(denc, decode_past_end) {
+  denc_test_t t;
+  t.s = "hello world";
+  bufferlist bl;
+  ::encode(t, bl);
+  bufferlist trunc;
+  trunc.substr_of(bl, 0, bl.length() - 1);
+  denc_test_t u;
+  auto p = trunc.begin();
+  ASSERT_THROW(::decode(u, p), buffer::error);
+}
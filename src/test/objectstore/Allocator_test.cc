@@ -7,6 +7,7 @@
 #include "os/bluestore/Allocator.h"
 #include "global/global_init.h"
 #include <iostream>
+#include <fstream>
 #include "include/Context.h"
 #include "common/ceph_argparse.h"
 #include "global/global_init.h"
@@ -19,6 +20,18 @@
 
 #if GTEST_HAS_PARAM_TEST
 
+static uint64_t get_rss_kb()
+{
+  std::ifstream f("/proc/self/status");
+  string line;
+  while (std::getline(f, line)) {
+    if (line.compare(0, 6, "VmRSS:") == 0) {
+      return strtoull(line.c_str() + 6, NULL, 10);
+    }
+  }
+  return 0;
+}
+
 class AllocTest : public ::testing::TestWithParam<const char*> {
 public:
     boost::scoped_ptr<Allocator> alloc;
@@ -187,10 +200,159 @@ TEST_P(AllocTest, test_alloc_failure)
   }
 }
 
+TEST_P(AllocTest, test_alloc_hybrid_spill)
+{
+  if (string(GetParam()) != "hybrid")
+    return;
+  int64_t block_size = 4096;
+  int64_t blocks = 1024 * block_size;
+  uint64_t offset = 0;
+  uint32_t length = 0;
+
+  // the limit is read when the allocator is created
+  uint64_t max_extents = g_conf->bluestore_hybrid_alloc_max_extents;
+  g_conf->set_val("bluestore_hybrid_alloc_max_extents", "4");
+  init_alloc(blocks, block_size);
+  g_conf->set_val("bluestore_hybrid_alloc_max_extents",
+		  stringify(max_extents));
+
+  // 16 single blocks with gaps between them, plus one big extent; all
+  // but 4 extents end up in the bitmap
+  for (int i = 0; i < 16; ++i) {
+    alloc->init_add_free(2 * i * block_size, block_size);
+  }
+  alloc->init_add_free(64 * block_size, 64 * block_size);
+  ASSERT_EQ((16 + 64) * block_size, (int64_t)alloc->get_free());
+
+  ASSERT_EQ(0, alloc->reserve((16 + 64) * block_size));
+  ASSERT_EQ(0, alloc->allocate(64 * block_size, block_size, 0,
+			       &offset, &length));
+  ASSERT_EQ(64 * block_size, (int64_t)offset);
+  ASSERT_EQ(64 * block_size, (int64_t)length);
+
+  // the singles come out of the tree first, then the bitmap
+  std::set<uint64_t> got;
+  for (int i = 0; i < 16; ++i) {
+    ASSERT_EQ(0, alloc->allocate(block_size, block_size, 0,
+				 &offset, &length));
+    ASSERT_EQ(block_size, (int64_t)length);
+    ASSERT_EQ(0u, offset % (2 * block_size));
+    ASSERT_LT(offset, 32u * block_size);
+    ASSERT_TRUE(got.insert(offset).second);
+  }
+  ASSERT_EQ(0u, alloc->get_free());
+  ASSERT_EQ(-ENOSPC, alloc->allocate(block_size, block_size, 0,
+				     &offset, &length));
+
+  // give them back; nothing is usable until the commit
+  for (auto o : got) {
+    alloc->release(o, block_size);
+  }
+  ASSERT_EQ(0u, alloc->get_free());
+  alloc->commit_start();
+  alloc->commit_finish();
+  ASSERT_EQ(16 * block_size, (int64_t)alloc->get_free());
+
+  // filling the gaps coalesces tree and bitmap space into one extent
+  for (int i = 0; i < 16; ++i) {
+    alloc->init_add_free((2 * i + 1) * block_size, block_size);
+  }
+  ASSERT_EQ(32 * block_size, (int64_t)alloc->get_free());
+  ASSERT_EQ(0, alloc->reserve(32 * block_size));
+  ASSERT_EQ(0, alloc->allocate(32 * block_size, block_size, 0,
+			       &offset, &length));
+  ASSERT_EQ(0u, offset);
+  ASSERT_EQ(32 * block_size, (int64_t)length);
+  ASSERT_EQ(0u, alloc->get_free());
+  alloc->shutdown();
+}
+
+/*
+ * Not a pass/fail test: fragment a 10TB device into ~1M small free
+ * extents plus a few bigger ones, then report what that costs each
+ * allocator in memory and in allocation latency.  Disabled by default;
+ * run it with --gtest_also_run_disabled_tests.
+ */
+TEST_P(AllocTest, DISABLED_test_alloc_fragmented_bench)
+{
+  int64_t block_size = 64 * 1024;
+  int64_t dev_size = 10ull << 40;
+  uint64_t num_holes = 1ull << 20;
+  uint64_t stride = dev_size / num_holes;
+  uint64_t num_allocs = 100000;
+
+  uint64_t rss_start = get_rss_kb();
+  init_alloc(dev_size, block_size);
+
+  utime_t start = ceph_clock_now(NULL);
+  uint64_t free_bytes = 0;
+  for (uint64_t i = 0; i < num_holes; ++i) {
+    // mostly single blocks, every 64th hole is 1MB
+    uint64_t len = (i % 64) ? block_size : 16 * block_size;
+    alloc->init_add_free(i * stride, len);
+    free_bytes += len;
+  }
+  utime_t init_lat = ceph_clock_now(NULL) - start;
+  ASSERT_EQ(free_bytes, alloc->get_free());
+  uint64_t rss_init = get_rss_kb();
+
+  // small allocations
+  std::vector<AllocExtent> allocated;
+  start = ceph_clock_now(NULL);
+  for (uint64_t i = 0; i < num_allocs; ++i) {
+    uint64_t offset;
+    uint32_t length;
+    ASSERT_EQ(0, alloc->reserve(block_size));
+    ASSERT_EQ(0, alloc->allocate(block_size, block_size, 0, &offset, &length));
+    allocated.push_back(AllocExtent(offset, length));
+  }
+  utime_t small_lat = ceph_clock_now(NULL) - start;
+
+  // larger allocations that mostly have to be stitched together
+  int count = 0;
+  uint64_t big = 4ull << 20;
+  uint64_t num_big = 1000;
+  start = ceph_clock_now(NULL);
+  for (uint64_t i = 0; i < num_big; ++i) {
+    std::vector<AllocExtent> extents(big / block_size, AllocExtent(0, 0));
+    ASSERT_EQ(0, alloc->reserve(big));
+    ASSERT_EQ(0, alloc->alloc_extents(big, block_size, 0, &extents, &count));
+    allocated.insert(allocated.end(), extents.begin(), extents.begin() + count);
+  }
+  utime_t big_lat = ceph_clock_now(NULL) - start;
+  uint64_t rss_alloc = get_rss_kb();
+
+  // give it all back
+  start = ceph_clock_now(NULL);
+  for (auto& e : allocated) {
+    alloc->release(e.offset, e.length);
+  }
+  alloc->commit_start();
+  alloc->commit_finish();
+  utime_t release_lat = ceph_clock_now(NULL) - start;
+  ASSERT_EQ(free_bytes, alloc->get_free());
+
+  int64_t init_mb = ((int64_t)rss_init - (int64_t)rss_start) / 1024;
+  int64_t alloc_mb = ((int64_t)rss_alloc - (int64_t)rss_start) / 1024;
+  std::cout << GetParam() << ": " << num_holes << " free extents on a "
+	    << (dev_size >> 40) << "TB device" << std::endl
+	    << "  init_add_free " << (double)init_lat * 1000000.0 / num_holes
+	    << " us/extent, rss +" << init_mb << " MB"
+	    << std::endl
+	    << "  allocate(64K) " << (double)small_lat * 1000000.0 / num_allocs
+	    << " us" << std::endl
+	    << "  alloc_extents(4M) " << (double)big_lat * 1000000.0 / num_big
+	    << " us, rss +" << alloc_mb << " MB"
+	    << std::endl
+	    << "  release+commit " << (double)release_lat * 1000000.0 /
+	       allocated.size() << " us/extent" << std::endl;
+  alloc->shutdown();
+}
+
 INSTANTIATE_TEST_CASE_P(
   Allocator,
   AllocTest,
-  ::testing::Values("stupid", "bitmap"));
+  ::testing::Values("stupid", "bitmap", "hybrid"));
 
 #else
 
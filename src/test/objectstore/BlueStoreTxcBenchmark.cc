@@ -0,0 +1,222 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * Copyright (C) 2016 Red Hat
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+/*
+ * Per-transaction CPU overhead of BlueStore.
+ *
+ * Runs small overwrites from several sequencers at a fixed queue depth
+ * against a BlueStore on the null BlockDevice (bdev_type = null), so
+ * that what is left is the cost of the transaction state machine,
+ * metadata encoding and the kv commit.  The kv store lives on the local
+ * filesystem (bluestore_bluefs = false) since BlueFS cannot run on a
+ * device that discards its writes.
+ */
+
+#include <sys/resource.h>
+#include <stdlib.h>
+#include <iostream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "common/ceph_argparse.h"
+#include "common/debug.h"
+#include "common/errno.h"
+#include "global/global_init.h"
+#include "include/stringify.h"
+#include "os/ObjectStore.h"
+
+using namespace std;
+
+class Worker {
+  ObjectStore *store;
+  ObjectStore::Sequencer osr;
+  coll_t cid;
+  unsigned num_objects;
+  uint64_t object_size;
+  uint64_t write_size;
+  unsigned qd;
+
+  std::mutex lock;
+  std::condition_variable cond;
+  unsigned in_flight = 0;
+
+  struct C_Committed : public Context {
+    Worker *w;
+    explicit C_Committed(Worker *w) : w(w) {}
+    void finish(int r) {
+      std::lock_guard<std::mutex> l(w->lock);
+      --w->in_flight;
+      w->cond.notify_all();
+    }
+  };
+
+  ghobject_t get_object(unsigned n) {
+    return ghobject_t(hobject_t(object_t("obj_" + stringify(n)), "",
+				CEPH_NOSNAP, n, 1, ""));
+  }
+
+  void wait_for(unsigned max) {
+    std::unique_lock<std::mutex> l(lock);
+    while (in_flight > max)
+      cond.wait(l);
+  }
+
+  void queue(ObjectStore::Transaction&& t) {
+    {
+      std::lock_guard<std::mutex> l(lock);
+      ++in_flight;
+    }
+    store->queue_transaction(&osr, std::move(t), nullptr,
+			     new C_Committed(this));
+    wait_for(qd - 1);
+  }
+
+public:
+  Worker(ObjectStore *s, unsigned id, unsigned no, uint64_t os,
+	 uint64_t ws, unsigned q)
+    : store(s),
+      osr("worker" + stringify(id)),
+      cid(spg_t(pg_t(id, 1), shard_id_t::NO_SHARD)),
+      num_objects(no),
+      object_size(os),
+      write_size(ws),
+      qd(q) {}
+
+  void prepare() {
+    ObjectStore::Transaction t;
+    t.create_collection(cid, 0);
+    queue(std::move(t));
+    bufferlist bl;
+    bl.append_zero(object_size);
+    for (unsigned i = 0; i < num_objects; ++i) {
+      ObjectStore::Transaction t;
+      t.write(cid, get_object(i), 0, object_size, bl);
+      queue(std::move(t));
+    }
+    wait_for(0);
+  }
+
+  void run(uint64_t ops) {
+    bufferlist bl;
+    bl.append(buffer::create_page_aligned(write_size));
+    bl.zero();
+    unsigned seed = (uintptr_t)this;
+    uint64_t blocks = object_size / write_size;
+    for (uint64_t i = 0; i < ops; ++i) {
+      unsigned o = rand_r(&seed) % num_objects;
+      uint64_t off = (rand_r(&seed) % blocks) * write_size;
+      ObjectStore::Transaction t;
+      t.write(cid, get_object(o), off, write_size, bl);
+      queue(std::move(t));
+    }
+    wait_for(0);
+  }
+};
+
+static double cpu_seconds()
+{
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1000000.0 +
+    ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1000000.0;
+}
+
+void usage(const string &name) {
+  cerr << "Usage: " << name << " <dir> [ops per thread] [threads] [qd]"
+       << " [write size]" << std::endl;
+}
+
+int main(int argc, char **argv)
+{
+  vector<const char*> args;
+  argv_to_vec(argc, (const char **)argv, args);
+  env_to_vec(args);
+
+  global_init(NULL, args, CEPH_ENTITY_TYPE_CLIENT, CODE_ENVIRONMENT_UTILITY, 0);
+  common_init_finish(g_ceph_context);
+
+  if (args.size() < 1) {
+    usage(argv[0]);
+    return 1;
+  }
+  string dir = args[0];
+  uint64_t ops = args.size() > 1 ? atoll(args[1]) : 100000;
+  unsigned threads = args.size() > 2 ? atoi(args[2]) : 4;
+  unsigned qd = args.size() > 3 ? atoi(args[3]) : 16;
+  uint64_t write_size = args.size() > 4 ? atoll(args[4]) : 4096;
+
+  g_ceph_context->_conf->set_val("bdev_type", "null");
+  g_ceph_context->_conf->set_val("bluestore_bluefs", "false");
+  g_ceph_context->_conf->set_val("bluestore_fsck_on_mount", "false");
+  g_ceph_context->_conf->set_val("bluestore_fsck_on_umount", "false");
+  g_ceph_context->_conf->set_val(
+    "enable_experimental_unrecoverable_data_corrupting_features", "*");
+  g_ceph_context->_conf->apply_changes(NULL);
+
+  int r = ::mkdir(dir.c_str(), 0777);
+  if (r < 0 && errno != EEXIST) {
+    r = -errno;
+    cerr << "unable to create " << dir << ": " << cpp_strerror(r) << std::endl;
+    return 1;
+  }
+  ObjectStore *store = ObjectStore::create(g_ceph_context, "bluestore",
+					   dir, "");
+  assert(store);
+  r = store->mkfs();
+  if (r < 0) {
+    cerr << "mkfs failed: " << cpp_strerror(r) << std::endl;
+    return 1;
+  }
+  r = store->mount();
+  if (r < 0) {
+    cerr << "mount failed: " << cpp_strerror(r) << std::endl;
+    return 1;
+  }
+
+  vector<Worker*> workers;
+  for (unsigned i = 0; i < threads; ++i) {
+    workers.push_back(new Worker(store, i, 16, 4 << 20, write_size, qd));
+    workers.back()->prepare();
+  }
+
+  utime_t start = ceph_clock_now(g_ceph_context);
+  double cpu_start = cpu_seconds();
+  vector<std::thread> ts;
+  for (auto w : workers) {
+    ts.push_back(std::thread([w, ops]() { w->run(ops); }));
+  }
+  for (auto& t : ts) {
+    t.join();
+  }
+  double elapsed = ceph_clock_now(g_ceph_context) - start;
+  double cpu = cpu_seconds() - cpu_start;
+
+  uint64_t total = ops * threads;
+  cout << "txcs " << total
+       << " threads " << threads
+       << " qd " << qd
+       << " write_size " << write_size << std::endl;
+  cout << "elapsed " << elapsed << " s, "
+       << (uint64_t)(total / elapsed) << " txc/s, "
+       << (elapsed * 1000000.0 / total) << " us/txc wall, "
+       << (cpu * 1000000.0 / total) << " us/txc cpu" << std::endl;
+
+  for (auto w : workers) {
+    delete w;
+  }
+  store->umount();
+  delete store;
+  return 0;
+}
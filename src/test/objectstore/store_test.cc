@@ -26,8 +26,11 @@
 #include "common/Mutex.h"
 #include "common/Cond.h"
 #include "common/errno.h"
+#include "common/ceph_json.h"
+#include "common/perf_counters.h"
 #include "include/stringify.h"
 #include <boost/scoped_ptr.hpp>
+#include <boost/scope_exit.hpp>
 #include <boost/random/mersenne_twister.hpp>
 #include <boost/random/uniform_int.hpp>
 #include <boost/random/binomial_distribution.hpp>
@@ -67,6 +70,27 @@ static bool bl_eq(bufferlist& expected, bufferlist& actual)
   return false;
 }
 
+// current value of a u64 perf counter; 0 if there is no such logger
+static uint64_t get_perf_counter(const string& logger, const string& counter)
+{
+  JSONFormatter f;
+  g_ceph_context->get_perfcounters_collection()->dump_formatted(
+    &f, false, logger, counter);
+  stringstream ss;
+  f.flush(ss);
+  string s = ss.str();
+  JSONParser p;
+  if (!p.parse(s.c_str(), s.length()))
+    return 0;
+  JSONObj *l = p.find_obj(logger);
+  if (!l)
+    return 0;
+  JSONObj *c = l->find_obj(counter);
+  if (!c)
+    return 0;
+  return strtoull(c->get_data().c_str(), NULL, 10);
+}
+
 
 
 template <typename T>
@@ -903,6 +927,79 @@ TEST_P(StoreTest, CompressionTest) {
   g_ceph_context->_conf->apply_changes(NULL);
 }
 
+TEST_P(StoreTest, CompressionParkedTest) {
+  if (string(GetParam()) != "bluestore")
+    return;
+  ObjectStore::Sequencer osr("test");
+  int r;
+  coll_t cid;
+  ghobject_t hoid(hobject_t(sobject_t("Object 1", CEPH_NOSNAP)));
+  ghobject_t hoid2(hobject_t(sobject_t("Object 2", CEPH_NOSNAP)));
+
+  g_conf->set_val("bluestore_compression", "force");
+  g_ceph_context->_conf->apply_changes(NULL);
+  {
+    ObjectStore::Transaction t;
+    t.create_collection(cid, 0);
+    r = apply_transaction(store, &osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  // big compressible writes park their txc; the small overwrites queued
+  // right behind them must still land on top
+  const unsigned len = 0x100000;
+  string expected;
+  for (unsigned i = 0; i < 4; ++i) {
+    string data(len, 0);
+    for (unsigned k = 0; k < len; ++k)
+      data[k] = 'a' + (k / 512 + i) % 4;
+    {
+      bufferlist bl;
+      bl.append(data);
+      ObjectStore::Transaction t;
+      t.write(cid, hoid, 0, bl.length(), bl);
+      store->queue_transaction(&osr, std::move(t), nullptr);
+    }
+    {
+      bufferlist bl;
+      bl.append(string(4096, 'z'));
+      ObjectStore::Transaction t;
+      t.write(cid, hoid, i * 4096, bl.length(), bl);
+      store->queue_transaction(&osr, std::move(t), nullptr);
+    }
+    data.replace(i * 4096, 4096, string(4096, 'z'));
+    expected = data;
+  }
+  {
+    // alloc hint in the same transaction as the write
+    bufferlist bl;
+    bl.append(expected);
+    ObjectStore::Transaction t;
+    t.touch(cid, hoid2);
+    t.set_alloc_hint(cid, hoid2, len, len,
+		     CEPH_OSD_ALLOC_HINT_FLAG_SEQUENTIAL_READ |
+		     CEPH_OSD_ALLOC_HINT_FLAG_IMMUTABLE);
+    t.write(cid, hoid2, 0, bl.length(), bl);
+    r = apply_transaction(store, &osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  for (auto o : { hoid, hoid2 }) {
+    bufferlist bl;
+    r = store->read(cid, o, 0, len, bl);
+    ASSERT_EQ((int)len, r);
+    ASSERT_TRUE(bl.contents_equal(expected.c_str(), len));
+  }
+  {
+    ObjectStore::Transaction t;
+    t.remove(cid, hoid);
+    t.remove(cid, hoid2);
+    t.remove_collection(cid);
+    r = apply_transaction(store, &osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  g_conf->set_val("bluestore_compression", "none");
+  g_ceph_context->_conf->apply_changes(NULL);
+}
+
 TEST_P(StoreTest, SimpleObjectTest) {
   ObjectStore::Sequencer osr("test");
   int r;
@@ -1123,6 +1220,8 @@ TEST_P(StoreTest, BluestoreStatFSTest) {
   if(string(GetParam()) != "bluestore")
     return;
   g_conf->set_val("bluestore_compression", "force");
+  // the numbers below assume every blob gets whole allocation units
+  g_conf->set_val("bluestore_pack_small_blobs", "false");
   g_ceph_context->_conf->apply_changes(NULL);
 
   ObjectStore::Sequencer osr("test");
@@ -1343,12 +1442,15 @@ TEST_P(StoreTest, BluestoreStatFSTest) {
     ASSERT_EQ( 0u, statfs.compressed_allocated);
   }
   g_conf->set_val("bluestore_compression", "none");
+  g_conf->set_val("bluestore_pack_small_blobs", "true");
   g_ceph_context->_conf->apply_changes(NULL);
 }
 
 TEST_P(StoreTest, BluestoreFragmentedBlobTest) {
   if(string(GetParam()) != "bluestore")
     return;
+  g_conf->set_val("bluestore_pack_small_blobs", "false");
+  g_ceph_context->_conf->apply_changes(NULL);
 
   ObjectStore::Sequencer osr("test");
   int r;
@@ -1540,6 +1642,114 @@ TEST_P(StoreTest, BluestoreFragmentedBlobTest) {
     ASSERT_EQ( 0u, statfs.compressed);
     ASSERT_EQ( 0u, statfs.compressed_allocated);
   }
+  g_conf->set_val("bluestore_pack_small_blobs", "true");
+  g_ceph_context->_conf->apply_changes(NULL);
+}
+
+TEST_P(StoreTest, BluestorePackedSmallBlobTest) {
+  if(string(GetParam()) != "bluestore")
+    return;
+  g_conf->set_val("bluestore_pack_small_blobs", "true");
+  g_ceph_context->_conf->apply_changes(NULL);
+
+  ObjectStore::Sequencer osr("test");
+  int r;
+  coll_t cid;
+  {
+    ObjectStore::Transaction t;
+    t.create_collection(cid, 0);
+    r = apply_transaction(store, &osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  uint64_t available0 = 0;
+  {
+    struct store_statfs_t statfs;
+    r = store->statfs(&statfs);
+    ASSERT_EQ(r, 0);
+    available0 = statfs.available;
+  }
+  vector<ghobject_t> objs;
+  for (int i = 0; i < 8; ++i) {
+    objs.push_back(ghobject_t(hobject_t(sobject_t("Object " + stringify(i),
+						  CEPH_NOSNAP))));
+  }
+  {
+    ObjectStore::Transaction t;
+    for (unsigned i = 0; i < objs.size(); ++i) {
+      bufferlist bl;
+      bl.append(string(0x1000, 'a' + i));
+      t.write(cid, objs[i], 0, bl.length(), bl);
+    }
+    cerr << "Write 8 4K objects" << std::endl;
+    r = apply_transaction(store, &osr, std::move(t));
+    ASSERT_EQ(r, 0);
+
+    struct store_statfs_t statfs;
+    r = store->statfs(&statfs);
+    ASSERT_EQ(r, 0);
+    ASSERT_EQ(0x8000, statfs.stored);
+    // all in one shared unit, whose other half is still available
+    ASSERT_EQ(0x8000, statfs.allocated);
+    ASSERT_EQ(available0 - 0x8000, statfs.available);
+  }
+  //force fsck
+  EXPECT_EQ(store->umount(), 0);
+  EXPECT_EQ(store->mount(), 0);
+  for (unsigned i = 0; i < objs.size(); ++i) {
+    bufferlist bl;
+    r = store->read(cid, objs[i], 0, 0x1000, bl);
+    ASSERT_EQ(r, 0x1000);
+    bufferlist expected;
+    expected.append(string(0x1000, 'a' + i));
+    ASSERT_TRUE(bl_eq(expected, bl));
+  }
+  {
+    ObjectStore::Transaction t;
+    bufferlist bl;
+    bl.append(string(0x1000, 'z'));
+    t.write(cid, objs[0], 0x2000, bl.length(), bl);
+    cerr << "Grow an object within its first allocation unit" << std::endl;
+    r = apply_transaction(store, &osr, std::move(t));
+    ASSERT_EQ(r, 0);
+
+    struct store_statfs_t statfs;
+    r = store->statfs(&statfs);
+    ASSERT_EQ(r, 0);
+    ASSERT_EQ(0x9000, statfs.stored);
+    ASSERT_EQ(0x8000 + 0x10000, statfs.allocated);
+
+    bufferlist newdata, expected;
+    r = store->read(cid, objs[0], 0, 0x3000, newdata);
+    ASSERT_EQ(r, 0x3000);
+    expected.append(string(0x1000, 'a'));
+    expected.append(string(0x1000, 0));
+    expected.append(string(0x1000, 'z'));
+    ASSERT_TRUE(bl_eq(expected, newdata));
+  }
+  {
+    ObjectStore::Transaction t;
+    for (auto& o : objs)
+      t.remove(cid, o);
+    t.remove_collection(cid);
+    cerr << "Cleaning" << std::endl;
+    r = apply_transaction(store, &osr, std::move(t));
+    ASSERT_EQ(r, 0);
+
+    struct store_statfs_t statfs;
+    r = store->statfs(&statfs);
+    ASSERT_EQ(r, 0);
+    ASSERT_EQ(0u, statfs.allocated);
+    ASSERT_EQ(0u, statfs.stored);
+  }
+  //force fsck; the emptied unit goes back at mount
+  EXPECT_EQ(store->umount(), 0);
+  EXPECT_EQ(store->mount(), 0);
+  {
+    struct store_statfs_t statfs;
+    r = store->statfs(&statfs);
+    ASSERT_EQ(r, 0);
+    ASSERT_EQ(available0, statfs.available);
+  }
 }
 
 TEST_P(StoreTest, ManySmallWrite) {
@@ -1705,6 +1915,343 @@ TEST_P(StoreTest, AppendWalVsTailCache) {
   g_ceph_context->_conf->apply_changes(NULL);
 }
 
+// write len bytes of c at off to oid and mirror it in *expected
+static void sharding_write(ObjectStore *store, ObjectStore::Sequencer *osr,
+			   coll_t cid, ghobject_t oid, string *expected,
+			   uint64_t off, uint64_t len, char c)
+{
+  bufferlist bl;
+  bl.append(string(len, c));
+  ObjectStore::Transaction t;
+  t.write(cid, oid, off, len, bl, 0);
+  int r = store->apply_transaction(osr, std::move(t));
+  ASSERT_EQ(r, 0);
+  if (expected->length() < off + len)
+    expected->resize(off + len, 0);
+  expected->replace(off, len, string(len, c));
+}
+
+static void sharding_check(ObjectStore *store, coll_t cid, ghobject_t oid,
+			   const string& expected)
+{
+  bufferlist bl;
+  int r = store->read(cid, oid, 0, expected.length(), bl);
+  ASSERT_EQ((int)expected.length(), r);
+  ASSERT_TRUE(bl.contents_equal(expected.c_str(), expected.length()));
+}
+
+TEST_P(StoreTest, ExtentMapShardingTest) {
+  if (string(GetParam()) != "bluestore")
+    return;
+  ObjectStore::Sequencer osr("test");
+  int r;
+  coll_t cid;
+  ghobject_t a(hobject_t(sobject_t("Object 1", CEPH_NOSNAP)));
+  ghobject_t b(hobject_t(sobject_t("Object 2", CEPH_NOSNAP)));
+  ghobject_t c(hobject_t(sobject_t("Object 3", CEPH_NOSNAP)));
+  {
+    ObjectStore::Transaction t;
+    t.create_collection(cid, 0);
+    r = store->apply_transaction(&osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  string ea, eb;
+
+  // lots of small writes that can't be merged into each other make a
+  // big extent map, which gets sharded and split as it grows
+  for (unsigned i = 0; i < 512; ++i) {
+    sharding_write(store.get(), &osr, cid, a, &ea, i * 8192, 4096,
+		   'a' + i % 26);
+  }
+  sharding_check(store.get(), cid, a, ea);
+  store->umount();
+  ASSERT_EQ(0, store->mount());
+  sharding_check(store.get(), cid, a, ea);
+
+  // overwrites across shard boundaries, after reloading the shards
+  for (unsigned i = 0; i < 64; ++i) {
+    sharding_write(store.get(), &osr, cid, a, &ea, i * 65536 + 6000, 5000,
+		   'A' + i % 26);
+  }
+  sharding_check(store.get(), cid, a, ea);
+
+  // one big write collapses most of the map, so shards merge
+  sharding_write(store.get(), &osr, cid, a, &ea, 4096, 3 << 20, 'x');
+  sharding_check(store.get(), cid, a, ea);
+  store->umount();
+  ASSERT_EQ(0, store->mount());
+  sharding_check(store.get(), cid, a, ea);
+
+  // clone a sharded onode, then overwrite both sides
+  for (unsigned i = 0; i < 256; ++i) {
+    sharding_write(store.get(), &osr, cid, a, &ea, (3 << 20) + i * 8192,
+		   4096, 'a' + i % 26);
+  }
+  {
+    ObjectStore::Transaction t;
+    t.clone(cid, a, b);
+    r = store->apply_transaction(&osr, std::move(t));
+    ASSERT_EQ(r, 0);
+    eb = ea;
+  }
+  for (unsigned i = 0; i < 32; ++i) {
+    sharding_write(store.get(), &osr, cid, a, &ea, i * 131072, 3000, '1');
+    sharding_write(store.get(), &osr, cid, b, &eb, i * 131072 + 65536,
+		   3000, '2');
+  }
+  sharding_check(store.get(), cid, a, ea);
+  sharding_check(store.get(), cid, b, eb);
+  store->umount();
+  ASSERT_EQ(0, store->mount());
+  sharding_check(store.get(), cid, a, ea);
+  sharding_check(store.get(), cid, b, eb);
+
+  // rename moves the shards along with the onode
+  {
+    ObjectStore::Transaction t;
+    t.collection_move_rename(cid, b, cid, c);
+    r = store->apply_transaction(&osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  ASSERT_FALSE(store->exists(cid, b));
+  sharding_check(store.get(), cid, c, eb);
+  sharding_write(store.get(), &osr, cid, c, &eb, 100000, 70000, '3');
+  store->umount();
+  ASSERT_EQ(0, store->mount());
+  ASSERT_FALSE(store->exists(cid, b));
+  sharding_check(store.get(), cid, c, eb);
+  sharding_check(store.get(), cid, a, ea);
+
+  {
+    ObjectStore::Transaction t;
+    t.remove(cid, a);
+    t.remove(cid, c);
+    t.remove_collection(cid);
+    r = store->apply_transaction(&osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+}
+
+TEST_P(StoreTest, ExtentMapShardingPast4GTest) {
+  if (string(GetParam()) != "bluestore")
+    return;
+  ObjectStore::Sequencer osr("test");
+  int r;
+  coll_t cid;
+  ghobject_t a(hobject_t(sobject_t("Object 1", CEPH_NOSNAP)));
+  ghobject_t b(hobject_t(sobject_t("Object 2", CEPH_NOSNAP)));
+  {
+    ObjectStore::Transaction t;
+    t.create_collection(cid, 0);
+    r = store->apply_transaction(&osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  // shards can only start below 4GB, so everything past it lands in the
+  // last shard; enough of it to want splitting, around the boundary
+  uint64_t base = (4ull << 30) - (1 << 20);
+  map<uint64_t,char> written;
+  for (unsigned i = 0; i < 512; ++i) {
+    uint64_t off = base + i * 8192;
+    bufferlist bl;
+    bl.append(string(4096, 'a' + i % 26));
+    ObjectStore::Transaction t;
+    t.write(cid, a, off, bl.length(), bl, 0);
+    r = store->apply_transaction(&osr, std::move(t));
+    ASSERT_EQ(r, 0);
+    written[off] = 'a' + i % 26;
+  }
+  {
+    bufferlist bl;
+    bl.append(string(4096, 'z'));
+    ObjectStore::Transaction t;
+    t.write(cid, a, 5ull << 30, bl.length(), bl, 0);
+    t.clone(cid, a, b);
+    r = store->apply_transaction(&osr, std::move(t));
+    ASSERT_EQ(r, 0);
+    written[5ull << 30] = 'z';
+  }
+  for (unsigned remount = 0; remount < 2; ++remount) {
+    if (remount) {
+      store->umount();
+      ASSERT_EQ(0, store->mount());
+    }
+    for (auto o : { a, b }) {
+      struct stat st;
+      ASSERT_EQ(0, store->stat(cid, o, &st));
+      ASSERT_EQ((5ll << 30) + 4096, st.st_size);
+      for (auto& w : written) {
+	bufferlist bl;
+	r = store->read(cid, o, w.first, 4096, bl);
+	ASSERT_EQ(4096, r);
+	ASSERT_TRUE(bl.contents_equal(string(4096, w.second).c_str(), 4096));
+      }
+    }
+  }
+  {
+    ObjectStore::Transaction t;
+    t.remove(cid, a);
+    t.remove(cid, b);
+    t.remove_collection(cid);
+    r = store->apply_transaction(&osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+}
+
+TEST_P(StoreTest, SharedBlobTest) {
+  if (string(GetParam()) != "bluestore")
+    return;
+  ObjectStore::Sequencer osr("test");
+  int r;
+  coll_t cid;
+  // same hash, so both share a bnode
+  ghobject_t a(hobject_t(sobject_t("Object 1", CEPH_NOSNAP)));
+  ghobject_t b(hobject_t(sobject_t("Object 1", 1)));
+  {
+    ObjectStore::Transaction t;
+    t.create_collection(cid, 0);
+    r = store->apply_transaction(&osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  string da(0x20000, 'a');
+  {
+    bufferlist bl;
+    bl.append(da);
+    ObjectStore::Transaction t;
+    t.write(cid, a, 0, bl.length(), bl, 0);
+    t.clone(cid, a, b);
+    r = store->apply_transaction(&osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  string db = da;
+  {
+    // overwrite part of each side of the shared blob
+    bufferlist bla, blb;
+    bla.append(string(0x1000, 'b'));
+    blb.append(string(0x1000, 'c'));
+    ObjectStore::Transaction t;
+    t.write(cid, a, 0x1000, bla.length(), bla, 0);
+    t.write(cid, b, 0x10000, blb.length(), blb, 0);
+    r = store->apply_transaction(&osr, std::move(t));
+    ASSERT_EQ(r, 0);
+    da.replace(0x1000, 0x1000, string(0x1000, 'b'));
+    db.replace(0x10000, 0x1000, string(0x1000, 'c'));
+  }
+  for (unsigned remount = 0; remount < 2; ++remount) {
+    if (remount) {
+      ASSERT_EQ(0, store->umount());
+      ASSERT_EQ(0, store->fsck());
+      ASSERT_EQ(0, store->mount());
+    }
+    bufferlist bl;
+    r = store->read(cid, a, 0, da.size(), bl);
+    ASSERT_EQ((int)da.size(), r);
+    ASSERT_TRUE(bl.contents_equal(da.c_str(), da.size()));
+    bl.clear();
+    r = store->read(cid, b, 0, db.size(), bl);
+    ASSERT_EQ((int)db.size(), r);
+    ASSERT_TRUE(bl.contents_equal(db.c_str(), db.size()));
+  }
+  {
+    // drop one side; the other still reads through the shared blob
+    ObjectStore::Transaction t;
+    t.remove(cid, a);
+    r = store->apply_transaction(&osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  {
+    ASSERT_EQ(0, store->umount());
+    ASSERT_EQ(0, store->fsck());
+    ASSERT_EQ(0, store->mount());
+    bufferlist bl;
+    r = store->read(cid, b, 0, db.size(), bl);
+    ASSERT_EQ((int)db.size(), r);
+    ASSERT_TRUE(bl.contents_equal(db.c_str(), db.size()));
+  }
+  {
+    ObjectStore::Transaction t;
+    t.remove(cid, b);
+    t.remove_collection(cid);
+    r = store->apply_transaction(&osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  ASSERT_EQ(0, store->umount());
+  ASSERT_EQ(0, store->fsck());
+  ASSERT_EQ(0, store->mount());
+}
+
+TEST_P(StoreTest, WalBatchTest) {
+  if (string(GetParam()) != "bluestore")
+    return;
+  // batching is read when the store is created
+  g_conf->set_val("bluestore_wal_batch_ops", "8");
+  g_conf->set_val("bluestore_wal_batch_max_inflight", "2");
+  g_ceph_context->_conf->apply_changes(NULL);
+  store->umount();
+  store.reset(ObjectStore::create(g_ceph_context,
+				  string(GetParam()),
+				  string("store_test_temp_dir"),
+				  string("store_test_temp_journal")));
+  ASSERT_EQ(0, store->mount());
+
+  ObjectStore::Sequencer osr("test");
+  int r;
+  coll_t cid;
+  ghobject_t a(hobject_t(sobject_t("fooo", CEPH_NOSNAP)));
+  unsigned block = g_conf->bluestore_min_alloc_size;
+  unsigned len = block * 16;
+  bufferlist expected;
+  {
+    bufferptr bp(len);
+    memset(bp.c_str(), 0, len);
+    expected.append(bp);
+  }
+  {
+    ObjectStore::Transaction t;
+    t.create_collection(cid, 0);
+    t.write(cid, a, 0, expected.length(), expected, 0);
+    r = store->apply_transaction(&osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  // small overwrites go through the wal; hit some blocks repeatedly so
+  // that batches overlap both each other and themselves
+  for (unsigned i = 0; i < 100; ++i) {
+    unsigned off = (i * 7 % 16) * block + (i % 3) * 512;
+    bufferlist bl;
+    bl.append(string(1000, 'a' + i % 26));
+    ObjectStore::Transaction t;
+    t.write(cid, a, off, bl.length(), bl, 0);
+    r = store->apply_transaction(&osr, std::move(t));
+    ASSERT_EQ(r, 0);
+    bufferlist head, tail;
+    head.substr_of(expected, 0, off);
+    tail.substr_of(expected, off + bl.length(),
+		   expected.length() - off - bl.length());
+    expected.clear();
+    expected.append(head);
+    expected.append(bl);
+    expected.append(tail);
+  }
+  for (unsigned remount = 0; remount < 2; ++remount) {
+    if (remount) {
+      store->umount();
+      ASSERT_EQ(0, store->mount());
+    }
+    bufferlist actual;
+    ASSERT_EQ((int)len, store->read(cid, a, 0, len, actual));
+    ASSERT_TRUE(bl_eq(expected, actual));
+  }
+  {
+    ObjectStore::Transaction t;
+    t.remove(cid, a);
+    t.remove_collection(cid);
+    r = store->apply_transaction(&osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  g_conf->set_val("bluestore_wal_batch_ops", "0");
+  g_conf->set_val("bluestore_wal_batch_max_inflight", "4");
+  g_ceph_context->_conf->apply_changes(NULL);
+}
+
 TEST_P(StoreTest, AppendZeroTrailingSharedBlock) {
   ObjectStore::Sequencer osr("test");
   int r;
@@ -2137,6 +2684,81 @@ TEST_P(StoreTest, SimpleListTest) {
   }
 }
 
+TEST_P(StoreTest, PrefetchOnodesTest) {
+  ObjectStore::Sequencer osr("test");
+  int r;
+  coll_t cid(spg_t(pg_t(0, 1), shard_id_t(1)));
+  {
+    ObjectStore::Transaction t;
+    t.create_collection(cid, 0);
+    r = apply_transaction(store, &osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  map<ghobject_t, uint64_t, ghobject_t::BitwiseComparator> all;
+  {
+    ObjectStore::Transaction t;
+    for (int i=0; i<100; ++i) {
+      ghobject_t hoid(hobject_t(sobject_t("object_" + stringify(i),
+					  CEPH_NOSNAP)),
+		      ghobject_t::NO_GEN, shard_id_t(1));
+      hoid.hobj.pool = 1;
+      bufferlist bl;
+      bl.append(string(i * 10, 'a' + i % 26));
+      t.write(cid, hoid, 0, bl.length(), bl);
+      all[hoid] = bl.length();
+    }
+    r = apply_transaction(store, &osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  // start cold
+  store->umount();
+  r = store->mount();
+  ASSERT_EQ(0, r);
+
+  vector<ghobject_t> objects;
+  ghobject_t next;
+  r = store->collection_list(cid, ghobject_t(), ghobject_t::get_max(),
+			     true, INT_MAX, &objects, &next);
+  ASSERT_EQ(r, 0);
+  ASSERT_EQ(all.size(), objects.size());
+
+  // objects that do not exist are ignored
+  ghobject_t missing(hobject_t(sobject_t("missing", CEPH_NOSNAP)),
+		     ghobject_t::NO_GEN, shard_id_t(1));
+  missing.hobj.pool = 1;
+  objects.push_back(missing);
+  uint64_t prefetched = get_perf_counter("BlueStore",
+					 "bluestore_onode_prefetch");
+  store->prefetch_onodes(cid, objects);
+  if (string(GetParam()) == "bluestore") {
+    // all of them, but not the missing one
+    ASSERT_EQ(prefetched + all.size(),
+	      get_perf_counter("BlueStore", "bluestore_onode_prefetch"));
+  }
+  // and again, now that they are cached
+  store->prefetch_onodes(cid, objects);
+  if (string(GetParam()) == "bluestore") {
+    ASSERT_EQ(prefetched + all.size(),
+	      get_perf_counter("BlueStore", "bluestore_onode_prefetch"));
+  }
+
+  for (auto& p : all) {
+    struct stat st;
+    r = store->stat(cid, p.first, &st);
+    ASSERT_EQ(0, r);
+    ASSERT_EQ(p.second, (uint64_t)st.st_size);
+  }
+  ASSERT_FALSE(store->exists(cid, missing));
+  {
+    ObjectStore::Transaction t;
+    for (auto& p : all)
+      t.remove(cid, p.first);
+    t.remove_collection(cid);
+    r = apply_transaction(store, &osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+}
+
 TEST_P(StoreTest, Sort) {
   {
     hobject_t a(sobject_t("a", CEPH_NOSNAP));
@@ -2905,6 +3527,126 @@ TEST_P(StoreTest, ManyObjectTest) {
   }
 }
 
+static void check_listing(
+  ObjectStore *store, coll_t cid,
+  const set<ghobject_t, ghobject_t::BitwiseComparator> &created)
+{
+  for (set<ghobject_t, ghobject_t::BitwiseComparator>::const_iterator i =
+	 created.begin();
+       i != created.end();
+       ++i) {
+    struct stat buf;
+    ASSERT_EQ(0, store->stat(cid, *i, &buf));
+  }
+  set<ghobject_t, ghobject_t::BitwiseComparator> listed;
+  vector<ghobject_t> objects;
+  ghobject_t start, next;
+  while (1) {
+    int r = store->collection_list(cid, start, ghobject_t::get_max(), true,
+				   50, &objects, &next);
+    ASSERT_EQ(r, 0);
+    ASSERT_TRUE(sorted(objects, true));
+    if (!listed.empty() && !objects.empty())
+      ASSERT_TRUE(cmp_bitwise(*listed.rbegin(), objects.front()) < 0);
+    listed.insert(objects.begin(), objects.end());
+    if (objects.size() < 50) {
+      ASSERT_TRUE(next.is_max());
+      break;
+    }
+    objects.clear();
+    start = next;
+  }
+  ASSERT_EQ(created.size(), listed.size());
+}
+
+TEST_P(StoreTest, BackgroundSplitTest) {
+  if (string(GetParam()) != "filestore")
+    return;
+  ObjectStore::Sequencer osr("test");
+  int NUM_OBJS = 1000;
+  int r = 0;
+  coll_t cid(spg_t(pg_t(7, 15), shard_id_t::NO_SHARD));
+  set<ghobject_t, ghobject_t::BitwiseComparator> created;
+  // slow enough that the splits are still going while we look
+  g_ceph_context->_conf->set_val("filestore_split_background", "true");
+  g_ceph_context->_conf->set_val("filestore_split_rate", "500");
+  g_ceph_context->_conf->set_val("filestore_split_batch", "8");
+  g_ceph_context->_conf->set_val("filestore_merge_threshold", "-10");
+  g_ceph_context->_conf->apply_changes(NULL);
+  BOOST_SCOPE_EXIT_ALL(&) {
+    g_ceph_context->_conf->set_val("filestore_split_background", "false");
+    g_ceph_context->_conf->set_val("filestore_split_rate", "2000");
+    g_ceph_context->_conf->set_val("filestore_split_batch", "64");
+    g_ceph_context->_conf->set_val("filestore_merge_threshold", "10");
+    g_ceph_context->_conf->apply_changes(NULL);
+  };
+  uint64_t moved0 = get_perf_counter("filestore", "index_split_moved");
+  {
+    ObjectStore::Transaction t;
+    t.create_collection(cid, 0);
+    r = apply_transaction(store, &osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  for (int i = 0; i < NUM_OBJS; ++i) {
+    ObjectStore::Transaction t;
+    char buf[100];
+    snprintf(buf, sizeof(buf), "bgsplit_%d", i);
+    ghobject_t hoid(hobject_t(sobject_t(buf, CEPH_NOSNAP)));
+    t.touch(cid, hoid);
+    created.insert(hoid);
+    r = apply_transaction(store, &osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  check_listing(store.get(), cid, created);
+
+  // and on top of that, presplit everything two levels down
+  ASSERT_EQ(0, store->presplit_collection(cid, 2));
+  check_listing(store.get(), cid, created);
+
+  // all 256 second level dirs show up as the first level splits finish
+  string coll_dir = "store_test_temp_dir/current/" + cid.to_str();
+  const char *hex = "0123456789ABCDEF";
+  for (int tries = 0; ; ++tries) {
+    int missing = 0;
+    for (int i = 0; i < 16; ++i) {
+      for (int j = 0; j < 16; ++j) {
+	string dir = coll_dir + "/DIR_" + hex[i] + "/DIR_" + hex[j];
+	struct stat st;
+	if (::stat(dir.c_str(), &st) < 0)
+	  ++missing;
+      }
+    }
+    if (!missing)
+      break;
+    ASSERT_LT(tries, 600) << missing << " second level dirs missing";
+    usleep(100000);
+  }
+  // and objects were moved down by the splitter, not inline
+  ASSERT_LT(moved0, get_perf_counter("filestore", "index_split_moved"));
+  check_listing(store.get(), cid, created);
+
+  // a split cut short by umount is finished on mount
+  store->umount();
+  r = store->mount();
+  ASSERT_EQ(0, r);
+  check_listing(store.get(), cid, created);
+
+  for (set<ghobject_t, ghobject_t::BitwiseComparator>::iterator i = created.begin();
+       i != created.end();
+       ++i) {
+    ObjectStore::Transaction t;
+    t.remove(cid, *i);
+    r = apply_transaction(store, &osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+  {
+    ObjectStore::Transaction t;
+    t.remove_collection(cid);
+    r = apply_transaction(store, &osr, std::move(t));
+    ASSERT_EQ(r, 0);
+  }
+}
+
 
 class ObjectGenerator {
 public:
@@ -5143,8 +5885,7 @@ int main(int argc, char **argv) {
   g_ceph_context->_conf->set_val("bluestore_max_alloc_size", "196608");
 
   // set small cache sizes so we see trimming during Synthetic tests
-  g_ceph_context->_conf->set_val("bluestore_buffer_cache_size", "2000000");
-  g_ceph_context->_conf->set_val("bluestore_onode_cache_size", "500");
+  g_ceph_context->_conf->set_val("bluestore_cache_size", "4000000");
 
   g_ceph_context->_conf->set_val(
     "enable_experimental_unrecoverable_data_corrupting_features", "*");
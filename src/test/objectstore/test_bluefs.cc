@@ -8,6 +8,8 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <thread>
+#include <atomic>
+#include <algorithm>
 #include "global/global_init.h"
 #include "common/ceph_argparse.h"
 #include "include/stringify.h"
@@ -105,6 +107,76 @@ TEST(BlueFS, write_read) {
   rm_temp_bdev(fn);
 }
 
+TEST(BlueFS, read_random_cache) {
+  uint64_t size = 1048476 * 128;
+  string fn = get_temp_bdev(size);
+  g_ceph_context->_conf->set_val("bluefs_cache_size", "1048576");
+  g_ceph_context->_conf->apply_changes(NULL);
+  BlueFS fs;
+  ASSERT_EQ(0, fs.add_block_device(BlueFS::BDEV_DB, fn));
+  fs.add_block_extent(BlueFS::BDEV_DB, 1048576, size - 1048576);
+  uuid_d fsid;
+  ASSERT_EQ(0, fs.mkfs(fsid));
+  ASSERT_EQ(0, fs.mount());
+  ASSERT_TRUE(fs.has_read_cache());
+  uint64_t len = 4 * 1048576 + 1234;
+  char *data = gen_buffer(len);
+  {
+    BlueFS::FileWriter *h;
+    ASSERT_EQ(0, fs.mkdir("dir"));
+    ASSERT_EQ(0, fs.open_for_write("dir", "file", &h, false));
+    h->append(data, len);
+    fs.fsync(h);
+    fs.close_writer(h);
+  }
+  {
+    BlueFS::FileReader *h;
+    ASSERT_EQ(0, fs.open_for_read("dir", "file", &h, true));
+    char out[10000];
+    // random offsets, some straddling chunks, then the same again from
+    // the cache
+    for (unsigned pass = 0; pass < 2; ++pass) {
+      unsigned seed = 42;
+      for (unsigned i = 0; i < 200; ++i) {
+	uint64_t off = rand_r(&seed) % len;
+	size_t l = 1 + rand_r(&seed) % sizeof(out);
+	size_t expect = MIN(l, len - off);
+	ASSERT_EQ((int)expect, fs.read_random(h, off, l, out));
+	ASSERT_EQ(0, memcmp(data + off, out, expect));
+      }
+    }
+    // a sequential scan (read ahead) that cycles the whole cache
+    for (uint64_t off = 0; off < len; off += sizeof(out)) {
+      size_t expect = MIN(sizeof(out), len - off);
+      ASSERT_EQ((int)expect, fs.read_random(h, off, sizeof(out), out));
+      ASSERT_EQ(0, memcmp(data + off, out, expect));
+    }
+    delete h;
+  }
+  {
+    // overwrite in place; readers must not see the old data
+    BlueFS::FileWriter *h;
+    ASSERT_EQ(0, fs.open_for_write("dir", "file", &h, true));
+    memset(data, 'x', 8192);
+    h->append(data, 8192);
+    fs.fsync(h);
+    fs.close_writer(h);
+  }
+  {
+    BlueFS::FileReader *h;
+    ASSERT_EQ(0, fs.open_for_read("dir", "file", &h, true));
+    char out[8192];
+    ASSERT_EQ(8192, fs.read_random(h, 0, 8192, out));
+    ASSERT_EQ(0, memcmp(data, out, 8192));
+    delete h;
+  }
+  fs.umount();
+  delete[] data;
+  rm_temp_bdev(fn);
+  g_ceph_context->_conf->set_val("bluefs_cache_size", "0");
+  g_ceph_context->_conf->apply_changes(NULL);
+}
+
 TEST(BlueFS, small_appends) {
   uint64_t size = 1048476 * 128;
   string fn = get_temp_bdev(size);
@@ -576,6 +648,102 @@ TEST(BlueFS, test_replay) {
   rm_temp_bdev(fn);
 }
 
+#define NUM_SST_FILES 8
+#define NUM_READERS 4
+#define SST_SIZE (4 * 1048576)
+
+void read_sst_files(BlueFS &fs, std::atomic_bool *stop, uint64_t *bytes)
+{
+  unsigned i = 0;
+  while (!*stop) {
+    BlueFS::FileReader *h;
+    ASSERT_EQ(0, fs.open_for_read("db", "sst." + to_string(i++ % NUM_SST_FILES),
+				  &h));
+    bufferlist bl;
+    ASSERT_EQ(SST_SIZE, fs.read(h, &h->buf, 0, SST_SIZE, &bl, NULL));
+    *bytes += bl.length();
+    delete h;
+  }
+}
+
+/*
+ * WAL appends + fsyncs while other threads stream big reads out of
+ * "SST" files, like a compaction would.  The sync latency should not
+ * depend on what the readers are doing; print the distribution so a
+ * regression is easy to spot.
+ */
+TEST(BlueFS, test_wal_sync_latency_under_reads) {
+  uint64_t size = 1048476 * 256;
+  string fn = get_temp_bdev(size);
+  g_ceph_context->_conf->set_val(
+    "bluefs_alloc_size",
+    "65536");
+  g_ceph_context->_conf->apply_changes(NULL);
+
+  BlueFS fs;
+  ASSERT_EQ(0, fs.add_block_device(BlueFS::BDEV_DB, fn));
+  fs.add_block_extent(BlueFS::BDEV_DB, 1048576, size - 1048576);
+  uuid_d fsid;
+  ASSERT_EQ(0, fs.mkfs(fsid));
+  ASSERT_EQ(0, fs.mount());
+  ASSERT_EQ(0, fs.mkdir("db"));
+  ASSERT_EQ(0, fs.mkdir("db.wal"));
+  for (unsigned i = 0; i < NUM_SST_FILES; ++i) {
+    BlueFS::FileWriter *h;
+    ASSERT_EQ(0, fs.open_for_write("db", "sst." + to_string(i), &h, false));
+    bufferlist bl;
+    bl.append(buffer::claim_char(SST_SIZE, gen_buffer(SST_SIZE)));
+    h->append(bl);
+    ASSERT_EQ(0, fs.fsync(h));
+    fs.close_writer(h);
+  }
+  fs.sync_metadata();
+
+  std::atomic_bool stop(false);
+  vector<uint64_t> read_bytes(NUM_READERS, 0);
+  std::vector<std::thread> readers;
+  for (int i = 0; i < NUM_READERS; ++i) {
+    readers.push_back(std::thread(read_sst_files, std::ref(fs), &stop,
+				  &read_bytes[i]));
+  }
+
+  unsigned num_syncs = 2000;
+  vector<double> lat;
+  lat.reserve(num_syncs);
+  {
+    BlueFS::FileWriter *h;
+    ASSERT_EQ(0, fs.open_for_write("db.wal", "000001.log", &h, false));
+    bufferlist rec;
+    rec.append(buffer::claim_char(ALLOC_SIZE, gen_buffer(ALLOC_SIZE)));
+    for (unsigned i = 0; i < num_syncs; ++i) {
+      bufferlist bl;
+      bl.append(rec);
+      h->append(bl);
+      utime_t start = ceph_clock_now(NULL);
+      ASSERT_EQ(0, fs.fsync(h));
+      lat.push_back((double)(ceph_clock_now(NULL) - start) * 1000000.0);
+    }
+    fs.close_writer(h);
+  }
+
+  stop = true;
+  join_all(readers);
+
+  uint64_t total_read = 0;
+  for (auto b : read_bytes)
+    total_read += b;
+  std::sort(lat.begin(), lat.end());
+  std::cout << num_syncs << " wal fsyncs with " << NUM_READERS
+	    << " readers (" << (total_read >> 20) << " MB read): "
+	    << "p50 " << lat[lat.size() / 2] << " us, "
+	    << "p99 " << lat[lat.size() * 99 / 100] << " us, "
+	    << "max " << lat.back() << " us" << std::endl;
+  ASSERT_GT(total_read, 0u);
+
+  fs.umount();
+  rm_temp_bdev(fn);
+}
+
 int main(int argc, char **argv) {
   vector<const char*> args;
   argv_to_vec(argc, (const char **)argv, args);
@@ -1048,3 +1048,130 @@ TEST(bluestore_onode_t, insert_remove_lextent)
   r.clear();
   rp.clear();
 }
+
+TEST(bluestore_onode_t, denc)
+{
+  bluestore_onode_t on;
+  on.nid = 123;
+  on.size = 0x400000;
+  on.attrs["_"] = bufferptr("object_info", 11);
+  on.attrs["snapset"] = bufferptr("ss", 2);
+  for (unsigned i = 0; i < 256; ++i) {
+    on.extent_map[i * 0x4000] = bluestore_lextent_t(i + 1, 0, 0x1000 + i);
+  }
+  on.omap_head = 7;
+  on.expected_object_size = 0x400000;
+  on.expected_write_size = 0x1000;
+
+  size_t bound = 0;
+  denc(on, bound);
+  bufferlist bl;
+  ::encode(on, bl);
+  ASSERT_LE(bl.length(), bound);
+  ASSERT_EQ(1u, bl.get_num_buffers());
+
+  bluestore_onode_t on2;
+  bufferptr bp = bl.front();
+  auto p = bp.begin();
+  denc(on2, p);
+  ASSERT_TRUE(p.end());
+  ASSERT_EQ(on.nid, on2.nid);
+  ASSERT_EQ(on.size, on2.size);
+  ASSERT_EQ(on.attrs.size(), on2.attrs.size());
+  ASSERT_EQ(on.extent_map.size(), on2.extent_map.size());
+  for (auto& e : on.extent_map) {
+    auto& f = on2.extent_map[e.first];
+    ASSERT_EQ(e.second.blob, f.blob);
+    ASSERT_EQ(e.second.offset, f.offset);
+    ASSERT_EQ(e.second.length, f.length);
+  }
+  ASSERT_EQ(on.omap_head, on2.omap_head);
+  ASSERT_EQ(on.expected_write_size, on2.expected_write_size);
+
+  bufferlist bl2;
+  ::encode(on2, bl2);
+  ASSERT_TRUE(bl.contents_equal(bl2));
+}
+
+TEST(bluestore_onode_t, denc_sharded)
+{
+  bluestore_onode_t on;
+  on.nid = 123;
+  on.size = 0x400000;
+  for (unsigned i = 0; i < 256; ++i) {
+    on.extent_map[i * 0x4000] = bluestore_lextent_t(i + 1, 0, 0x1000 + i);
+  }
+  on.extent_map_shards.resize(2);
+  on.extent_map_shards[1].offset = 0x200000;
+  on.extent_map_shards[1].bytes = 99;
+
+  // the lextents are not part of a sharded onode
+  bufferlist bl;
+  ::encode(on, bl);
+  bluestore_onode_t on2;
+  bufferptr bp = bl.front();
+  auto p = bp.begin();
+  denc(on2, p);
+  ASSERT_TRUE(p.end());
+  ASSERT_EQ(0u, on2.extent_map.size());
+  ASSERT_EQ(2u, on2.extent_map_shards.size());
+  ASSERT_EQ(0x200000u, on2.extent_map_shards[1].offset);
+  ASSERT_EQ(99u, on2.extent_map_shards[1].bytes);
+
+  // they are encoded shard by shard instead
+  for (unsigned i = 0; i < 2; ++i) {
+    uint64_t start = on.extent_map_shards[i].offset;
+    uint64_t end = i ? 0xffffffffffffffffull : on.extent_map_shards[1].offset;
+    bufferlist sbl;
+    on.encode_lextents(start, end, sbl);
+    bufferptr sbp = sbl.front();
+    auto q = sbp.begin();
+    on2.decode_lextents(q);
+    ASSERT_TRUE(q.end());
+    ASSERT_EQ(128u * (i + 1), on2.extent_map.size());
+  }
+  for (auto& e : on.extent_map) {
+    auto& f = on2.extent_map[e.first];
+    ASSERT_EQ(e.second.blob, f.blob);
+    ASSERT_EQ(e.second.offset, f.offset);
+    ASSERT_EQ(e.second.length, f.length);
+  }
+
+  // empty range
+  bufferlist ebl;
+  on.encode_lextents(0x1000, 0x2000, ebl);
+  bufferptr ebp = ebl.front();
+  auto q = ebp.begin();
+  on2.decode_lextents(q);
+  ASSERT_EQ(256u, on2.extent_map.size());
+}
+
+TEST(bluestore_blob_t, denc)
+{
+  bluestore_blob_t b(bluestore_blob_t::FLAG_MUTABLE);
+  b.extents.push_back(bluestore_pextent_t(0x10000, 0x10000));
+  b.extents.push_back(bluestore_pextent_t(0x40000, 0x8000));
+  b.init_csum(bluestore_blob_t::CSUM_CRC32C, 12, 0x18000);
+  b.set_flag(bluestore_blob_t::FLAG_HAS_REFMAP);
+  b.get_ref(0, 0x18000);
+  b.add_unused(0, 0x8000, 0x10000);
+
+  size_t bound = 0;
+  denc(b, bound);
+  bufferlist bl;
+  ::encode(b, bl);
+  ASSERT_LE(bl.length(), bound);
+
+  bluestore_blob_t b2;
+  auto p = bl.begin();
+  ::decode(b2, p);
+  ASSERT_TRUE(p.end());
+  ASSERT_EQ(b.flags, b2.flags);
+  ASSERT_EQ(b.extents.size(), b2.extents.size());
+  ASSERT_EQ(b.extents[1].offset, b2.extents[1].offset);
+  ASSERT_EQ(b.extents[1].length, b2.extents[1].length);
+  ASSERT_EQ(b.csum_type, b2.csum_type);
+  ASSERT_EQ(b.csum_data.length(), b2.csum_data.length());
+  ASSERT_EQ(b.ref_map, b2.ref_map);
+  ASSERT_EQ(b.unused, b2.unused);
+}
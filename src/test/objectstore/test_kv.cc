@@ -156,6 +156,34 @@ TEST_P(KVTest, PutReopen) {
   fini();
 }
 
+TEST_P(KVTest, MultiGet) {
+  ASSERT_EQ(0, db->create_and_open(cout));
+  {
+    KeyValueDB::Transaction t = db->get_transaction();
+    bufferlist value;
+    value.append("value");
+    t->set("prefix", "a", value);
+    t->set("prefix", "b", value);
+    t->set("prefix", "d", value);
+    t->set("prefiy", "c", value);
+    db->submit_transaction_sync(t);
+  }
+  {
+    set<string> keys;
+    keys.insert("a");
+    keys.insert("c");
+    keys.insert("d");
+    keys.insert("e");
+    map<string, bufferlist> out;
+    ASSERT_EQ(0, db->get("prefix", keys, &out));
+    ASSERT_EQ(2u, out.size());
+    ASSERT_TRUE(out.count("a"));
+    ASSERT_TRUE(out.count("d"));
+    ASSERT_EQ(5u, out["d"].length());
+  }
+  fini();
+}
+
 TEST_P(KVTest, BenchCommit) {
   int n = 1024;
   ASSERT_EQ(0, db->create_and_open(cout));
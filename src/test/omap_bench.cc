@@ -55,6 +55,20 @@ int OmapBench::setup(int argc, const char** argv) {
 	else if (strcmp("uniform", args[i+1]) == 0) {
 	  omap_generator = OmapBench::generate_uniform_omap;
 	}
+	else if (strcmp("rgw", args[i+1]) == 0) {
+	  omap_generator = OmapBench::generate_rgw_index_omap;
+	}
+      } else if (strcmp(args[i], "--test") == 0) {
+	if (strcmp("read", args[i+1]) == 0) {
+	  test = &OmapBench::test_read_keys_in_parallel;
+	}
+	else if (strcmp("write", args[i+1]) == 0) {
+	  test = &OmapBench::test_write_objects_in_parallel;
+	}
+      } else if (strcmp(args[i], "--reads") == 0) {
+	reads = atoi(args[i+1]);
+      } else if (strcmp(args[i], "--keys-per-read") == 0) {
+	keys_per_read = atoi(args[i+1]);
       } else if (strcmp(args[i], "--name") == 0) {
 	rados_id = args[i+1];
       }
@@ -83,8 +97,17 @@ int OmapBench::setup(int argc, const char** argv) {
       	   << "	--omaptype      specify how omaps should be generated - "
       	   << "rand for random sizes between\n"
       	   << "                        0 and max size, uniform for all sizes"
-      	   << " to be specified size.\n"
+      	   << " to be specified size,\n"
+      	   << "                        rgw for bucket index like keys.\n"
            << "                        (default uniform)\n";
+      cout << "	--test          write to time omap writes, read to write "
+	   << "the objects and then\n"
+	   << "                        time omap_get_vals_by_keys on them "
+	   << "(default write)\n";
+      cout << "	--reads         number of reads for the read test (default "
+	   << reads << ")\n";
+      cout << "	--keys-per-read number of keys per read (default "
+	   << keys_per_read << ")\n";
       cout << "	--name          the rados id to use (default "<< rados_id
            << ")\n";
       exit(1);
@@ -260,6 +283,10 @@ int OmapBench::print_written_omap() {
 void OmapBench::print_results() {
   cout << "========================================================";
   cout << "\nNumber of kvmaps written:\t" << objects;
+  if (test == &OmapBench::test_read_keys_in_parallel) {
+    cout << "\nNumber of reads:\t\t" << reads;
+    cout << "\nKeys per read:\t\t" << keys_per_read;
+  }
   cout << "\nNumber of ops at once:\t" << threads;
   cout << "\nEntries per kvmap:\t\t" << entries_per_omap;
   cout << "\nCharacters per key:\t" << key_size;
@@ -362,6 +389,30 @@ int OmapBench::generate_small_non_random_omap(const int omap_entries,
   return 0;
 }
 
+int OmapBench::generate_rgw_index_omap(const int omap_entries,
+    const int key_size, const int value_size,
+    std::map<std::string,bufferlist> * out_omap) {
+  // a few "directories"; lower numbered ones are more popular
+  const int dirs = 8;
+  vector<string> stems;
+  for (int d = 0; d < dirs; d++) {
+    stringstream stem;
+    stem << "dir" << d << "/" << random_string(max(key_size - 8, 1));
+    stems.push_back(stem.str());
+  }
+
+  //setup omap
+  for (int i = 0; i < omap_entries; i++) {
+    int d = rand() % (rand() % dirs + 1);
+    char num[16];
+    snprintf(num, sizeof(num), "%08d", rand() % (omap_entries * 4));
+    bufferlist omap_val;
+    omap_val.append(random_string(value_size));
+    (*out_omap)[stems[d] + num] = omap_val;
+  }
+  return 0;
+}
+
 //tests
 int OmapBench::test_write_objects_in_parallel(omap_generator_t omap_gen) {
   comp = NULL;
@@ -405,6 +456,78 @@ int OmapBench::test_write_objects_in_parallel(omap_generator_t omap_gen) {
   return 0;
 }
 
+int OmapBench::test_read_keys_in_parallel(omap_generator_t omap_gen) {
+  AioWriter *this_aio_reader;
+
+  //write the objects to read from
+  written_keys.resize(objects);
+  for (int i = 0; i < objects; i++) {
+    std::map<std::string,bufferlist> omap;
+    int err = omap_gen(entries_per_omap, key_size, value_size, &omap);
+    if (err < 0) {
+      return err;
+    }
+    std::stringstream objstrm;
+    objstrm << prefix << "read." << i;
+    librados::ObjectWriteOperation owo;
+    owo.create(false);
+    owo.omap_clear();
+    owo.omap_set(omap);
+    err = io_ctx.operate(objstrm.str(), &owo);
+    if (err < 0) {
+      cout << "writing omap failed with code " << err << std::endl;
+      return err;
+    }
+    for (std::map<std::string,bufferlist>::iterator j = omap.begin();
+	 j != omap.end(); ++j) {
+      written_keys[i].push_back(j->first);
+    }
+  }
+
+  Mutex::Locker l(thread_is_free_lock);
+  for (int i = 0; i < reads; i++) {
+    assert(busythreads_count <= threads);
+    //wait for a reader to be free
+    if (busythreads_count == threads) {
+      int err = thread_is_free.Wait(thread_is_free_lock);
+      assert(busythreads_count < threads);
+      if (err < 0) {
+	return err;
+      }
+    }
+
+    //set up the read; reads only complete, they are never "safe"
+    this_aio_reader = new AioWriter(this);
+    this_aio_reader->set_aioc(safe, NULL);
+    int o = rand() % objects;
+    std::stringstream objstrm;
+    objstrm << prefix << "read." << o;
+    this_aio_reader->oid = objstrm.str();
+    const vector<string> &keys = written_keys[o];
+    set<string> to_get;
+    for (int k = 0; k < keys_per_read && !keys.empty(); k++) {
+      to_get.insert(keys[rand() % keys.size()]);
+    }
+    librados::ObjectReadOperation oro;
+    oro.omap_get_vals_by_keys(to_get, &this_aio_reader->get_omap(), NULL);
+
+    //perform the read
+    busythreads_count++;
+    this_aio_reader->start_time();
+    int err = io_ctx.aio_operate(this_aio_reader->get_oid(),
+				 this_aio_reader->get_aioc(), &oro, NULL);
+    if (err < 0) {
+      cout << "reading omap failed with code " << err << std::endl;
+      return err;
+    }
+  }
+  while(busythreads_count > 0) {
+    thread_is_free.Wait(thread_is_free_lock);
+  }
+
+  return 0;
+}
+
 /**
  * runs the specified test with the specified parameters and generates
  * a histogram of latencies
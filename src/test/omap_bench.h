@@ -19,6 +19,7 @@
 #include "include/rados/librados.hpp"
 #include <string>
 #include <map>
+#include <vector>
 #include <cfloat>
 
 using ceph::bufferlist;
@@ -103,6 +104,11 @@ protected:
   int key_size;
   int value_size;
   double increment;
+  int reads;
+  int keys_per_read;
+
+  /// keys written to each object, for the read test
+  std::vector<std::vector<std::string> > written_keys;
 
   friend class Writer;
   friend class AioWriter;
@@ -119,7 +125,7 @@ public:
       rados_id("admin"),
       prefix(rados_id+".obj."),
       threads(3), objects(100), entries_per_omap(10), key_size(10),
-      value_size(100), increment(10)
+      value_size(100), increment(10), reads(1000), keys_per_read(8)
   {}
   /**
    * Parses command line args, initializes rados and ioctx
@@ -192,6 +198,16 @@ public:
       const int key_size, const int value_size,
       std::map<std::string,bufferlist> * out_omap);
 
+  /**
+   * Generates an omap shaped like an rgw bucket index: keys are object
+   * names, clustered under a few "directory" prefixes of skewed
+   * popularity and numbered so neighbours share long prefixes; key_size
+   * is the length of the name part.
+   */
+  static int generate_rgw_index_omap(const int omap_entries,
+      const int key_size, const int value_size,
+      std::map<std::string,bufferlist> * out_omap);
+
   /*
    * Uses aio_write to write omaps generated by omap_gen to OBJECTS objects
    * using THREADS AioWriters at a time.
@@ -200,6 +216,15 @@ public:
    */
   int test_write_objects_in_parallel(omap_generator_t omap_gen);
 
+  /*
+   * Writes OBJECTS objects with omaps generated by omap_gen, then times
+   * READS omap_get_vals_by_keys of KEYS_PER_READ random keys each on
+   * random objects, THREADS at a time.
+   *
+   * @param omap_gen the method used to generate the omaps.
+   */
+  int test_read_keys_in_parallel(omap_generator_t omap_gen);
+
 };
 
 
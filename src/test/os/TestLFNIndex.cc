@@ -24,6 +24,7 @@
 #include "os/filestore/LFNIndex.h"
 #include "os/filestore/chain_xattr.h"
 #include "common/ceph_argparse.h"
+#include "common/perf_counters.h"
 #include "global/global_init.h"
 #include <gtest/gtest.h>
 
@@ -439,6 +440,92 @@ TEST_F(TestLFNIndex, get_mangled_name) {
   }
 }
 
+class TestLFNIndexPathCache : public TestWrapLFNIndex, public ::testing::Test {
+public:
+  IndexPathCache cache;
+  PerfCounters *logger;
+
+  TestLFNIndexPathCache()
+    : TestWrapLFNIndex(coll_t(), "PATH_1", CollectionIndex::HOBJECT_WITH_POOL),
+      cache(g_ceph_context) {
+    PerfCountersBuilder b(g_ceph_context, "test_lfnindex", l_os_first, l_os_last);
+    b.add_u64_counter(l_os_index_lookup, "index_lookup");
+    b.add_u64_counter(l_os_index_cache_hit, "index_cache_hit");
+    b.add_u64_counter(l_os_index_syscalls, "index_syscalls");
+    logger = b.create_perf_counters();
+    cache.logger = logger;
+    set_path_cache(&cache);
+  }
+  ~TestLFNIndexPathCache() {
+    delete logger;
+  }
+
+  virtual void SetUp() {
+    ASSERT_EQ(0, ::system("rm -fr PATH_1"));
+    ASSERT_EQ(0, ::mkdir("PATH_1", 0700));
+  }
+
+  virtual void TearDown() {
+    ASSERT_EQ(0, ::system("rm -fr PATH_1"));
+  }
+
+protected:
+  virtual int _lookup(
+		      const ghobject_t &hoid,
+		      vector<string> *path,
+		      string *mangled_name,
+		      int *exists
+		      ) {
+    return get_mangled_name(*path, hoid, mangled_name, exists);
+  }
+};
+
+TEST_F(TestLFNIndexPathCache, lookup) {
+  const std::string object_name(1024, 'A');
+  ghobject_t hoid(hobject_t(sobject_t(object_name, CEPH_NOSNAP)));
+  IndexedPath p;
+  int exists = 666;
+
+  // miss, then a negative hit without touching the fs
+  EXPECT_EQ(0, lookup(hoid, &p, &exists));
+  EXPECT_EQ(0, exists);
+  EXPECT_EQ(0u, logger->get(l_os_index_cache_hit));
+  uint64_t syscalls = logger->get(l_os_index_syscalls);
+  EXPECT_LT(0u, syscalls);
+  std::string pathname = p->path();
+  EXPECT_EQ(0, lookup(hoid, &p, &exists));
+  EXPECT_EQ(0, exists);
+  EXPECT_EQ(pathname, p->path());
+  EXPECT_EQ(1u, logger->get(l_os_index_cache_hit));
+  EXPECT_EQ(syscalls, logger->get(l_os_index_syscalls));
+
+  // created() makes it a positive entry; the link count is always fresh
+  EXPECT_EQ(0, ::close(::creat(pathname.c_str(), 0600)));
+  EXPECT_EQ(0, created(hoid, pathname.c_str()));
+  EXPECT_EQ(0, lookup(hoid, &p, &exists));
+  EXPECT_EQ(1, exists);
+  EXPECT_EQ(0, ::link(pathname.c_str(), "PATH_1/other"));
+  EXPECT_EQ(0, lookup(hoid, &p, &exists));
+  EXPECT_EQ(2, exists);
+  EXPECT_EQ(3u, logger->get(l_os_index_cache_hit));
+  EXPECT_EQ(syscalls + 2, logger->get(l_os_index_syscalls));
+
+  // a file that vanished behind our back is looked up again
+  EXPECT_EQ(0, ::unlink(pathname.c_str()));
+  EXPECT_EQ(0, lookup(hoid, &p, &exists));
+  EXPECT_EQ(0, exists);
+  EXPECT_EQ(3u, logger->get(l_os_index_cache_hit));
+
+  // moving things around drops everything we had
+  EXPECT_EQ(0, lookup(hoid, &p, &exists));
+  EXPECT_EQ(4u, logger->get(l_os_index_cache_hit));
+  vector<string> subdir;
+  subdir.push_back("DIR_A");
+  EXPECT_EQ(0, create_path(subdir));
+  EXPECT_EQ(0, lookup(hoid, &p, &exists));
+  EXPECT_EQ(4u, logger->get(l_os_index_cache_hit));
+}
+
 int main(int argc, char **argv) {
   int fd = ::creat("detect", 0600);
   int ret = chain_fsetxattr(fd, "user.test", "A", 1);
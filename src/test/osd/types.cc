@@ -1576,6 +1576,46 @@ TEST(pool_opts_t, deep_scrub_interval) {
   EXPECT_FALSE(opts.is_set(pool_opts_t::DEEP_SCRUB_INTERVAL));
 }
 
+TEST(pg_log_entry_t, bound_encode) {
+  list<pg_log_entry_t*> o;
+  pg_log_entry_t::generate_test_instances(o);
+  // snaps and mod_desc carry arbitrarily large bufferlists
+  pg_log_entry_t *e = new pg_log_entry_t(*o.back());
+  vector<snapid_t> snaps(100, snapid_t(7));
+  ::encode(snaps, e->snaps);
+  map<string, boost::optional<bufferlist> > attrs;
+  attrs["foo"] = bufferlist();
+  attrs["foo"]->append(string(1000, 'a'));
+  e->mod_desc.setattrs(attrs);
+  e->extra_reqids.push_back(make_pair(osd_reqid_t(), version_t(1)));
+  o.push_back(e);
+  for (list<pg_log_entry_t*>::iterator i = o.begin(); i != o.end(); ++i) {
+    size_t bound = 0;
+    (*i)->bound_encode(bound);
+    bufferlist bl;
+    (*i)->encode(bl);
+    EXPECT_GE(bound, bl.length());
+    delete *i;
+  }
+}
+
+TEST(object_info_t, bound_encode) {
+  object_info_t oi(hobject_t(object_t("objname"), "key", 123, 456, 0, "ns"));
+  oi.snaps = vector<snapid_t>(100, snapid_t(7));
+  for (uint64_t i = 0; i < 10; ++i)
+    oi.watchers[make_pair(i, entity_name_t::CLIENT(i))] =
+      watch_info_t(i, 30, entity_addr_t());
+  for (unsigned snap = 0; snap < 2; ++snap) {
+    if (snap)
+      oi.soid.snap = 5;
+    size_t bound = 0;
+    oi.bound_encode(bound);
+    bufferlist bl;
+    oi.encode(bl, CEPH_FEATURES_ALL);
+    EXPECT_GE(bound, bl.length());
+  }
+}
+
 /*
  * Local Variables:
  * compile-command: "cd ../.. ;
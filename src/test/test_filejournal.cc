@@ -9,6 +9,7 @@
 #include "common/config.h"
 #include "common/Finisher.h"
 #include "os/filestore/FileJournal.h"
+#include "os/filestore/ShardedJournal.h"
 #include "include/Context.h"
 #include "common/Mutex.h"
 #include "common/safe_io.h"
@@ -685,3 +686,108 @@ TEST(TestFileJournal, ReplayDetectCorruptHeader) {
     ::close(fd);
   }
 }
+
+TEST(TestFileJournal, ShardedReplay) {
+  g_ceph_context->_conf->set_val("journal_ignore_corruption", "false");
+  g_ceph_context->_conf->set_val("journal_write_header_frequency", "0");
+  g_ceph_context->_conf->apply_changes(NULL);
+
+  vector<ObjectStore::Transaction> tls;
+
+  for (unsigned i = 0 ; i < 3; ++i) {
+    SCOPED_TRACE(subtests[i].description);
+    fsid.generate_random();
+    ShardedJournal j(fsid, finisher, &sync_cond, path, 2, "",
+		     subtests[i].directio, subtests[i].aio, subtests[i].faio);
+    ASSERT_EQ(0, j.create());
+    j.make_writeable();
+
+    C_GatherBuilder gb(g_ceph_context, new C_SafeCond(&wait_lock, &cond, &done));
+
+    // seq 4 was to follow 2 on shard 1 and never made it
+    uint64_t seqs[][2] = { {1, 0}, {2, 1}, {3, 0}, {5, 0}, {6, 0} };
+    for (auto s : seqs) {
+      bufferlist bl;
+      bl.append("small");
+      int orig_len = j.prepare_entry(tls, &bl);
+      j.reserve_throttle_and_backoff(bl.length(), s[1]);
+      j.submit_entry(s[0], bl, orig_len, gb.new_sub(), TrackedOpRef(), s[1]);
+    }
+    gb.activate();
+    wait();
+    // nothing left in flight on either shard
+    ASSERT_EQ(6u, j.get_committable_seq(6));
+
+    j.close();
+
+    j.open(1);
+
+    bufferlist inbl;
+    string v;
+    uint64_t seq = 0;
+    uint64_t expect[] = { 2, 3, 5, 6 };
+    for (auto e : expect) {
+      ASSERT_EQ(true, j.read_entry(inbl, seq));
+      ASSERT_EQ(seq, e);
+      inbl.copy(0, inbl.length(), v);
+      ASSERT_EQ("small", v);
+      inbl.clear();
+      v.clear();
+      if (e == 2) {
+	// shard 1 may still have 4
+	ASSERT_FALSE(j.can_skip_missing_seq());
+      } else if (e == 5) {
+	ASSERT_TRUE(j.can_skip_missing_seq());
+      }
+    }
+
+    ASSERT_TRUE(!j.read_entry(inbl, seq));
+
+    j.make_writeable();
+    j.close();
+
+    // the shard count is in the header
+    FileJournal plain(fsid, finisher, &sync_cond, path, subtests[i].directio,
+		      subtests[i].aio, subtests[i].faio);
+    ASSERT_EQ(-EINVAL, plain.check());
+    ShardedJournal three(fsid, finisher, &sync_cond, path, 3, "",
+			 subtests[i].directio, subtests[i].aio,
+			 subtests[i].faio);
+    ASSERT_EQ(-EINVAL, three.open(1));
+  }
+  vector<string> paths;
+  ASSERT_EQ(0, ShardedJournal::get_shard_paths(path, 2, "", &paths));
+  unlink(paths[1].c_str());
+  ASSERT_EQ(-EINVAL, ShardedJournal::get_shard_paths(path, 3, "/a", &paths));
+  ASSERT_EQ(0, ShardedJournal::get_shard_paths(path, 3, "/a,/b", &paths));
+  ASSERT_EQ("/b", paths[2]);
+}
+
+TEST(TestFileJournal, RingReleaseOutOfOrder) {
+  JournalRing *ring = new JournalRing(4 * CEPH_PAGE_SIZE);
+  ASSERT_TRUE(ring->valid());
+  {
+    bufferptr a = ring->alloc(CEPH_PAGE_SIZE);
+    bufferptr b = ring->alloc(2 * CEPH_PAGE_SIZE);
+    ASSERT_EQ(a.length(), CEPH_PAGE_SIZE);
+    ASSERT_EQ(b.length(), 2 * CEPH_PAGE_SIZE);
+    ASSERT_EQ(0u, (unsigned long)a.c_str() & ~CEPH_PAGE_MASK);
+    ASSERT_EQ(0u, ring->alloc(2 * CEPH_PAGE_SIZE).length());
+
+    // freeing b first doesn't move the tail past a
+    b = bufferptr();
+    ASSERT_EQ(3 * CEPH_PAGE_SIZE, ring->get_used());
+    ASSERT_EQ(0u, ring->alloc(2 * CEPH_PAGE_SIZE).length());
+    a = bufferptr();
+    ASSERT_EQ(0u, ring->get_used());
+
+    // wraps back to the start once the tail has moved
+    bufferptr c = ring->alloc(3 * CEPH_PAGE_SIZE);
+    bufferptr d = ring->alloc(CEPH_PAGE_SIZE);
+    c = bufferptr();
+    bufferptr e = ring->alloc(2 * CEPH_PAGE_SIZE);
+    ASSERT_EQ(2 * CEPH_PAGE_SIZE, e.length());
+    ASSERT_LT(e.c_str(), d.c_str());
+  }
+  ring->put();
+}
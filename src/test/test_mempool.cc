@@ -0,0 +1,117 @@
+// -*- mode:C++; tab-width:8; c-basic-offset:2; indent-tabs-mode:t -*-
+// vim: ts=8 sw=2 smarttab
+/*
+ * Ceph - scalable distributed file system
+ *
+ * Copyright (C) 2016 Red Hat
+ *
+ * This is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License version 2.1, as published by the Free Software
+ * Foundation.  See file COPYING.
+ *
+ */
+
+#include <thread>
+
+#include "include/mempool.h"
+#include "include/buffer.h"
+#include "common/Formatter.h"
+
+#include "gtest/gtest.h"
+
+// osd_pglog and osdmap are only used by the OSD, so nothing else in
+// this binary should be charging them behind our back.
+
+struct obj {
+  MEMPOOL_CLASS_HELPERS();
+  int a;
+  int b;
+  obj() : a(1), b(1) {}
+};
+
+MEMPOOL_DEFINE_OBJECT_FACTORY(obj, obj, osdmap);
+
+TEST(mempool, containers)
+{
+  size_t before_items = mempool::osd_pglog::allocated_items();
+  size_t before_bytes = mempool::osd_pglog::allocated_bytes();
+  {
+    mempool::osd_pglog::vector<int> v;
+    v.reserve(100);
+    EXPECT_EQ(before_items + 100, mempool::osd_pglog::allocated_items());
+    EXPECT_EQ(before_bytes + 100 * sizeof(int),
+	      mempool::osd_pglog::allocated_bytes());
+
+    mempool::osd_pglog::map<int, int> m;
+    for (int i = 0; i < 10; ++i) {
+      m[i] = i;
+    }
+    EXPECT_EQ(before_items + 110, mempool::osd_pglog::allocated_items());
+
+    mempool::osd_pglog::unordered_map<int, int> um;
+    um[1] = 2;
+    EXPECT_LT(before_items + 110, mempool::osd_pglog::allocated_items());
+  }
+  EXPECT_EQ(before_items, mempool::osd_pglog::allocated_items());
+  EXPECT_EQ(before_bytes, mempool::osd_pglog::allocated_bytes());
+}
+
+TEST(mempool, class_factory)
+{
+  size_t before_items = mempool::osdmap::allocated_items();
+  size_t before_bytes = mempool::osdmap::allocated_bytes();
+  obj *a = new obj;
+  obj *b = new obj;
+  EXPECT_EQ(before_items + 2, mempool::osdmap::allocated_items());
+  EXPECT_EQ(before_bytes + 2 * sizeof(obj),
+	    mempool::osdmap::allocated_bytes());
+  delete a;
+  delete b;
+  EXPECT_EQ(before_items, mempool::osdmap::allocated_items());
+  EXPECT_EQ(before_bytes, mempool::osdmap::allocated_bytes());
+}
+
+TEST(mempool, free_on_another_thread)
+{
+  size_t before_items = mempool::osdmap::allocated_items();
+  obj *o = new obj;
+  std::thread t([o]() { delete o; });
+  t.join();
+  EXPECT_EQ(before_items, mempool::osdmap::allocated_items());
+}
+
+TEST(mempool, bufferlist_reassign)
+{
+  size_t anon_bytes = mempool::buffer_anon::allocated_bytes();
+  size_t pglog_bytes = mempool::osd_pglog::allocated_bytes();
+  {
+    bufferlist bl;
+    bl.append(buffer::create(4096));
+    bl.append(buffer::create(4096));
+    EXPECT_LE(anon_bytes + 8192, mempool::buffer_anon::allocated_bytes());
+
+    bl.reassign_to_mempool(mempool::mempool_osd_pglog);
+    EXPECT_EQ(anon_bytes, mempool::buffer_anon::allocated_bytes());
+    EXPECT_EQ(pglog_bytes + 8192, mempool::osd_pglog::allocated_bytes());
+    EXPECT_EQ(mempool::mempool_osd_pglog, bl.front().get_mempool());
+
+    // already assigned; must not move back
+    bl.try_assign_to_mempool(mempool::mempool_osdmap);
+    EXPECT_EQ(pglog_bytes + 8192, mempool::osd_pglog::allocated_bytes());
+  }
+  EXPECT_EQ(anon_bytes, mempool::buffer_anon::allocated_bytes());
+  EXPECT_EQ(pglog_bytes, mempool::osd_pglog::allocated_bytes());
+}
+
+TEST(mempool, dump)
+{
+  mempool::osd_pglog::list<int> l;
+  l.push_back(1);
+  JSONFormatter f;
+  mempool::dump(&f);
+  std::stringstream ss;
+  f.flush(ss);
+  EXPECT_NE(std::string::npos, ss.str().find("\"osd_pglog\""));
+  EXPECT_NE(std::string::npos, ss.str().find("\"total\""));
+}